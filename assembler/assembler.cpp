@@ -1,4 +1,6 @@
+
 #include <cassert>
+#include <charconv>
 #include <cstring>
 #include <algorithm>
 #include <cstdlib>
@@ -6,202 +8,191 @@
 #include "assembler.h"
 #include "token.h"
 #include "instruction.h"
+#include "linker.h"
+
+// same as atoi, minus the need for a terminated string
+static int32_t parseNumber(const std::string_view text) {
+    int32_t value = 0;
+    const auto skip = !text.empty() && text[0] == '+' ? 1 : 0;
+    std::from_chars(text.data() + skip, text.data() + text.size(), value);
+    return value;
+}
 
-void Assembler::generateSymbolTable() {
+void Assembler::assemble() {
     assert(asm_source_ != nullptr && "asm_source_ is nullptr!!!");
-    uint8_t pc{0};
-    const auto len = strlen(asm_source_);
-    std::string token;
-    char curr_c;
-    for (uint32_t pos = 0; pos < len && isascii(asm_source_[pos]); ++pos) {
-        curr_c = asm_source_[pos];
-        if (curr_c == '.') {
-            // advance position in order to skip '.'
-            pos++;
-            const auto label_name = getLabelName(pos, len);
-            // store that into symbol table
-            proc_sym_table_.emplace(label_name, pc);
-
-        } else if (isascii(curr_c) && isspace(curr_c)) {
+    Lexer lexer(std::string_view(asm_source_, source_size_));
+    uint32_t pc{0};
+    for (auto token = lexer.next(); token.type != TokenType::END; token = lexer.next()) {
+        if (token.type == TokenType::LABEL) {
+            // the first definition of a label is the one that counts
+            auto &symbol = symbols_->intern(token.text);
+            if (!(symbol.flags & SymbolTable::has_label)) {
+                symbol.label = pc;
+                symbol.flags |= SymbolTable::has_label;
+            }
             continue;
-        } else {
-            token += curr_c;
-
-            const auto it = instructions.find(token);
-            // increment pc when encountered an instruction
-            if (it != instructions.cend() && pos + 1 < len  && isspace(asm_source_[pos + 1])) {
-                fprintf(stdout, "Token: %s, Mode: %d\n", token.c_str(), static_cast<uint32_t>(it->second));
-                pc++;
-                nextLine(pos, len);
-                token = "";
+        }
+
+        if (token.type == TokenType::WORD && token.text == "BEGINDATA") {
+            parseVarBlock(lexer);
+            continue;
+        }
+
+        if (token.type == TokenType::WORD && (token.text == "EXPORT" || token.text == "IMPORT")) {
+            parseLinkage(lexer, token.text == "EXPORT" ? SymbolTable::exported : SymbolTable::imported);
+            continue;
+        }
+
+        const auto *instruction = token.type == TokenType::WORD ? findInstruction(token.text) : nullptr;
+        if (!instruction) {
+            reportError(token, "unknown instruction");
+        }
+        if (verbosity_ > 0) {
+            fprintf(stdout, "Token: %.*s, Mode: %d\n", static_cast<int>(token.text.size()), token.text.data(),
+                    static_cast<uint32_t>(instruction->mode));
+        }
+
+        const auto wide_operand = wide_ && instruction->mode == InstructionMode::MEMORY;
+        if (pc + wide_operand >= (wide_ ? wide_address_space_size : data_section_start)) {
+            reportError(token, "code runs into the data section at");
+        }
+
+        uint8_t value = 0;
+        if (instruction->mode != InstructionMode::NONE) {
+            const auto operand = lexer.next();
+            if (operand.type != TokenType::WORD) {
+                reportError(token, "missing operand of");
             }
-                // beginning of data section
-            else if (token == "BEGINDATA") {
-                // advance position in order to jump over 'A' character
-                pos++;
-                // move to the next line
-                parseVarBlock(pos, len);
-                token = "";
+
+            if (instruction->mode == InstructionMode::IMMEDIATE) {
+                value = static_cast<uint8_t>(parseNumber(operand.text));
             } else {
-                continue;
+                // Memory instruction mode, resolved once the whole source is seen. a wide operand
+                // is the word after the instruction
+                fixups_.push_back(Fixup{pc + wide_operand, operand});
             }
         }
-    }
-}
 
-void Assembler::assemble(const std::string &output_file) {
-    assert(asm_source_ != nullptr && "asm_source_ is nullptr!!!");
-    uint8_t pc{0};
-    const auto len = strlen(asm_source_);
-    std::string token;
-    char curr_c;
-    for (uint32_t pos = 0; pos < len, isascii(asm_source_[pos]); ++pos) {
-        curr_c = asm_source_[pos];
-        if (curr_c == '.') {
-            // ignore labels
-            nextLine(pos, len);
-        } else if (isascii(curr_c) && isspace(curr_c)) {
-            continue;
+        if (wide_operand) {
+            object_.code.push_back(wideWord(instruction->opcode));
+            object_.code.push_back(0);
+            pc += 2;
         } else {
-            token += curr_c;
-            // TODO(threadedstream): At that point, i don't think we need instruction mode anymore.
-            // I'll probably elide it and make more room for instructions, thus allowing up to 255 entries in my
-            // yet poor instruction set.
-            const auto it = instructions.find(token);
-            if (it != instructions.cend() && pos + 1 < len && isspace(asm_source_[pos + 1])) {
-                pos++;
-                if (it->second == InstructionMode::NONE) {
-                    address_space_[pc] = assembleInstruction(token, 0x0);
-                    token = "";
-                } else if (it->second == InstructionMode::IMMEDIATE) {
-                    const auto value = fetchImmediateOperand(pos, len);
-                    address_space_[pc] = assembleInstruction(token, value);
-                    token = "";
-                } else {
-                    // Memory instruction mode
-                    const auto value = fetchMemoryOperand(pos, len);
-                    address_space_[pc] = assembleInstruction(token, value);
-                    token = "";
-                }
-                pc++;
-            }
+            object_.code.push_back(assembleInstruction(*instruction, value));
+            pc++;
         }
     }
 
-    const auto success = tools::cStyleWriteToFile(output_file.c_str(), address_space_);
-    ASSERT_WITH_CLEANUP(success, "", "");
+    resolveFixups();
 }
 
-uint32_t Assembler::fetchMemoryOperand(uint32_t &pos, uint32_t len) {
-    eatWhitespaces(pos, len);
-    std::string value;
-    while (pos < len && !isspace(asm_source_[pos])) {
-        value += asm_source_[pos];
-        pos++;
+void Assembler::resolveFixups() {
+    for (const auto &fixup: fixups_) {
+        object_.fixups.push_back(ObjectFixup{static_cast<uint16_t>(fixup.slot), objectSymbol(fixup.symbol)});
     }
+    fixups_.clear();
 
-    const auto label_it = proc_sym_table_.find(value);
-    const auto var_it = data_var_sym_table_.find(value);
+    for (size_t i = 0; i < symbols_->size(); ++i) {
+        const auto &symbol = (*symbols_)[i];
+        if (!(symbol.flags & SymbolTable::exported)) {
+            continue;
+        }
 
+        const Token name{TokenType::WORD, symbol.name, symbol.line};
+        if (!(symbol.flags & (SymbolTable::has_label | SymbolTable::has_variable))) {
+            reportError(name, "exported symbol is not defined");
+        }
+        objectSymbol(name);
+    }
+}
 
-    // make sure value does not exist in both symbol tables
-    const auto multiple_definition_cond = label_it != proc_sym_table_.cend() && var_it != data_var_sym_table_.cend();
-    ASSERT_WITH_CLEANUP(!multiple_definition_cond, "multiple definition of %s", value);
+uint16_t Assembler::objectSymbol(const Token &name) {
+    auto &symbol = symbols_->intern(name.text);
+    if (symbol.flags & SymbolTable::in_object) {
+        return symbol.object_symbol;
+    }
 
+    // make sure the name is not both a label and a variable
+    const auto defined = symbol.flags & (SymbolTable::has_label | SymbolTable::has_variable);
+    if (defined == (SymbolTable::has_label | SymbolTable::has_variable)) {
+        reportError(name, "multiple definition of");
+    }
 
-    if (label_it != proc_sym_table_.cend()) {
-        return proc_sym_table_[value];
-    } else if (var_it != data_var_sym_table_.cend()) {
-        return data_var_sym_table_[value];
+    const auto binding = symbol.flags & SymbolTable::exported ? SymbolBinding::EXPORTED : SymbolBinding::LOCAL;
+    if (defined == SymbolTable::has_label) {
+        symbol.object_symbol = object_.addSymbol(name.text, SymbolSection::CODE, binding, symbol.label);
+    } else if (defined == SymbolTable::has_variable) {
+        symbol.object_symbol = object_.addSymbol(name.text, SymbolSection::DATA, binding,
+                                                 symbol.variable - data_section_start);
+    } else if (symbol.flags & SymbolTable::imported) {
+        symbol.object_symbol = object_.addSymbol(name.text, SymbolSection::NONE, SymbolBinding::IMPORTED, 0);
     } else {
-        fprintf(stderr, "unresolved symbol %s", value.c_str());
-        cleanup();
-        exit(-1);
+        reportError(name, "unresolved symbol");
     }
-}
 
+    symbol.flags |= SymbolTable::in_object;
+    return symbol.object_symbol;
+}
 
-uint32_t Assembler::fetchImmediateOperand(uint32_t &pos, uint32_t len) {
-    eatWhitespaces(pos, len);
-    std::string value;
-    while (pos < len && !isspace(asm_source_[pos])) {
-        value += asm_source_[pos];
-        pos++;
-    }
+void Assembler::writeImage(const std::string &output_file) {
+    Linker linker;
+    linker.add(object_, path_);
 
-    return static_cast<uint32_t>(atoi(value.c_str()));
+    ImageSections image;
+    const auto success = linker.link(image) && tools::cStyleWriteToFile(output_file.c_str(), image);
+    ASSERT_WITH_CLEANUP(success, "", "");
 }
 
-void Assembler::nextLine(uint32_t &pos, const uint32_t len) {
-    while (pos < len && asm_source_[pos] != '\n') {
-        pos++;
-    }
-}
+void Assembler::parseVarBlock(Lexer &lexer) {
+    expectSymbol(lexer, '{');
 
-void Assembler::parseVarBlock(uint32_t &pos, uint32_t len) {
-    std::string identifier, value;
-    eatWhitespaces(pos, len);
-    expectSymbol('{', pos, len);
-    eatWhitespaces(pos, len);
-
-    while (pos < len && asm_source_[pos] != '}') {
-        // TODO(threadedstream): account for an empty BEGINDATA section
-        while (pos < len && asm_source_[pos] != ' ') {
-            identifier += asm_source_[pos];
-            pos++;
+    for (auto identifier = lexer.next(); identifier.type != TokenType::SYMBOL || identifier.text != "}";
+         identifier = lexer.next()) {
+        if (identifier.type != TokenType::WORD) {
+            // making sure that data var block is terminated with '}' symbol
+            reportError(identifier, "expected '}' or a variable, got");
         }
 
-        eatWhitespaces(pos, len);
-        expectSymbol('=', pos, len);
-        eatWhitespaces(pos, len);
-
-        while (!isspace(asm_source_[pos])) {
-            value += asm_source_[pos];
-            pos++;
+        expectSymbol(lexer, '=');
+        const auto value = lexer.next();
+        if (value.type != TokenType::WORD) {
+            reportError(value, "expected a value, got");
         }
 
-        const auto value_int = atoi(value.c_str());
-        ASSERT_WITH_CLEANUP(data_section_ptr < 0xFF, "data section overflow", "");
-        data_var_sym_table_[identifier] = data_section_ptr++;
-        address_space_[data_section_ptr - 1] = value_int;
-        identifier = "";
-        value = "";
-        eatWhitespaces(pos, len);
+        const auto data_end = wide_ ? wide_address_space_size : address_space_size;
+        ASSERT_WITH_CLEANUP(data_section_start + object_.data.size() < data_end, "data section overflow", "");
+        auto &symbol = symbols_->intern(identifier.text);
+        symbol.variable = data_section_start + object_.data.size();
+        symbol.flags |= SymbolTable::has_variable;
+        object_.data.push_back(parseNumber(value.text));
     }
-
-    // making sure that data var block is terminated with '}' symbol
-    // throw an exception if it is not.
-    expectSymbol('}', pos, len);
-
-    return;
 }
 
-void Assembler::expectSymbol(uint8_t symbol, uint32_t &pos, uint32_t len) {
-    if (pos < len) {
-        ASSERT_WITH_CLEANUP(asm_source_[pos] == symbol, "expected %c", symbol);
-    } else {
-        return;
+void Assembler::parseLinkage(Lexer &lexer, const uint8_t linkage) {
+    const auto name = lexer.next();
+    if (name.type != TokenType::WORD) {
+        reportError(name, "expected a symbol name, got");
     }
 
-    pos++;
-}
-
-
-uint32_t Assembler::lookupLabel(const std::string &name) {
-    const auto val = proc_sym_table_[name];
-    ASSERT_WITH_CLEANUP(val != 0, "unresolved label %s", name);
-
-    return val;
+    auto &symbol = symbols_->intern(name.text);
+    if (!(symbol.flags & (SymbolTable::exported | SymbolTable::imported))) {
+        symbol.line = name.line;
+    }
+    symbol.flags |= linkage;
 }
 
-
-std::string Assembler::getLabelName(uint32_t &pos, uint32_t len) {
-    std::string label;
-    while (pos < len && asm_source_[pos] != ':') {
-        label += asm_source_[pos];
-        pos++;
+void Assembler::expectSymbol(Lexer &lexer, const char symbol) {
+    const auto token = lexer.next();
+    if (token.type != TokenType::SYMBOL || token.text[0] != symbol) {
+        char message[] = "expected ?, got";
+        message[9] = symbol;
+        reportError(token, message);
     }
-
-    return label;
 }
 
+void Assembler::reportError(const Token &token, const char *message) {
+    fprintf(stderr, "[[error]] line %u: %s '%.*s'\n", token.line, message, static_cast<int>(token.text.size()),
+            token.text.data());
+    cleanup();
+    exit(-1);
+}
@@ -2,10 +2,14 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <string_view>
 #include <unordered_map>
 #include <cassert>
 
 #include "tools.h"
+#include "lexer.h"
+#include "symbol_table.h"
 
 #if defined(_MSC_VER)
     #define ASSERT_WITH_CLEANUP(cond, fmt, ...) \
@@ -40,15 +44,34 @@ constexpr uint8_t address_space_size = 0xFF;
 
 class Assembler {
 public:
-    explicit Assembler(const char *path, const std::string &output_file) {
-		uint32_t size = 0;
-		asm_source_ = tools::cStyleLoadFileIntoMemory(path, &size);
+    // assembles a single source straight into an image
+    explicit Assembler(const char *path, const std::string &output_file) : Assembler(path) {
+        assemble();
+        writeImage(output_file);
+    }
+
+    // only loads the source, assemble() turns it into an object. symbols is a table to reuse,
+    // it's emptied first and has to outlive the assembler. A wide object addresses the 16-bit
+    // address space, every memory operand takes a word of its own. From a verbosity of 1 on
+    // every instruction is reported on stdout as it's assembled
+    explicit Assembler(const char *path, SymbolTable *symbols = nullptr, bool wide = false, uint32_t verbosity = 0)
+            : path_{path}, symbols_{symbols ? symbols : &own_symbols_}, wide_{wide}, verbosity_{verbosity} {
+		symbols_->reset();
+		asm_source_ = tools::cStyleLoadFileIntoMemory(path, &source_size_);
 		assert(asm_source_ != nullptr && "asm_source_ is nullptr");
-		address_space_.resize(address_space_size);
-		data_section_ptr = 0xF0;
-		
-		generateSymbolTable();
-		assemble(output_file);
+		object_.wide = wide;
+    }
+
+    // same for a source that is already in memory, which is copied. name is what errors refer to it by
+    explicit Assembler(const std::string_view source, const char *name, SymbolTable *symbols = nullptr,
+                       bool wide = false, uint32_t verbosity = 0)
+            : path_{name}, symbols_{symbols ? symbols : &own_symbols_}, wide_{wide}, verbosity_{verbosity} {
+        symbols_->reset();
+        asm_source_ = static_cast<char *>(malloc(source.size() ? source.size() : 1));
+        assert(asm_source_ != nullptr && "asm_source_ is nullptr");
+        memcpy(asm_source_, source.data(), source.size());
+        source_size_ = static_cast<uint32_t>(source.size());
+        object_.wide = wide;
     }
 
     ~Assembler() {
@@ -56,50 +79,53 @@ public:
     }
 
 
-    void generateSymbolTable();
-
-    void assemble(const std::string& output_file);
+    // single pass over the source, memory operands become fixups of the object once every symbol is known
+    void assemble();
 
 public:
-    [[nodiscard]] constexpr inline auto &dataVarSymTable() noexcept { return data_var_sym_table_; }
+    [[nodiscard]] inline SymbolTable &symbols() noexcept { return *symbols_; }
+
+    [[nodiscard]] inline std::string_view source() const noexcept { return {asm_source_, source_size_}; }
 
-    [[nodiscard]] constexpr inline auto &procSymTable() noexcept { return proc_sym_table_; }
+    [[nodiscard]] inline ObjectFile &object() noexcept { return object_; }
 
 private:
-    std::string getLabelName(uint32_t &pos, uint32_t len);
+    // memory operand waiting for its symbol
+    struct Fixup {
+        uint32_t slot;
+        Token symbol;
+    };
 
-//    void parseLabel(uint32_t &pos, uint32_t len);
+    void parseVarBlock(Lexer &lexer);
 
-    void nextLine(uint32_t &pos, uint32_t len);
+    // IMPORT and EXPORT take a single name each
+    void parseLinkage(Lexer &lexer, uint8_t linkage);
 
-    void parseVarBlock(uint32_t &pos, uint32_t len);
+    void resolveFixups();
 
-    uint32_t lookupLabel(const std::string &name);
+    // symbol of the object a name refers to, added on first use
+    uint16_t objectSymbol(const Token &name);
 
-    uint32_t lookupVar(const std::string &name);
+    void writeImage(const std::string &output_file);
 
-    uint32_t fetchImmediateOperand(uint32_t &pos, uint32_t len);
+    void expectSymbol(Lexer &lexer, char symbol);
 
-    uint32_t fetchMemoryOperand(uint32_t &pos, uint32_t len);
+    [[noreturn]] void reportError(const Token &token, const char *message);
 
     inline void cleanup() {
         free(asm_source_);
+        asm_source_ = nullptr;
     }
 
-
-    inline void eatWhitespaces(uint32_t &pos, uint32_t len) {
-        while (pos < len && isspace(asm_source_[pos])) {
-            pos++;
-        }
-    }
-
-    void expectSymbol(uint8_t symbol, uint32_t &pos, uint32_t len);
-
 private:
-	uint8_t data_section_ptr;
-	std::vector<uint16_t> address_space_;
-	std::unordered_map<std::string, uint32_t> proc_sym_table_;
-    std::unordered_map<std::string, uint32_t> data_var_sym_table_;
+    std::vector<Fixup> fixups_;
+    ObjectFile object_;
+    std::string path_;
+    // labels and variables alike
+    SymbolTable own_symbols_;
+    SymbolTable *symbols_;
     char *asm_source_;
+    uint32_t source_size_{0};
+    bool wide_{false};
+    uint32_t verbosity_{0};
 };
-
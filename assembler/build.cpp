@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <optional>
+#include <random>
+#include <thread>
+
+#include "build.h"
+#include "assembler.h"
+#include "linker.h"
+#include "optimizer.h"
+#include "../common/metrics.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+    bool isObject(const std::string &path) {
+        return fs::path(path).extension() == ".o";
+    }
+
+    // object of a source, taken from the cache when the same contents were assembled before
+    bool assembleSource(const std::string &path, const BuildOptions &options, SymbolTable &symbols,
+                        ObjectFile &object) {
+        countMetric(Metric::SOURCES_ASSEMBLED);
+        // every phase runs until the next one starts
+        std::optional<MetricTimer> phase(std::in_place, Metric::ASSEMBLE_READ_NS);
+        Assembler assembler(path.c_str(), &symbols, options.wide, options.verbosity);
+        const auto &cache_dir = options.cache_dir;
+
+        fs::path cached;
+        std::error_code error;
+        if (!cache_dir.empty()) {
+            char key[17];
+            const auto hash = contentHash(assembler.source(), options.wide, options.optimize);
+            snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(hash));
+            cached = fs::path(cache_dir) / (std::string(key) + ".o");
+            if (fs::exists(cached, error) && tools::cStyleLoadObject(cached.c_str(), object)) {
+                countMetric(Metric::OBJECT_CACHE_HITS);
+                return true;
+            }
+            countMetric(Metric::OBJECT_CACHE_MISSES);
+        }
+
+        phase.emplace(Metric::ASSEMBLE_PARSE_NS);
+        assembler.assemble();
+        object = std::move(assembler.object());
+        if (options.optimize) {
+            phase.emplace(Metric::ASSEMBLE_OPTIMIZE_NS);
+            optimizeObject(object);
+        }
+        if (cached.empty()) {
+            return true;
+        }
+
+        // written under a name of its own first, concurrent builds never see half an object.
+        // a cache that can't be written to only costs the next build some time
+        phase.emplace(Metric::ASSEMBLE_WRITE_NS);
+        const auto scratch = cached.string() + "." + std::to_string(std::random_device{}());
+        if (tools::cStyleWriteToFile(scratch.c_str(), object)) {
+            fs::rename(scratch, cached, error);
+        }
+        if (error) {
+            fs::remove(scratch, error);
+        }
+        return true;
+    }
+
+}
+
+uint64_t contentHash(const std::string_view source, const bool wide, const bool optimize) {
+    uint64_t hash = 14695981039346656037ull ^ object_format_version ^ (wide ? 1ull << 32 : 0) ^
+                    (optimize ? 1ull << 33 : 0);
+    for (const auto c: source) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+bool build(const BuildOptions &options) {
+    const auto count = options.inputs.size();
+    std::vector<ObjectFile> objects(count);
+    std::vector<uint8_t> loaded(count);
+
+    if (!options.cache_dir.empty()) {
+        std::error_code error;
+        fs::create_directories(options.cache_dir, error);
+    }
+
+    // every worker keeps taking the next input until there are none left
+    std::atomic<size_t> next{0};
+    // and keeps a symbol table of its own for all of them
+    const auto work = [&] {
+        SymbolTable symbols;
+        for (auto i = next++; i < count; i = next++) {
+            const auto &input = options.inputs[i];
+            loaded[i] = isObject(input) ? tools::cStyleLoadObject(input.c_str(), objects[i])
+                                        : assembleSource(input, options, symbols, objects[i]);
+        }
+    };
+
+    const auto hardware = std::max(1u, std::thread::hardware_concurrency());
+    const auto threads = std::min<size_t>(options.threads ? options.threads : hardware, count);
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; ++i) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto &worker: workers) {
+        worker.join();
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (!loaded[i]) {
+            fprintf(stderr, "[[error]] failed to load %s\n", options.inputs[i].c_str());
+            return false;
+        }
+    }
+
+    if (options.objects_only) {
+        MetricTimer phase(Metric::ASSEMBLE_WRITE_NS);
+        for (size_t i = 0; i < count; ++i) {
+            const auto &input = options.inputs[i];
+            if (isObject(input)) {
+                continue;
+            }
+
+            const auto path = count == 1 && !options.output.empty() ? options.output
+                                                                    : fs::path(input).replace_extension(".o").string();
+            if (!tools::cStyleWriteToFile(path.c_str(), objects[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    ImageSections image;
+    {
+        MetricTimer phase(Metric::ASSEMBLE_LINK_NS);
+        Linker linker;
+        for (size_t i = 0; i < count; ++i) {
+            linker.add(std::move(objects[i]), options.inputs[i]);
+        }
+        if (!linker.link(image)) {
+            return false;
+        }
+    }
+
+    MetricTimer phase(Metric::ASSEMBLE_WRITE_NS);
+    return tools::cStyleWriteToFile(options.output.c_str(), image);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// inputs - metasm sources and .o objects, linked in the order they are given
+// output - image, or the object itself when objects_only is set for a single input
+// cache_dir - objects of sources are kept there under the hash of their contents,
+//             empty to assemble everything every time
+// threads - sources assembled at once, 0 for one per core
+// objects_only - write an object per input instead of linking them
+// wide - assemble for the 16-bit address space, the image is a wide one
+// optimize - run optimizeObject over the object of every source, objects given as inputs are
+//            linked as they are
+// verbosity - 0 keeps stdout quiet, 1 reports every instruction as it's assembled
+struct BuildOptions {
+    std::vector<std::string> inputs;
+    std::string output;
+    std::string cache_dir;
+    uint32_t threads{0};
+    bool objects_only{false};
+    bool wide{false};
+    bool optimize{false};
+    uint32_t verbosity{0};
+};
+
+// fnv-1a over the source, seeded with the object format, the address space and whether it is
+// optimized, so that a change of any of them misses the cache
+uint64_t contentHash(std::string_view source, bool wide = false, bool optimize = false);
+
+// assembles every source in parallel, then either links them or writes their objects out. the time
+// of every phase goes into the assemble metrics of common/metrics.h
+bool build(const BuildOptions &options);
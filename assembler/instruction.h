@@ -1,9 +1,11 @@
 #pragma once
 
-#include <string>
-#include <unordered_map>
+#include <string_view>
 #include <cstdint>
 
+#include "token.h"
+#include "../common/isa.h"
+
 // addi - 0x0 (add immediate)
 // add  - 0x1 (add value the address points to)
 // subi - 0x2 (sub immediate)
@@ -19,33 +21,71 @@
 // big - 0xC (branch-if-greater)
 // bil - 0xD (branch-if-less)
 
+// Perfect hash over the mnemonics, the seed is searched for at compile time so that
+// every mnemonic lands in a slot of its own. A lookup is one hash and one comparison.
+constexpr uint32_t mnemonic_slot_bits = 6;
+
+constexpr uint32_t mnemonic_slots = 1u << mnemonic_slot_bits;
+
+// fnv-1a, mixed with the seed and folded down to the top bits
+constexpr uint32_t mnemonicHash(const std::string_view mnemonic, const uint32_t seed) {
+    uint32_t hash = 2166136261u;
+    for (const auto c: mnemonic) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return ((hash ^ seed) * 0x9E3779B1u) >> (32 - mnemonic_slot_bits);
+}
 
-static std::unordered_map<std::string, uint8_t> opcodes = {
-        {"addi",  0x00},
-        {"add",   0x01},
-        {"subi",  0x02},
-        {"sub",   0x03},
-        {"clac",  0x04},
-        {"bnz",   0x05},
-        {"bz",    0x06},
-        {"ucb",   0x07},
-        {"str",   0x08},
-        {"leave", 0x09},
-        {"cmp",   0x0A},
-        {"cmpi",  0x0B},
-        {"outd",  0x0C},
-        {"big",   0x0D},
-        {"bil",   0x0E},
-        {"outb",  0x0F},
-        {"ret",   0x10},
-		{"submem", 0x11},
-		{"addmem", 0x12}
+struct MnemonicTable {
+    uint32_t seed;
+    int8_t slots[mnemonic_slots];
 };
 
+constexpr MnemonicTable buildMnemonicTable() {
+    for (uint32_t seed = 0;; ++seed) {
+        MnemonicTable table{seed, {}};
+        for (auto &slot: table.slots) {
+            slot = -1;
+        }
+
+        bool collides = false;
+        for (uint32_t i = 0; i < isa_count && !collides; ++i) {
+            auto &slot = table.slots[mnemonicHash(isa[i].mnemonic, seed)];
+            collides = slot != -1;
+            slot = static_cast<int8_t>(i);
+        }
+
+        if (!collides) {
+            return table;
+        }
+    }
+}
+
+static constexpr MnemonicTable mnemonic_table = buildMnemonicTable();
+
+// instruction with the given mnemonic, nullptr if there is none
+static constexpr const IsaEntry *findInstruction(const std::string_view mnemonic) {
+    const auto index = mnemonic_table.slots[mnemonicHash(mnemonic, mnemonic_table.seed)];
+    if (index < 0 || isa[index].mnemonic != mnemonic) {
+        return nullptr;
+    }
+    return &isa[index];
+}
+
+static_assert(findInstruction("submem")->opcode == 0x11 && !findInstruction("sum"), "mnemonic table is broken");
+
+// instructions which end a basic block
+static constexpr bool isBranch(const IsaEntry &instruction) {
+    return instruction.kind & kind_branch;
+}
+
+static constexpr bool isExit(const IsaEntry &instruction) {
+    return instruction.kind & kind_exit;
+}
 
-static inline uint16_t assembleInstruction(const std::string &instruction, const uint8_t value) {
+static inline uint16_t assembleInstruction(const IsaEntry &instruction, const uint8_t value) {
     // 0x00FF
-    const uint16_t opcode = (opcodes[instruction]) << 8;
+    const uint16_t opcode = instruction.opcode << 8;
 
     return opcode | value;
-}
\ No newline at end of file
+}
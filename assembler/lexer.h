@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <string_view>
+
+#include "token.h"
+
+// Splits metasm source into tokens on demand. Words are separated by whitespace or by
+// one of the symbols, labels start with '.' and run up to ':'. Like the old scanner,
+// lexing stops at the first byte that is not ascii.
+class Lexer final {
+public:
+    explicit Lexer(const std::string_view source) : source_{source} {}
+
+    Token next() {
+        skipWhitespace();
+        if (pos_ == source_.size()) {
+            return Token{TokenType::END, {}, line_};
+        }
+
+        const auto start = pos_;
+        const auto c = source_[pos_];
+        if (c == '{' || c == '}' || c == '=') {
+            pos_++;
+            return Token{TokenType::SYMBOL, source_.substr(start, 1), line_};
+        }
+
+        if (c == '.') {
+            pos_++;
+            while (pos_ < source_.size() && source_[pos_] != ':' && isWordChar(source_[pos_])) {
+                pos_++;
+            }
+            const auto name = source_.substr(start + 1, pos_ - start - 1);
+            if (pos_ < source_.size() && source_[pos_] == ':') {
+                pos_++;
+            }
+            return Token{TokenType::LABEL, name, line_};
+        }
+
+        while (pos_ < source_.size() && isWordChar(source_[pos_])) {
+            pos_++;
+        }
+        return Token{TokenType::WORD, source_.substr(start, pos_ - start), line_};
+    }
+
+private:
+    static inline bool isWordChar(const char c) {
+        return isascii(c) && !isspace(c) && c != '{' && c != '}' && c != '=' && c != '\0';
+    }
+
+    inline void skipWhitespace() {
+        while (pos_ < source_.size()) {
+            const auto c = source_[pos_];
+            if (!isascii(c) || c == '\0') {
+                // garbage past the end of the text, treat it as the end of input
+                pos_ = source_.size();
+                return;
+            }
+            if (!isspace(c)) {
+                return;
+            }
+            if (c == '\n') {
+                line_++;
+            }
+            pos_++;
+        }
+    }
+
+private:
+    std::string_view source_;
+    size_t pos_{0};
+    uint32_t line_{1};
+};
@@ -0,0 +1,121 @@
+#include <cstdio>
+#include <string_view>
+#include <unordered_map>
+
+#include "linker.h"
+#include "../common/isa.h"
+
+void Linker::add(ObjectFile object, std::string name) {
+    units_.push_back(Unit{std::move(object), std::move(name)});
+}
+
+bool Linker::link(ImageSections &image) const {
+    const auto wide = !units_.empty() && units_.front().object.wide;
+    for (const auto &unit: units_) {
+        if (unit.object.wide != wide) {
+            fprintf(stderr, "[[error]] %s is not assembled for the same address space as %s\n", unit.name.c_str(),
+                    units_.front().name.c_str());
+            return false;
+        }
+    }
+
+    std::vector<uint32_t> code_bases;
+    uint32_t code_size = 0;
+    for (const auto &unit: units_) {
+        code_bases.push_back(code_size);
+        code_size += unit.object.code.size();
+    }
+
+    // wide programs keep their data right after the code
+    const uint32_t data_start = wide ? code_size : data_section_start;
+    std::vector<uint32_t> data_bases;
+    uint32_t data_size = data_start;
+    for (const auto &unit: units_) {
+        data_bases.push_back(data_size);
+        data_size += unit.object.data.size();
+    }
+
+    if (wide && data_size > wide_address_space_size) {
+        fprintf(stderr, "[[error]] %u words of code and data do not fit into the wide address space\n", data_size);
+        return false;
+    }
+    if (!wide && code_size > data_section_start) {
+        fprintf(stderr, "[[error]] %u words of code do not fit below the data section, try --wide\n", code_size);
+        return false;
+    }
+    if (!wide && data_size > 0xFF) {
+        fprintf(stderr, "[[error]] data section overflow, %u words, try --wide\n", data_size - data_section_start);
+        return false;
+    }
+
+    const auto address = [&](const size_t unit, const ObjectSymbol &symbol) {
+        return (symbol.section == SymbolSection::CODE ? code_bases[unit] : data_bases[unit]) + symbol.value;
+    };
+
+    std::unordered_map<std::string_view, uint32_t> exported;
+    for (size_t i = 0; i < units_.size(); ++i) {
+        const auto &object = units_[i].object;
+        for (const auto &symbol: object.symbols) {
+            if (symbol.binding != SymbolBinding::EXPORTED) {
+                continue;
+            }
+
+            const auto name = object.symbolName(symbol);
+            if (!exported.emplace(name, address(i, symbol)).second) {
+                fprintf(stderr, "[[error]] multiple definition of '%.*s' in %s\n", static_cast<int>(name.size()),
+                        name.data(), units_[i].name.c_str());
+                return false;
+            }
+        }
+    }
+
+    image.code.clear();
+    image.data.clear();
+    for (size_t i = 0; i < units_.size(); ++i) {
+        const auto &object = units_[i].object;
+        image.code.insert(image.code.end(), object.code.begin(), object.code.end());
+        image.data.insert(image.data.end(), object.data.begin(), object.data.end());
+
+        for (const auto &fixup: object.fixups) {
+            const auto &symbol = object.symbols[fixup.symbol];
+            uint32_t value;
+            if (symbol.binding != SymbolBinding::IMPORTED) {
+                value = address(i, symbol);
+            } else {
+                const auto name = object.symbolName(symbol);
+                const auto it = exported.find(name);
+                if (it == exported.cend()) {
+                    fprintf(stderr, "[[error]] unresolved symbol '%.*s' imported by %s\n",
+                            static_cast<int>(name.size()), name.data(), units_[i].name.c_str());
+                    return false;
+                }
+                value = it->second;
+            }
+
+            auto &word = image.code[code_bases[i] + fixup.slot];
+            word = wide ? static_cast<uint16_t>(value) : (word & instruction_mask) | static_cast<uint8_t>(value);
+        }
+    }
+
+    image.data_start = data_start;
+    image.entry = 0;
+    image.wide = wide;
+    image.leaders.clear();
+    if (wide) {
+        return true;
+    }
+
+    // blocks start at the entry, at every branch target and right after every branch or exit
+    markLeader(image.leaders, image.entry);
+    for (uint32_t pc = 0; pc < image.code.size(); ++pc) {
+        const auto opcode = static_cast<uint8_t>(image.code[pc] >> 8);
+        if (hasKind(opcode, kind_branch)) {
+            markLeader(image.leaders, image.code[pc] & value_mask);
+        }
+        if (hasKind(opcode, kind_branch | kind_exit)) {
+            markLeader(image.leaders, pc + 1);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "../common/object.h"
+
+// Lays objects out one after another and patches every fixup with the final address of
+// its symbol. Code of the first object starts at 0 and holds the entry point, data of every
+// object follows data_section_start in the same order. Exported symbols share a single
+// namespace, local ones only resolve within their own object. Wide objects link into a wide
+// image, with the data of every object following the code of all of them, and can't be mixed
+// with single-bank ones.
+class Linker final {
+public:
+    // name is what errors refer to the object by
+    void add(ObjectFile object, std::string name);
+
+    // errors go to stderr, image is left half-built when it fails
+    [[nodiscard]] bool link(ImageSections &image) const;
+
+private:
+    struct Unit {
+        ObjectFile object;
+        std::string name;
+    };
+
+    std::vector<Unit> units_;
+};
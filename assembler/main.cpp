@@ -5,36 +5,68 @@
 #include <vector>
 #include <cstring>
 
-#include "assembler.h"
+#include "build.h"
+#include "../common/metrics.h"
 
 // Phases of a metacpu assembler
 // 1) resolve aliases (labels)
 // 2) parse the resolved assembly code
 // 3) generate an equivalent machine code
+// 4) with -O, drop the code that never runs or changes nothing
+// 5) link the objects of every source into one image
 
+// metacpu_asm <sources and objects...> [-o <output>] [-c] [-j<threads>] [--cache=<dir>] [--wide] [-O] [-v]
+//             [--metrics=text|json|prometheus]
+// -v reports every instruction on stdout, --metrics prints the counters of the build to stderr
 int main(int argc, const char *argv[]) {
-	if (argc < 2) {
+	BuildOptions options;
+	bool metrics = false;
+	MetricsFormat metrics_format = MetricsFormat::TEXT;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			options.output = argv[++i];
+		} else if (!strcmp(argv[i], "-c")) {
+			options.objects_only = true;
+		} else if (!strncmp(argv[i], "-j", 2)) {
+			options.threads = static_cast<uint32_t>(atoi(argv[i] + 2));
+		} else if (!strncmp(argv[i], "--cache=", 8)) {
+			options.cache_dir = argv[i] + 8;
+		} else if (!strcmp(argv[i], "--wide")) {
+			options.wide = true;
+		} else if (!strcmp(argv[i], "-O")) {
+			options.optimize = true;
+		} else if (!strcmp(argv[i], "-v")) {
+			options.verbosity++;
+		} else if (!strncmp(argv[i], "--metrics=", 10)) {
+			if (!parseMetricsFormat(argv[i] + 10, metrics_format)) {
+				fprintf(stderr, "[[error]] unknown metrics format %s\n", argv[i] + 10);
+				exit(-1);
+			}
+			metrics = true;
+		} else {
+			options.inputs.emplace_back(argv[i]);
+		}
+	}
+
+	if (options.inputs.empty()) {
 		fputs("nothing to assemble", stderr);
 		exit(-1);
 	}
 	
-	std::string output_file;
-	if (argc > 3) {
-		output_file = argv[3];
-	}
-	else {
-		std::string source = argv[1];
+	if (options.output.empty() && !options.objects_only) {
+		const auto &source = options.inputs.front();
 		const auto idx = source.find_first_of(".");
 		if (idx != std::string::npos) {
-			output_file = source.substr(0, idx) + ".bin";
+			options.output = source.substr(0, idx) + ".bin";
 		}
 		else {
-			output_file = "main.bin";
+			options.output = "main.bin";
 		}
 	}
-	
-
-    Assembler assembler(argv[1], output_file);
 
-    return 0;
+    const auto built = build(options);
+    if (metrics) {
+        fputs(formatMetrics(metricSamples(), metrics_format).c_str(), stderr);
+    }
+    return built ? 0 : -1;
 }
@@ -0,0 +1,217 @@
+#include <vector>
+
+#include "optimizer.h"
+#include "../common/isa.h"
+
+namespace {
+
+    // slot - first word of the instruction
+    // length - one word, two for wide memory instructions
+    // fixup - index into the fixups of the object, -1 without a memory operand
+    struct Instruction {
+        uint32_t slot;
+        uint8_t length;
+        uint8_t opcode;
+        int32_t fixup{-1};
+    };
+
+    constexpr uint32_t no_target = UINT32_MAX;
+
+    // opcodes the rules look for
+    constexpr uint8_t op_addi = opcodeWord("addi") >> 8;
+    constexpr uint8_t op_add = opcodeWord("add") >> 8;
+    constexpr uint8_t op_subi = opcodeWord("subi") >> 8;
+    constexpr uint8_t op_sub = opcodeWord("sub") >> 8;
+    constexpr uint8_t op_clac = opcodeWord("clac") >> 8;
+    constexpr uint8_t op_ucb = opcodeWord("ucb") >> 8;
+    constexpr uint8_t op_cmp = opcodeWord("cmp") >> 8;
+    constexpr uint8_t op_cmpi = opcodeWord("cmpi") >> 8;
+    constexpr uint8_t op_ret = opcodeWord("ret") >> 8;
+
+}
+
+OptimizeStats optimizeObject(ObjectFile &object) {
+    OptimizeStats stats;
+    const auto &code = object.code;
+
+    std::vector<Instruction> instructions;
+    // index of the instruction starting at a slot, one past the last one for the end of the code
+    std::vector<uint32_t> index_of(code.size() + 1, no_target);
+    for (uint32_t slot = 0; slot < code.size();) {
+        const auto length = static_cast<uint8_t>(object.wide && isWideWord(code[slot]) ? 2 : 1);
+        index_of[slot] = instructions.size();
+        instructions.push_back(Instruction{slot, length, static_cast<uint8_t>((code[slot] >> 8) & ~wide_opcode_bit)});
+        slot += length;
+    }
+    index_of[code.size()] = instructions.size();
+
+    // labels the object refers to, nothing else can be jumped to
+    std::vector<uint8_t> labeled(code.size() + 1);
+    bool links = false;
+    for (const auto &symbol: object.symbols) {
+        links |= symbol.binding != SymbolBinding::LOCAL;
+        if (symbol.section == SymbolSection::CODE && symbol.binding != SymbolBinding::IMPORTED) {
+            if (symbol.value > code.size() || index_of[symbol.value] == no_target) {
+                return stats;
+            }
+            labeled[symbol.value] = true;
+        }
+    }
+
+    for (size_t i = 0; i < object.fixups.size(); ++i) {
+        const auto &fixup = object.fixups[i];
+        const auto slot = object.wide ? fixup.slot - 1u : fixup.slot;
+        if (slot >= code.size() || index_of[slot] == no_target) {
+            return stats;
+        }
+
+        auto &instruction = instructions[index_of[slot]];
+        instruction.fixup = static_cast<int32_t>(i);
+        const auto &symbol = object.symbols[fixup.symbol];
+        const auto local = symbol.binding != SymbolBinding::IMPORTED;
+        const auto in_code = symbol.section == SymbolSection::CODE;
+        if (local && in_code != hasKind(instruction.opcode, kind_branch)) {
+            return stats;
+        }
+    }
+
+    bool returns = links;
+    for (const auto &instruction: instructions) {
+        returns |= instruction.opcode == op_ret;
+    }
+
+    // instruction a branch lands on, no_target if it's in another object
+    const auto target = [&](const Instruction &instruction) {
+        const auto &symbol = object.symbols[object.fixups[instruction.fixup].symbol];
+        return symbol.binding == SymbolBinding::IMPORTED ? no_target : index_of[symbol.value];
+    };
+
+    std::vector<uint8_t> keep(instructions.size());
+    std::vector<uint32_t> pending;
+    const auto reach = [&](const uint32_t index) {
+        if (index < instructions.size() && !keep[index]) {
+            keep[index] = true;
+            pending.push_back(index);
+        }
+    };
+
+    reach(0);
+    for (const auto &symbol: object.symbols) {
+        if (symbol.section == SymbolSection::CODE && symbol.binding == SymbolBinding::EXPORTED) {
+            reach(index_of[symbol.value]);
+        }
+    }
+    while (!pending.empty()) {
+        const auto index = pending.back();
+        pending.pop_back();
+        const auto &instruction = instructions[index];
+        if (hasKind(instruction.opcode, kind_exit)) {
+            continue;
+        }
+        if (hasKind(instruction.opcode, kind_branch)) {
+            reach(target(instruction));
+            if (!hasKind(instruction.opcode, kind_conditional) && !returns) {
+                continue;
+            }
+        }
+        reach(index + 1);
+    }
+
+    for (uint32_t index = 0; index < instructions.size(); ++index) {
+        stats.unreachable += keep[index] ? 0 : instructions[index].length;
+    }
+
+    // flags follow acc - the last instruction of the block left acc and its flags in agreement
+    bool flags_follow_acc = false;
+    bool after_clac = false;
+    for (uint32_t index = 0; index < instructions.size(); ++index) {
+        if (!keep[index]) {
+            continue;
+        }
+
+        const auto &instruction = instructions[index];
+        const auto opcode = instruction.opcode;
+        const auto leader = index == 0 || labeled[instruction.slot] ||
+                            hasKind(instructions[index - 1].opcode, kind_branch | kind_exit);
+        if (leader) {
+            flags_follow_acc = false;
+            after_clac = false;
+        }
+
+        const auto operand = static_cast<uint8_t>(code[instruction.slot] & value_mask);
+        bool redundant = false;
+        if (opcode == op_clac) {
+            redundant = after_clac;
+        } else if (opcode == op_addi || opcode == op_subi) {
+            redundant = operand == 0 && flags_follow_acc;
+        } else if (opcode == op_ucb && !returns) {
+            // lands on the next instruction that is kept
+            auto next = index + 1;
+            while (next < instructions.size() && !keep[next]) {
+                next++;
+            }
+            redundant = target(instruction) == next;
+        }
+
+        if (redundant) {
+            keep[index] = false;
+            stats.peephole += instruction.length;
+            continue;
+        }
+
+        switch (opcode) {
+            case op_addi:
+            case op_add:
+            case op_subi:
+            case op_sub:
+            case op_clac:
+                flags_follow_acc = true;
+                break;
+            case op_cmp:
+            case op_cmpi:
+                flags_follow_acc = false;
+                break;
+            default:
+                break;
+        }
+        after_clac = opcode == op_clac;
+    }
+
+    if (!stats.unreachable && !stats.peephole) {
+        return stats;
+    }
+
+    // slot every old one moves to, a slot that is gone moves to whatever is kept after it
+    std::vector<uint32_t> moved(code.size() + 1);
+    std::vector<uint16_t> compacted;
+    for (uint32_t index = 0; index < instructions.size(); ++index) {
+        const auto &instruction = instructions[index];
+        for (uint32_t i = 0; i < instruction.length; ++i) {
+            moved[instruction.slot + i] = compacted.size() + (keep[index] ? i : 0);
+        }
+        if (keep[index]) {
+            compacted.insert(compacted.end(), code.begin() + instruction.slot,
+                             code.begin() + instruction.slot + instruction.length);
+        }
+    }
+    moved[code.size()] = compacted.size();
+
+    std::vector<ObjectFixup> fixups;
+    for (uint32_t index = 0; index < instructions.size(); ++index) {
+        const auto &instruction = instructions[index];
+        if (keep[index] && instruction.fixup >= 0) {
+            auto fixup = object.fixups[instruction.fixup];
+            fixup.slot = static_cast<uint16_t>(moved[fixup.slot]);
+            fixups.push_back(fixup);
+        }
+    }
+
+    for (auto &symbol: object.symbols) {
+        if (symbol.section == SymbolSection::CODE && symbol.binding != SymbolBinding::IMPORTED) {
+            symbol.value = moved[symbol.value];
+        }
+    }
+    object.code = std::move(compacted);
+    object.fixups = std::move(fixups);
+    return stats;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+#include "../common/object.h"
+
+// words an optimisation took out of an object
+// unreachable - blocks no path of the program leads to
+// peephole - single instructions that change nothing
+struct OptimizeStats {
+    uint32_t unreachable{0};
+    uint32_t peephole{0};
+};
+
+// Optional pass over an object whose symbols are resolved, nothing is changed unless it runs.
+// The code is split into basic blocks at every label and branch, and blocks that can't be reached
+// from slot 0 or an exported label are dropped. Every branch keeps whatever follows it alive, since
+// that's where a ret lands. Then the peephole rules:
+// - clac right after another clac
+// - addi 0 and subi 0 while the flags already follow acc, i.e. after addi, add, subi, sub or clac
+//   within the same block
+// - ucb to the instruction right after it, as long as nothing can return to the address it pushes:
+//   the object has no ret and does not link against any other object
+// What is left is compacted, labels and fixups move along with their instructions.
+// An object that reads or writes its own code through a memory operand, or branches into data, is
+// left as it is, its layout is part of what it does. Code of other objects is assumed to never be
+// used as data either.
+OptimizeStats optimizeObject(ObjectFile &object);
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Bump allocator handing out pieces of large chunks. Nothing is freed one by one,
+// reset() rewinds to the first chunk and keeps every chunk around for the next round.
+class Arena final {
+public:
+    static constexpr size_t chunk_size = 16 * 1024;
+
+    char *allocate(const size_t size) {
+        while (chunk_ < chunks_.size() && used_ + size > chunks_[chunk_].size) {
+            chunk_++;
+            used_ = 0;
+        }
+        if (chunk_ == chunks_.size()) {
+            const auto capacity = std::max(chunk_size, size);
+            chunks_.push_back(Chunk{std::make_unique<char[]>(capacity), capacity});
+            used_ = 0;
+        }
+
+        auto *ptr = chunks_[chunk_].memory.get() + used_;
+        used_ += size;
+        return ptr;
+    }
+
+    inline void reset() noexcept {
+        chunk_ = 0;
+        used_ = 0;
+    }
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> memory;
+        size_t size;
+    };
+
+    std::vector<Chunk> chunks_;
+    size_t chunk_{0};
+    size_t used_{0};
+};
+
+// Every name of a source, whether it's a label, a variable or both. Names are interned
+// into an arena, symbols are kept in the order they were first seen and found through an
+// open addressed index with linear probing, kept at most half full. reset() empties the
+// table without giving back any memory, so one table serves any number of sources.
+class SymbolTable final {
+public:
+    // has_label, has_variable - the name is defined as such
+    // exported, imported - named by EXPORT or IMPORT
+    // in_object - object_symbol holds its index in the symbols of the object
+    static constexpr uint8_t has_label = 1u << 0;
+    static constexpr uint8_t has_variable = 1u << 1;
+    static constexpr uint8_t exported = 1u << 2;
+    static constexpr uint8_t imported = 1u << 3;
+    static constexpr uint8_t in_object = 1u << 4;
+
+    // line - where the symbol was named by EXPORT or IMPORT
+    struct Symbol {
+        std::string_view name;
+        uint32_t hash;
+        uint32_t label;
+        uint32_t variable;
+        uint32_t line;
+        uint16_t object_symbol;
+        uint8_t flags;
+    };
+
+    // symbol of a name, added if it's not there yet
+    Symbol &intern(const std::string_view name) {
+        const auto hash = hashOf(name);
+        if (!index_.empty()) {
+            const auto entry = index_[find(name, hash)];
+            if (entry) {
+                return symbols_[entry - 1];
+            }
+        }
+
+        if ((symbols_.size() + 1) * 2 > index_.size()) {
+            grow();
+        }
+
+        const auto slot = find(name, hash);
+        auto *text = arena_.allocate(name.size());
+        memcpy(text, name.data(), name.size());
+        symbols_.push_back(Symbol{std::string_view(text, name.size()), hash, 0, 0, 0, 0, 0});
+        index_[slot] = static_cast<uint32_t>(symbols_.size());
+        return symbols_.back();
+    }
+
+    // nullptr if the name was never interned
+    [[nodiscard]] const Symbol *lookup(const std::string_view name) const {
+        if (index_.empty()) {
+            return nullptr;
+        }
+        const auto slot = find(name, hashOf(name));
+        return index_[slot] ? &symbols_[index_[slot] - 1] : nullptr;
+    }
+
+    inline void reset() {
+        symbols_.clear();
+        std::fill(index_.begin(), index_.end(), 0);
+        arena_.reset();
+    }
+
+    [[nodiscard]] inline size_t size() const noexcept { return symbols_.size(); }
+
+    [[nodiscard]] inline Symbol &operator[](const size_t index) noexcept { return symbols_[index]; }
+
+private:
+    // fnv-1a
+    static constexpr uint32_t hashOf(const std::string_view name) {
+        uint32_t hash = 2166136261u;
+        for (const auto c: name) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+        }
+        return hash;
+    }
+
+    // slot holding the name, or the empty slot it would go into
+    [[nodiscard]] size_t find(const std::string_view name, const uint32_t hash) const {
+        const auto mask = index_.size() - 1;
+        for (auto slot = hash & mask;; slot = (slot + 1) & mask) {
+            const auto entry = index_[slot];
+            if (!entry) {
+                return slot;
+            }
+            const auto &symbol = symbols_[entry - 1];
+            if (symbol.hash == hash && symbol.name == name) {
+                return slot;
+            }
+        }
+    }
+
+    void grow() {
+        index_.assign(std::max<size_t>(64, index_.size() * 2), 0);
+        const auto mask = index_.size() - 1;
+        for (uint32_t i = 0; i < symbols_.size(); ++i) {
+            auto slot = symbols_[i].hash & mask;
+            while (index_[slot]) {
+                slot = (slot + 1) & mask;
+            }
+            index_[slot] = i + 1;
+        }
+    }
+
+private:
+    Arena arena_;
+    std::vector<Symbol> symbols_;
+    // 1-based positions in symbols_, 0 for an empty slot
+    std::vector<uint32_t> index_;
+};
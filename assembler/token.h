@@ -1,54 +1,25 @@
 #pragma once
 
-#include <vector>
-#include <string>
-#include <unordered_map>
+#include <cstdint>
+#include <string_view>
 
 
-enum class InstructionMode : unsigned {
-    NONE = 0x0,
-    IMMEDIATE = 0x1,
-    MEMORY = 0x2
-};
-
 // Available memory bank: 256 16-bit entries 
 
-// TODO(threadedstream): needs to be changed to something less painful to query
-static std::unordered_map<std::string, InstructionMode> instructions = {
-        {"addi",  InstructionMode::IMMEDIATE},
-        {"subi",  InstructionMode::IMMEDIATE},
-        {"add",   InstructionMode::MEMORY},
-        {"sub",   InstructionMode::MEMORY},
-        {"clac",  InstructionMode::NONE},
-        {"str",   InstructionMode::MEMORY},
-        {"bz",    InstructionMode::MEMORY},
-        {"bnz",   InstructionMode::MEMORY},
-        {"ucb",   InstructionMode::MEMORY},
-        {"leave", InstructionMode::NONE},
-        {"cmpi",  InstructionMode::IMMEDIATE},
-        {"cmp",   InstructionMode::MEMORY},
-        {"outd",  InstructionMode::NONE},
-        {"big",   InstructionMode::MEMORY},
-        {"bil",   InstructionMode::MEMORY},
-        {"outb",  InstructionMode::NONE},
-        {"ret", InstructionMode::NONE},
-		{"submem", InstructionMode::MEMORY},
-		{"addmem", InstructionMode::MEMORY}
-};
-
+// word - mnemonic, operand, variable name or number
+// label - ".name:", text holds the name alone
+// symbol - one of '{', '}' and '='
+// end - no more input
 enum class TokenType : unsigned {
-    INSTRUCTION,
-    NUMBER,
+    WORD,
     LABEL,
+    SYMBOL,
+    END,
 };
 
-
+// text points into the source buffer, tokens never own any memory
 struct Token {
     TokenType type;
-    const char *name;
-    union {
-        Token *operand;
-        const char *value_str;
-        int16_t value_int;
-    };
+    std::string_view text;
+    uint32_t line;
 };
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <cstring>
 #include <fstream>
 #include <filesystem>
+#include <vector>
 #include "../common/errors.h"
+#include "../common/image.h"
+#include "../common/object.h"
 
 namespace tools {
 	
@@ -25,7 +29,7 @@ namespace tools {
 		
 	}
 
-    static char *cppStyleLoadFileIntoMemory(const char *const path) {
+    static inline char *cppStyleLoadFileIntoMemory(const char *const path) {
         std::ifstream stream(path, std::ios::in | std::ios::app);
         if (!stream) {
             fputs("[[error]] make sure that path to the file is correct\n", stderr);
@@ -54,7 +58,7 @@ namespace tools {
         return src;
     }
 
-    static char *cStyleLoadFileIntoMemory(const char *const path, uint32_t *size) {
+    static inline char *cStyleLoadFileIntoMemory(const char *const path, uint32_t *size) {
 		// TODO(threadedstream): when opened in binary mode, buffer also retrieves
 		// some piece of shitty garbage. I probably should investigate this problem further, inasmuch as
 		// comparison of the number of read bytes against the actual file size, which in turn
@@ -92,7 +96,7 @@ namespace tools {
     }
 
     // TOTEST(threadedstream)
-    static bool cppStyleWriteToFile(const char *const path, const std::string &contents) {
+    static inline bool cppStyleWriteToFile(const char *const path, const std::string &contents) {
         std::ofstream stream(path, std::ios::app | std::ios::out);
 
         if (!stream) {
@@ -122,7 +126,7 @@ namespace tools {
     }
 
     // TODO(threadedstream): test transfer of an ownership against "const char* const"
-    static bool cStyleWriteToFile(const char *const path, const std::vector<uint16_t> &opcodes) {
+    static inline bool cStyleWriteToFile(const char *const path, const std::vector<uint16_t> &opcodes) {
         FILE *stream = fopen(path, "wb");
         if (!stream) {
             fputs("[[error]] make sure that path to the file is correct\n", stderr);
@@ -146,4 +150,139 @@ namespace tools {
 
         return true;
     }
+
+    // writes a v2 image, or a v3 one if the image is wide, see imageBytes for the layout
+    static inline bool cStyleWriteToFile(const char *const path, const ImageSections &image) {
+        FILE *stream = fopen(path, "wb");
+        if (!stream) {
+            fputs("[[error]] make sure that path to the file is correct\n", stderr);
+            return false;
+        }
+
+        const auto bytes = imageBytes(image);
+        if (fwrite(bytes.data(), 1, bytes.size(), stream) != bytes.size()) {
+            fputs("[[error]] failed to put contents into a file\n", stderr);
+            fclose(stream);
+            return false;
+        }
+
+        fclose(stream);
+
+        return true;
+    }
+
+    // writes a relocatable object, see object.h for the layout
+    static inline bool cStyleWriteToFile(const char *const path, const ObjectFile &object) {
+        const ObjectHeader header{
+                object_format_version,
+                static_cast<uint32_t>(object.code.size()),
+                static_cast<uint32_t>(object.data.size()),
+                static_cast<uint32_t>(object.symbols.size()),
+                static_cast<uint32_t>(object.fixups.size()),
+                static_cast<uint32_t>(object.strings.size()),
+                object.wide ? object_wide : 0,
+        };
+
+        FILE *stream = fopen(path, "wb");
+        if (!stream) {
+            fputs("[[error]] make sure that path to the file is correct\n", stderr);
+            return false;
+        }
+
+        char preamble[image_header_offset] = {};
+        memcpy(preamble, expected_preamble_object, sizeof(expected_preamble_object));
+        if (!fwrite(preamble, 1, sizeof(preamble), stream) || !fwrite(&header, sizeof(header), 1, stream)) {
+            fputs("[[error]] failed to write preamble to a file\n", stderr);
+            fclose(stream);
+            return false;
+        }
+
+        const auto written = fwrite(object.code.data(), sizeof(uint16_t), object.code.size(), stream) +
+                             fwrite(object.data.data(), sizeof(uint16_t), object.data.size(), stream) +
+                             fwrite(object.symbols.data(), sizeof(ObjectSymbol), object.symbols.size(), stream) +
+                             fwrite(object.fixups.data(), sizeof(ObjectFixup), object.fixups.size(), stream) +
+                             fwrite(object.strings.data(), 1, object.strings.size(), stream);
+        if (written != object.code.size() + object.data.size() + object.symbols.size() + object.fixups.size() +
+                       object.strings.size()) {
+            fputs("[[error]] failed to put contents into a file\n", stderr);
+            fclose(stream);
+            return false;
+        }
+
+        fclose(stream);
+
+        return true;
+    }
+
+    // reads an object back, everything it refers to is checked to lie within the object
+    static inline bool cStyleLoadObject(const char *const path, ObjectFile &object) {
+        FILE *stream = fopen(path, "rb");
+        if (!stream) {
+            fputs(errors[FAILED_TO_INIT_STREAM], stderr);
+            return false;
+        }
+
+        char preamble[image_header_offset];
+        ObjectHeader header{};
+        if (fread(preamble, 1, sizeof(preamble), stream) != sizeof(preamble) ||
+            fread(&header, sizeof(header), 1, stream) != 1) {
+            fputs(errors[FAILED_TO_READ_PREAMBLE], stderr);
+            fclose(stream);
+            return false;
+        }
+
+        if (memcmp(preamble, expected_preamble_object, sizeof(expected_preamble_object)) != 0) {
+            fputs(errors[MALFORMED_PREAMBLE], stderr);
+            fclose(stream);
+            return false;
+        }
+
+        const auto wide = (header.flags & object_wide) != 0;
+        const auto code_limit = wide ? wide_address_space_size : data_section_start;
+        const auto data_limit = wide ? wide_address_space_size : 0x100 - data_section_start;
+        if (header.version != object_format_version || (header.flags & ~object_wide) ||
+            header.code_words > code_limit || header.data_words > data_limit || header.symbol_count > 0xFFFF ||
+            header.fixup_count > header.code_words || header.strings_size > 0xFFFFFF) {
+            fputs(errors[MALFORMED_OBJECT], stderr);
+            fclose(stream);
+            return false;
+        }
+
+        object.wide = wide;
+        object.code.resize(header.code_words);
+        object.data.resize(header.data_words);
+        object.symbols.resize(header.symbol_count);
+        object.fixups.resize(header.fixup_count);
+        object.strings.resize(header.strings_size);
+        const auto read = fread(object.code.data(), sizeof(uint16_t), object.code.size(), stream) +
+                          fread(object.data.data(), sizeof(uint16_t), object.data.size(), stream) +
+                          fread(object.symbols.data(), sizeof(ObjectSymbol), object.symbols.size(), stream) +
+                          fread(object.fixups.data(), sizeof(ObjectFixup), object.fixups.size(), stream) +
+                          fread(object.strings.data(), 1, object.strings.size(), stream);
+        fclose(stream);
+        if (read != object.code.size() + object.data.size() + object.symbols.size() + object.fixups.size() +
+                    object.strings.size()) {
+            fputs(errors[FAILED_TO_READ_CONTENTS], stderr);
+            return false;
+        }
+
+        for (const auto &symbol: object.symbols) {
+            const auto extent = symbol.section == SymbolSection::CODE ? object.code.size() : object.data.size();
+            if (symbol.section > SymbolSection::NONE || symbol.binding > SymbolBinding::IMPORTED ||
+                symbol.name_offset + static_cast<size_t>(symbol.name_size) > object.strings.size() ||
+                (symbol.binding == SymbolBinding::IMPORTED) != (symbol.section == SymbolSection::NONE) ||
+                (symbol.section != SymbolSection::NONE && symbol.value > extent)) {
+                fputs(errors[MALFORMED_OBJECT], stderr);
+                return false;
+            }
+        }
+        for (const auto &fixup: object.fixups) {
+            if (fixup.slot >= object.code.size() || fixup.symbol >= object.symbols.size()) {
+                fputs(errors[MALFORMED_OBJECT], stderr);
+                return false;
+            }
+        }
+
+        return true;
+    }
 }
\ No newline at end of file
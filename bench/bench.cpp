@@ -0,0 +1,195 @@
+// Benchmarks of the vm and the assembler. Every .asm file of the corpus is assembled,
+// loaded and run under each dispatch mode, timings are reported per retired instruction,
+// per load and per byte of input.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "assembler.h"
+#include "linker.h"
+#include "jit.h"
+#include "vm.h"
+
+namespace fs = std::filesystem;
+
+using bench_clock = std::chrono::steady_clock;
+
+#ifndef METACPU_BENCH_CORPUS
+#define METACPU_BENCH_CORPUS "corpus"
+#endif
+
+namespace {
+
+    struct BenchOptions {
+        // fixed number of runs per case, 0 to calibrate against min_seconds
+        uint32_t reps{0};
+        double min_seconds{0.2};
+        // only programs whose name contains filter are measured
+        const char *filter{nullptr};
+    };
+
+    // output is thrown away, only the cost of producing it is measured
+    class NullSink final : public OutputSink {
+    protected:
+        bool drain(const char *, size_t) override { return true; }
+    };
+
+    struct Measurement {
+        uint32_t reps;
+        double seconds_per_run;
+    };
+
+    // one warm-up run, then as many as options ask for, or as fit into min_seconds
+    template<typename Fn>
+    Measurement measure(const BenchOptions &options, Fn &&fn) {
+        const auto time = [&fn](const uint32_t reps) {
+            const auto start = bench_clock::now();
+            for (uint32_t i = 0; i < reps; ++i) {
+                fn();
+            }
+            return std::chrono::duration<double>(bench_clock::now() - start).count();
+        };
+
+        auto reps = options.reps;
+        if (!reps) {
+            const auto once = std::max(time(1), 1e-9);
+            reps = static_cast<uint32_t>(std::clamp(options.min_seconds / once, 1.0, 1e7));
+        } else {
+            time(1);
+        }
+
+        return Measurement{reps, time(reps) / reps};
+    }
+
+    // number of instructions a run retires, as accounted by the profiled loop
+    uint64_t countInstructions(const MappedImage &image) {
+        NullSink sink;
+        Profile profile;
+        Interpreter interp(image, {}, DispatchMode::SWITCH, &sink, &profile);
+        return profile.total();
+    }
+
+    constexpr std::pair<DispatchMode, const char *> bench_modes[] = {
+            {DispatchMode::SWITCH,   "switch"},
+            {DispatchMode::THREADED, "threaded"},
+            {DispatchMode::FUSED,    "fused"},
+            {DispatchMode::JIT,      "jit"},
+    };
+
+    void benchProgram(const BenchOptions &options, const fs::path &source, const fs::path &binary) {
+        const auto name = source.stem().string();
+        const auto source_bytes = fs::file_size(source);
+        const auto measured = [&](const char *stage, const Measurement &m, const double bytes) {
+            printf("%-16s %-10s %10u %12.0f %12.1f %10.2f\n", name.c_str(), stage, m.reps, bytes,
+                   m.seconds_per_run * 1e9, bytes / m.seconds_per_run / 1e6);
+        };
+
+        // the source is read once, then assembled from memory, linked and written, each on its own
+        std::ifstream stream(source, std::ios::binary);
+        const std::string text{std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>()};
+        ObjectFile object;
+        measured("assemble", measure(options, [&] {
+            Assembler assembler(text, source.c_str());
+            assembler.assemble();
+            object = std::move(assembler.object());
+        }), static_cast<double>(source_bytes));
+
+        ImageSections sections;
+        measured("link", measure(options, [&] {
+            Linker linker;
+            linker.add(object, source.string());
+            sections = ImageSections{};
+            if (!linker.link(sections)) {
+                exit(-1);
+            }
+        }), static_cast<double>(source_bytes));
+        measured("write", measure(options, [&] {
+            if (!tools::cStyleWriteToFile(binary.c_str(), sections)) {
+                exit(-1);
+            }
+        }), static_cast<double>(source_bytes));
+
+        MappedImage image;
+        if (!image.open(binary.c_str())) {
+            return;
+        }
+        const auto image_bytes = static_cast<double>(fs::file_size(binary));
+        measured("load", measure(options, [&] {
+            MappedImage loaded;
+            uint16_t memory[memory_bank_capacity];
+            loaded.open(binary.c_str());
+            loaded.copyInto(memory, memory_bank_capacity);
+        }), image_bytes);
+
+        const auto instructions = countInstructions(image);
+        // the jit keeps one compiler across its runs, as the server and the batch do, so the
+        // warm-up run pays for the translation and the timed ones only execute
+        JitCompiler jit(nullptr, image.layout().code_end);
+        for (const auto &[mode, mode_name]: bench_modes) {
+            const auto m = measure(options, [&] {
+                NullSink sink;
+                if (mode == DispatchMode::JIT) {
+                    Interpreter interp(image, {}, jit, &sink);
+                } else {
+                    Interpreter interp(image, {}, mode, &sink);
+                }
+            });
+            const auto ns = m.seconds_per_run * 1e9 / static_cast<double>(std::max<uint64_t>(instructions, 1));
+            printf("%-16s %-10s %10u %12llu %12.3f %10.1f\n", name.c_str(), mode_name, m.reps,
+                   static_cast<unsigned long long>(instructions), ns, 1e3 / ns);
+        }
+    }
+
+}
+
+int main(int argc, const char *argv[]) {
+    BenchOptions options;
+    const char *corpus = METACPU_BENCH_CORPUS;
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--reps=", 7)) {
+            options.reps = static_cast<uint32_t>(atoi(argv[i] + 7));
+        } else if (!strncmp(argv[i], "--min-time=", 11)) {
+            options.min_seconds = atof(argv[i] + 11) / 1e3;
+        } else if (!strncmp(argv[i], "--filter=", 9)) {
+            options.filter = argv[i] + 9;
+        } else if (!strncmp(argv[i], "--", 2)) {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return -1;
+        } else {
+            corpus = argv[i];
+        }
+    }
+
+    std::error_code error;
+    std::vector<fs::path> sources;
+    for (const auto &entry: fs::directory_iterator(corpus, error)) {
+        const auto &path = entry.path();
+        if (path.extension() == ".asm" && (!options.filter || path.stem().string().find(options.filter) != std::string::npos)) {
+            sources.push_back(path);
+        }
+    }
+    if (error || sources.empty()) {
+        fprintf(stderr, "no programs found in %s\n", corpus);
+        return -1;
+    }
+    std::sort(sources.begin(), sources.end());
+
+    const auto scratch = fs::temp_directory_path() / "metacpu_bench";
+    fs::create_directories(scratch, error);
+
+    // assemble, link, write and load rows report bytes of input, vm rows retired instructions
+    printf("%-16s %-10s %10s %12s %12s %10s\n", "program", "stage", "runs", "bytes", "ns/run", "MB/s");
+    printf("%-16s %-10s %10s %12s %12s %10s\n", "", "engine", "runs", "insns", "ns/insn", "MIPS");
+    for (const auto &source: sources) {
+        benchProgram(options, source, scratch / (source.stem().string() + ".bin"));
+    }
+
+    fs::remove_all(scratch, error);
+    return 0;
+}
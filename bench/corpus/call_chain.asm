@@ -0,0 +1,32 @@
+.loop:
+    ucb first
+    submem count
+    clac
+    add count
+    bnz loop
+    clac
+    add calls
+    outd
+    leave
+
+.first:
+    addmem calls
+    ucb second
+    ret
+
+.second:
+    addmem calls
+    ucb third
+    ret
+
+.third:
+    addmem calls
+    clac
+    add calls
+    ret
+
+BEGINDATA
+{
+    count = 120
+    calls = 0
+}
@@ -0,0 +1,24 @@
+.outer_loop:
+    clac
+    add inner_init
+    str inner
+.inner_loop:
+    submem inner
+    clac
+    add inner
+    bnz inner_loop
+    submem outer
+    clac
+    add outer
+    bnz outer_loop
+    clac
+    addi 33
+    outb
+    leave
+
+BEGINDATA
+{
+    outer = 200
+    inner = 0
+    inner_init = 100
+}
@@ -0,0 +1,43 @@
+.loop:
+    clac
+    add a
+    add b
+    str c
+    sub d
+    str e
+    add f
+    cmp g
+    str h
+    addmem i
+    submem j
+    add k
+    sub l
+    str m
+    cmpi 3
+    submem n
+    clac
+    add n
+    bnz loop
+    clac
+    add o
+    outd
+    leave
+
+BEGINDATA
+{
+    a = 1
+    b = 2
+    c = 3
+    d = 4
+    e = 5
+    f = 6
+    g = 7
+    h = 8
+    i = 9
+    j = 10
+    k = 11
+    l = 12
+    m = 13
+    n = 120
+    o = 15
+}
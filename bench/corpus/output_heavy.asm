@@ -0,0 +1,27 @@
+.line:
+    clac
+    add width
+    str column
+.char:
+    clac
+    addi 46
+    outb
+    submem column
+    clac
+    add column
+    bnz char
+    clac
+    addi 10
+    outb
+    submem lines
+    clac
+    add lines
+    bnz line
+    leave
+
+BEGINDATA
+{
+    lines = 100
+    column = 0
+    width = 79
+}
@@ -0,0 +1,520 @@
+// Differential fuzzing of the dispatch engines. Random single-bank programs are run on the bounded
+// switch loop first, which is the reference, and then on every other engine: threaded, fused, jit,
+// fused off a predecoded image, lockstep over a handful of data sets, and the Go vm if it's given.
+// Whatever ends up different
+// from the reference in acc, flags, memory or output is reported along with the seed that makes the
+// program again. Every engine is timed on every program as well, relative to the switch loop.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "vm.h"
+#include "jit.h"
+#include "lockstep.h"
+
+namespace fs = std::filesystem;
+
+using bench_clock = std::chrono::steady_clock;
+
+namespace {
+
+    struct FuzzOptions {
+        uint64_t seed{1};
+        uint32_t programs{500};
+        // steps the reference may take, programs that don't halt within them are thrown away
+        uint64_t budget{100000};
+        // runs per engine when timing, 0 skips timing altogether
+        uint32_t reps{20};
+        // data sets lockstep runs a program over
+        uint32_t lanes{8};
+        // seconds a single program may take on all engines together before the harness gives up
+        uint32_t timeout{10};
+        // where images of programs that differ are written to, nowhere if null
+        const char *save{nullptr};
+        // metacpu-go binary, the Go vm is left out if null
+        const char *go{nullptr};
+        bool quiet{false};
+    };
+
+    // output is thrown away, only the cost of producing it is measured
+    class NullSink final : public OutputSink {
+    protected:
+        bool drain(const char *, size_t) override { return true; }
+    };
+
+    struct Outcome {
+        int8_t acc{0};
+        uint8_t pc{0};
+        uint8_t flags{0};
+        std::vector<uint16_t> memory;
+        std::string output;
+    };
+
+    struct Engine {
+        const char *name;
+        // runs the program once, to the end
+        Outcome (*run)(const MappedImage &image, const MappedImage &predecoded);
+        // what the timed runs go on
+        DispatchMode mode;
+        bool predecoded;
+    };
+
+    // the final state of a vm, along with what it printed
+    Outcome outcomeOf(VmState &&state, std::string &&output) {
+        Outcome outcome;
+        outcome.acc = state.acc;
+        outcome.pc = state.pc;
+        outcome.flags = state.flags;
+        outcome.memory = std::move(state.memory);
+        outcome.output = std::move(output);
+        return outcome;
+    }
+
+    template<DispatchMode Mode, bool Predecoded>
+    Outcome runEngine(const MappedImage &image, const MappedImage &predecoded) {
+        std::string output;
+        VmState state;
+        {
+            StringSink sink(output);
+            Interpreter interp(Predecoded ? predecoded : image, {}, Mode, &sink);
+            state = interp.state();
+        }
+        return outcomeOf(std::move(state), std::move(output));
+    }
+
+    // the switch loop comes first, everything is timed against it
+    constexpr Engine engines[] = {
+            {"switch",     runEngine<DispatchMode::SWITCH, false>,   DispatchMode::SWITCH,   false},
+            {"threaded",   runEngine<DispatchMode::THREADED, false>, DispatchMode::THREADED, false},
+            {"fused",      runEngine<DispatchMode::FUSED, false>,    DispatchMode::FUSED,    false},
+            {"jit",        runEngine<DispatchMode::JIT, false>,      DispatchMode::JIT,      false},
+            {"predecoded", runEngine<DispatchMode::FUSED, true>,     DispatchMode::FUSED,    true},
+    };
+
+    constexpr uint32_t engine_count = sizeof(engines) / sizeof(engines[0]);
+    // lockstep is reported after the scalar engines
+    constexpr uint32_t lockstep_column = engine_count;
+
+    // seed of the program being run, for the watchdog to report
+    volatile uint64_t watched_seed = 0;
+
+    void watchdog(int) {
+        char message[96];
+        const auto size = snprintf(message, sizeof(message), "[[error]] program %llu hangs on some engine\n",
+                                   static_cast<unsigned long long>(watched_seed));
+        if (size > 0) {
+            write(STDERR_FILENO, message, static_cast<size_t>(size));
+        }
+        _exit(2);
+    }
+
+    // Random program of a single bank. Code fills the bottom of the bank and ends with leave, branch
+    // targets stay within the code, and most memory operands point into the data section or the
+    // free words between it and the code. Now and then one points at the code itself, which is how
+    // self-modifying programs come out of it
+    ImageSections generateProgram(std::mt19937_64 &rng) {
+        const auto pick = [&rng](const uint32_t bound) { return static_cast<uint32_t>(rng() % bound); };
+
+        ImageSections sections;
+        const auto code_words = 4 + pick(60);
+        const auto data_words = 1 + pick(0x100 - data_section_start);
+        sections.code.resize(code_words);
+        sections.data.resize(data_words);
+        for (auto &word: sections.data) {
+            // mostly small values, so that arithmetic on them stays interesting
+            word = static_cast<uint16_t>(pick(4) ? pick(16) : rng());
+        }
+        sections.entry = pick(8) ? 0 : pick(code_words);
+
+        for (uint32_t slot = 0; slot + 1 < code_words; ++slot) {
+            auto opcode = static_cast<uint8_t>(pick(isa_count));
+            // leave and ret end things early, they only show up once in a while
+            while ((opcode == LEAVE >> 8 || opcode == RET >> 8) && pick(4)) {
+                opcode = static_cast<uint8_t>(pick(isa_count));
+            }
+
+            const auto &entry = isa[opcode];
+            uint32_t operand = 0;
+            if (entry.mode == InstructionMode::IMMEDIATE) {
+                operand = pick(0x100);
+            } else if (entry.mode == InstructionMode::MEMORY && (entry.kind & kind_branch)) {
+                // forward more often than not, so that most programs get to the end
+                operand = pick(3) ? slot + 1 + pick(code_words - slot - 1) : pick(slot + 1);
+            } else if (entry.mode == InstructionMode::MEMORY) {
+                const auto where = pick(16);
+                if (where == 0) {
+                    operand = pick(code_words);
+                } else if (where < 4 && code_words < data_section_start) {
+                    operand = code_words + pick(data_section_start - code_words);
+                } else {
+                    operand = data_section_start + pick(0x100 - data_section_start);
+                }
+            }
+            sections.code[slot] = static_cast<uint16_t>((opcode << 8) | operand);
+        }
+        sections.code.back() = LEAVE;
+        return sections;
+    }
+
+    bool loadSections(const ImageSections &sections, MappedImage &image) {
+        const auto bytes = imageBytes(sections);
+        return image.load(bytes.data(), bytes.size());
+    }
+
+    // first difference between two outcomes, nullptr if there is none
+    const char *difference(const Outcome &expected, const Outcome &actual) {
+        if (expected.output != actual.output) {
+            return "output";
+        }
+        if (expected.acc != actual.acc) {
+            return "acc";
+        }
+        if (expected.flags != actual.flags) {
+            return "flags";
+        }
+        if (expected.pc != actual.pc) {
+            return "pc";
+        }
+        if (expected.memory != actual.memory) {
+            return "memory";
+        }
+        return nullptr;
+    }
+
+    // one warm-up run, then reps of them, seconds per run
+    template<typename Fn>
+    double measure(const uint32_t reps, Fn &&fn) {
+        fn();
+        const auto start = bench_clock::now();
+        for (uint32_t i = 0; i < reps; ++i) {
+            fn();
+        }
+        return std::chrono::duration<double>(bench_clock::now() - start).count() / reps;
+    }
+
+    // seconds per run of a program on an engine, execution alone. Every vm is loaded and decoded before
+    // the clock starts, and the jit translates on a single compiler, during the warm-up run
+    double timeEngine(const Engine &engine, const MappedImage &image, const MappedImage &predecoded,
+                      const uint32_t reps) {
+        NullSink sink;
+        JitCompiler jit(nullptr, image.layout().code_end);
+        const auto &loaded = engine.predecoded ? predecoded : image;
+        {
+            Interpreter warm_up(loaded, {}, &sink);
+            warm_up.prepare(engine.mode, &jit);
+            warm_up.finish();
+        }
+
+        std::vector<std::unique_ptr<Interpreter>> interps;
+        for (uint32_t i = 0; i < reps; ++i) {
+            interps.push_back(std::make_unique<Interpreter>(loaded, std::vector<uint16_t>{}, &sink));
+            interps.back()->prepare(engine.mode, &jit);
+        }
+        const auto start = bench_clock::now();
+        for (auto &interp: interps) {
+            interp->finish();
+        }
+        return std::chrono::duration<double>(bench_clock::now() - start).count() / reps;
+    }
+
+    std::string readFile(const fs::path &path) {
+        std::ifstream stream(path, std::ios::binary);
+        std::ostringstream contents;
+        contents << stream.rdbuf();
+        return contents.str();
+    }
+
+    // state as metacpu-go --state prints it
+    std::string goState(const Outcome &outcome) {
+        std::string state = "halted acc " + std::to_string(outcome.acc) + " flags " + std::to_string(outcome.flags) +
+                            " pc " + std::to_string(outcome.pc) + "\n";
+        char word[8];
+        for (size_t i = 0; i < outcome.memory.size(); ++i) {
+            snprintf(word, sizeof(word), i ? " %04x" : "%04x", outcome.memory[i]);
+            state += word;
+        }
+        return state + "\n";
+    }
+
+    // the Go vm runs in a process of its own, off the image in a file. First difference from the
+    // reference, nullptr if there is none
+    const char *goDifference(const FuzzOptions &options, const ImageSections &sections, const Outcome &reference) {
+        const auto scratch = fs::temp_directory_path() / ("metacpu_fuzz_" + std::to_string(getpid()));
+        std::error_code error;
+        fs::create_directories(scratch, error);
+        const auto image = scratch / "image.bin";
+        const auto output = scratch / "output";
+        const auto state = scratch / "state";
+
+        const auto bytes = imageBytes(sections);
+        FILE *stream = fopen(image.c_str(), "wb");
+        const auto written = stream && fwrite(bytes.data(), 1, bytes.size(), stream) == bytes.size();
+        if (stream) {
+            fclose(stream);
+        }
+        if (!written) {
+            return "whether it runs";
+        }
+
+        const auto command = std::string(options.go) + " --steps=" + std::to_string(options.budget) + " --state " +
+                             image.string() + " > " + output.string() + " 2> " + state.string();
+        const auto status = system(command.c_str());
+        const char *what = nullptr;
+        if (status != 0) {
+            what = "whether it halts";
+        } else if (readFile(output) != reference.output) {
+            what = "output";
+        } else if (readFile(state) != goState(reference)) {
+            what = "state";
+        }
+        fs::remove_all(scratch, error);
+        return what;
+    }
+
+    struct Totals {
+        uint32_t generated{0};
+        uint32_t halted{0};
+        uint32_t mismatches{0};
+        // sum of the logs of every ratio to the switch loop, and how many went into it
+        double log_speedup[engine_count + 1]{};
+        uint32_t timed[engine_count + 1]{};
+    };
+
+    void save(const FuzzOptions &options, const ImageSections &sections, const uint64_t seed) {
+        if (!options.save) {
+            return;
+        }
+        std::error_code error;
+        fs::create_directories(options.save, error);
+        const auto path = fs::path(options.save) / ("fuzz-" + std::to_string(seed) + ".bin");
+        const auto bytes = imageBytes(sections);
+        FILE *stream = fopen(path.c_str(), "wb");
+        if (!stream || fwrite(bytes.data(), 1, bytes.size(), stream) != bytes.size()) {
+            fprintf(stderr, "[[error]] failed to save %s\n", path.c_str());
+        }
+        if (stream) {
+            fclose(stream);
+        }
+    }
+
+    void mismatch(const FuzzOptions &options, Totals &totals, const ImageSections &sections, const uint64_t seed,
+                  const char *engine, const char *what) {
+        fprintf(stderr, "[[error]] program %llu: %s differs from the reference in %s\n",
+                static_cast<unsigned long long>(seed), engine, what);
+        totals.mismatches++;
+        save(options, sections, seed);
+    }
+
+    void fuzzProgram(const FuzzOptions &options, Totals &totals, const uint64_t seed) {
+        std::mt19937_64 rng(seed);
+        const auto sections = generateProgram(rng);
+        totals.generated++;
+
+        MappedImage image;
+        if (!loadSections(sections, image)) {
+            mismatch(options, totals, sections, seed, "loader", "whether it loads");
+            return;
+        }
+
+        // the reference, a single step at a time with a budget. Anything else only ever runs
+        // programs it saw halt, as none of them would stop otherwise
+        Outcome reference;
+        uint64_t steps = 0;
+        {
+            std::string output;
+            VmState state;
+            {
+                StringSink sink(output);
+                Interpreter interp(image, {}, &sink);
+                if (interp.run(options.budget) != RunStatus::HALTED) {
+                    return;
+                }
+                steps = interp.retired();
+                state = interp.state();
+            }
+            reference = outcomeOf(std::move(state), std::move(output));
+        }
+        totals.halted++;
+
+        watched_seed = seed;
+        alarm(options.timeout);
+
+        ImageSections predecoded_sections;
+        predecodeImage(image, predecoded_sections);
+        MappedImage predecoded;
+        if (!loadSections(predecoded_sections, predecoded)) {
+            mismatch(options, totals, sections, seed, "predecoded", "whether it loads");
+            alarm(0);
+            return;
+        }
+
+        for (const auto &engine: engines) {
+            const auto what = difference(reference, engine.run(image, predecoded));
+            if (what) {
+                mismatch(options, totals, sections, seed, engine.name, what);
+            }
+        }
+
+        if (options.go) {
+            const auto what = goDifference(options, sections, reference);
+            if (what) {
+                mismatch(options, totals, sections, seed, "go", what);
+            }
+        }
+
+        // lockstep over data sets, each lane checked against a reference run of its own in everything
+        // the scalar engines are. Data sets that don't halt on the reference leave lockstep out for the
+        // program
+        std::vector<std::vector<uint16_t>> data_sets(options.lanes);
+        std::vector<Outcome> expected(options.lanes);
+        bool lockstep = options.lanes > 0;
+        for (uint32_t lane = 0; lane < options.lanes && lockstep; ++lane) {
+            auto &data = data_sets[lane];
+            data = sections.data;
+            for (auto &word: data) {
+                if (rng() % 2) {
+                    word = static_cast<uint16_t>(rng() % 16);
+                }
+            }
+            std::string output;
+            VmState state;
+            {
+                StringSink sink(output);
+                Interpreter interp(image, data, &sink);
+                lockstep = interp.run(options.budget) == RunStatus::HALTED;
+                state = interp.state();
+            }
+            expected[lane] = outcomeOf(std::move(state), std::move(output));
+        }
+
+        std::vector<uint16_t> bank(memory_bank_capacity);
+        image.copyInto(bank.data(), bank.size());
+        if (lockstep) {
+            std::vector<VmState> states;
+            auto results = runLockstep(bank, data_sets, DispatchMode::SWITCH, 1, image.layout(), options.budget,
+                                       &states);
+            for (uint32_t lane = 0; lane < options.lanes; ++lane) {
+                const auto what = results[lane].status != BatchStatus::HALTED ? "whether it halts" :
+                                  difference(expected[lane], outcomeOf(std::move(states[lane]),
+                                                                       std::move(results[lane].output)));
+                if (what) {
+                    mismatch(options, totals, sections, seed, "lockstep", what);
+                    break;
+                }
+            }
+        }
+
+        if (options.reps) {
+            double seconds[engine_count + 1]{};
+            for (uint32_t i = 0; i < engine_count; ++i) {
+                seconds[i] = timeEngine(engines[i], image, predecoded, options.reps);
+            }
+            if (lockstep) {
+                // against the switch loop running every data set one after the other
+                seconds[lockstep_column] = measure(options.reps, [&] {
+                    runLockstep(bank, data_sets, DispatchMode::SWITCH, 1, image.layout(), options.budget);
+                }) / options.lanes;
+            }
+
+            if (!options.quiet) {
+                printf("%-10llu %6zu %10llu", static_cast<unsigned long long>(seed), sections.code.size(),
+                       static_cast<unsigned long long>(steps));
+            }
+            for (uint32_t i = 0; i <= engine_count; ++i) {
+                if (!seconds[i]) {
+                    if (!options.quiet) {
+                        printf(" %10s", "-");
+                    }
+                    continue;
+                }
+                const auto speedup = seconds[0] / seconds[i];
+                totals.log_speedup[i] += std::log(speedup);
+                totals.timed[i]++;
+                if (!options.quiet) {
+                    printf(" %9.2fx", speedup);
+                }
+            }
+            if (!options.quiet) {
+                printf("\n");
+            }
+        }
+
+        alarm(0);
+    }
+
+    void printHeader() {
+        printf("%-10s %6s %10s", "seed", "words", "steps");
+        for (const auto &engine: engines) {
+            printf(" %10s", engine.name);
+        }
+        printf(" %10s\n", "lockstep");
+    }
+
+}
+
+int main(int argc, const char *argv[]) {
+    FuzzOptions options;
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--seed=", 7)) {
+            options.seed = strtoull(argv[i] + 7, nullptr, 10);
+        } else if (!strncmp(argv[i], "--programs=", 11)) {
+            options.programs = static_cast<uint32_t>(atoi(argv[i] + 11));
+        } else if (!strncmp(argv[i], "--budget=", 9)) {
+            options.budget = strtoull(argv[i] + 9, nullptr, 10);
+        } else if (!strncmp(argv[i], "--reps=", 7)) {
+            options.reps = static_cast<uint32_t>(atoi(argv[i] + 7));
+        } else if (!strncmp(argv[i], "--lanes=", 8)) {
+            options.lanes = static_cast<uint32_t>(atoi(argv[i] + 8));
+        } else if (!strncmp(argv[i], "--timeout=", 10)) {
+            options.timeout = static_cast<uint32_t>(std::max(atoi(argv[i] + 10), 1));
+        } else if (!strncmp(argv[i], "--save=", 7)) {
+            options.save = argv[i] + 7;
+        } else if (!strncmp(argv[i], "--go=", 5)) {
+            options.go = argv[i] + 5;
+        } else if (!strcmp(argv[i], "--quiet")) {
+            options.quiet = true;
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    signal(SIGALRM, watchdog);
+
+    // a row per program that halted, every engine's speed relative to the switch loop
+    if (options.reps && !options.quiet) {
+        printHeader();
+    }
+    Totals totals;
+    for (uint32_t i = 0; i < options.programs; ++i) {
+        fuzzProgram(options, totals, options.seed + i);
+    }
+
+    printf("%u programs, %u halted within %llu steps, %u mismatches\n", totals.generated, totals.halted,
+           static_cast<unsigned long long>(options.budget), totals.mismatches);
+    if (options.reps) {
+        printf("%-28s", "geometric mean");
+        for (uint32_t i = 0; i <= engine_count; ++i) {
+            if (totals.timed[i]) {
+                printf(" %9.2fx", std::exp(totals.log_speedup[i] / totals.timed[i]));
+            } else {
+                printf(" %10s", "-");
+            }
+        }
+        printf("\n");
+    }
+    return totals.mismatches ? 1 : 0;
+}
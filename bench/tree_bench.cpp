@@ -0,0 +1,141 @@
+// Symbol structures side by side: the pooled AVL tree of common/bin_tree.h, std::map,
+// std::unordered_map and the interned symbol table of the assembler. Every structure gets
+// the same names, once in order and once shuffled, and reports ns per insert, per lookup
+// of a present name, per lookup of a missing one and per removal where it supports that.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <bin_tree.h>
+#include "symbol_table.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+namespace {
+
+    struct Names {
+        std::vector<std::string> present;
+        std::vector<std::string> missing;
+    };
+
+    Names makeNames(const size_t count, const bool shuffled) {
+        Names names;
+        for (size_t i = 0; i < count; ++i) {
+            names.present.push_back("label_" + std::to_string(100000 + i));
+            names.missing.push_back("var_" + std::to_string(100000 + i));
+        }
+        if (shuffled) {
+            std::mt19937 random(42);
+            std::shuffle(names.present.begin(), names.present.end(), random);
+            std::shuffle(names.missing.begin(), names.missing.end(), random);
+        }
+        return names;
+    }
+
+    // total time of running fn over every name, sink keeps the compiler from dropping the work
+    template<typename Fn>
+    double perName(const std::vector<std::string> &names, uint64_t &sink, Fn &&fn) {
+        const auto start = bench_clock::now();
+        for (const auto &name: names) {
+            sink += fn(std::string_view(name));
+        }
+        const auto elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+        return elapsed * 1e9 / static_cast<double>(names.size());
+    }
+
+    void report(const char *structure, const size_t count, const char *order, const double insert,
+                const double hit, const double miss, const double remove) {
+        printf("%-14s %8zu %-9s %10.1f %10.1f %10.1f", structure, count, order, insert, hit, miss);
+        if (remove >= 0) {
+            printf(" %10.1f\n", remove);
+        } else {
+            printf(" %10s\n", "-");
+        }
+    }
+
+    void benchTree(const Names &names, const char *order, uint64_t &sink) {
+        BinTree tree;
+        const auto insert = perName(names.present, sink, [&](const std::string_view name) {
+            return tree.insert(name, 1) != nullptr;
+        });
+        const auto hit = perName(names.present, sink, [&](const std::string_view name) {
+            return tree.find(name)->value;
+        });
+        const auto miss = perName(names.missing, sink, [&](const std::string_view name) {
+            return tree.find(name) != nullptr;
+        });
+        const auto remove = perName(names.present, sink, [&](const std::string_view name) {
+            return tree.remove(name);
+        });
+        report("bin_tree", names.present.size(), order, insert, hit, miss, remove);
+    }
+
+    template<typename Map>
+    void benchMap(const char *structure, const Names &names, const char *order, uint64_t &sink) {
+        Map map;
+        const auto insert = perName(names.present, sink, [&](const std::string_view name) {
+            return map.emplace(name, 1).second;
+        });
+        const auto hit = perName(names.present, sink, [&](const std::string_view name) {
+            return map.find(name)->second;
+        });
+        const auto miss = perName(names.missing, sink, [&](const std::string_view name) {
+            return map.find(name) != map.end();
+        });
+        const auto remove = perName(names.present, sink, [&](const std::string_view name) {
+            return map.erase(name);
+        });
+        report(structure, names.present.size(), order, insert, hit, miss, remove);
+    }
+
+    // the symbol table never forgets a single name, reset() drops all of them at once
+    void benchSymbolTable(const Names &names, const char *order, uint64_t &sink) {
+        SymbolTable table;
+        const auto insert = perName(names.present, sink, [&](const std::string_view name) {
+            auto &symbol = table.intern(name);
+            symbol.flags |= SymbolTable::has_label;
+            return symbol.flags;
+        });
+        const auto hit = perName(names.present, sink, [&](const std::string_view name) {
+            return table.lookup(name)->flags;
+        });
+        const auto miss = perName(names.missing, sink, [&](const std::string_view name) {
+            return table.lookup(name) != nullptr;
+        });
+        report("symbol_table", names.present.size(), order, insert, hit, miss, -1);
+    }
+
+}
+
+int main(int argc, const char *argv[]) {
+    std::vector<size_t> counts = {64, 1024, 16384, 262144};
+    if (argc > 1) {
+        counts.assign(1, static_cast<size_t>(atoll(argv[1])));
+    }
+
+    uint64_t sink = 0;
+    printf("%-14s %8s %-9s %10s %10s %10s %10s\n", "structure", "names", "order", "insert", "hit", "miss",
+           "remove");
+    for (const auto count: counts) {
+        for (const auto shuffled: {false, true}) {
+            const auto names = makeNames(count, shuffled);
+            const auto order = shuffled ? "shuffled" : "sorted";
+            benchTree(names, order, sink);
+            benchMap<std::map<std::string_view, uint8_t>>("std::map", names, order, sink);
+            benchMap<std::unordered_map<std::string_view, uint8_t>>("unordered_map", names, order, sink);
+            benchSymbolTable(names, order, sink);
+        }
+    }
+
+    // ns per operation above, the sum only exists so the work can't be optimized away
+    fprintf(stderr, "checksum %llu\n", static_cast<unsigned long long>(sink));
+    return 0;
+}
@@ -1,203 +1,258 @@
 #pragma once
 
 #include <cstdint>
-#include <cstdlib>
-#include <errors.h>
 #include <cstdio>
-#include <cstring>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <vector>
+#include <errors.h>
 
+// name is not owned by the node, it has to outlive the tree
 struct Node {
-    const char *name; // 8
-    Node* parent; // 8
+    std::string_view name; // 16
+    Node *parent; // 8
     Node *right; // 8
     Node *left; // 8
     uint8_t value; // 1
-    bool    to_be_freed{false}; // 1
-
-    inline void ingest(const Node& other) {
-        name = other.name;
-        value = other.value;
-    }
+    int8_t height; // 1, a leaf is 1 high
 };
 
-static inline Node *allocateNode(const char *name, const uint8_t value) {
-    Node *ptr = static_cast<Node *>(calloc(1, sizeof(Node)));
-    if (!ptr) {
-        return nullptr;
-    }
+// AVL tree of names. The heights of the two subtrees of any node differ by one at most,
+// so every operation is O(log n) no matter in which order names come in. Nodes are carved out
+// of blocks of block_nodes at a time, removed nodes go onto a free list and are handed out
+// again by the next insert, blocks themselves are only released along with the tree.
+class BinTree final {
+public:
+    static constexpr size_t block_nodes = 64;
 
-    ptr->name = name;
-    ptr->value = value;
-    return ptr;
-}
+    BinTree() = default;
 
-static inline Node *insert(Node *root, const char *name, const uint8_t value) {
-    auto n = allocateNode(name, value);
-    if (!n) {
-        fputs(errors[FAILED_TO_ALLOCATE_MEMORY], stderr);
-        return nullptr;
-    }
+    BinTree(const BinTree &) = delete;
 
-    auto temp = root;
+    BinTree &operator=(const BinTree &) = delete;
 
-    Node *temp1 = nullptr;
+    // nullptr if the name is already there or no memory is left
+    Node *insert(const std::string_view name, const uint8_t value) {
+        Node *parent = nullptr;
+        auto *link = &root_;
+        while (*link) {
+            parent = *link;
+            const auto order = name.compare(parent->name);
+            if (order == 0) {
+                return nullptr;
+            }
+            link = order < 0 ? &parent->left : &parent->right;
+        }
 
-    while (temp) {
-        temp1 = temp;
-        if (strcmp(name, root->name) < 0) {
-            temp = temp->left;
-        } else {
-            temp = temp->right;
+        auto *node = allocateNode();
+        if (!node) {
+            return nullptr;
         }
+
+        *node = Node{name, parent, nullptr, nullptr, value, 1};
+        *link = node;
+        size_++;
+        rebalance(parent);
+        return node;
     }
 
-    if (!temp1) {
-        temp1 = n;
-    } else if (strcmp(name, temp1->name) < 0) {
-        temp1->left = n;
-        n->parent = temp1;
-    } else if (strcmp(name, temp1->name) > 0){
-        temp1->right = n;
-        n->parent = temp1;
-    } else {
-        free(n);
-        n = nullptr;
+    [[nodiscard]] Node *find(const std::string_view name) const {
+        auto *node = root_;
+        while (node) {
+            const auto order = name.compare(node->name);
+            if (order == 0) {
+                return node;
+            }
+            node = order < 0 ? node->left : node->right;
+        }
         return nullptr;
     }
 
-    return n;
-}
+    // nodes handed out before stay where they are, apart from the removed one
+    bool remove(const std::string_view name) {
+        auto *node = find(name);
+        if (!node) {
+            return false;
+        }
 
-static Node *& find(Node *&root, const char *name) {
-    if (root == nullptr) {
-        // returning root because of a reference
-        return root;
-    }
+        Node *unbalanced;
+        if (!node->left || !node->right) {
+            unbalanced = node->parent;
+            replace(node, node->left ? node->left : node->right);
+        } else {
+            // node happens to be a happy father of two kids, its in-order successor takes its place
+            auto *successor = leftmost(node->right);
+            if (successor->parent != node) {
+                unbalanced = successor->parent;
+                replace(successor, successor->right);
+                successor->right = node->right;
+                successor->right->parent = successor;
+            } else {
+                unbalanced = successor;
+            }
+            replace(node, successor);
+            successor->left = node->left;
+            successor->left->parent = successor;
+            successor->height = node->height;
+        }
 
-    if (strcmp(name, root->name) > 0) {
-        return find(root->right, name);
-    } else if (strcmp(name, root->name) < 0) {
-        return find(root->left, name);
-    } else {
-        return root;
+        releaseNode(node);
+        size_--;
+        rebalance(unbalanced);
+        return true;
     }
-}
 
-inline void findIop(Node * node, Node*& pred) {
-    if (!node) {
-        return;
+    // in-order successor, nullptr for the last node
+    static Node *successor(Node *node) {
+        if (node->right) {
+            return leftmost(node->right);
+        }
+        while (node->parent && node->parent->right == node) {
+            node = node->parent;
+        }
+        return node->parent;
     }
 
-    if (!node->left) {
-        // not really sure about that one
-
-        while (node->parent) {
-            if (node->parent->right == node) {
-                pred = node->parent;
-                return;
+    // in-order predecessor, nullptr for the first node
+    static Node *predecessor(Node *node) {
+        if (node->left) {
+            node = node->left;
+            while (node->right) {
+                node = node->right;
             }
-            node = node->parent;
+            return node;
         }
-    } else {
-        node = node->left;
-        pred = node;
-        while (node && node->right) {
-            pred = node->right;
-            node = node->right;
+        while (node->parent && node->parent->left == node) {
+            node = node->parent;
         }
+        return node->parent;
     }
 
-    return;
-}
+    [[nodiscard]] inline Node *first() const noexcept { return root_ ? leftmost(root_) : nullptr; }
 
-// find in-order successor of a node
-inline void findIos(Node * node, Node*& succ) {
-    // excluding case when node is nullptr
-    if (!node) {
-        return;
-    }
+    [[nodiscard]] inline Node *root() const noexcept { return root_; }
 
-    if (!node->right) {
-        // not sure
-        while (node->parent) {
-            if (node->parent->left == node) {
-                succ = node->parent;
-                return;
+    [[nodiscard]] inline size_t size() const noexcept { return size_; }
+
+    // every node goes back onto the free list, blocks are kept
+    void clear() {
+        while (root_) {
+            auto *node = root_;
+            while (node->left || node->right) {
+                node = node->left ? node->left : node->right;
             }
-            node = node->parent;
+            replace(node, nullptr);
+            releaseNode(node);
         }
-    } else {
-        node = node->right;
+        size_ = 0;
+    }
+
+private:
+    static inline int8_t heightOf(const Node *node) noexcept { return node ? node->height : 0; }
 
-        // at that point, we traverse the right subtree to find a minimum element, i.e
-        // we traverse down to a left-most leaf
-        succ = node;
-        while (node && node->left) {
-            succ = node->left;
+    static inline void updateHeight(Node *node) noexcept {
+        const auto left = heightOf(node->left);
+        const auto right = heightOf(node->right);
+        node->height = static_cast<int8_t>((left > right ? left : right) + 1);
+    }
+
+    static inline Node *leftmost(Node *node) noexcept {
+        while (node->left) {
             node = node->left;
         }
+        return node;
     }
 
-    return;
-}
+    // hangs node where old used to be
+    void replace(Node *old, Node *node) {
+        if (!old->parent) {
+            root_ = node;
+        } else if (old->parent->left == old) {
+            old->parent->left = node;
+        } else {
+            old->parent->right = node;
+        }
+        if (node) {
+            node->parent = old->parent;
+        }
+    }
 
-static inline bool remove(Node *&root, const char *name) {
-    if (!root) {
-        return false;
+    Node *rotateLeft(Node *node) {
+        auto *pivot = node->right;
+        node->right = pivot->left;
+        if (pivot->left) {
+            pivot->left->parent = node;
+        }
+        replace(node, pivot);
+        pivot->left = node;
+        node->parent = pivot;
+        updateHeight(node);
+        updateHeight(pivot);
+        return pivot;
     }
 
-    auto &node_to_delete = find(root, name);
-    if (!node_to_delete) {
-        return false;
+    Node *rotateRight(Node *node) {
+        auto *pivot = node->left;
+        node->left = pivot->right;
+        if (pivot->right) {
+            pivot->right->parent = node;
+        }
+        replace(node, pivot);
+        pivot->right = node;
+        node->parent = pivot;
+        updateHeight(node);
+        updateHeight(pivot);
+        return pivot;
     }
 
-    // node_to_delete is a leaf
-    if (!node_to_delete->right && !node_to_delete->left) {
-        free(node_to_delete);
-        node_to_delete = nullptr;
-        return true;
-    } else {
-        // node_to_delete has a single right kid
-        if (node_to_delete->right && !node_to_delete->left) {
-            Node* iop;
-            findIop(node_to_delete, iop);
-            node_to_delete->ingest(*iop);
-            iop->to_be_freed = true;
-            return true;
-        }
-
-        // node_to_delete has a single left kid
-        else if (node_to_delete->left && !node_to_delete->right) {
-            Node* ios = nullptr;
-            findIos(node_to_delete, ios);
-            node_to_delete->ingest(*ios);
-            ios->to_be_freed = true;
-            return true;
-        }
-
-        // node_to_delete happens to be a happy father of two kids
-        else {
-            Node* iop;
-            findIop(node_to_delete, iop);
-            node_to_delete->ingest(*iop);
-            iop->to_be_freed = true;
-            return true;
+    // walks up from node to the root, fixing heights and rotating wherever the subtrees drifted apart
+    void rebalance(Node *node) {
+        while (node) {
+            updateHeight(node);
+            const auto balance = heightOf(node->left) - heightOf(node->right);
+            if (balance > 1) {
+                if (heightOf(node->left->left) < heightOf(node->left->right)) {
+                    rotateLeft(node->left);
+                }
+                node = rotateRight(node);
+            } else if (balance < -1) {
+                if (heightOf(node->right->right) < heightOf(node->right->left)) {
+                    rotateRight(node->right);
+                }
+                node = rotateLeft(node);
+            }
+            node = node->parent;
+        }
+    }
+
+    Node *allocateNode() {
+        if (!free_) {
+            std::unique_ptr<Node[]> block(new(std::nothrow) Node[block_nodes]);
+            if (!block) {
+                fputs(errors[FAILED_TO_ALLOCATE_MEMORY], stderr);
+                return nullptr;
+            }
+            for (size_t i = 0; i < block_nodes; ++i) {
+                releaseNode(&block[i]);
+            }
+            blocks_.push_back(std::move(block));
         }
+
+        auto *node = free_;
+        free_ = node->parent;
+        return node;
     }
-}
-
-//inline void destroyToBeFreed(Node*& root, void *root_saved_addr) {
-//    if (root == nullptr) {
-//        root = (Node*) root_saved_addr;
-//        return;
-//    }
-//    destroyToBeFreed(root->left, root_saved_addr);
-//    if (root->to_be_freed) {
-//        free(root);
-//        root = nullptr;
-//    }
-//    destroyToBeFreed(root->right, root_saved_addr);
-//
-//}
 
+    // free nodes are chained through parent
+    inline void releaseNode(Node *node) noexcept {
+        node->parent = free_;
+        free_ = node;
+    }
 
+private:
+    std::vector<std::unique_ptr<Node[]>> blocks_;
+    Node *free_{nullptr};
+    Node *root_{nullptr};
+    size_t size_{0};
+};
@@ -6,6 +6,9 @@ enum {
     FAILED_TO_READ_CONTENTS,
     FAILED_TO_ALLOCATE_MEMORY,
     MALFORMED_PREAMBLE,
+    MALFORMED_HEADER,
+    MALFORMED_OBJECT,
+    NEEDS_WIDE_ENGINE,
 };
 
 static const char *errors[] = {
@@ -14,4 +17,7 @@ static const char *errors[] = {
         "failed to read contents from a file\n",
         "failed to allocate memory\n",
         "malformed preamble\n",
+        "malformed image header\n",
+        "malformed object file\n",
+        "image is a wide program, run it on the wide engine\n",
 };
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// metasm images
+// v1 - "metasm v_1_0\0" followed by a raw dump of the whole address space
+// v2 - "metasm v_2_0\0", padded up to image_header_offset, followed by an ImageHeader.
+//      sections live wherever the header points, offsets are counted from the start of the file
+// v3 - "metasm v_3_0\0", padded up to image_header_offset, followed by a WideImageHeader.
+//      a program of the 16-bit address space, laid out like v2 minus leaders and decoded stream
+constexpr uint16_t preamble_size = 12;
+
+constexpr const char expected_preamble[preamble_size + 1] = "metasm v_1_0";
+
+constexpr const char expected_preamble_v2[preamble_size + 1] = "metasm v_2_0";
+
+constexpr const char expected_preamble_v3[preamble_size + 1] = "metasm v_3_0";
+
+constexpr uint32_t image_header_offset = 16;
+
+// assembler places variables of BEGINDATA block starting from that address,
+// everything below is treated as code
+constexpr uint8_t data_section_start = 0xF0;
+
+// one bit per slot, set for the first slot of every basic block
+constexpr uint32_t image_leaders_size = 0x100 / 8;
+
+// handler, operand and next_pc of every code slot
+constexpr uint32_t image_decoded_entry_size = 3;
+
+// code_offset - code words, loaded at address 0
+// data_offset - data words, loaded at data_start
+// leaders_offset - jump target table, 0 if the image has none
+// decoded_offset - pre-decoded handler stream covering code_words slots, 0 if the image has none
+// decoded_version - numbering of the handlers in the decoded stream
+struct ImageHeader {
+    uint32_t code_offset;
+    uint32_t data_offset;
+    uint32_t leaders_offset;
+    uint32_t decoded_offset;
+    uint16_t code_words;
+    uint16_t data_words;
+    uint8_t data_start;
+    uint8_t entry;
+    uint8_t decoded_version;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(ImageHeader) == 24, "ImageHeader is stored as is");
+
+// words a wide program can address
+constexpr uint32_t wide_address_space_size = 0x10000;
+
+// code_offset - code words, loaded at address 0
+// data_offset - data words, loaded at data_start
+struct WideImageHeader {
+    uint32_t code_offset;
+    uint32_t data_offset;
+    uint32_t code_words;
+    uint32_t data_words;
+    uint32_t data_start;
+    uint32_t entry;
+};
+
+static_assert(sizeof(WideImageHeader) == 24, "WideImageHeader is stored as is");
+
+// everything that goes into a v2 image, or a v3 one if wide is set. Empty sections are left
+// out of the file, wide images never have leaders or a decoded stream
+struct ImageSections {
+    std::vector<uint16_t> code;
+    std::vector<uint16_t> data;
+    uint32_t data_start{data_section_start};
+    uint32_t entry{0};
+    bool wide{false};
+    std::vector<uint8_t> leaders;
+    std::vector<uint8_t> decoded;
+    uint8_t decoded_version{0};
+};
+
+static inline void markLeader(std::vector<uint8_t> &leaders, const uint32_t slot) {
+    leaders.resize(image_leaders_size);
+    leaders[(slot & 0xFF) / 8] |= 1u << (slot % 8);
+}
+
+static inline bool isLeader(const uint8_t *leaders, const uint32_t slot) {
+    return leaders[(slot & 0xFF) / 8] & (1u << (slot % 8));
+}
+
+// an image as it is written to a file: v3 if wide is set, v2 otherwise, with the sections laid
+// out right after the header in the order they are declared
+static inline std::vector<uint8_t> imageBytes(const ImageSections &image) {
+    // code starts on its own 16-byte boundary, so it can be used in place
+    const uint32_t header_size = image.wide ? sizeof(WideImageHeader) : sizeof(ImageHeader);
+    const uint32_t code_offset = (image_header_offset + header_size + 15) & ~15u;
+    auto offset = static_cast<uint32_t>(code_offset + image.code.size() * sizeof(uint16_t));
+    const auto data_offset = image.data.empty() ? 0 : offset;
+    offset += image.data.size() * sizeof(uint16_t);
+
+    std::vector<uint8_t> bytes(offset + (image.wide ? 0 : image.leaders.size() + image.decoded.size()));
+    if (image.wide) {
+        memcpy(bytes.data(), expected_preamble_v3, sizeof(expected_preamble_v3));
+        WideImageHeader header{};
+        header.code_offset = code_offset;
+        header.code_words = static_cast<uint32_t>(image.code.size());
+        header.data_offset = data_offset;
+        header.data_words = static_cast<uint32_t>(image.data.size());
+        header.data_start = image.data_start;
+        header.entry = image.entry;
+        memcpy(bytes.data() + image_header_offset, &header, sizeof(header));
+    } else {
+        memcpy(bytes.data(), expected_preamble_v2, sizeof(expected_preamble_v2));
+        ImageHeader header{};
+        header.code_offset = code_offset;
+        header.code_words = static_cast<uint16_t>(image.code.size());
+        header.data_offset = data_offset;
+        header.data_words = static_cast<uint16_t>(image.data.size());
+        header.data_start = static_cast<uint8_t>(image.data_start);
+        header.entry = static_cast<uint8_t>(image.entry);
+        header.leaders_offset = image.leaders.empty() ? 0 : offset;
+        offset += image.leaders.size();
+        header.decoded_offset = image.decoded.empty() ? 0 : offset;
+        header.decoded_version = image.decoded_version;
+        memcpy(bytes.data() + image_header_offset, &header, sizeof(header));
+    }
+
+    auto cursor = bytes.data() + code_offset;
+    const auto append = [&cursor](const void *section, const size_t size) {
+        if (size) {
+            memcpy(cursor, section, size);
+            cursor += size;
+        }
+    };
+    append(image.code.data(), image.code.size() * sizeof(uint16_t));
+    append(image.data.data(), image.data.size() * sizeof(uint16_t));
+    if (!image.wide) {
+        append(image.leaders.data(), image.leaders.size());
+        append(image.decoded.data(), image.decoded.size());
+    }
+    return bytes;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+// The metacpu instruction set, described once. The assembler's mnemonic lookup, the
+// vm's opcode constants and the decoder tables are all generated from this table at
+// compile time, so the two can't drift apart.
+
+constexpr uint16_t instruction_mask = 0xFF00;
+constexpr uint16_t value_mask = 0x00FF;
+
+// wide instructions reach the 16-bit address space of wide programs. The first word holds the
+// opcode with wide_opcode_bit set and no operand, the word after it holds the whole address.
+// Only memory operands have a wide form, the single-bank engines take the first word for an
+// unknown instruction
+constexpr uint8_t wide_opcode_bit = 0x80;
+
+enum class InstructionMode : unsigned {
+    NONE = 0x0,
+    IMMEDIATE = 0x1,
+    MEMORY = 0x2
+};
+
+// flag effects
+// reads_zf, reads_sf - outcome depends on the flag
+// writes_flags - zf and sf are set from the result, whatever was there before is gone
+// sets_zf - zf is raised, no branch reads sf while it is up
+constexpr uint8_t reads_zf = 1u << 0;
+constexpr uint8_t reads_sf = 1u << 1;
+constexpr uint8_t writes_flags = 1u << 2;
+constexpr uint8_t sets_zf = 1u << 3;
+
+// kinds of instructions
+// branch - pushes its own pc onto the return stack and jumps to the operand when taken
+// conditional - branch that is only taken depending on flags
+// exit - leaves the current block for good, either returning or halting
+// store - writes memory at the operand
+// output - prints acc
+constexpr uint8_t kind_branch = 1u << 0;
+constexpr uint8_t kind_conditional = 1u << 1;
+constexpr uint8_t kind_exit = 1u << 2;
+constexpr uint8_t kind_store = 1u << 3;
+constexpr uint8_t kind_output = 1u << 4;
+
+struct IsaEntry {
+    std::string_view mnemonic;
+    uint8_t opcode;
+    InstructionMode mode;
+    uint8_t flags;
+    uint8_t kind;
+};
+
+// opcodes are dense, entry i encodes opcode i
+static constexpr IsaEntry isa[] = {
+        {"addi",   0x00, InstructionMode::IMMEDIATE, writes_flags,          0},
+        {"add",    0x01, InstructionMode::MEMORY,    writes_flags,          0},
+        {"subi",   0x02, InstructionMode::IMMEDIATE, writes_flags,          0},
+        {"sub",    0x03, InstructionMode::MEMORY,    writes_flags,          0},
+        {"clac",   0x04, InstructionMode::NONE,      sets_zf,               0},
+        {"bnz",    0x05, InstructionMode::MEMORY,    reads_zf,              kind_branch | kind_conditional},
+        {"bz",     0x06, InstructionMode::MEMORY,    reads_zf,              kind_branch | kind_conditional},
+        {"ucb",    0x07, InstructionMode::MEMORY,    0,                     kind_branch},
+        {"str",    0x08, InstructionMode::MEMORY,    0,                     kind_store},
+        {"leave",  0x09, InstructionMode::NONE,      0,                     kind_exit},
+        {"cmp",    0x0A, InstructionMode::MEMORY,    writes_flags,          0},
+        {"cmpi",   0x0B, InstructionMode::IMMEDIATE, writes_flags,          0},
+        {"outd",   0x0C, InstructionMode::NONE,      0,                     kind_output},
+        {"big",    0x0D, InstructionMode::MEMORY,    reads_zf | reads_sf,   kind_branch | kind_conditional},
+        {"bil",    0x0E, InstructionMode::MEMORY,    reads_zf | reads_sf,   kind_branch | kind_conditional},
+        {"outb",   0x0F, InstructionMode::NONE,      0,                     kind_output},
+        {"ret",    0x10, InstructionMode::NONE,      0,                     kind_exit},
+        {"submem", 0x11, InstructionMode::MEMORY,    0,                     kind_store},
+        {"addmem", 0x12, InstructionMode::MEMORY,    0,                     kind_store},
+};
+
+constexpr uint32_t isa_count = sizeof(isa) / sizeof(isa[0]);
+
+constexpr bool isaIsDense() {
+    for (uint32_t i = 0; i < isa_count; ++i) {
+        if (isa[i].opcode != i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(isaIsDense(), "opcodes have to follow the order of the table");
+
+// entry of an opcode, nullptr if the opcode is not part of the isa
+static constexpr const IsaEntry *isaEntry(const uint8_t opcode) {
+    return opcode < isa_count ? &isa[opcode] : nullptr;
+}
+
+static constexpr bool hasKind(const uint8_t opcode, const uint8_t kind) {
+    return opcode < isa_count && (isa[opcode].kind & kind);
+}
+
+static constexpr bool isWideWord(const uint16_t word) {
+    return (word >> 8) & wide_opcode_bit;
+}
+
+// first word of the wide form of an opcode
+static constexpr uint16_t wideWord(const uint8_t opcode) {
+    return static_cast<uint16_t>((opcode | wide_opcode_bit) << 8);
+}
+
+// deliberately not constexpr, naming a mnemonic that does not exist fails the build
+uint16_t unknownMnemonic();
+
+// instruction word of a mnemonic with a zero operand
+static constexpr uint16_t opcodeWord(const std::string_view mnemonic) {
+    for (const auto &entry: isa) {
+        if (entry.mnemonic == mnemonic) {
+            return static_cast<uint16_t>(entry.opcode << 8);
+        }
+    }
+    return unknownMnemonic();
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Process-wide counters of the vm and the assembler. Every thread counts into a shard of its own,
+// which it alone writes, so counting takes neither a lock nor an atomic read-modify-write. Shards
+// are never freed: a thread that exits hands its shard, counts and all, to the next thread that
+// starts counting, and reading the counters sums every shard there is. Engines count once per run,
+// never per instruction, and what the fast ones can't count cheaply they leave out, see
+// metric_info.
+
+enum class Metric : uint32_t {
+    INSTRUCTIONS,
+    BRANCHES_TAKEN,
+    OUTPUT_BYTES,
+    RUNS,
+    IMAGE_LOADS,
+    IMAGE_LOAD_NS,
+    RUN_CACHE_HITS,
+    RUN_CACHE_MISSES,
+    SOURCES_ASSEMBLED,
+    ASSEMBLE_READ_NS,
+    ASSEMBLE_PARSE_NS,
+    ASSEMBLE_OPTIMIZE_NS,
+    ASSEMBLE_LINK_NS,
+    ASSEMBLE_WRITE_NS,
+    OBJECT_CACHE_HITS,
+    OBJECT_CACHE_MISSES,
+    COUNT,
+};
+
+constexpr uint32_t metric_count = static_cast<uint32_t>(Metric::COUNT);
+
+// key - name in json and text, family and labels - series in prometheus text
+// nanoseconds - counts nanoseconds, which prometheus gets as seconds
+struct MetricInfo {
+    const char *key;
+    const char *family;
+    const char *labels;
+    const char *help;
+    bool nanoseconds;
+};
+
+// must follow the order of Metric
+static constexpr MetricInfo metric_info[metric_count] = {
+        {"instructions", "metacpu_instructions_total", "", "instructions retired on every engine but the lanes of a lockstep group", false},
+        {"branches_taken", "metacpu_branches_taken_total", "", "branches taken on every engine but the lanes of a lockstep group", false},
+        {"output_bytes", "metacpu_output_bytes_total", "", "bytes programs printed", false},
+        {"runs", "metacpu_runs_total", "", "programs run, to the end or for a budget", false},
+        {"image_loads", "metacpu_image_loads_total", "", "images opened or loaded", false},
+        {"image_load_ns", "metacpu_image_load_seconds_total", "", "time spent opening and loading images", true},
+        {"run_cache_hits", "metacpu_run_cache_hits_total", "", "runs answered by the run cache", false},
+        {"run_cache_misses", "metacpu_run_cache_misses_total", "", "runs the run cache did not know", false},
+        {"sources_assembled", "metacpu_sources_assembled_total", "", "sources assembled or taken from the object cache", false},
+        {"assemble_read_ns", "metacpu_assemble_seconds_total", "phase=\"read\"", "time the assembler spent per phase", true},
+        {"assemble_parse_ns", "metacpu_assemble_seconds_total", "phase=\"parse\"", "time the assembler spent per phase", true},
+        {"assemble_optimize_ns", "metacpu_assemble_seconds_total", "phase=\"optimize\"", "time the assembler spent per phase", true},
+        {"assemble_link_ns", "metacpu_assemble_seconds_total", "phase=\"link\"", "time the assembler spent per phase", true},
+        {"assemble_write_ns", "metacpu_assemble_seconds_total", "phase=\"write\"", "time the assembler spent per phase", true},
+        {"object_cache_hits", "metacpu_object_cache_hits_total", "", "objects taken from the object cache", false},
+        {"object_cache_misses", "metacpu_object_cache_misses_total", "", "sources the object cache did not know", false},
+};
+
+struct alignas(64) MetricsShard {
+    std::atomic<uint64_t> values[metric_count]{};
+    // held by a live thread
+    std::atomic<bool> claimed{true};
+    MetricsShard *next{nullptr};
+};
+
+// every shard ever made, newest first
+inline std::atomic<MetricsShard *> metrics_shards{nullptr};
+
+namespace metrics_detail {
+
+    // gives the shard back when its thread exits
+    struct ShardHolder {
+        MetricsShard *shard{nullptr};
+
+        ~ShardHolder() {
+            if (shard) {
+                shard->claimed.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    inline MetricsShard *claimShard() {
+        for (auto *shard = metrics_shards.load(std::memory_order_acquire); shard; shard = shard->next) {
+            bool claimed = false;
+            if (!shard->claimed.load(std::memory_order_relaxed) &&
+                shard->claimed.compare_exchange_strong(claimed, true, std::memory_order_acquire)) {
+                return shard;
+            }
+        }
+
+        auto *shard = new MetricsShard;
+        shard->next = metrics_shards.load(std::memory_order_relaxed);
+        while (!metrics_shards.compare_exchange_weak(shard->next, shard, std::memory_order_release,
+                                                     std::memory_order_relaxed)) {}
+        return shard;
+    }
+
+}
+
+static inline MetricsShard &metricsShard() {
+    thread_local metrics_detail::ShardHolder holder;
+    if (!holder.shard) {
+        holder.shard = metrics_detail::claimShard();
+    }
+    return *holder.shard;
+}
+
+static inline void countMetric(const Metric metric, const uint64_t amount = 1) {
+    if (!amount) {
+        return;
+    }
+    // only this thread writes the shard, readers never see a torn value
+    auto &value = metricsShard().values[static_cast<uint32_t>(metric)];
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// every shard summed up. A thread that is counting right now may or may not be in it yet
+static inline std::vector<uint64_t> collectMetrics() {
+    std::vector<uint64_t> totals(metric_count);
+    for (auto *shard = metrics_shards.load(std::memory_order_acquire); shard; shard = shard->next) {
+        for (uint32_t i = 0; i < metric_count; ++i) {
+            totals[i] += shard->values[i].load(std::memory_order_relaxed);
+        }
+    }
+    return totals;
+}
+
+// adds the time from its construction to its destruction to a metric
+class MetricTimer final {
+public:
+    explicit MetricTimer(const Metric metric) : metric_{metric}, start_{std::chrono::steady_clock::now()} {}
+
+    ~MetricTimer() {
+        const auto elapsed = std::chrono::steady_clock::now() - start_;
+        countMetric(metric_, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    }
+
+    MetricTimer(const MetricTimer &) = delete;
+
+    MetricTimer &operator=(const MetricTimer &) = delete;
+
+private:
+    Metric metric_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// text - a "key value" line per sample
+// json - a single object of key to value
+// prometheus - the text exposition format, with a help and a type line per family
+enum class MetricsFormat : uint8_t {
+    TEXT,
+    JSON,
+    PROMETHEUS,
+};
+
+// false if name is none of text, json and prometheus
+static inline bool parseMetricsFormat(const char *name, MetricsFormat &format) {
+    const std::string value(name);
+    if (value == "text") {
+        format = MetricsFormat::TEXT;
+    } else if (value == "json") {
+        format = MetricsFormat::JSON;
+    } else if (value == "prometheus") {
+        format = MetricsFormat::PROMETHEUS;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// a value to export, the counters of collectMetrics() or whatever else a tool keeps track of
+// type - counter or gauge, as prometheus knows them
+struct MetricSample {
+    std::string key;
+    std::string family;
+    std::string labels;
+    const char *type;
+    const char *help;
+    uint64_t value;
+    bool nanoseconds;
+};
+
+static inline std::vector<MetricSample> metricSamples() {
+    const auto totals = collectMetrics();
+    std::vector<MetricSample> samples;
+    for (uint32_t i = 0; i < metric_count; ++i) {
+        const auto &info = metric_info[i];
+        samples.push_back(MetricSample{info.key, info.family, info.labels, "counter", info.help, totals[i],
+                                       info.nanoseconds});
+    }
+    return samples;
+}
+
+// samples of a family have to follow each other for prometheus
+static inline std::string formatMetrics(const std::vector<MetricSample> &samples, const MetricsFormat format) {
+    std::string out;
+    char line[256];
+    if (format == MetricsFormat::JSON) {
+        out += "{";
+    }
+    for (size_t i = 0; i < samples.size(); ++i) {
+        const auto &sample = samples[i];
+        const auto value = static_cast<unsigned long long>(sample.value);
+        switch (format) {
+            case MetricsFormat::TEXT:
+                snprintf(line, sizeof(line), "%s %llu\n", sample.key.c_str(), value);
+                break;
+            case MetricsFormat::JSON:
+                snprintf(line, sizeof(line), "%s\"%s\": %llu", i ? ", " : "", sample.key.c_str(), value);
+                break;
+            case MetricsFormat::PROMETHEUS:
+                if (!i || samples[i - 1].family != sample.family) {
+                    out += "# HELP " + sample.family + " " + sample.help + "\n";
+                    out += "# TYPE " + sample.family + " " + sample.type + "\n";
+                }
+                if (sample.nanoseconds) {
+                    snprintf(line, sizeof(line), "%s%s%s%s %.9f\n", sample.family.c_str(),
+                             sample.labels.empty() ? "" : "{", sample.labels.c_str(), sample.labels.empty() ? "" : "}",
+                             static_cast<double>(sample.value) / 1e9);
+                } else {
+                    snprintf(line, sizeof(line), "%s%s%s%s %llu\n", sample.family.c_str(),
+                             sample.labels.empty() ? "" : "{", sample.labels.c_str(), sample.labels.empty() ? "" : "}",
+                             value);
+                }
+                break;
+        }
+        out += line;
+    }
+    if (format == MetricsFormat::JSON) {
+        out += "}\n";
+    }
+    return out;
+}
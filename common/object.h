@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "image.h"
+
+// metasm relocatable objects
+// "metasm o_1_0\0", padded up to image_header_offset, followed by an ObjectHeader, code words,
+// data words, symbols, fixups and the string table holding symbol names, in that order.
+// code is assembled as if it started at 0 and data as if it started at data_section_start,
+// the linker moves both and patches every memory operand listed in fixups. A wide object is
+// assembled for the 16-bit address space, its fixups name the operand words of wide instructions.
+constexpr const char expected_preamble_object[preamble_size + 1] = "metasm o_1_0";
+
+// bumped whenever the layout below or the meaning of its fields changes
+constexpr uint32_t object_format_version = 2;
+
+// flags of an object
+constexpr uint32_t object_wide = 1u << 0;
+
+enum class SymbolSection : uint8_t {
+    CODE,
+    DATA,
+    // imported symbols are defined by some other object
+    NONE,
+};
+
+// local - only visible to the object itself
+// exported - visible to every object of the link
+// imported - has to be exported by another object
+enum class SymbolBinding : uint8_t {
+    LOCAL,
+    EXPORTED,
+    IMPORTED,
+};
+
+// value - offset into the section the symbol lives in
+struct ObjectSymbol {
+    uint32_t name_offset;
+    uint16_t name_size;
+    SymbolSection section;
+    SymbolBinding binding;
+    uint32_t value;
+};
+
+static_assert(sizeof(ObjectSymbol) == 12, "ObjectSymbol is stored as is");
+
+// slot - code word whose operand receives the address of symbol
+struct ObjectFixup {
+    uint16_t slot;
+    uint16_t symbol;
+};
+
+static_assert(sizeof(ObjectFixup) == 4, "ObjectFixup is stored as is");
+
+struct ObjectHeader {
+    uint32_t version;
+    uint32_t code_words;
+    uint32_t data_words;
+    uint32_t symbol_count;
+    uint32_t fixup_count;
+    uint32_t strings_size;
+    uint32_t flags;
+};
+
+static_assert(sizeof(ObjectHeader) == 28, "ObjectHeader is stored as is");
+
+struct ObjectFile {
+    std::vector<uint16_t> code;
+    std::vector<uint16_t> data;
+    std::vector<ObjectSymbol> symbols;
+    std::vector<ObjectFixup> fixups;
+    std::string strings;
+    bool wide{false};
+
+    [[nodiscard]] inline std::string_view symbolName(const ObjectSymbol &symbol) const {
+        return std::string_view(strings).substr(symbol.name_offset, symbol.name_size);
+    }
+
+    inline uint16_t addSymbol(const std::string_view name, const SymbolSection section, const SymbolBinding binding,
+                              const uint32_t value) {
+        symbols.push_back(ObjectSymbol{static_cast<uint32_t>(strings.size()), static_cast<uint16_t>(name.size()),
+                                       section, binding, value});
+        strings.append(name);
+        return static_cast<uint16_t>(symbols.size() - 1);
+    }
+};
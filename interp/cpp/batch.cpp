@@ -0,0 +1,204 @@
+#include "batch.h"
+#include "jit.h"
+#include "wide.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+WorkStealingPool::WorkStealingPool(uint32_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (uint32_t i = 0; i < threads; ++i) {
+        queues_.emplace_back(std::make_unique<TaskQueue>());
+    }
+
+    for (uint32_t i = 0; i < threads; ++i) {
+        workers_.emplace_back([this, i] { work(i); });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> guard(idle_lock_);
+        stopping_ = true;
+    }
+    idle_cv_.notify_all();
+
+    for (auto &worker: workers_) {
+        worker.join();
+    }
+}
+
+void WorkStealingPool::submit(std::function<void()> task) {
+    auto &queue = *queues_[next_queue_++ % queues_.size()];
+    pending_++;
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.emplace_back(std::move(task));
+    }
+    queued_++;
+
+    // taking the lock makes sure a worker about to sleep sees the new task
+    {
+        std::lock_guard<std::mutex> guard(idle_lock_);
+    }
+    idle_cv_.notify_one();
+}
+
+void WorkStealingPool::wait() {
+    std::unique_lock<std::mutex> lock(idle_lock_);
+    done_cv_.wait(lock, [this] { return pending_ == 0; });
+}
+
+bool WorkStealingPool::tryPop(const uint32_t worker, std::function<void()> &task) {
+    const auto count = static_cast<uint32_t>(queues_.size());
+    for (uint32_t i = 0; i < count; ++i) {
+        auto &queue = *queues_[(worker + i) % count];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+
+        // own queue is consumed from the front, victims from the back
+        if (i == 0) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        } else {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        queued_--;
+        return true;
+    }
+
+    return false;
+}
+
+void WorkStealingPool::work(const uint32_t worker) {
+    std::function<void()> task;
+    for (;;) {
+        if (tryPop(worker, task)) {
+            task();
+            task = nullptr;
+            if (--pending_ == 0) {
+                std::lock_guard<std::mutex> guard(idle_lock_);
+                done_cv_.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(idle_lock_);
+        idle_cv_.wait(lock, [this] { return stopping_ || queued_ > 0; });
+        if (stopping_ && queued_ == 0) {
+            return;
+        }
+    }
+}
+
+std::vector<BatchResult> runBatch(const std::vector<BatchJob> &jobs, const DispatchMode mode, const uint32_t threads,
+                                  RunCache *cache, const uint64_t max_steps) {
+    std::vector<BatchResult> results(jobs.size());
+    WorkStealingPool pool(threads);
+
+    // every distinct image is mapped exactly once and shared by all of its jobs
+    std::unordered_map<std::string, MappedImage> images;
+    for (const auto &job: jobs) {
+        images.emplace(job.path, MappedImage{});
+    }
+
+    for (auto &[path, image]: images) {
+        pool.submit([ptr = &image, path = path.c_str()] {
+            ptr->open(path);
+        });
+    }
+    pool.wait();
+
+    // and on the jit, every job of an image starts off the blocks its earlier jobs translated
+    std::unordered_map<std::string, JitCompilerPool> jits;
+    if (mode == DispatchMode::JIT) {
+        for (const auto &job: jobs) {
+            jits[job.path];
+        }
+    }
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        pool.submit([&, i] {
+            const auto &job = jobs[i];
+            auto &result = results[i];
+            const auto &image = images.at(job.path);
+            if (!image.ready()) {
+                result.status = BatchStatus::LOAD_FAILED;
+                return;
+            }
+
+            const auto data_end = image.wide() ? wide_address_space_size : memory_bank_capacity;
+            const auto data_start = image.wide() ? image.wideLayout().data_start : image.layout().data_start;
+            if (data_start + job.data.size() > data_end) {
+                result.status = BatchStatus::BAD_DATA;
+                return;
+            }
+
+            if (cache && !image.wide()) {
+                CachedRun run;
+                result.status = batchStatusOf(cache->run(image, job.data, mode, max_steps, run));
+                result.output = std::move(run.output);
+                return;
+            }
+
+            // every instance gets a private copy, programs are free to write anywhere
+            StringSink sink(result.output);
+            if (image.wide()) {
+                WideInterpreter interp(image, job.data, &sink);
+                result.status = batchStatusOf(interp.run(max_steps));
+            } else if (mode == DispatchMode::JIT) {
+                auto &compilers = jits.at(job.path);
+                auto jit = compilers.checkOut(image.layout().code_end);
+                {
+                    Interpreter interp(image, job.data, &sink);
+                    result.status = batchStatusOf(interp.run(max_steps, *jit));
+                }
+                compilers.checkIn(std::move(jit));
+            } else {
+                Interpreter interp(image, job.data, &sink);
+                result.status = batchStatusOf(interp.run(max_steps, mode));
+            }
+        });
+    }
+    pool.wait();
+
+    return results;
+}
+
+std::vector<BatchResult> runBatch(const VmState &state, const std::vector<std::vector<uint16_t>> &data_sets,
+                                  const DispatchMode mode, const uint32_t threads, const uint64_t max_steps) {
+    std::vector<BatchResult> results(data_sets.size());
+    WorkStealingPool pool(threads);
+    // every fork starts out with the same code
+    JitCompilerPool jits;
+
+    for (size_t i = 0; i < data_sets.size(); ++i) {
+        pool.submit([&, i] {
+            const auto &data = data_sets[i];
+            auto &result = results[i];
+            if (state.data_start + data.size() > memory_bank_capacity) {
+                result.status = BatchStatus::BAD_DATA;
+                return;
+            }
+
+            StringSink sink(result.output);
+            Interpreter interp(state, data, &sink);
+            if (mode == DispatchMode::JIT) {
+                auto jit = jits.checkOut(state.code_end);
+                result.status = batchStatusOf(interp.run(max_steps, *jit));
+                jits.checkIn(std::move(jit));
+            } else {
+                result.status = batchStatusOf(interp.run(max_steps, mode));
+            }
+        });
+    }
+    pool.wait();
+
+    return results;
+}
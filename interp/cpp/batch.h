@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vm.h"
+#include "cache.h"
+
+// Fixed set of workers, each owning a deque of tasks. A worker drains its own deque
+// from the front and steals from the back of the others once it runs dry.
+class WorkStealingPool final {
+public:
+    explicit WorkStealingPool(uint32_t threads);
+
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    // tasks are dealt round-robin over the workers' deques
+    void submit(std::function<void()> task);
+
+    // blocks until every submitted task has finished
+    void wait();
+
+    [[nodiscard]] inline uint32_t size() const noexcept { return static_cast<uint32_t>(workers_.size()); }
+
+private:
+    struct TaskQueue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool tryPop(uint32_t worker, std::function<void()> &task);
+
+    void work(uint32_t worker);
+
+private:
+    std::vector<std::unique_ptr<TaskQueue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex idle_lock_;
+    std::condition_variable idle_cv_;
+    std::condition_variable done_cv_;
+    // tasks sitting in queues, and tasks not finished yet
+    std::atomic<uint64_t> queued_{0};
+    std::atomic<uint64_t> pending_{0};
+    std::atomic<uint32_t> next_queue_{0};
+    bool stopping_{false};
+};
+
+// instructions a job runs for unless it's given a budget of its own, a program that never halts
+// would hold on to its worker forever otherwise
+constexpr uint64_t batch_step_limit = 1ull << 28;
+
+// halted, budget_exhausted, fault - where the run of a job stopped, see RunStatus
+enum class BatchStatus : uint8_t {
+    HALTED,
+    LOAD_FAILED,
+    // data overrides do not fit into the memory bank
+    BAD_DATA,
+    BUDGET_EXHAUSTED,
+    FAULT,
+};
+
+static inline const char *batchStatusName(const BatchStatus status) {
+    switch (status) {
+        case BatchStatus::HALTED:
+            return "halted";
+        case BatchStatus::LOAD_FAILED:
+            return "load failed";
+        case BatchStatus::BAD_DATA:
+            return "bad data";
+        case BatchStatus::BUDGET_EXHAUSTED:
+            return "budget exhausted";
+        case BatchStatus::FAULT:
+            return "fault";
+    }
+    return "unknown";
+}
+
+// path - image to run, jobs sharing a path share a single loaded copy of it
+// data - words written over the image starting from data_section_start
+struct BatchJob {
+    std::string path;
+    std::vector<uint16_t> data;
+};
+
+struct BatchResult {
+    BatchStatus status{BatchStatus::HALTED};
+    std::string output;
+};
+
+static inline BatchStatus batchStatusOf(const RunStatus status) {
+    switch (status) {
+        case RunStatus::HALTED:
+            return BatchStatus::HALTED;
+        case RunStatus::BUDGET_EXHAUSTED:
+            return BatchStatus::BUDGET_EXHAUSTED;
+        case RunStatus::FAULT:
+            break;
+    }
+    return BatchStatus::FAULT;
+}
+
+// runs every job on its own vm for at most max_steps instructions, results come back in the order
+// of jobs. With a cache, single-bank jobs whose run it already holds don't run at all, and every
+// other one that halts ends up in it
+std::vector<BatchResult> runBatch(const std::vector<BatchJob> &jobs, DispatchMode mode, uint32_t threads,
+                                  RunCache *cache = nullptr, uint64_t max_steps = batch_step_limit);
+
+// forks a vm off state for every data set, the shared part of the run is never repeated. Every
+// fork runs for at most max_steps instructions, results come back in the order of data_sets
+std::vector<BatchResult> runBatch(const VmState &state, const std::vector<std::vector<uint16_t>> &data_sets,
+                                  DispatchMode mode, uint32_t threads, uint64_t max_steps = batch_step_limit);
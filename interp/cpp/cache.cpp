@@ -0,0 +1,224 @@
+#include "cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../common/metrics.h"
+
+namespace {
+
+    constexpr char run_store_magic[8] = {'m', 'e', 't', 'a', 'r', 'u', 'n', 's'};
+
+    // sequence - 0 while the slot was never written, odd while it's being written
+    struct RunStoreSlot {
+        std::atomic<uint32_t> sequence;
+        uint32_t output_size;
+        uint64_t key;
+        uint16_t memory[memory_bank_capacity];
+        char output[run_store_output_size];
+    };
+
+    static_assert(sizeof(RunStoreSlot) == run_store_slot_size, "RunStoreSlot is stored as is");
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "slots are shared between processes");
+
+}
+
+uint64_t runKey(const uint16_t *bank, const uint8_t code_end, const uint8_t entry) {
+    uint64_t hash = 14695981039346656037ull ^ (static_cast<uint64_t>(code_end) << 32) ^
+                    (static_cast<uint64_t>(entry) << 40);
+    for (uint32_t addr = 0; addr < memory_bank_capacity; ++addr) {
+        hash = (hash ^ bank[addr]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t runKey(const MappedImage &image, const std::vector<uint16_t> &data) {
+    const auto &layout = image.layout();
+    uint16_t bank[memory_bank_capacity];
+    image.copyInto(bank, memory_bank_capacity);
+    const auto data_words = std::min<size_t>(data.size(), memory_bank_capacity - layout.data_start);
+    std::copy(data.begin(), data.begin() + data_words, bank + layout.data_start);
+    return runKey(bank, layout.code_end, layout.entry);
+}
+
+RunCache::~RunCache() {
+    if (mapping_) {
+        munmap(mapping_, mapped_);
+    }
+}
+
+bool RunCache::attachStore(const char *path, uint32_t slots) {
+    const int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fputs(errors[FAILED_TO_INIT_STREAM], stderr);
+        return false;
+    }
+
+    // whoever gets here first lays the store out, everyone else waits for it
+    flock(fd, LOCK_EX);
+    RunStoreHeader header{};
+    struct stat info{};
+    bool valid = fstat(fd, &info) == 0;
+    if (valid && info.st_size == 0) {
+        memcpy(header.magic, run_store_magic, sizeof(header.magic));
+        header.version = run_store_version;
+        header.slots = slots ? slots : 1;
+        header.slot_size = run_store_slot_size;
+        valid = !ftruncate(fd, static_cast<off_t>(header.slots + 1ull) * run_store_slot_size) &&
+                pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    } else if (valid) {
+        valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                !memcmp(header.magic, run_store_magic, sizeof(header.magic)) &&
+                header.version == run_store_version && header.slot_size == run_store_slot_size && header.slots &&
+                static_cast<uint64_t>(info.st_size) == (header.slots + 1ull) * run_store_slot_size;
+    }
+    flock(fd, LOCK_UN);
+
+    if (!valid) {
+        fprintf(stderr, "[[error]] %s is not a run store\n", path);
+        close(fd);
+        return false;
+    }
+
+    const auto size = (header.slots + 1ull) * run_store_slot_size;
+    void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fputs(errors[FAILED_TO_READ_CONTENTS], stderr);
+        return false;
+    }
+
+    if (mapping_) {
+        munmap(mapping_, mapped_);
+    }
+    mapping_ = static_cast<unsigned char *>(mapping);
+    mapped_ = size;
+    slots_ = header.slots;
+    return true;
+}
+
+bool RunCache::find(const uint64_t key, CachedRun &run) {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        const auto found = index_.find(key);
+        if (found != index_.end()) {
+            recent_.splice(recent_.begin(), recent_, found->second);
+            run = found->second->run;
+            hits_++;
+            countMetric(Metric::RUN_CACHE_HITS);
+            return true;
+        }
+    }
+
+    if (findStored(key, run)) {
+        remember(key, run);
+        hits_++;
+        countMetric(Metric::RUN_CACHE_HITS);
+        return true;
+    }
+
+    misses_++;
+    countMetric(Metric::RUN_CACHE_MISSES);
+    return false;
+}
+
+void RunCache::insert(const uint64_t key, const CachedRun &run) {
+    remember(key, run);
+    store(key, run);
+}
+
+RunStatus RunCache::run(const MappedImage &image, const std::vector<uint16_t> &data, const DispatchMode mode,
+                        const uint64_t max_steps, CachedRun &run) {
+    if (image.wide()) {
+        fputs(errors[NEEDS_WIDE_ENGINE], stderr);
+        return RunStatus::FAULT;
+    }
+
+    const auto key = runKey(image, data);
+    if (find(key, run)) {
+        return RunStatus::HALTED;
+    }
+
+    run.output.clear();
+    auto status = RunStatus::HALTED;
+    {
+        StringSink sink(run.output);
+        Interpreter interp(image, data, &sink);
+        status = interp.run(max_steps, mode);
+        const auto &memory = interp.peek().memory;
+        run.memory.assign(memory, memory + memory_bank_capacity);
+    }
+    // a run that faulted or ran out of steps has not finished, the next one has to find that out again
+    if (status == RunStatus::HALTED) {
+        insert(key, run);
+    }
+    return status;
+}
+
+void RunCache::remember(const uint64_t key, const CachedRun &run) {
+    std::lock_guard<std::mutex> guard(lock_);
+    const auto found = index_.find(key);
+    if (found != index_.end()) {
+        recent_.splice(recent_.begin(), recent_, found->second);
+        return;
+    }
+
+    if (index_.size() == entries_) {
+        index_.erase(recent_.back().key);
+        recent_.pop_back();
+    }
+    recent_.push_front(Entry{key, run});
+    index_.emplace(key, recent_.begin());
+}
+
+bool RunCache::findStored(const uint64_t key, CachedRun &run) const {
+    if (!mapping_) {
+        return false;
+    }
+
+    auto &slot = *reinterpret_cast<RunStoreSlot *>(mapping_ + (key % slots_ + 1) * run_store_slot_size);
+    const auto sequence = slot.sequence.load(std::memory_order_acquire);
+    if (!sequence || (sequence & 1) || slot.key != key) {
+        return false;
+    }
+
+    // a writer may come in at any point, the copy only counts if the sequence didn't move
+    const auto size = std::min(slot.output_size, run_store_output_size);
+    CachedRun copy;
+    copy.output.assign(slot.output, size);
+    copy.memory.assign(slot.memory, slot.memory + memory_bank_capacity);
+    const auto stored_key = slot.key;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != sequence || stored_key != key) {
+        return false;
+    }
+
+    run = std::move(copy);
+    return true;
+}
+
+void RunCache::store(const uint64_t key, const CachedRun &run) {
+    if (!mapping_ || run.output.size() > run_store_output_size || run.memory.size() != memory_bank_capacity) {
+        return;
+    }
+
+    auto &slot = *reinterpret_cast<RunStoreSlot *>(mapping_ + (key % slots_ + 1) * run_store_slot_size);
+    auto sequence = slot.sequence.load(std::memory_order_relaxed);
+    if ((sequence & 1) || !slot.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_acquire)) {
+        return;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.key = key;
+    slot.output_size = static_cast<uint32_t>(run.output.size());
+    memcpy(slot.memory, run.memory.data(), sizeof(slot.memory));
+    memcpy(slot.output, run.output.data(), run.output.size());
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vm.h"
+
+// runs the in-memory cache keeps by default
+constexpr size_t run_cache_entries = 4096;
+
+// On-disk store, a file of fixed-size slots that any number of processes map at once
+// 0 - RunStoreHeader, padded to a slot
+// then the slots, a run lands in the slot its key selects and replaces whatever was there
+constexpr uint32_t run_store_version = 1;
+constexpr uint32_t run_store_slot_size = 4096;
+constexpr uint32_t run_store_slots = 1024;
+// output that does not fit into a slot along with the memory bank stays in memory only
+constexpr uint32_t run_store_output_size = run_store_slot_size - 16 - memory_bank_capacity * sizeof(uint16_t);
+
+struct RunStoreHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t reserved;
+};
+
+// what a program does when it runs over a particular memory bank
+// output - everything it printed
+// memory - the bank as it left it
+struct CachedRun {
+    std::string output;
+    std::vector<uint16_t> memory;
+};
+
+// the bank as the program starts with it (code, whatever lies between code and data, data with the
+// overrides written over it) along with the entry point and where its code ends. Runs are
+// deterministic, so equal keys mean equal runs, up to collisions of a 64-bit hash
+uint64_t runKey(const uint16_t *bank, uint8_t code_end, uint8_t entry);
+
+// same for a run of a single-bank image over data
+uint64_t runKey(const MappedImage &image, const std::vector<uint16_t> &data);
+
+// Content-addressed cache of finished runs. Lookups go to an LRU of recent runs first, then to the
+// store if one is attached, and a run found there is kept in the LRU too. Every method can be
+// called from any number of threads. Slots of the store are guarded by a sequence number, readers
+// never block and a writer skips a slot someone else is writing. A process that dies halfway
+// through writing a slot leaves it unusable until the store is deleted
+class RunCache final {
+public:
+    explicit RunCache(size_t entries = run_cache_entries) : entries_{entries ? entries : 1} {}
+
+    ~RunCache();
+
+    RunCache(const RunCache &) = delete;
+
+    RunCache &operator=(const RunCache &) = delete;
+
+    // maps the store at path, creating it with the given number of slots if it doesn't exist yet.
+    // an existing store keeps its own number of slots. Reports the reason on stderr and returns
+    // false if it isn't a store
+    bool attachStore(const char *path, uint32_t slots = run_store_slots);
+
+    bool find(uint64_t key, CachedRun &run);
+
+    void insert(uint64_t key, const CachedRun &run);
+
+    // runs a single-bank image over data on mode for at most max_steps instructions, unless the cache
+    // already knows how that ends, and returns where it stopped. Only a run that halted is kept,
+    // and one the cache knows is answered as halted whatever max_steps is
+    RunStatus run(const MappedImage &image, const std::vector<uint16_t> &data, DispatchMode mode, uint64_t max_steps,
+                  CachedRun &run);
+
+    [[nodiscard]] inline uint64_t hits() const noexcept { return hits_; }
+
+    [[nodiscard]] inline uint64_t misses() const noexcept { return misses_; }
+
+private:
+    struct Entry {
+        uint64_t key;
+        CachedRun run;
+    };
+
+    void remember(uint64_t key, const CachedRun &run);
+
+    bool findStored(uint64_t key, CachedRun &run) const;
+
+    void store(uint64_t key, const CachedRun &run);
+
+private:
+    size_t entries_;
+    std::mutex lock_;
+    // most recently used first
+    std::list<Entry> recent_;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+
+    unsigned char *mapping_{nullptr};
+    size_t mapped_{0};
+    uint32_t slots_{0};
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+};
@@ -0,0 +1,40 @@
+#include "cycles.h"
+
+#include <algorithm>
+
+CycleModel::CycleModel(const CycleCosts (&costs)[isa_count], const uint8_t redirect_cycles)
+        : redirect_cycles_{redirect_cycles} {
+    // a word that is not an instruction still has to be fetched and found out
+    uint32_t unknown = UINT32_MAX;
+    for (uint32_t opcode = 0; opcode < isa_count; ++opcode) {
+        cost_[opcode] = costs[opcode].fetch + costs[opcode].decode + costs[opcode].execute;
+        unknown = std::min<uint32_t>(unknown, costs[opcode].fetch + costs[opcode].decode);
+    }
+    std::fill(std::begin(cost_) + isa_count, std::end(cost_), unknown);
+}
+
+void CycleModel::reset() {
+    std::fill(std::begin(opcode_cycles_), std::end(opcode_cycles_), 0);
+    cycles_ = 0;
+    instructions_ = 0;
+    redirects_ = 0;
+}
+
+void CycleModel::write(FILE *stream, const double clock_hz) const {
+    const auto cpi = instructions_ ? static_cast<double>(cycles_) / static_cast<double>(instructions_) : 0.0;
+    fprintf(stream, "cycles %llu, instructions %llu, redirects %llu, cpi %.2f\n",
+            static_cast<unsigned long long>(cycles_), static_cast<unsigned long long>(instructions_),
+            static_cast<unsigned long long>(redirects_), cpi);
+    if (clock_hz > 0) {
+        fprintf(stream, "estimated %.6f s at %.0f Hz\n", static_cast<double>(cycles_) / clock_hz, clock_hz);
+    }
+
+    for (uint32_t opcode = 0; opcode < 0x100; ++opcode) {
+        if (!opcode_cycles_[opcode]) {
+            continue;
+        }
+        const auto *entry = isaEntry(static_cast<uint8_t>(opcode));
+        fprintf(stream, "  %-8.*s %12llu\n", entry ? static_cast<int>(entry->mnemonic.size()) : 3,
+                entry ? entry->mnemonic.data() : "???", static_cast<unsigned long long>(opcode_cycles_[opcode]));
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+#include "instructions.h"
+
+// Timing of the control unit in circuits/metacpu.circ. The datapath there is a single-ported
+// RAM (one load or store per clock), the ALU with its memory/immediate operand mux, and the
+// ACC register, every cycle below is a clock edge one of them needs:
+// fetch - the instruction word comes out of the RAM
+// decode - the word drives the control lines (clear acc, acc write enable, operand mode, ALU op)
+// execute - an operand in memory takes a RAM load, ACC latches the ALU result, a store takes a
+// RAM store, and a branch or ret loads pc
+// The sheet has no sequencer of its own, so the phases are what the datapath needs for every
+// instruction, one clock per register or RAM access.
+struct CycleCosts {
+    uint8_t fetch;
+    uint8_t decode;
+    uint8_t execute;
+};
+
+// indexed by opcode, in the order of the isa table
+static constexpr CycleCosts circuit_cycle_costs[] = {
+        {1, 1, 1}, // addi - ACC latch
+        {1, 1, 2}, // add - operand load, ACC latch
+        {1, 1, 1}, // subi
+        {1, 1, 2}, // sub
+        {1, 1, 1}, // clac - clear acc
+        {1, 1, 1}, // bnz - flags are checked, pc loaded
+        {1, 1, 1}, // bz
+        {1, 1, 1}, // ucb
+        {1, 1, 1}, // str - RAM store
+        {1, 1, 1}, // leave
+        {1, 1, 2}, // cmp - operand load, flags latch
+        {1, 1, 1}, // cmpi
+        {1, 1, 1}, // outd
+        {1, 1, 1}, // big
+        {1, 1, 1}, // bil
+        {1, 1, 1}, // outb
+        {1, 1, 1}, // ret
+        {1, 1, 2}, // submem - operand load, RAM store
+        {1, 1, 2}, // addmem
+};
+
+static_assert(sizeof(circuit_cycle_costs) / sizeof(circuit_cycle_costs[0]) == isa_count,
+              "every opcode needs its cycle costs");
+
+// a taken branch or a ret spends one more clock on storing the return address or reading it
+// back, whatever was fetched after it is thrown away
+constexpr uint8_t circuit_redirect_cycles = 1;
+
+// Cycle counter of a single run, filled by the instrumented dispatch loop along with the
+// profile. Instructions are charged their fetch, decode and execute cycles, plus the redirect
+// cycles when they move pc somewhere else. Words that are not instructions cost a fetch and
+// a decode. leave ends the run and is not charged.
+class CycleModel final {
+public:
+    CycleModel() : CycleModel(circuit_cycle_costs, circuit_redirect_cycles) {}
+
+    CycleModel(const CycleCosts (&costs)[isa_count], uint8_t redirect_cycles);
+
+    // zeroes every counter, costs are kept
+    void reset();
+
+    // accounts an instruction, redirected if it was a taken branch or a ret
+    inline void retire(const uint16_t word, const bool redirected) {
+        const uint8_t opcode = word >> 8;
+        const auto cycles = cost_[opcode] + (redirected ? redirect_cycles_ : 0);
+        cycles_ += cycles;
+        opcode_cycles_[opcode] += cycles;
+        instructions_++;
+        redirects_ += redirected;
+    }
+
+    [[nodiscard]] inline uint64_t cycles() const noexcept { return cycles_; }
+
+    [[nodiscard]] inline uint64_t instructions() const noexcept { return instructions_; }
+
+    [[nodiscard]] inline uint64_t redirects() const noexcept { return redirects_; }
+
+    [[nodiscard]] inline uint64_t opcodeCycles(const uint16_t opcode) const noexcept {
+        return opcode_cycles_[opcode >> 8];
+    }
+
+    // cycles of a single instruction that does not redirect
+    [[nodiscard]] inline uint32_t cost(const uint16_t opcode) const noexcept { return cost_[opcode >> 8]; }
+
+    // totals, then cycles per opcode, the clock turns the cycles into an estimated run time
+    void write(FILE *stream, double clock_hz) const;
+
+private:
+    uint32_t cost_[0x100]{};
+    uint32_t redirect_cycles_;
+    uint64_t opcode_cycles_[0x100]{};
+    uint64_t cycles_{0};
+    uint64_t instructions_{0};
+    uint64_t redirects_{0};
+};
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <cstdint>
+
+#include "../../common/image.h"
+#include "instructions.h"
+
+// Handlers of the pre-decoded program. Opcodes map one-to-one onto the first
+// entries, the rest are internal to the dispatch loop.
+enum Handler : uint8_t {
+    H_ADDI = ADDI >> 8,
+    H_ADD = ADD >> 8,
+    H_SUBI = SUBI >> 8,
+    H_SUB = SUB >> 8,
+    H_CLAC = CLAC >> 8,
+    H_BNZ = BNZ >> 8,
+    H_BZ = BZ >> 8,
+    H_UCB = UCB >> 8,
+    H_STR = STR >> 8,
+    H_LEAVE = LEAVE >> 8,
+    H_CMP = CMP >> 8,
+    H_CMPI = CMPI >> 8,
+    H_OUTD = OUTD >> 8,
+    H_BIG = BIG >> 8,
+    H_BIL = BIL >> 8,
+    H_OUTB = OUTB >> 8,
+    H_RET = RET >> 8,
+    H_SUBMEM = SUBMEM >> 8,
+    H_ADDMEM = ADDMEM >> 8,
+    // word does not encode a known opcode
+    H_UNKNOWN,
+    // slot has to be (re)decoded from memory before it can be executed
+    H_DECODE,
+    // superinstructions, operands of the trailing instructions are read
+    // from the slots the group still covers
+    H_CLAC_ADDI_OUTB,
+    H_SUBMEM_ADD_BNZ,
+    H_CMPI_BZ,
+    H_CMPI_BNZ,
+    // the same instructions with a flag write nothing reads dropped, never stored in an image
+    H_ADDI_NOFLAGS,
+    H_ADD_NOFLAGS,
+    H_SUBI_NOFLAGS,
+    H_SUB_NOFLAGS,
+    H_CLAC_NOFLAGS,
+    // cmp or cmpi, without its flags there is nothing left to do
+    H_SKIP,
+    HANDLER_COUNT,
+};
+
+constexpr uint8_t max_fused_length = 3;
+
+// numbering of the handlers above as stored in the pre-decoded stream of an image,
+// has to be bumped whenever it changes
+constexpr uint8_t decoder_version = 1;
+
+constexpr bool isFused(const uint8_t handler) {
+    return handler >= H_CLAC_ADDI_OUTB && handler <= H_CMPI_BNZ;
+}
+
+constexpr bool dropsFlags(const uint8_t handler) {
+    return handler >= H_ADDI_NOFLAGS && handler < HANDLER_COUNT;
+}
+
+// what an instruction turns into when its flags are dead, itself if there is nothing to drop
+constexpr uint8_t withoutFlags(const uint8_t handler) {
+    switch (handler) {
+        case H_ADDI:
+            return H_ADDI_NOFLAGS;
+        case H_ADD:
+            return H_ADD_NOFLAGS;
+        case H_SUBI:
+            return H_SUBI_NOFLAGS;
+        case H_SUB:
+            return H_SUB_NOFLAGS;
+        case H_CLAC:
+            return H_CLAC_NOFLAGS;
+        case H_CMP:
+        case H_CMPI:
+            return H_SKIP;
+        default:
+            return handler;
+    }
+}
+
+// flags are lazy, whatever was written before is forgotten once the instruction runs
+constexpr bool overwritesFlags(const uint8_t handler) {
+    const auto *entry = isaEntry(handler);
+    return entry && (entry->flags & (writes_flags | sets_zf));
+}
+
+static_assert(H_ADDMEM + 1 == isa_count, "every opcode of the isa needs a handler");
+
+constexpr bool isBlockTerminator(const uint8_t handler) {
+    return hasKind(handler, kind_branch | kind_exit);
+}
+
+// number of slots reachable by an 8-bit pc
+constexpr uint32_t decoded_program_size = 0x100;
+
+// handler - what to execute
+// operand - lower byte of an instruction word
+// next_pc - fall-through successor of a slot
+struct DecodedInsn {
+    uint8_t handler;
+    uint8_t operand;
+    uint8_t next_pc;
+};
+
+static inline DecodedInsn decodeInstruction(const uint16_t word, const uint8_t slot) {
+    const uint8_t opcode = word >> 8;
+    return DecodedInsn{
+        static_cast<uint8_t>(isaEntry(opcode) ? opcode : static_cast<uint8_t>(H_UNKNOWN)),
+        static_cast<uint8_t>(word & value_mask),
+        static_cast<uint8_t>(slot + 1),
+    };
+}
+
+// decodes every slot below code_end, slots past it are left to be decoded on fetch,
+// since whatever lives there is data and can be rewritten at any moment
+static inline void decodeProgram(const uint16_t *memory, const uint8_t code_end, DecodedInsn *program) {
+    for (uint32_t slot = 0; slot < decoded_program_size; ++slot) {
+        if (slot < code_end) {
+            program[slot] = decodeInstruction(memory[slot], slot);
+        } else {
+            program[slot] = DecodedInsn{H_DECODE, 0, static_cast<uint8_t>(slot + 1)};
+        }
+    }
+}
+
+// marks the first slot of every basic block below code_end: the entry point,
+// targets of branches and whatever follows a branch, since that is where ret lands
+static inline void findBlockLeaders(const DecodedInsn *program, const uint8_t code_end, bool *leaders) {
+    for (uint32_t slot = 0; slot < decoded_program_size; ++slot) {
+        leaders[slot] = slot == 0;
+    }
+
+    for (uint32_t slot = 0; slot < code_end; ++slot) {
+        const auto handler = program[slot].handler;
+        if (!isBlockTerminator(handler)) {
+            continue;
+        }
+        if (handler != H_RET && handler != H_LEAVE) {
+            leaders[program[slot].operand] = true;
+        }
+        leaders[(slot + 1) % decoded_program_size] = true;
+    }
+}
+
+struct FusionPattern {
+    uint8_t handlers[max_fused_length];
+    uint8_t length;
+    uint8_t fused;
+};
+
+// longer patterns go first
+static constexpr FusionPattern fusion_patterns[] = {
+        {{H_CLAC,   H_ADDI, H_OUTB}, 3, H_CLAC_ADDI_OUTB},
+        {{H_SUBMEM, H_ADD,  H_BNZ},  3, H_SUBMEM_ADD_BNZ},
+        {{H_CMPI,   H_BZ},           2, H_CMPI_BZ},
+        {{H_CMPI,   H_BNZ},          2, H_CMPI_BNZ},
+};
+
+// Rewrites heads of common sequences into superinstructions. A group never crosses
+// a block leader, and slots it covers keep their own decoded form, so jumping into
+// the middle of a group still executes the original instructions.
+// Leaders come from the jump target table of an image when it has one.
+static inline void fuseSuperinstructions(DecodedInsn *program, const uint8_t code_end,
+                                         const uint8_t *leader_table = nullptr) {
+    bool leaders[decoded_program_size];
+    if (leader_table) {
+        for (uint32_t slot = 0; slot < decoded_program_size; ++slot) {
+            leaders[slot] = isLeader(leader_table, slot);
+        }
+    } else {
+        findBlockLeaders(program, code_end, leaders);
+    }
+
+    uint32_t slot = 0;
+    while (slot < code_end) {
+        uint8_t length = 1;
+        for (const auto &pattern: fusion_patterns) {
+            if (slot + pattern.length > code_end) {
+                continue;
+            }
+
+            bool matches = true;
+            for (uint8_t i = 0; i < pattern.length && matches; ++i) {
+                matches = program[slot + i].handler == pattern.handlers[i] && (i == 0 || !leaders[slot + i]);
+            }
+
+            if (matches) {
+                program[slot].handler = pattern.fused;
+                program[slot].next_pc = static_cast<uint8_t>(slot + pattern.length);
+                length = pattern.length;
+                break;
+            }
+        }
+        slot += length;
+    }
+}
+
+// The flag write of a slot is dead when the instruction after it overwrites the flags, since a
+// slot that writes flags never branches and that one always runs next. Only the next slot is
+// looked at, so a rewritten slot takes nothing but its predecessor down with it. The dispatch
+// loop stops at leave alone, hence nobody else gets to see the flags in between either.
+static inline void dropDeadFlagWrites(DecodedInsn *program, const uint16_t *memory, const uint8_t code_end) {
+    for (uint32_t slot = 0; slot + 1 < code_end; ++slot) {
+        const auto quiet = withoutFlags(program[slot].handler);
+        if (quiet != program[slot].handler && overwritesFlags(decodeInstruction(memory[slot + 1], slot + 1).handler)) {
+            program[slot].handler = quiet;
+        }
+    }
+}
+
+// drops a cached slot, along with a superinstruction covering it and a flag write it made dead.
+// a dropped slot covers itself alone again, the dispatch loop counts steps off next_pc
+static inline void invalidateDecodedSlot(DecodedInsn *program, const uint8_t addr) {
+    program[addr] = DecodedInsn{H_DECODE, 0, static_cast<uint8_t>(addr + 1)};
+    if (addr > 0 && dropsFlags(program[addr - 1].handler)) {
+        program[addr - 1] = DecodedInsn{H_DECODE, 0, addr};
+    }
+    const uint8_t first_head = addr >= max_fused_length - 1 ? addr - (max_fused_length - 1) : 0;
+    for (uint8_t head = first_head; head < addr; ++head) {
+        if (isFused(program[head].handler) && program[head].next_pc > addr) {
+            program[head] = DecodedInsn{H_DECODE, 0, static_cast<uint8_t>(head + 1)};
+        }
+    }
+}
+
+// turns superinstructions back into the instructions they cover
+static inline void defuseSuperinstructions(DecodedInsn *program, const uint16_t *memory, const uint8_t code_end) {
+    for (uint32_t slot = 0; slot < code_end; ++slot) {
+        if (isFused(program[slot].handler)) {
+            program[slot] = decodeInstruction(memory[slot], slot);
+        }
+    }
+}
+
+static inline const FusionPattern *findFusionPattern(const uint8_t fused) {
+    for (const auto &pattern: fusion_patterns) {
+        if (pattern.fused == fused) {
+            return &pattern;
+        }
+    }
+    return nullptr;
+}
+
+// Takes the decoded program over from the handler stream of an image, instead of decoding
+// and fusing it again. Every entry has to agree with memory, a superinstruction with every
+// slot it covers, otherwise nothing is taken and false is returned.
+static inline bool loadDecodedProgram(const uint8_t *stream, const uint16_t *memory, const uint8_t code_end,
+                                      DecodedInsn *program) {
+    for (uint32_t slot = 0; slot < code_end; ++slot) {
+        const auto *entry = stream + slot * image_decoded_entry_size;
+        const DecodedInsn insn{entry[0], entry[1], entry[2]};
+        const auto plain = decodeInstruction(memory[slot], slot);
+        if (insn.operand != plain.operand) {
+            return false;
+        }
+
+        if (!isFused(insn.handler)) {
+            if (insn.handler != plain.handler || insn.next_pc != plain.next_pc) {
+                return false;
+            }
+            continue;
+        }
+
+        const auto *pattern = findFusionPattern(insn.handler);
+        if (!pattern || slot + pattern->length > code_end || insn.next_pc != slot + pattern->length) {
+            return false;
+        }
+        for (uint8_t i = 0; i < pattern->length; ++i) {
+            if (decodeInstruction(memory[slot + i], slot + i).handler != pattern->handlers[i]) {
+                return false;
+            }
+        }
+    }
+
+    for (uint32_t slot = 0; slot < decoded_program_size; ++slot) {
+        if (slot < code_end) {
+            const auto *entry = stream + slot * image_decoded_entry_size;
+            program[slot] = DecodedInsn{entry[0], entry[1], entry[2]};
+        } else {
+            program[slot] = DecodedInsn{H_DECODE, 0, static_cast<uint8_t>(slot + 1)};
+        }
+    }
+    return true;
+}
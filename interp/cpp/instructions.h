@@ -1,27 +1,29 @@
 #pragma once
 
+#include <cstdint>
 
-constexpr uint16_t instruction_mask = 0xFF00;
-constexpr uint16_t value_mask = 0x00FF;
+#include "../../common/isa.h"
 
-enum {
-    ADDI = 0x0000,
-    ADD = 0x0100,
-    SUBI = 0x0200,
-    SUB = 0x0300,
-    CLAC = 0x0400,
-    BNZ = 0x0500,
-    BZ = 0x0600,
-    UCB = 0x0700,
-    STR = 0x0800,
-    LEAVE = 0x0900,
-    CMP = 0x0A00,
-    CMPI = 0x0B00,
-    OUTD = 0x0C00,
-    BIG = 0x0D00,
-    BIL = 0x0E00,
-    OUTB = 0x0F00,
-    RET  = 0x1000,
-	SUBMEM = 0x1100,
-	ADDMEM = 0x1200,
-};
\ No newline at end of file
+
+// instruction words as the vm sees them, straight out of the isa table
+enum : uint16_t {
+    ADDI = opcodeWord("addi"),
+    ADD = opcodeWord("add"),
+    SUBI = opcodeWord("subi"),
+    SUB = opcodeWord("sub"),
+    CLAC = opcodeWord("clac"),
+    BNZ = opcodeWord("bnz"),
+    BZ = opcodeWord("bz"),
+    UCB = opcodeWord("ucb"),
+    STR = opcodeWord("str"),
+    LEAVE = opcodeWord("leave"),
+    CMP = opcodeWord("cmp"),
+    CMPI = opcodeWord("cmpi"),
+    OUTD = opcodeWord("outd"),
+    BIG = opcodeWord("big"),
+    BIL = opcodeWord("bil"),
+    OUTB = opcodeWord("outb"),
+    RET  = opcodeWord("ret"),
+	SUBMEM = opcodeWord("submem"),
+	ADDMEM = opcodeWord("addmem"),
+};
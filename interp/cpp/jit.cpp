@@ -0,0 +1,494 @@
+#include "jit.h"
+#include "vm.h"
+#include "../../common/metrics.h"
+
+#if METACPU_JIT_AVAILABLE
+#include <sys/mman.h>
+#endif
+
+// large enough for a few hundred worst-case blocks, filling it up flushes the whole cache
+constexpr size_t jit_code_capacity = 256 * 1024;
+
+#if METACPU_JIT_AVAILABLE
+
+// pinned registers are loaded with 8-bit displacements off the vm pointer
+static_assert(offsetof(vm, memory) < 0x80 && offsetof(vm, flag_result) < 0x80, "vm layout out of disp8 reach");
+
+namespace {
+
+    class X64Emitter {
+    public:
+        inline void bytes(std::initializer_list<uint8_t> list) {
+            buffer_.insert(buffer_.end(), list);
+        }
+
+        inline void imm32(const uint32_t value) {
+            for (uint32_t i = 0; i < 4; ++i) {
+                buffer_.push_back(static_cast<uint8_t>(value >> (i * 8)));
+            }
+        }
+
+        inline void imm64(const uint64_t value) {
+            for (uint32_t i = 0; i < 8; ++i) {
+                buffer_.push_back(static_cast<uint8_t>(value >> (i * 8)));
+            }
+        }
+
+        // push rbx, r12-r15, then load the pinned registers out of vm
+        void prologue() {
+            bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});
+            // mov r14, rdi; mov r15, rsi
+            bytes({0x49, 0x89, 0xFE, 0x49, 0x89, 0xF7});
+            // lea r12, [r14 + memory]
+            bytes({0x4D, 0x8D, 0x66, static_cast<uint8_t>(offsetof(vm, memory))});
+            // movzx ebx, byte [r14 + acc]; movzx r13d, byte [r14 + flag_result]
+            bytes({0x41, 0x0F, 0xB6, 0x5E, static_cast<uint8_t>(offsetof(vm, acc))});
+            bytes({0x45, 0x0F, 0xB6, 0x6E, static_cast<uint8_t>(offsetof(vm, flag_result))});
+        }
+
+        // mov eax, code, write acc and the flag result back, restore registers and return
+        void exit(const uint32_t code) {
+            bytes({0xB8});
+            imm32(code);
+            exitWithEax();
+        }
+
+        void exitWithEax() {
+            spillAcc();
+            // mov [r14 + flag_result], r13b
+            bytes({0x45, 0x88, 0x6E, static_cast<uint8_t>(offsetof(vm, flag_result))});
+            bytes({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+        }
+
+        // mov [r14 + acc], bl
+        inline void spillAcc() {
+            bytes({0x41, 0x88, 0x5E, static_cast<uint8_t>(offsetof(vm, acc))});
+        }
+
+        // movzx eax, word [r12 + addr * 2]
+        inline void loadWord(const uint8_t addr) {
+            bytes({0x41, 0x0F, 0xB7, 0x84, 0x24});
+            imm32(addr * sizeof(uint16_t));
+        }
+
+        // flags are lazy here as well, acc is what they are read off, mirrors SET_FLAGS
+        // movzx r13d, bl
+        inline void setFlags() {
+            bytes({0x44, 0x0F, 0xB6, 0xEB});
+        }
+
+        // test r13b, r13b
+        inline void testFlags() {
+            bytes({0x45, 0x84, 0xED});
+        }
+
+        // mov rdi, r15; mov esi, arg; mov rax, fn; call rax
+        void call(const void *fn, const uint32_t arg) {
+            bytes({0x4C, 0x89, 0xFF, 0xBE});
+            imm32(arg);
+            bytes({0x48, 0xB8});
+            imm64(reinterpret_cast<uint64_t>(fn));
+            bytes({0xFF, 0xD0});
+        }
+
+        // jcc rel32 with the displacement left to patch
+        inline size_t jump(const uint8_t condition_opcode) {
+            bytes({0x0F, condition_opcode});
+            imm32(0);
+            return buffer_.size();
+        }
+
+        inline void patch(const size_t jump_end) {
+            const auto rel = static_cast<uint32_t>(buffer_.size() - jump_end);
+            for (uint32_t i = 0; i < 4; ++i) {
+                buffer_[jump_end - 4 + i] = static_cast<uint8_t>(rel >> (i * 8));
+            }
+        }
+
+        [[nodiscard]] inline const std::vector<uint8_t> &buffer() const noexcept { return buffer_; }
+
+    private:
+        std::vector<uint8_t> buffer_;
+    };
+
+    constexpr uint8_t jz_opcode = 0x84;
+    constexpr uint8_t jnz_opcode = 0x85;
+    constexpr uint8_t jns_opcode = 0x89;
+    constexpr uint8_t jle_opcode = 0x8E;
+
+}
+
+JitCompiler::JitCompiler(const uint16_t *memory, const uint8_t code_end) : memory_{memory}, code_end_{code_end} {
+    void *region = mmap(nullptr, jit_code_capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        fputs(errors[FAILED_TO_ALLOCATE_MEMORY], stderr);
+        return;
+    }
+
+    code_ = static_cast<uint8_t *>(region);
+    code_capacity_ = jit_code_capacity;
+    writable_ = true;
+}
+
+JitCompiler::~JitCompiler() {
+    if (code_) {
+        munmap(code_, code_capacity_);
+    }
+}
+
+JitBlock JitCompiler::blockAt(const uint8_t pc) {
+    if (pc >= code_end_ || dirty_[pc]) {
+        return nullptr;
+    }
+
+    if (!blocks_[pc] && !compilePass(pc)) {
+        return nullptr;
+    }
+
+    return blocks_[pc];
+}
+
+bool JitCompiler::compilePass(const uint8_t pc) {
+    if (!writable_ && mprotect(code_, code_capacity_, PROT_READ | PROT_WRITE)) {
+        return false;
+    }
+    writable_ = true;
+
+    // the block asked for may flush the cache to fit, the rest only take what room is left
+    std::vector<uint8_t> pending;
+    const auto compiled = compile(pc, true, pending);
+    while (compiled && !pending.empty()) {
+        const auto start = pending.back();
+        pending.pop_back();
+        if (start < code_end_ && !dirty_[start] && !blocks_[start]) {
+            compile(start, false, pending);
+        }
+    }
+
+    if (mprotect(code_, code_capacity_, PROT_READ | PROT_EXEC)) {
+        flush();
+        return false;
+    }
+    writable_ = false;
+    return compiled;
+}
+
+void JitCompiler::invalidate(const uint8_t addr) {
+    dirty_[addr] = true;
+    for (uint32_t start = 0; start <= addr; ++start) {
+        if (blocks_[start] && block_end_[start] > addr) {
+            blocks_[start] = nullptr;
+        }
+    }
+}
+
+void JitCompiler::flush() {
+    for (auto &block: blocks_) {
+        block = nullptr;
+    }
+    code_used_ = 0;
+}
+
+bool JitCompiler::compile(const uint8_t start, const bool may_flush, std::vector<uint8_t> &successors) {
+    X64Emitter emitter;
+    emitter.prologue();
+
+    uint32_t slot = start;
+    bool terminated = false;
+    // leave and unknown instructions end the block without being executed
+    bool executes_last = true;
+    bool returns = false;
+    while (!terminated) {
+        if (slot >= code_end_ || dirty_[slot]) {
+            // interpreter takes over from here
+            if (slot == start) {
+                return false;
+            }
+            emitter.exit(slot);
+            break;
+        }
+
+        const auto insn = decodeInstruction(memory_[slot], slot);
+        const auto operand = insn.operand;
+        const auto next = (slot + 1) % decoded_program_size;
+        // the next instruction overwrites the flags and ends up in this block too, see
+        // dropDeadFlagWrites
+        const bool flags_dead = next < code_end_ && !dirty_[next] &&
+                                overwritesFlags(decodeInstruction(memory_[next], next).handler);
+        switch (insn.handler) {
+            case H_ADDI:
+                // add bl, imm8
+                emitter.bytes({0x80, 0xC3, operand});
+                if (!flags_dead) {
+                    emitter.setFlags();
+                }
+                break;
+            case H_SUBI:
+                // sub bl, imm8
+                emitter.bytes({0x80, 0xEB, operand});
+                if (!flags_dead) {
+                    emitter.setFlags();
+                }
+                break;
+            case H_CMPI:
+                // movzx r13d, bl; sub r13b, imm8
+                if (!flags_dead) {
+                    emitter.setFlags();
+                    emitter.bytes({0x41, 0x80, 0xED, operand});
+                }
+                break;
+            case H_ADD:
+                // add bl, al
+                emitter.loadWord(operand);
+                emitter.bytes({0x00, 0xC3});
+                if (!flags_dead) {
+                    emitter.setFlags();
+                }
+                break;
+            case H_SUB:
+                // sub bl, al
+                emitter.loadWord(operand);
+                emitter.bytes({0x28, 0xC3});
+                if (!flags_dead) {
+                    emitter.setFlags();
+                }
+                break;
+            case H_CMP:
+                // movzx r13d, bl; sub r13b, al
+                if (!flags_dead) {
+                    emitter.loadWord(operand);
+                    emitter.setFlags();
+                    emitter.bytes({0x41, 0x28, 0xC5});
+                }
+                break;
+            case H_CLAC:
+                // xor ebx, ebx
+                emitter.bytes({0x31, 0xDB});
+                if (!flags_dead) {
+                    emitter.setFlags();
+                }
+                break;
+            case H_STR:
+                // movsx eax, bl; mov word [r12 + addr * 2], ax
+                emitter.bytes({0x0F, 0xBE, 0xC3, 0x66, 0x41, 0x89, 0x84, 0x24});
+                emitter.imm32(operand * sizeof(uint16_t));
+                break;
+            case H_ADDMEM:
+                // add word [r12 + addr * 2], 1
+                emitter.bytes({0x66, 0x41, 0x83, 0x84, 0x24});
+                emitter.imm32(operand * sizeof(uint16_t));
+                emitter.bytes({0x01});
+                break;
+            case H_SUBMEM:
+                // sub word [r12 + addr * 2], 1
+                emitter.bytes({0x66, 0x41, 0x83, 0xAC, 0x24});
+                emitter.imm32(operand * sizeof(uint16_t));
+                emitter.bytes({0x01});
+                break;
+            case H_OUTB:
+                emitter.spillAcc();
+                emitter.call(reinterpret_cast<const void *>(&JitCompiler::helperOutb), 0);
+                break;
+            case H_OUTD:
+                emitter.spillAcc();
+                emitter.call(reinterpret_cast<const void *>(&JitCompiler::helperOutd), 0);
+                break;
+            case H_BNZ:
+            case H_BZ:
+            case H_BIG:
+            case H_BIL: {
+                size_t not_taken;
+                emitter.testFlags();
+                if (insn.handler == H_BNZ) {
+                    not_taken = emitter.jump(jz_opcode);
+                } else if (insn.handler == H_BZ) {
+                    not_taken = emitter.jump(jnz_opcode);
+                } else if (insn.handler == H_BIG) {
+                    not_taken = emitter.jump(jle_opcode);
+                } else {
+                    not_taken = emitter.jump(jns_opcode);
+                }
+                emitter.call(reinterpret_cast<const void *>(&JitCompiler::helperPush), slot);
+                emitter.exit(operand);
+                emitter.patch(not_taken);
+                emitter.exit(next);
+                successors.insert(successors.end(), {operand, static_cast<uint8_t>(next)});
+                terminated = true;
+                break;
+            }
+            case H_UCB:
+                emitter.call(reinterpret_cast<const void *>(&JitCompiler::helperPush), slot);
+                emitter.exit(operand);
+                successors.push_back(operand);
+                terminated = true;
+                break;
+            case H_RET:
+                emitter.call(reinterpret_cast<const void *>(&JitCompiler::helperRet), 0);
+                emitter.exitWithEax();
+                terminated = true;
+                returns = true;
+                break;
+            case H_LEAVE:
+                emitter.exit(jit_exit_leave | slot);
+                terminated = true;
+                executes_last = false;
+                break;
+            default:
+                // unknown instruction, let the interpreter report it
+                if (slot == start) {
+                    return false;
+                }
+                emitter.exit(slot);
+                terminated = true;
+                executes_last = false;
+                break;
+        }
+
+        // stores into the code region leave the block, so the caller gets a chance to invalidate
+        const bool stores = insn.handler == H_STR || insn.handler == H_ADDMEM || insn.handler == H_SUBMEM;
+        if (stores && operand < code_end_) {
+            emitter.exit(jit_exit_code_store | (static_cast<uint32_t>(operand) << 16) | next);
+            successors.push_back(static_cast<uint8_t>(next));
+            terminated = true;
+        }
+
+        slot++;
+    }
+
+    const auto &buffer = emitter.buffer();
+    if (code_used_ + buffer.size() > code_capacity_) {
+        if (!may_flush) {
+            return false;
+        }
+        flush();
+    }
+
+    memcpy(code_ + code_used_, buffer.data(), buffer.size());
+
+    blocks_[start] = reinterpret_cast<JitBlock>(code_ + code_used_);
+    block_end_[start] = static_cast<uint16_t>(slot);
+    block_steps_[start] = static_cast<uint8_t>(slot - start - (terminated && !executes_last));
+    block_returns_[start] = returns;
+    code_used_ += buffer.size();
+    return true;
+}
+
+#else
+
+JitCompiler::JitCompiler(const uint16_t *memory, const uint8_t code_end) : memory_{memory}, code_end_{code_end} {}
+
+JitCompiler::~JitCompiler() = default;
+
+JitBlock JitCompiler::blockAt(uint8_t) {
+    return nullptr;
+}
+
+void JitCompiler::invalidate(const uint8_t addr) {
+    dirty_[addr] = true;
+}
+
+void JitCompiler::flush() {}
+
+bool JitCompiler::compilePass(uint8_t) {
+    return false;
+}
+
+bool JitCompiler::compile(uint8_t, bool, std::vector<uint8_t> &) {
+    return false;
+}
+
+#endif
+
+std::unique_ptr<JitCompiler> JitCompilerPool::checkOut(const uint8_t code_end) {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (!idle_.empty()) {
+            auto jit = std::move(idle_.back());
+            idle_.pop_back();
+            return jit;
+        }
+    }
+    return std::make_unique<JitCompiler>(nullptr, code_end);
+}
+
+void JitCompilerPool::checkIn(std::unique_ptr<JitCompiler> jit) {
+    std::lock_guard<std::mutex> guard(lock_);
+    idle_.push_back(std::move(jit));
+}
+
+void JitCompiler::helperPush(Interpreter *interp, const uint32_t pc) {
+    interp->vm_->stack.push(static_cast<uint8_t>(pc));
+}
+
+uint32_t JitCompiler::helperRet(Interpreter *interp) {
+    interp->ret();
+    return static_cast<uint8_t>(interp->vm_->pc + 1);
+}
+
+void JitCompiler::helperOutb(Interpreter *interp) {
+    interp->outb();
+}
+
+void JitCompiler::helperOutd(Interpreter *interp) {
+    interp->outd();
+}
+
+RunStatus Interpreter::run(const uint64_t max_steps, JitCompiler &jit) {
+    assert(vm_ && "vm must be initialized!");
+    assert(jit.codeEnd() == code_end_ && "the compiler was made for another image");
+
+    if (!jit.ready()) {
+        // no executable memory on this platform, take the fastest interpreter instead
+        return run(max_steps, DispatchMode::THREADED);
+    }
+    if (profile_ || cycles_ || trace_) {
+        return run(max_steps);
+    }
+    jit.rebind(vm_->memory);
+
+    // once a block no longer fits, or ends in a ret with nowhere to return to, the rest goes step
+    // by step, checked the way run() checks it
+    const auto retired = retired_;
+    const auto pushes = vm_->stack.pushes();
+    auto &pc = vm_->pc;
+    bool stepping = false;
+    for (;;) {
+        const auto block = stepping ? nullptr : jit.blockAt(pc);
+        if (block) {
+            const auto steps = jit.blockSteps(pc);
+            if (retired_ - retired + steps > max_steps || (jit.blockReturns(pc) && vm_->stack.empty())) {
+                stepping = true;
+                continue;
+            }
+            const auto exit_code = block(vm_, this);
+            retired_ += steps;
+            pc = static_cast<uint8_t>(exit_code);
+            if (exit_code & jit_exit_leave) {
+                break;
+            }
+            if (exit_code & jit_exit_code_store) {
+                jit.invalidate(static_cast<uint8_t>(exit_code >> 16));
+            }
+            continue;
+        }
+
+        const auto insn = decodeInstruction(vm_->memory[pc], pc);
+        const bool faults = insn.handler == H_UNKNOWN || (insn.handler == H_RET && vm_->stack.empty());
+        if (insn.handler == H_LEAVE || faults || retired_ - retired == max_steps) {
+            break;
+        }
+        step();
+        retired_++;
+        if (hasKind(insn.handler, kind_store) && insn.operand < code_end_) {
+            jit.invalidate(insn.operand);
+        }
+    }
+
+    if (retired_ != retired) {
+        dropDecoded();
+    }
+    countMetric(Metric::INSTRUCTIONS, retired_ - retired);
+    countMetric(Metric::BRANCHES_TAKEN, vm_->stack.pushes() - pushes);
+    // whatever stopped the loop, run() tells it apart, counts the run and flushes the output
+    return run(max_steps - (retired_ - retired));
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "decoder.h"
+
+struct vm;
+class Interpreter;
+
+// translated basic block, returns an exit code describing where to go next
+using JitBlock = uint32_t (*)(vm *state, Interpreter *interp);
+
+// exit code layout
+// bits 0-7   - pc to continue from
+// bit 8      - block ended with leave, pc points at it
+// bit 9      - block stored into the code region, bits 16-23 hold the address
+constexpr uint32_t jit_exit_leave = 0x100;
+constexpr uint32_t jit_exit_code_store = 0x200;
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define METACPU_JIT_AVAILABLE 1
+#else
+#define METACPU_JIT_AVAILABLE 0
+#endif
+
+// Template JIT translating blocks of metasm code into x86-64 machine code.
+// acc lives in bl, the flag result in r13b, memory base in r12 for the whole block.
+// Blocks run until the first branch, ret, leave, or store into the code region.
+// Slots rewritten at run time are never translated again and go through the
+// interpreter instead.
+class JitCompiler final {
+public:
+    JitCompiler(const uint16_t *memory, uint8_t code_end);
+
+    ~JitCompiler();
+
+    JitCompiler(const JitCompiler &) = delete;
+
+    JitCompiler &operator=(const JitCompiler &) = delete;
+
+    [[nodiscard]] inline bool ready() const noexcept { return code_ != nullptr; }
+
+    // translated block starting at pc, nullptr if pc has to be interpreted
+    JitBlock blockAt(uint8_t pc);
+
+    // drops every block covering addr and hands the slot over to the interpreter
+    void invalidate(uint8_t addr);
+
+    // translates out of another vm's memory from here on. Blocks translated so far are kept, which
+    // is only right for a vm that starts out with the same code. Slots some earlier run stored into
+    // stay with the interpreter
+    inline void rebind(const uint16_t *memory) noexcept { memory_ = memory; }
+
+    [[nodiscard]] inline uint8_t codeEnd() const noexcept { return code_end_; }
+
+    // instructions the block at pc retires, not counting the leave or unknown instruction it stops
+    // at. Only meaningful while blockAt(pc) returns the block
+    [[nodiscard]] inline uint8_t blockSteps(const uint8_t pc) const noexcept { return block_steps_[pc]; }
+
+    // the block at pc ends with a ret
+    [[nodiscard]] inline bool blockReturns(const uint8_t pc) const noexcept { return block_returns_[pc]; }
+
+private:
+    // translates the block at pc and every block reachable from it that still fits, with a single
+    // switch of the code region to writable and back for all of them
+    bool compilePass(uint8_t pc);
+
+    // translates the block at start into the code region, which has to be writable. A block that
+    // does not fit flushes the cache if may_flush is set and fails otherwise. The slots it may exit
+    // to, as far as they are known up front, go into successors
+    bool compile(uint8_t start, bool may_flush, std::vector<uint8_t> &successors);
+
+    void flush();
+
+    // called from translated code
+    static void helperPush(Interpreter *interp, uint32_t pc);
+
+    static uint32_t helperRet(Interpreter *interp);
+
+    static void helperOutb(Interpreter *interp);
+
+    static void helperOutd(Interpreter *interp);
+
+private:
+    const uint16_t *memory_;
+    uint8_t code_end_;
+
+    uint8_t *code_{nullptr};
+    size_t code_capacity_{0};
+    size_t code_used_{0};
+    // code region is mapped writable rather than executable
+    bool writable_{false};
+
+    JitBlock blocks_[decoded_program_size]{};
+    // first slot after the last instruction translated into a block
+    uint16_t block_end_[decoded_program_size]{};
+    uint8_t block_steps_[decoded_program_size]{};
+    bool block_returns_[decoded_program_size]{};
+    bool dirty_[decoded_program_size]{};
+};
+
+// compilers of a single image kept between its runs. A run checks one out, which is then its own
+// until it checks it back in, and starts off every block earlier runs translated. Runs of the
+// image may go on at once, each on a compiler of its own
+class JitCompilerPool final {
+public:
+    // an idle compiler, or a new one for a code region of code_end slots. The run it's handed to
+    // points it at its own memory
+    std::unique_ptr<JitCompiler> checkOut(uint8_t code_end);
+
+    void checkIn(std::unique_ptr<JitCompiler> jit);
+
+private:
+    std::mutex lock_;
+    std::vector<std::unique_ptr<JitCompiler>> idle_;
+};
@@ -0,0 +1,258 @@
+#include "loader.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../common/errors.h"
+#include "../../common/metrics.h"
+
+MappedImage::MappedImage(MappedImage &&other) noexcept
+        : mapping_{other.mapping_}, size_{other.size_}, version_{other.version_}, header_{other.header_},
+          layout_{other.layout_}, wide_header_{other.wide_header_}, wide_layout_{other.wide_layout_} {
+    other.mapping_ = nullptr;
+    other.size_ = 0;
+    other.version_ = 0;
+}
+
+MappedImage &MappedImage::operator=(MappedImage &&other) noexcept {
+    if (this != &other) {
+        close();
+        std::swap(mapping_, other.mapping_);
+        std::swap(size_, other.size_);
+        std::swap(version_, other.version_);
+        std::swap(header_, other.header_);
+        std::swap(layout_, other.layout_);
+        std::swap(wide_header_, other.wide_header_);
+        std::swap(wide_layout_, other.wide_layout_);
+    }
+    return *this;
+}
+
+bool MappedImage::open(const char *path) {
+    MetricTimer timer(Metric::IMAGE_LOAD_NS);
+    countMetric(Metric::IMAGE_LOADS);
+    close();
+
+    const auto fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        fputs(errors[FAILED_TO_INIT_STREAM], stderr);
+        return false;
+    }
+
+    struct stat info{};
+    if (fstat(fd, &info) || static_cast<size_t>(info.st_size) < preamble_size + 1) {
+        fputs(errors[FAILED_TO_READ_PREAMBLE], stderr);
+        ::close(fd);
+        return false;
+    }
+
+    const auto size = static_cast<size_t>(info.st_size);
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps its own reference to the file
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        fputs(errors[FAILED_TO_READ_CONTENTS], stderr);
+        return false;
+    }
+
+    mapping_ = static_cast<const unsigned char *>(mapping);
+    size_ = size;
+    return parse();
+}
+
+bool MappedImage::load(const void *bytes, const size_t size) {
+    MetricTimer timer(Metric::IMAGE_LOAD_NS);
+    countMetric(Metric::IMAGE_LOADS);
+    close();
+
+    if (size < preamble_size + 1) {
+        fputs(errors[FAILED_TO_READ_PREAMBLE], stderr);
+        return false;
+    }
+
+    // a private copy in a mapping of its own, so that close() does not care where the image came from
+    void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        fputs(errors[FAILED_TO_ALLOCATE_MEMORY], stderr);
+        return false;
+    }
+    memcpy(mapping, bytes, size);
+    mprotect(mapping, size, PROT_READ);
+
+    mapping_ = static_cast<const unsigned char *>(mapping);
+    size_ = size;
+    return parse();
+}
+
+bool MappedImage::parse() {
+    // preamble is compared together with its terminator, just like the old strcmp did
+    if (!memcmp(mapping_, expected_preamble, preamble_size + 1)) {
+        version_ = 1;
+        layout_ = ImageLayout{};
+        return true;
+    }
+
+    if (!memcmp(mapping_, expected_preamble_v3, preamble_size + 1)) {
+        if (!parseWideHeader()) {
+            fputs(errors[MALFORMED_HEADER], stderr);
+            close();
+            return false;
+        }
+        version_ = 3;
+        return true;
+    }
+
+    if (memcmp(mapping_, expected_preamble_v2, preamble_size + 1)) {
+        fputs(errors[MALFORMED_PREAMBLE], stderr);
+        close();
+        return false;
+    }
+
+    if (!parseHeader()) {
+        fputs(errors[MALFORMED_HEADER], stderr);
+        close();
+        return false;
+    }
+
+    version_ = 2;
+    return true;
+}
+
+bool MappedImage::parseHeader() {
+    if (size_ < image_header_offset + sizeof(ImageHeader)) {
+        return false;
+    }
+    memcpy(&header_, mapping_ + image_header_offset, sizeof(ImageHeader));
+
+    const auto fits = [this](const uint32_t offset, const size_t bytes) {
+        return offset <= size_ && bytes <= size_ - offset;
+    };
+
+    const auto &h = header_;
+    if (h.code_words > h.data_start || h.data_start + h.data_words > decoded_program_size ||
+        !fits(h.code_offset, h.code_words * sizeof(uint16_t)) ||
+        (h.data_words && !fits(h.data_offset, h.data_words * sizeof(uint16_t)))) {
+        return false;
+    }
+
+    if (h.leaders_offset && !fits(h.leaders_offset, image_leaders_size)) {
+        return false;
+    }
+
+    if (h.decoded_offset && !fits(h.decoded_offset, h.code_words * image_decoded_entry_size)) {
+        return false;
+    }
+
+    layout_.entry = h.entry;
+    layout_.code_end = static_cast<uint8_t>(h.code_words);
+    layout_.data_start = h.data_start;
+    layout_.leaders = h.leaders_offset ? mapping_ + h.leaders_offset : nullptr;
+    // a stream written for another numbering of handlers is useless, the decoder starts from scratch
+    const auto usable = h.decoded_offset && h.decoded_version == decoder_version;
+    layout_.decoded = usable ? mapping_ + h.decoded_offset : nullptr;
+    return true;
+}
+
+bool MappedImage::parseWideHeader() {
+    if (size_ < image_header_offset + sizeof(WideImageHeader)) {
+        return false;
+    }
+    memcpy(&wide_header_, mapping_ + image_header_offset, sizeof(WideImageHeader));
+
+    const auto fits = [this](const uint32_t offset, const size_t bytes) {
+        return offset <= size_ && bytes <= size_ - offset;
+    };
+
+    const auto &h = wide_header_;
+    if (h.code_words > h.data_start || h.data_start > wide_address_space_size ||
+        h.data_words > wide_address_space_size - h.data_start || h.entry >= wide_address_space_size ||
+        !fits(h.code_offset, h.code_words * sizeof(uint16_t)) ||
+        (h.data_words && !fits(h.data_offset, h.data_words * sizeof(uint16_t)))) {
+        return false;
+    }
+
+    layout_ = ImageLayout{};
+    wide_layout_ = WideLayout{h.entry, h.code_words, h.data_start};
+    return true;
+}
+
+void MappedImage::close() {
+    if (mapping_) {
+        munmap(const_cast<unsigned char *>(mapping_), size_);
+        mapping_ = nullptr;
+        size_ = 0;
+        version_ = 0;
+    }
+}
+
+size_t MappedImage::words() const noexcept {
+    if (version_ == 1) {
+        return (size_ - (preamble_size + 1)) / sizeof(uint16_t);
+    }
+    if (version_ == 2) {
+        return header_.data_words ? header_.data_start + header_.data_words : header_.code_words;
+    }
+    if (version_ == 3) {
+        return wide_header_.data_words ? wide_header_.data_start + wide_header_.data_words : wide_header_.code_words;
+    }
+    return 0;
+}
+
+size_t MappedImage::copyInto(uint16_t *bank, const size_t capacity) const {
+    const auto count = std::min(words(), capacity);
+    memset(bank, 0, capacity * sizeof(uint16_t));
+    if (version_ == 1) {
+        copyWords(bank, mapping_ + preamble_size + 1, count);
+    } else if (version_ == 2) {
+        copyWords(bank, mapping_ + header_.code_offset, std::min<size_t>(header_.code_words, capacity));
+        if (header_.data_start < capacity) {
+            const auto data_words = std::min<size_t>(header_.data_words, capacity - header_.data_start);
+            copyWords(bank + header_.data_start, mapping_ + header_.data_offset, data_words);
+        }
+    } else if (version_ == 3) {
+        copyWords(bank, mapping_ + wide_header_.code_offset, std::min<size_t>(wide_header_.code_words, capacity));
+        if (wide_header_.data_start < capacity) {
+            const auto data_words = std::min<size_t>(wide_header_.data_words, capacity - wide_header_.data_start);
+            copyWords(bank + wide_header_.data_start, mapping_ + wide_header_.data_offset, data_words);
+        }
+    }
+    return count;
+}
+
+void predecodeImage(const MappedImage &image, ImageSections &sections) {
+    uint16_t memory[decoded_program_size];
+    image.copyInto(memory, decoded_program_size);
+    const auto &layout = image.layout();
+
+    DecodedInsn program[decoded_program_size];
+    decodeProgram(memory, layout.code_end, program);
+
+    sections = ImageSections{};
+    if (layout.leaders) {
+        sections.leaders.assign(layout.leaders, layout.leaders + image_leaders_size);
+    } else {
+        bool leaders[decoded_program_size];
+        findBlockLeaders(program, layout.code_end, leaders);
+        for (uint32_t slot = 0; slot < decoded_program_size; ++slot) {
+            if (leaders[slot]) {
+                markLeader(sections.leaders, slot);
+            }
+        }
+    }
+    fuseSuperinstructions(program, layout.code_end, sections.leaders.data());
+
+    const auto data_end = std::clamp<size_t>(image.words(), layout.data_start, decoded_program_size);
+    sections.code.assign(memory, memory + layout.code_end);
+    sections.data.assign(memory + layout.data_start, memory + data_end);
+    sections.data_start = layout.data_start;
+    sections.entry = layout.entry;
+    for (uint32_t slot = 0; slot < layout.code_end; ++slot) {
+        sections.decoded.insert(sections.decoded.end(), {program[slot].handler, program[slot].operand, program[slot].next_pc});
+    }
+    sections.decoded_version = decoder_version;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "../../common/image.h"
+#include "decoder.h"
+
+// what an image tells about its own address space, v1 images get the defaults
+// entry - pc the program starts at
+// code_end - everything from here on is data
+// data_start - where the data section, and so batch data overrides, begin
+// leaders - jump target table, nullptr if the decoder has to find block leaders itself
+// decoded - pre-decoded handler stream of the code region, nullptr if the image has none
+struct ImageLayout {
+    uint8_t entry{0};
+    uint8_t code_end{data_section_start};
+    uint8_t data_start{data_section_start};
+    const uint8_t *leaders{nullptr};
+    const uint8_t *decoded{nullptr};
+};
+
+// same for wide images, whose addresses don't fit into a byte
+struct WideLayout {
+    uint32_t entry{0};
+    uint32_t code_end{0};
+    uint32_t data_start{0};
+};
+
+// Read-only view of a metasm binary. The file is mapped instead of being read, the
+// preamble and header are checked in place, and words are only copied once, straight
+// into the memory bank of whichever vm runs the image. Mapping is private and never
+// written to, so any number of vms may share a single image. v1, v2 and v3 images are
+// accepted, a v3 one is a wide program and only has a wide layout.
+class MappedImage final {
+public:
+    MappedImage() = default;
+
+    ~MappedImage() { close(); }
+
+    MappedImage(const MappedImage &) = delete;
+
+    MappedImage &operator=(const MappedImage &) = delete;
+
+    MappedImage(MappedImage &&other) noexcept;
+
+    MappedImage &operator=(MappedImage &&other) noexcept;
+
+    // maps path and validates it, reports the reason on stderr and returns false if it is not an image
+    bool open(const char *path);
+
+    // same for an image that is already in memory, the bytes are copied
+    bool load(const void *bytes, size_t size);
+
+    void close();
+
+    [[nodiscard]] inline bool ready() const noexcept { return mapping_ != nullptr; }
+
+    [[nodiscard]] inline uint8_t version() const noexcept { return version_; }
+
+    // pointers of the layout stay valid for as long as the image is mapped
+    [[nodiscard]] inline const ImageLayout &layout() const noexcept { return layout_; }
+
+    [[nodiscard]] inline bool wide() const noexcept { return version_ == 3; }
+
+    [[nodiscard]] inline const WideLayout &wideLayout() const noexcept { return wide_layout_; }
+
+    // number of words of the address space the image fills in
+    [[nodiscard]] size_t words() const noexcept;
+
+    // fills bank with the image, anything it does not cover is zeroed. Returns the number of words copied
+    size_t copyInto(uint16_t *bank, size_t capacity) const;
+
+private:
+    // checks the preamble and whichever header follows it
+    bool parse();
+
+    bool parseHeader();
+
+    bool parseWideHeader();
+
+    // words may sit at odd file offsets, so they are never accessed through a uint16_t pointer
+    static inline void copyWords(uint16_t *bank, const unsigned char *words, const size_t count) {
+        if (count) {
+            memcpy(bank, words, count * sizeof(uint16_t));
+        }
+    }
+
+private:
+    const unsigned char *mapping_{nullptr};
+    size_t size_{0};
+    uint8_t version_{0};
+    ImageHeader header_{};
+    ImageLayout layout_{};
+    WideImageHeader wide_header_{};
+    WideLayout wide_layout_{};
+};
+
+// sections of a single-bank image rewritten in the v2 format, along with its jump target table and
+// a decoded, fused program, so that the vm can skip both passes whenever it loads them
+void predecodeImage(const MappedImage &image, ImageSections &sections);
@@ -0,0 +1,391 @@
+#include "lockstep.h"
+
+#include <algorithm>
+
+// Lane loops below are written to be auto-vectorized. On x86-64 the group loop is
+// additionally cloned for AVX2 and picked at load time, AArch64 gets NEON as a baseline.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && defined(__linux__)
+#define LOCKSTEP_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define LOCKSTEP_TARGETS
+#endif
+
+#define FOR_LANES(lane) for (uint32_t lane = 0; lane < Lanes; ++lane)
+
+// SET_FLAGS for every lane at once
+#define SET_LANE_FLAGS(result) \
+    FOR_LANES(l) { group.flag_result[l] = result[l]; }
+
+namespace {
+
+    // where every lane starts, the data of a lane is written over it
+    struct LockstepProgram {
+        const std::vector<uint16_t> &image;
+        const std::vector<std::vector<uint16_t>> &data_sets;
+        const ImageLayout &layout;
+        DispatchMode scalar_mode;
+        uint64_t max_steps;
+        // where the final state of every lane goes, if anywhere
+        std::vector<VmState> *states;
+    };
+
+    template<uint32_t Lanes>
+    struct GroupContext {
+        BasicLockstepGroup<Lanes> &group;
+        ReturnStack stack;
+        uint8_t pc{0};
+        uint8_t code_end{data_section_start};
+        uint8_t data_start{data_section_start};
+        DispatchMode scalar_mode;
+        // steps every lane executed in lockstep, and what they get in all
+        uint64_t steps{0};
+        uint64_t max_steps{0};
+        OutputSink *sinks[Lanes];
+        BatchResult *results[Lanes];
+        VmState *states[Lanes];
+    };
+
+    // runs a program off state on the scalar engine, for whatever is left of the budget
+    void runScalar(const VmState &state, const std::vector<uint16_t> &data, const DispatchMode mode,
+                   const uint64_t max_steps, OutputSink &sink, BatchResult &result, VmState *final_state) {
+        Interpreter interp(state, data, &sink);
+        result.status = batchStatusOf(interp.run(max_steps, mode));
+        if (final_state) {
+            *final_state = interp.state();
+        }
+    }
+
+    template<uint32_t Lanes>
+    VmState laneState(const GroupContext<Lanes> &context, const uint32_t lane) {
+        const auto &group = context.group;
+        VmState state;
+        state.acc = group.acc[lane];
+        state.flags = flags_of(group.flag_result[lane]);
+        state.pc = context.pc;
+        state.stack = context.stack;
+        state.code_end = context.code_end;
+        state.data_start = context.data_start;
+        state.memory.resize(decoded_program_size);
+        for (uint32_t addr = 0; addr < decoded_program_size; ++addr) {
+            state.memory[addr] = group.memory[addr][lane];
+        }
+        return state;
+    }
+
+    // hands a lane over to the scalar engine, it resumes at the current pc
+    template<uint32_t Lanes>
+    void splitLane(GroupContext<Lanes> &context, const uint32_t lane) {
+        const auto state = laneState(context, lane);
+        context.group.active[lane] = false;
+        runScalar(state, {}, context.scalar_mode, context.max_steps - context.steps, *context.sinks[lane],
+                  *context.results[lane], context.states[lane]);
+    }
+
+    template<uint32_t Lanes>
+    void splitAll(GroupContext<Lanes> &context) {
+        for (uint32_t lane = 0; lane < Lanes; ++lane) {
+            if (context.group.active[lane]) {
+                splitLane(context, lane);
+            }
+        }
+    }
+
+    template<uint32_t Lanes>
+    LOCKSTEP_TARGETS
+    void runGroup(GroupContext<Lanes> &context) {
+        auto &group = context.group;
+        auto &pc = context.pc;
+
+        uint32_t lead = 0;
+        while (lead < Lanes && !group.active[lead]) {
+            lead++;
+        }
+
+        alignas(32) int8_t scratch[Lanes];
+        alignas(32) uint8_t taken[Lanes];
+        for (;;) {
+            if (lead == Lanes) {
+                return;
+            }
+
+            // lanes may disagree on anything past the code region
+            if (pc >= context.code_end) {
+                splitAll(context);
+                return;
+            }
+
+            // the scalar engine tells whether a lane halts, faults or runs out on the step it is at
+            if (context.steps == context.max_steps) {
+                splitAll(context);
+                return;
+            }
+
+            const auto word = group.memory[pc][lead];
+            const auto opcode = word & instruction_mask;
+            const auto operand = static_cast<uint8_t>(word & value_mask);
+            bool branch = false;
+            switch (opcode) {
+                case ADDI:
+                    FOR_LANES(l) { group.acc[l] = static_cast<int8_t>(group.acc[l] + operand); }
+                    SET_LANE_FLAGS(group.acc)
+                    break;
+                case SUBI:
+                    FOR_LANES(l) { group.acc[l] = static_cast<int8_t>(group.acc[l] - operand); }
+                    SET_LANE_FLAGS(group.acc)
+                    break;
+                case ADD:
+                    FOR_LANES(l) { group.acc[l] = static_cast<int8_t>(group.acc[l] + group.memory[operand][l]); }
+                    SET_LANE_FLAGS(group.acc)
+                    break;
+                case SUB:
+                    FOR_LANES(l) { group.acc[l] = static_cast<int8_t>(group.acc[l] - group.memory[operand][l]); }
+                    SET_LANE_FLAGS(group.acc)
+                    break;
+                case CMPI:
+                    FOR_LANES(l) { scratch[l] = static_cast<int8_t>(group.acc[l] - operand); }
+                    SET_LANE_FLAGS(scratch)
+                    break;
+                case CMP:
+                    FOR_LANES(l) { scratch[l] = static_cast<int8_t>(group.acc[l] - group.memory[operand][l]); }
+                    SET_LANE_FLAGS(scratch)
+                    break;
+                case CLAC:
+                    FOR_LANES(l) {
+                        group.acc[l] = 0;
+                        group.flag_result[l] = 0;
+                    }
+                    break;
+                case STR:
+                case ADDMEM:
+                case SUBMEM:
+                    // code has to stay identical across lanes
+                    if (operand < context.code_end) {
+                        splitAll(context);
+                        return;
+                    }
+                    if (opcode == STR) {
+                        FOR_LANES(l) { group.memory[operand][l] = static_cast<uint16_t>(group.acc[l]); }
+                    } else if (opcode == ADDMEM) {
+                        FOR_LANES(l) { group.memory[operand][l] += 1; }
+                    } else {
+                        FOR_LANES(l) { group.memory[operand][l] -= 1; }
+                    }
+                    break;
+                case OUTB:
+                    FOR_LANES(l) {
+                        if (group.active[l]) {
+                            context.sinks[l]->put(static_cast<char>(group.acc[l]));
+                        }
+                    }
+                    break;
+                case OUTD:
+                    FOR_LANES(l) {
+                        if (group.active[l]) {
+                            context.sinks[l]->putDecimal(group.acc[l]);
+                        }
+                    }
+                    break;
+                case BNZ:
+                    FOR_LANES(l) { taken[l] = group.flag_result[l] != 0; }
+                    branch = true;
+                    break;
+                case BZ:
+                    FOR_LANES(l) { taken[l] = group.flag_result[l] == 0; }
+                    branch = true;
+                    break;
+                case BIG:
+                    FOR_LANES(l) { taken[l] = group.flag_result[l] > 0; }
+                    branch = true;
+                    break;
+                case BIL:
+                    FOR_LANES(l) { taken[l] = group.flag_result[l] < 0; }
+                    branch = true;
+                    break;
+                case UCB:
+                    FOR_LANES(l) { taken[l] = 1; }
+                    branch = true;
+                    break;
+                case RET:
+                    if (context.stack.empty()) {
+                        splitAll(context);
+                        return;
+                    }
+                    pc = context.stack.pop();
+                    break;
+                case LEAVE:
+                    for (uint32_t lane = 0; lane < Lanes; ++lane) {
+                        if (group.active[lane] && context.states[lane]) {
+                            *context.states[lane] = laneState(context, lane);
+                        }
+                    }
+                    return;
+                default:
+                    // let the scalar engine deal with unknown instructions
+                    splitAll(context);
+                    return;
+            }
+
+            if (branch) {
+                uint32_t active = 0, taken_count = 0;
+                FOR_LANES(l) {
+                    active += group.active[l];
+                    taken_count += group.active[l] & taken[l];
+                }
+
+                // diverged, the smaller side goes scalar and re-executes the branch there
+                if (taken_count != 0 && taken_count != active) {
+                    const uint8_t leaving = taken_count * 2 < active ? 1 : 0;
+                    FOR_LANES(l) {
+                        if (group.active[l] && taken[l] == leaving) {
+                            splitLane(context, l);
+                        }
+                    }
+                    lead = 0;
+                    while (!group.active[lead]) {
+                        lead++;
+                    }
+                    taken_count = 1 - leaving;
+                }
+
+                if (taken_count) {
+                    context.stack.push(pc);
+                    pc = operand - 1;
+                }
+            }
+
+            pc++;
+            context.steps++;
+        }
+    }
+
+
+    // runs data sets [first, first + count) in a group of Lanes lanes
+    template<uint32_t Lanes>
+    void runLanes(const LockstepProgram &program, const size_t first, const size_t count,
+                  std::vector<BatchResult> &results) {
+        // every slot is written below, the group is left uninitialized
+        std::unique_ptr<BasicLockstepGroup<Lanes>> group(new BasicLockstepGroup<Lanes>);
+        const auto &layout = program.layout;
+        GroupContext<Lanes> context{*group, {}, layout.entry, layout.code_end, layout.data_start,
+                                    program.scalar_mode, 0, program.max_steps, {}, {}, {}};
+
+        // lanes start off the same bank, one row at a time
+        for (uint32_t addr = 0; addr < decoded_program_size; ++addr) {
+            const uint16_t word = addr < program.image.size() ? program.image[addr] : 0;
+            for (uint32_t lane = 0; lane < Lanes; ++lane) {
+                group->memory[addr][lane] = word;
+            }
+        }
+
+        std::vector<std::unique_ptr<StringSink>> sinks;
+        sinks.reserve(count);
+        for (uint32_t lane = 0; lane < Lanes; ++lane) {
+            const auto job = first + lane;
+            group->acc[lane] = 0;
+            group->flag_result[lane] = flag_result_of(0);
+            group->active[lane] = lane < count && results[job].status == BatchStatus::HALTED;
+            context.sinks[lane] = nullptr;
+            context.results[lane] = nullptr;
+            context.states[lane] = nullptr;
+            if (group->active[lane]) {
+                sinks.emplace_back(std::make_unique<StringSink>(results[job].output));
+                context.sinks[lane] = sinks.back().get();
+                context.results[lane] = &results[job];
+                context.states[lane] = program.states ? &(*program.states)[job] : nullptr;
+
+                const auto &data = program.data_sets[job];
+                for (size_t i = 0; i < data.size(); ++i) {
+                    group->memory[layout.data_start + i][lane] = data[i];
+                }
+            }
+        }
+
+        runGroup(context);
+    }
+
+    // a group as narrow as count allows, or none at all below lockstep_min_lanes
+    void runChunk(const LockstepProgram &program, const VmState &start, const size_t first, const size_t count,
+                  std::vector<BatchResult> &results) {
+        if (count < lockstep_min_lanes) {
+            for (size_t job = first; job < first + count; ++job) {
+                if (results[job].status == BatchStatus::HALTED) {
+                    StringSink sink(results[job].output);
+                    runScalar(start, program.data_sets[job], program.scalar_mode, program.max_steps, sink,
+                              results[job], program.states ? &(*program.states)[job] : nullptr);
+                }
+            }
+        } else if (count <= 8) {
+            runLanes<8>(program, first, count, results);
+        } else if (count <= 16) {
+            runLanes<16>(program, first, count, results);
+        } else {
+            runLanes<lockstep_lanes>(program, first, count, results);
+        }
+    }
+
+    // where runs that skip lockstep start from
+    VmState startState(const LockstepProgram &program) {
+        VmState state;
+        state.memory.assign(program.image.begin(),
+                            program.image.begin() + std::min<size_t>(program.image.size(), memory_bank_capacity));
+        state.memory.resize(memory_bank_capacity);
+        state.pc = program.layout.entry;
+        state.code_end = program.layout.code_end;
+        state.data_start = program.layout.data_start;
+        return state;
+    }
+
+    // a result for every data set, those that don't fit are done with already
+    std::vector<BatchResult> prepareResults(const LockstepProgram &program) {
+        const auto &data_sets = program.data_sets;
+        std::vector<BatchResult> results(data_sets.size());
+        for (size_t i = 0; i < data_sets.size(); ++i) {
+            if (program.layout.data_start + data_sets[i].size() > memory_bank_capacity) {
+                results[i].status = BatchStatus::BAD_DATA;
+            }
+        }
+        if (program.states) {
+            program.states->assign(data_sets.size(), VmState{});
+        }
+        return results;
+    }
+
+}
+
+std::vector<BatchResult> runLockstep(const std::vector<uint16_t> &image,
+                                     const std::vector<std::vector<uint16_t>> &data_sets,
+                                     const DispatchMode scalar_mode, WorkStealingPool &pool,
+                                     const ImageLayout &layout, const uint64_t max_steps,
+                                     std::vector<VmState> *states) {
+    const LockstepProgram program{image, data_sets, layout, scalar_mode, max_steps, states};
+    const auto start = startState(program);
+    auto results = prepareResults(program);
+    for (size_t first = 0; first < data_sets.size(); first += lockstep_lanes) {
+        pool.submit([&, first] {
+            runChunk(program, start, first, std::min<size_t>(lockstep_lanes, data_sets.size() - first), results);
+        });
+    }
+    pool.wait();
+
+    return results;
+}
+
+std::vector<BatchResult> runLockstep(const std::vector<uint16_t> &image,
+                                     const std::vector<std::vector<uint16_t>> &data_sets,
+                                     const DispatchMode scalar_mode, const uint32_t threads,
+                                     const ImageLayout &layout, const uint64_t max_steps,
+                                     std::vector<VmState> *states) {
+    if (threads > 1 && data_sets.size() > lockstep_lanes) {
+        WorkStealingPool pool(threads);
+        return runLockstep(image, data_sets, scalar_mode, pool, layout, max_steps, states);
+    }
+
+    // threads would only be started to wait for this one
+    const LockstepProgram program{image, data_sets, layout, scalar_mode, max_steps, states};
+    const auto start = startState(program);
+    auto results = prepareResults(program);
+    for (size_t first = 0; first < data_sets.size(); first += lockstep_lanes) {
+        runChunk(program, start, first, std::min<size_t>(lockstep_lanes, data_sets.size() - first), results);
+    }
+    return results;
+}
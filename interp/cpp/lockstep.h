@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "vm.h"
+#include "batch.h"
+
+// widest group, one byte of acc per lane fills a 256-bit register
+constexpr uint32_t lockstep_lanes = 32;
+// fewer data sets than that are not worth a group, they run on the scalar engine one after the other
+constexpr uint32_t lockstep_min_lanes = 4;
+
+// Structure-of-arrays state of a group of vms running the same program. Every
+// lane shares pc and the return stack, everything else is kept per lane.
+template<uint32_t Lanes>
+struct BasicLockstepGroup {
+    alignas(32) int8_t acc[Lanes];
+    alignas(32) int8_t flag_result[Lanes];
+    alignas(32) uint16_t memory[decoded_program_size][Lanes];
+    // lane is still executing in lockstep
+    bool active[Lanes];
+};
+
+using LockstepGroup = BasicLockstepGroup<lockstep_lanes>;
+
+// Runs image once per data set for at most max_steps instructions each, packing up to
+// lockstep_lanes instances into a group that executes in lockstep, no wider than its data sets
+// need. When a branch splits a group, the smaller side leaves it and runs on the scalar engine
+// given by scalar_mode, the same happens to the whole group on stores into the code region, on
+// faults and once the budget runs out. Groups are spread over pool. layout tells where the program
+// starts and where its code ends, v1 images go with the defaults. With states, the state every lane
+// ended in goes there too, in the order of data_sets
+std::vector<BatchResult> runLockstep(const std::vector<uint16_t> &image,
+                                     const std::vector<std::vector<uint16_t>> &data_sets,
+                                     DispatchMode scalar_mode, WorkStealingPool &pool,
+                                     const ImageLayout &layout = ImageLayout{},
+                                     uint64_t max_steps = batch_step_limit, std::vector<VmState> *states = nullptr);
+
+// same on a pool of its own with the given number of threads, or on the calling thread if there is
+// just one of them or a single group to run
+std::vector<BatchResult> runLockstep(const std::vector<uint16_t> &image,
+                                     const std::vector<std::vector<uint16_t>> &data_sets,
+                                     DispatchMode scalar_mode, uint32_t threads,
+                                     const ImageLayout &layout = ImageLayout{},
+                                     uint64_t max_steps = batch_step_limit, std::vector<VmState> *states = nullptr);
@@ -1,7 +1,114 @@
 #define _CRT_SECURE_NO_WARNINGS 1
 
+#include <csignal>
+#include <fstream>
+#include <sstream>
+
 #include "vm.h"
+#include "batch.h"
+#include "lockstep.h"
+#include "wide.h"
+#include "specialize.h"
+#include "cache.h"
+#include "server.h"
+#include "tools.h"
+#include "../../common/metrics.h"
+
+
+// every line of a data file is one set of data section overrides
+static bool readDataFile(const char *path, std::vector<std::vector<uint16_t>> &data_sets) {
+	std::ifstream stream(path);
+	if (!stream) {
+		fputs(errors[FAILED_TO_INIT_STREAM], stderr);
+		return false;
+	}
 
+	std::string line;
+	while (std::getline(stream, line)) {
+		std::istringstream words(line);
+		std::vector<uint16_t> data;
+		int32_t word;
+		while (words >> word) {
+			data.push_back(static_cast<uint16_t>(word));
+		}
+		if (!data.empty()) {
+			data_sets.emplace_back(std::move(data));
+		}
+	}
+
+	return true;
+}
+
+// rewrites an image so that the vm can skip decoding it the next time it loads it
+static bool writePredecodedImage(const MappedImage &image, const char *path) {
+	if (image.wide()) {
+		fputs("wide images are never decoded ahead of time\n", stderr);
+		return false;
+	}
+
+	ImageSections sections;
+	predecodeImage(image, sections);
+	return tools::cStyleWriteToFile(path, sections);
+}
+
+// prints the steps of a trace, or only the one numbered step. With an image the run is repeated up
+// to that step, the memory bank and the return stack it left are printed too, and checked against
+// the trace
+static bool replayTrace(const char *path, const char *image_path, const bool single, const uint64_t step) {
+	if (!single) {
+		return readTrace(path, [](const TraceStep &traced) {
+			writeTraceStep(stdout, traced);
+			return true;
+		});
+	}
+
+	TraceStep found{};
+	bool seen = false;
+	if (!readTrace(path, [&](const TraceStep &traced) {
+		found = traced;
+		seen = traced.step == step;
+		return false;
+	}, step)) {
+		return false;
+	}
+	if (!seen) {
+		fprintf(stderr, "[[error]] step %llu is not in the trace\n", static_cast<unsigned long long>(step));
+		return false;
+	}
+	writeTraceStep(stdout, found);
+	if (!image_path) {
+		return true;
+	}
+
+	MappedImage image;
+	if (!image.open(image_path)) {
+		return false;
+	}
+	std::string output;
+	VmState state;
+	{
+		StringSink sink(output);
+		state = Interpreter::capture(image, {}, step + 1, &sink);
+	}
+	printf("output %zu bytes, return stack depth %u\n", output.size(), state.stack.size());
+	for (uint32_t addr = state.code_end; addr < state.memory.size(); ++addr) {
+		if (state.memory[addr]) {
+			printf("0x%02x %u\n", addr, state.memory[addr]);
+		}
+	}
+	if (state.acc != found.acc || state.flags != found.flags) {
+		fputs("[[error]] the image does not run the way the trace says\n", stderr);
+		return false;
+	}
+	return true;
+}
+
+static MetricsFormat metrics_format = MetricsFormat::TEXT;
+
+// counters of everything that ran, whichever way main() ends
+static void printMetrics() {
+	fputs(formatMetrics(metricSamples(), metrics_format).c_str(), stderr);
+}
 
 int main(int argc, const char* argv[]) {
 	if (argc < 2) {
@@ -9,9 +116,295 @@ int main(int argc, const char* argv[]) {
 		exit(-1);
 	}
 
-	// compiler will implicitly convert const char* to std::string
-	Interpreter interp(argv[1]);
+	auto mode = DispatchMode::SWITCH;
+	bool batch = false;
+	bool lockstep = false;
+	uint32_t threads = 0;
+	const char *data_file = nullptr;
+	const char *output_file = nullptr;
+	const char *predecode_file = nullptr;
+	const char *specialize_file = nullptr;
+	uint32_t inputs = 0;
+	bool profile = false;
+	const char *folded_file = nullptr;
+	bool cycles = false;
+	double clock_hz = 0;
+	uint64_t prefix_steps = 0;
+	bool cache = false;
+	bool serve = false;
+	const char *trace_file = nullptr;
+	const char *replay_file = nullptr;
+	bool single_step = false;
+	uint64_t replay_step = 0;
+	const char *socket_path = nullptr;
+	const char *store_file = nullptr;
+	bool metrics = false;
+	std::vector<const char *> paths;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--dispatch=threaded")) {
+			mode = DispatchMode::THREADED;
+		} else if (!strcmp(argv[i], "--dispatch=fused")) {
+			mode = DispatchMode::FUSED;
+		} else if (!strcmp(argv[i], "--dispatch=jit")) {
+			mode = DispatchMode::JIT;
+		} else if (!strcmp(argv[i], "--dispatch=switch")) {
+			mode = DispatchMode::SWITCH;
+		} else if (!strcmp(argv[i], "--batch")) {
+			batch = true;
+		} else if (!strcmp(argv[i], "--lockstep")) {
+			lockstep = true;
+		} else if (!strncmp(argv[i], "--threads=", 10)) {
+			threads = static_cast<uint32_t>(atoi(argv[i] + 10));
+		} else if (!strncmp(argv[i], "--output=", 9)) {
+			output_file = argv[i] + 9;
+		} else if (!strcmp(argv[i], "--profile")) {
+			profile = true;
+		} else if (!strncmp(argv[i], "--profile-folded=", 17)) {
+			folded_file = argv[i] + 17;
+		} else if (!strcmp(argv[i], "--cycles")) {
+			cycles = true;
+		} else if (!strncmp(argv[i], "--cycles=", 9)) {
+			cycles = true;
+			clock_hz = strtod(argv[i] + 9, nullptr);
+		} else if (!strncmp(argv[i], "--predecode=", 12)) {
+			predecode_file = argv[i] + 12;
+		} else if (!strncmp(argv[i], "--specialize=", 13)) {
+			specialize_file = argv[i] + 13;
+		} else if (!strncmp(argv[i], "--inputs=", 9)) {
+			inputs = static_cast<uint32_t>(atoi(argv[i] + 9));
+		} else if (!strncmp(argv[i], "--data=", 7)) {
+			data_file = argv[i] + 7;
+		} else if (!strncmp(argv[i], "--trace=", 8)) {
+			trace_file = argv[i] + 8;
+		} else if (!strncmp(argv[i], "--replay=", 9)) {
+			replay_file = argv[i] + 9;
+		} else if (!strncmp(argv[i], "--step=", 7)) {
+			single_step = true;
+			replay_step = strtoull(argv[i] + 7, nullptr, 10);
+		} else if (!strcmp(argv[i], "--serve")) {
+			serve = true;
+		} else if (!strncmp(argv[i], "--serve=", 8)) {
+			serve = true;
+			socket_path = argv[i] + 8;
+		} else if (!strcmp(argv[i], "--cache")) {
+			cache = true;
+		} else if (!strncmp(argv[i], "--cache=", 8)) {
+			cache = true;
+			store_file = argv[i] + 8;
+		} else if (!strncmp(argv[i], "--prefix=", 9)) {
+			prefix_steps = strtoull(argv[i] + 9, nullptr, 10);
+		} else if (!strncmp(argv[i], "--metrics=", 10)) {
+			if (!parseMetricsFormat(argv[i] + 10, metrics_format)) {
+				fprintf(stderr, "unknown metrics format %s\n", argv[i] + 10);
+				exit(-1);
+			}
+			metrics = true;
+		} else if (!strncmp(argv[i], "--", 2)) {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			exit(-1);
+		} else {
+			paths.push_back(argv[i]);
+		}
+	}
+
+	// runs already seen come back out of the cache, the store shares them with other processes
+	std::unique_ptr<RunCache> run_cache;
+	if (cache) {
+		run_cache = std::make_unique<RunCache>();
+		if (store_file && !run_cache->attachStore(store_file)) {
+			exit(-1);
+		}
+	}
+
+	if (replay_file) {
+		return replayTrace(replay_file, paths.empty() ? nullptr : paths.front(), single_step, replay_step) ? 0 : 1;
+	}
+
+	if (serve) {
+		// programs come over the socket, or over stdin with the answers on stdout
+		signal(SIGPIPE, SIG_IGN);
+		VmServer server(mode, threads, run_cache.get());
+		if (socket_path) {
+			server.listen(socket_path);
+			exit(-1);
+		}
+		server.serve(fileno(stdin), fileno(stdout));
+		fputs(server.metrics(metrics_format).c_str(), stderr);
+		return 0;
+	}
+
+	if (metrics) {
+		std::atexit(printMetrics);
+	}
+
+	if (paths.empty()) {
+		fputs("nothing to interpret", stderr);
+		exit(-1);
+	}
+
+	if (predecode_file) {
+		MappedImage image;
+		if (!image.open(paths.front()) || !writePredecodedImage(image, predecode_file)) {
+			exit(-1);
+		}
+		return 0;
+	}
+
+	if (specialize_file) {
+		MappedImage image;
+		ImageSections residual;
+		Specialization specialization;
+		if (!image.open(paths.front()) || !specializeImage(image, inputs, residual, specialization) ||
+			!tools::cStyleWriteToFile(specialize_file, residual)) {
+			exit(-1);
+		}
+		fprintf(stderr, "folded %llu instructions into %zu words of code%s\n",
+				static_cast<unsigned long long>(specialization.folded_steps), residual.code.size(),
+				specialization.complete ? ", the program only prints" : "");
+		return 0;
+	}
+
+	if (!batch) {
+		std::unique_ptr<MappedFileSink> sink;
+		if (output_file) {
+			sink = std::make_unique<MappedFileSink>(output_file);
+			if (!sink->ready()) {
+				exit(-1);
+			}
+		}
+
+		MappedImage image;
+		if (!image.open(paths.front())) {
+			exit(-1);
+		}
+
+		if (image.wide()) {
+			// wide programs have an engine of their own, a switch loop without instrumentation
+			if (profile || folded_file || cycles || trace_file) {
+				fputs("wide images can't be profiled or traced\n", stderr);
+			}
+			WideInterpreter interp(image, {}, sink.get());
+			return interp.resume() == RunStatus::HALTED ? 0 : 1;
+		}
+
+		Profile profiler;
+		CycleModel cycle_model;
+		const auto profiled = profile || folded_file;
+		if (run_cache && !profiled && !cycles && !trace_file) {
+			// the output of a cached run is only written once the run is over
+			std::unique_ptr<OutputSink> stdout_sink;
+			if (!sink) {
+				stdout_sink = std::make_unique<FdSink>(fileno(stdout));
+			}
+			auto &destination = sink ? static_cast<OutputSink &>(*sink) : *stdout_sink;
+			CachedRun run;
+			const auto status = run_cache->run(image, {}, mode, std::numeric_limits<uint64_t>::max(), run);
+			destination.append(run.output.data(), run.output.size());
+			destination.flush();
+			return status == RunStatus::HALTED ? 0 : 1;
+		}
+
+		// the trace goes out on a writer thread while the program runs
+		std::unique_ptr<TraceRecorder> trace;
+		if (trace_file) {
+			trace = std::make_unique<TraceRecorder>();
+			if (!trace->stream(trace_file)) {
+				exit(-1);
+			}
+		}
+		{
+			Interpreter interp(image, {}, mode, sink.get(), profiled ? &profiler : nullptr,
+							   cycles ? &cycle_model : nullptr, trace.get());
+		}
+		if (trace) {
+			trace->finish();
+			fprintf(stderr, "traced %llu instructions, %llu dropped\n",
+					static_cast<unsigned long long>(trace->steps()), static_cast<unsigned long long>(trace->dropped()));
+		}
+
+		if (cycles) {
+			cycle_model.write(stderr, clock_hz);
+		}
+
+		if (profile) {
+			// counts are printed against the image as loaded, not as the program left it
+			uint16_t memory[memory_bank_capacity];
+			image.copyInto(memory, memory_bank_capacity);
+			profiler.writeFlat(stderr, memory);
+		}
+		if (folded_file) {
+			FILE *stream = fopen(folded_file, "w");
+			if (!stream) {
+				fputs(errors[FAILED_TO_INIT_STREAM], stderr);
+				exit(-1);
+			}
+			profiler.writeFolded(stream);
+			fclose(stream);
+		}
+		return 0;
+	}
+
+	// batch mode: every image, or every image times every line of a data file
+	std::vector<std::vector<uint16_t>> data_sets;
+	if (data_file && !readDataFile(data_file, data_sets)) {
+		exit(-1);
+	}
+	if (data_sets.empty()) {
+		data_sets.emplace_back();
+	}
+
+	std::vector<BatchJob> jobs;
+	for (const auto path: paths) {
+		for (const auto &data: data_sets) {
+			jobs.push_back(BatchJob{path, data});
+		}
+	}
+
+	std::vector<BatchResult> results;
+	if (prefix_steps) {
+		// the shared prefix runs once, every data set forks off where it stopped
+		MappedImage mapped;
+		if (paths.size() != 1 || lockstep || !mapped.open(paths.front())) {
+			fputs("--prefix needs exactly one loadable image and no --lockstep\n", stderr);
+			exit(-1);
+		}
+		std::string prefix_output;
+		VmState state;
+		{
+			StringSink sink(prefix_output);
+			state = Interpreter::capture(mapped, {}, prefix_steps, &sink);
+		}
+		results = runBatch(state, data_sets, mode, threads);
+		for (auto &result: results) {
+			result.output.insert(0, prefix_output);
+		}
+	} else if (lockstep) {
+		// a single program over every data set, the dispatch mode picks the engine diverged lanes fall back to
+		MappedImage mapped;
+		if (paths.size() != 1 || !mapped.open(paths.front())) {
+			fputs("lockstep mode needs exactly one loadable image\n", stderr);
+			exit(-1);
+		}
+		std::vector<uint16_t> image(memory_bank_capacity);
+		mapped.copyInto(image.data(), image.size());
+		results = runLockstep(image, data_sets, mode, threads, mapped.layout());
+	} else {
+		results = runBatch(jobs, mode, threads, run_cache.get());
+	}
+	if (run_cache) {
+		fprintf(stderr, "cache: %llu hits, %llu misses\n", static_cast<unsigned long long>(run_cache->hits()),
+				static_cast<unsigned long long>(run_cache->misses()));
+	}
+	int exit_code = 0;
+	for (size_t i = 0; i < results.size(); ++i) {
+		fprintf(stdout, "== job %zu %s (%s)\n", i, jobs[i].path.c_str(), batchStatusName(results[i].status));
+		fwrite(results[i].output.data(), 1, results[i].output.size(), stdout);
+		fputc('\n', stdout);
+		if (results[i].status != BatchStatus::HALTED) {
+			exit_code = 1;
+		}
+	}
 
-	return 0;
+	return exit_code;
 
-}
\ No newline at end of file
+}
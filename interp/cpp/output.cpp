@@ -0,0 +1,147 @@
+#include "output.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../../common/errors.h"
+#include "../../common/metrics.h"
+
+OutputSink::OutputSink(const size_t capacity) : buffer_{new char[capacity ? capacity : 1]} {
+    cursor_ = buffer_.get();
+    end_ = cursor_ + (capacity ? capacity : 1);
+}
+
+void OutputSink::append(const char *data, size_t size) {
+    while (size) {
+        if (cursor_ == end_) {
+            flush();
+        }
+        const auto chunk = std::min(size, static_cast<size_t>(end_ - cursor_));
+        memcpy(cursor_, data, chunk);
+        cursor_ += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+void OutputSink::putDecimal(const int8_t value) {
+    char digits[4];
+    uint32_t magnitude = value < 0 ? -static_cast<int32_t>(value) : value;
+    size_t count = 0;
+    do {
+        digits[count++] = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+
+    if (value < 0) {
+        put('-');
+    }
+    while (count) {
+        put(digits[--count]);
+    }
+}
+
+void OutputSink::flush() {
+    const auto begin = buffer_.get();
+    if (cursor_ == begin) {
+        return;
+    }
+
+    if (!drain(begin, cursor_ - begin)) {
+        fputs("[[error]] failed to flush program output\n", stderr);
+    }
+    countMetric(Metric::OUTPUT_BYTES, cursor_ - begin);
+    cursor_ = begin;
+}
+
+bool writeAll(const int fd, const void *buffer, size_t size) {
+    auto cursor = static_cast<const char *>(buffer);
+    while (size) {
+        const auto count = ::write(fd, cursor, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        cursor += count;
+        size -= count;
+    }
+    return true;
+}
+
+bool FdSink::drain(const char *data, const size_t size) {
+    return writeAll(fd_, data, size);
+}
+
+bool StringSink::drain(const char *data, const size_t size) {
+    output_.append(data, size);
+    return true;
+}
+
+MappedFileSink::MappedFileSink(const char *path, const size_t capacity) : OutputSink(capacity) {
+    fd_ = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+        fputs(errors[FAILED_TO_INIT_STREAM], stderr);
+    }
+}
+
+MappedFileSink::~MappedFileSink() {
+    flush();
+    if (mapping_) {
+        munmap(mapping_, mapped_);
+    }
+    if (fd_ >= 0) {
+        // mapping is grown in large steps, cut the file down to what was actually written
+        if (ftruncate(fd_, static_cast<off_t>(written_))) {
+            fputs("[[error]] failed to truncate output file\n", stderr);
+        }
+        close(fd_);
+    }
+}
+
+bool MappedFileSink::reserve(const size_t size) {
+    if (written_ + size <= mapped_) {
+        return true;
+    }
+
+    auto capacity = mapped_ ? mapped_ : output_buffer_size;
+    while (written_ + size > capacity) {
+        capacity *= 2;
+    }
+
+    if (mapping_) {
+        munmap(mapping_, mapped_);
+        mapping_ = nullptr;
+        mapped_ = 0;
+    }
+
+    if (ftruncate(fd_, static_cast<off_t>(capacity))) {
+        return false;
+    }
+
+    void *mapping = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    mapping_ = static_cast<char *>(mapping);
+    mapped_ = capacity;
+    return true;
+}
+
+bool MappedFileSink::drain(const char *data, const size_t size) {
+    if (fd_ < 0 || !reserve(size)) {
+        return false;
+    }
+
+    memcpy(mapping_ + written_, data, size);
+    written_ += size;
+    return true;
+}
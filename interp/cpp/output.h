@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// default size of a sink buffer, small enough to stay in L2
+constexpr size_t output_buffer_size = 64 * 1024;
+
+// Preallocated buffer sitting between outb/outd and the actual destination. Bytes are
+// only handed over to the backend when the buffer fills up, or when flush() is called,
+// which the interpreter does once the program leaves.
+class OutputSink {
+public:
+    explicit OutputSink(size_t capacity = output_buffer_size);
+
+    virtual ~OutputSink() = default;
+
+    OutputSink(const OutputSink &) = delete;
+
+    OutputSink &operator=(const OutputSink &) = delete;
+
+    inline void put(const char c) {
+        if (cursor_ == end_) {
+            flush();
+        }
+        *cursor_++ = c;
+    }
+
+    void append(const char *data, size_t size);
+
+    // acc as a decimal integer, the way outd prints it
+    void putDecimal(int8_t value);
+
+    void flush();
+
+protected:
+    // receives the buffered bytes, returns false if they could not be written
+    virtual bool drain(const char *data, size_t size) = 0;
+
+private:
+    std::unique_ptr<char[]> buffer_;
+    char *cursor_;
+    char *end_;
+};
+
+// writes all of buffer to fd, retrying writes a signal interrupted. False on any other failure
+bool writeAll(int fd, const void *buffer, size_t size);
+
+// writes into a file descriptor, a single write(2) per flush
+class FdSink final : public OutputSink {
+public:
+    explicit FdSink(int fd, size_t capacity = output_buffer_size) : OutputSink(capacity), fd_{fd} {}
+
+    ~FdSink() override { flush(); }
+
+protected:
+    bool drain(const char *data, size_t size) override;
+
+private:
+    int fd_;
+};
+
+// collects output in memory, used wherever a caller wants the output of a run back
+class StringSink final : public OutputSink {
+public:
+    explicit StringSink(std::string &output, size_t capacity = 4096) : OutputSink(capacity), output_{output} {}
+
+    ~StringSink() override { flush(); }
+
+protected:
+    bool drain(const char *data, size_t size) override;
+
+private:
+    std::string &output_;
+};
+
+// writes into a memory mapped file, which is grown as needed and trimmed on destruction
+class MappedFileSink final : public OutputSink {
+public:
+    explicit MappedFileSink(const char *path, size_t capacity = output_buffer_size);
+
+    ~MappedFileSink() override;
+
+    [[nodiscard]] inline bool ready() const noexcept { return fd_ >= 0; }
+
+protected:
+    bool drain(const char *data, size_t size) override;
+
+private:
+    bool reserve(size_t size);
+
+private:
+    int fd_{-1};
+    char *mapping_{nullptr};
+    size_t mapped_{0};
+    size_t written_{0};
+};
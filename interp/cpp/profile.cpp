@@ -0,0 +1,126 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <string>
+
+namespace {
+
+    std::string mnemonic(const uint8_t opcode) {
+        const auto *entry = isaEntry(opcode);
+        return entry ? std::string(entry->mnemonic) : "???";
+    }
+
+    double percent(const uint64_t part, const uint64_t total) {
+        return total ? 100.0 * static_cast<double>(part) / static_cast<double>(total) : 0.0;
+    }
+
+}
+
+void Profile::begin(const uint8_t entry) {
+    std::fill(std::begin(opcodes_), std::end(opcodes_), 0);
+    std::fill(std::begin(hits_), std::end(hits_), 0);
+    std::fill(std::begin(taken_), std::end(taken_), 0);
+    std::fill(std::begin(not_taken_), std::end(not_taken_), 0);
+
+    frames_.assign(1, Frame{0, entry});
+    samples_.assign(1, 0);
+    children_.clear();
+    returns_.clear();
+    frame_ = 0;
+}
+
+void Profile::enter(const uint8_t target) {
+    returns_.push_back(frame_);
+
+    // back edge into a frame already on the chain
+    for (auto frame = frame_;; frame = frames_[frame].parent) {
+        if (frames_[frame].entry == target) {
+            frame_ = frame;
+            return;
+        }
+        if (frame == 0) {
+            break;
+        }
+    }
+
+    const auto key = static_cast<uint64_t>(frame_) << 8 | target;
+    const auto it = children_.find(key);
+    if (it != children_.end()) {
+        frame_ = it->second;
+        return;
+    }
+
+    const auto child = static_cast<uint32_t>(frames_.size());
+    frames_.push_back(Frame{frame_, target});
+    samples_.push_back(0);
+    children_.emplace(key, child);
+    frame_ = child;
+}
+
+uint64_t Profile::total() const noexcept {
+    uint64_t total = 0;
+    for (const auto count: opcodes_) {
+        total += count;
+    }
+    return total;
+}
+
+void Profile::writeFlat(FILE *stream, const uint16_t *memory) const {
+    const auto all = total();
+    fprintf(stream, "%llu instructions retired\n\n", static_cast<unsigned long long>(all));
+
+    std::vector<uint8_t> order;
+    for (uint32_t opcode = 0; opcode < 0x100; ++opcode) {
+        if (opcodes_[opcode]) {
+            order.push_back(static_cast<uint8_t>(opcode));
+        }
+    }
+    std::sort(order.begin(), order.end(), [this](const uint8_t a, const uint8_t b) {
+        return opcodes_[a] > opcodes_[b];
+    });
+
+    fprintf(stream, "%-8s %14s %8s\n", "opcode", "count", "%");
+    for (const auto opcode: order) {
+        fprintf(stream, "%-8s %14llu %8.2f\n", mnemonic(opcode).c_str(), static_cast<unsigned long long>(opcodes_[opcode]),
+                percent(opcodes_[opcode], all));
+    }
+
+    fprintf(stream, "\n%-6s %-14s %14s %8s %14s %14s\n", "pc", "instruction", "hits", "%", "taken", "not taken");
+    for (uint32_t pc = 0; pc < 0x100; ++pc) {
+        if (!hits_[pc]) {
+            continue;
+        }
+
+        const uint8_t opcode = memory[pc] >> 8;
+        const auto text = mnemonic(opcode) + " " + std::to_string(memory[pc] & value_mask);
+        fprintf(stream, "0x%02x   %-14s %14llu %8.2f", pc, text.c_str(), static_cast<unsigned long long>(hits_[pc]),
+                percent(hits_[pc], all));
+        if (isConditionalBranch(opcode)) {
+            fprintf(stream, " %14llu %14llu", static_cast<unsigned long long>(taken_[pc]),
+                    static_cast<unsigned long long>(not_taken_[pc]));
+        }
+        fputc('\n', stream);
+    }
+}
+
+void Profile::writeFolded(FILE *stream) const {
+    std::vector<uint8_t> chain;
+    for (uint32_t frame = 0; frame < frames_.size(); ++frame) {
+        if (!samples_[frame]) {
+            continue;
+        }
+
+        chain.clear();
+        for (auto current = frame;; current = frames_[current].parent) {
+            chain.push_back(frames_[current].entry);
+            if (current == 0) {
+                break;
+            }
+        }
+
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            fprintf(stream, it == chain.rbegin() ? "0x%02x" : ";0x%02x", *it);
+        }
+        fprintf(stream, " %llu\n", static_cast<unsigned long long>(samples_[frame]));
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+
+#include "instructions.h"
+
+// Execution profile of a single run, filled by the profiled dispatch loop.
+// Counts are kept per opcode, per pc, and for branches per outcome. Every executed
+// instruction is also charged to the chain of frames it ran in, a frame being the
+// target of a branch that pushed onto the return stack. A branch to a frame that is
+// already part of the chain goes back to it instead of nesting (the usual recursion
+// collapsing of folded stacks), so loops show up once and not once per iteration.
+class Profile final {
+public:
+    // resets everything, entry names the root frame
+    void begin(uint8_t entry);
+
+    // accounts an instruction at pc, given the stack depth before and after it ran
+    inline void retire(const uint8_t pc, const uint16_t word, const size_t depth_before, const size_t depth_after) {
+        const uint8_t opcode = word >> 8;
+        opcodes_[opcode]++;
+        hits_[pc]++;
+        samples_[frame_]++;
+        if (depth_after > depth_before) {
+            taken_[pc]++;
+            enter(static_cast<uint8_t>(word & value_mask));
+        } else if (depth_after < depth_before) {
+            leave();
+        } else if (isConditionalBranch(opcode)) {
+            not_taken_[pc]++;
+        }
+    }
+
+    [[nodiscard]] uint64_t total() const noexcept;
+
+    [[nodiscard]] inline uint64_t opcodeCount(const uint16_t opcode) const noexcept { return opcodes_[opcode >> 8]; }
+
+    [[nodiscard]] inline uint64_t hits(const uint8_t pc) const noexcept { return hits_[pc]; }
+
+    [[nodiscard]] inline uint64_t taken(const uint8_t pc) const noexcept { return taken_[pc]; }
+
+    [[nodiscard]] inline uint64_t notTaken(const uint8_t pc) const noexcept { return not_taken_[pc]; }
+
+    // opcode table followed by every pc that was hit, memory is used to print what lives there
+    void writeFlat(FILE *stream, const uint16_t *memory) const;
+
+    // one line per frame chain, "0x00;0x05;0x0c count", ready for flamegraph.pl
+    void writeFolded(FILE *stream) const;
+
+private:
+    static constexpr bool isConditionalBranch(const uint8_t opcode) {
+        return hasKind(opcode, kind_conditional);
+    }
+
+    void enter(uint8_t target);
+
+    inline void leave() {
+        if (!returns_.empty()) {
+            frame_ = returns_.back();
+            returns_.pop_back();
+        }
+    }
+
+private:
+    struct Frame {
+        uint32_t parent;
+        uint8_t entry;
+    };
+
+    uint64_t opcodes_[0x100]{};
+    uint64_t hits_[0x100]{};
+    uint64_t taken_[0x100]{};
+    uint64_t not_taken_[0x100]{};
+
+    std::vector<Frame> frames_;
+    std::vector<uint64_t> samples_;
+    // child frame of a parent, keyed by parent << 8 | entry
+    std::unordered_map<uint64_t, uint32_t> children_;
+    // frame to come back to on every ret, mirrors the return stack of the vm
+    std::vector<uint32_t> returns_;
+    uint32_t frame_{0};
+};
@@ -0,0 +1,383 @@
+#include "server.h"
+#include "wide.h"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+    bool readAll(const int fd, void *buffer, size_t size) {
+        auto cursor = static_cast<char *>(buffer);
+        while (size) {
+            const auto count = read(fd, cursor, size);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                return false;
+            }
+            cursor += count;
+            size -= count;
+        }
+        return true;
+    }
+
+    ServerStatus serverStatusOf(const RunStatus status) {
+        switch (status) {
+            case RunStatus::HALTED:
+                return ServerStatus::HALTED;
+            case RunStatus::BUDGET_EXHAUSTED:
+                return ServerStatus::BUDGET_EXHAUSTED;
+            case RunStatus::FAULT:
+                break;
+        }
+        return ServerStatus::FAULT;
+    }
+
+    // the bucket a value falls into, values below sub_buckets have one each
+    uint32_t bucketOf(const uint64_t value, const uint32_t sub_buckets) {
+        if (value < sub_buckets) {
+            return static_cast<uint32_t>(value);
+        }
+        const auto exponent = 63u - static_cast<uint32_t>(__builtin_clzll(value));
+        const auto sub = static_cast<uint32_t>(value >> (exponent - 3)) & (sub_buckets - 1);
+        return (exponent - 2) * sub_buckets + sub;
+    }
+
+    uint64_t bucketEnd(const uint32_t bucket, const uint32_t sub_buckets) {
+        if (bucket < sub_buckets) {
+            return bucket;
+        }
+        const auto exponent = bucket / sub_buckets + 2;
+        const auto start = static_cast<uint64_t>(sub_buckets + bucket % sub_buckets) << (exponent - 3);
+        return start + (1ull << (exponent - 3)) - 1;
+    }
+
+}
+
+uint64_t imageHash(const void *bytes, const size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    const auto data = static_cast<const uint8_t *>(bytes);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+void LatencyHistogram::record(const uint64_t ns) noexcept {
+    buckets_[bucketOf(ns, sub_buckets)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    auto max = max_.load(std::memory_order_relaxed);
+    while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+}
+
+uint64_t LatencyHistogram::percentile(const double q) const noexcept {
+    const auto count = count_.load(std::memory_order_relaxed);
+    if (!count) {
+        return 0;
+    }
+
+    const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * static_cast<double>(count) + 0.5));
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < 64 * sub_buckets; ++bucket) {
+        seen += buckets_[bucket].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return std::min(bucketEnd(bucket, sub_buckets), max_.load(std::memory_order_relaxed));
+        }
+    }
+    return max_;
+}
+
+// answers of a connection may come from any worker, one at a time
+struct VmServer::Connection {
+    int out_fd;
+    std::mutex write_lock;
+
+    std::mutex pending_lock;
+    std::condition_variable idle;
+    uint64_t pending{0};
+
+    void respond(const ServerRequest &request, const ServerStatus status, const uint64_t image_hash,
+                 const std::string &output, const uint64_t latency_ns) {
+        ServerResponse response{};
+        response.magic = server_response_magic;
+        response.id = request.id;
+        response.status = static_cast<uint8_t>(status);
+        response.output_size = static_cast<uint32_t>(output.size());
+        response.image_hash = image_hash;
+        response.latency_ns = latency_ns;
+
+        // a client that went away just doesn't get its answers
+        std::lock_guard<std::mutex> guard(write_lock);
+        if (writeAll(out_fd, &response, sizeof(response))) {
+            writeAll(out_fd, output.data(), output.size());
+        }
+    }
+};
+
+VmServer::VmServer(const DispatchMode mode, const uint32_t threads, RunCache *cache, const size_t images,
+                   const uint64_t step_limit)
+        : mode_{mode}, cache_{cache}, image_entries_{images ? images : 1}, step_limit_{step_limit}, pool_{threads} {}
+
+VmServer::~VmServer() {
+    std::lock_guard<std::mutex> guard(connections_lock_);
+    for (auto &connection: connections_) {
+        connection.thread.join();
+    }
+}
+
+void VmServer::serve(const int in_fd, const int out_fd) {
+    using clock = std::chrono::steady_clock;
+    Connection connection;
+    connection.out_fd = out_fd;
+
+    const auto elapsed = [](const clock::time_point since) {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - since).count());
+    };
+
+    for (;;) {
+        ServerRequest request{};
+        if (!readAll(in_fd, &request, sizeof(request))) {
+            break;
+        }
+        const auto received = clock::now();
+        requests_++;
+
+        const auto kind = static_cast<ServerRequestKind>(request.kind);
+        if (request.magic != server_request_magic || request.kind > static_cast<uint8_t>(ServerRequestKind::METRICS) ||
+            request.image_size > server_max_image_size || request.data_words > wide_address_space_size) {
+            connection.respond(request, ServerStatus::BAD_REQUEST, 0, {}, elapsed(received));
+            break;
+        }
+
+        if (kind == ServerRequestKind::METRICS) {
+            const auto format = request.format <= static_cast<uint8_t>(MetricsFormat::PROMETHEUS)
+                                ? static_cast<MetricsFormat>(request.format) : MetricsFormat::TEXT;
+            connection.respond(request, ServerStatus::HALTED, 0, metrics(format), elapsed(received));
+            continue;
+        }
+
+        std::vector<uint8_t> bytes(request.image_size);
+        std::vector<uint16_t> data(request.data_words);
+        if (!readAll(in_fd, bytes.data(), bytes.size()) ||
+            !readAll(in_fd, data.data(), data.size() * sizeof(uint16_t))) {
+            break;
+        }
+
+        // images are prepared right away, a request that comes next may already refer to this one
+        auto status = ServerStatus::HALTED;
+        auto prepared = prepare(request, bytes, status);
+        if (!prepared) {
+            const auto latency = elapsed(received);
+            latency_.record(latency);
+            connection.respond(request, status, 0, {}, latency);
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(connection.pending_lock);
+            connection.pending++;
+        }
+        pool_.submit([this, &connection, request, prepared = std::move(prepared), data = std::move(data), received,
+                      elapsed] {
+            std::string output;
+            const auto status = run(*prepared, request, data, output);
+            const auto latency = elapsed(received);
+            latency_.record(latency);
+            connection.respond(request, status, prepared->hash, output, latency);
+
+            std::lock_guard<std::mutex> guard(connection.pending_lock);
+            if (--connection.pending == 0) {
+                connection.idle.notify_all();
+            }
+        });
+    }
+
+    std::unique_lock<std::mutex> lock(connection.pending_lock);
+    connection.idle.wait(lock, [&connection] { return connection.pending == 0; });
+}
+
+bool VmServer::listen(const char *path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fputs("[[error]] socket path is too long\n", stderr);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+
+    const auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fputs(errors[FAILED_TO_INIT_STREAM], stderr);
+        return false;
+    }
+    unlink(path);
+    if (bind(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) || ::listen(fd, SOMAXCONN)) {
+        fprintf(stderr, "[[error]] failed to listen on %s\n", path);
+        close(fd);
+        return false;
+    }
+
+    for (;;) {
+        const auto client = accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        std::lock_guard<std::mutex> guard(connections_lock_);
+        // joins whoever left since the last client came, so threads don't pile up over time
+        for (auto connection = connections_.begin(); connection != connections_.end();) {
+            if (connection->done) {
+                connection->thread.join();
+                connection = connections_.erase(connection);
+            } else {
+                ++connection;
+            }
+        }
+
+        auto &reader = connections_.emplace_back();
+        reader.thread = std::thread([this, client, &reader] {
+            serve(client, client);
+            close(client);
+            reader.done = true;
+        });
+    }
+
+    fprintf(stderr, "[[error]] stopped accepting connections on %s\n", path);
+    close(fd);
+    return false;
+}
+
+std::string VmServer::metrics(const MetricsFormat format) const {
+    const auto latency = [](const char *key, const char *quantile, const uint64_t value) {
+        return MetricSample{key, "metacpu_server_latency_seconds", std::string("quantile=\"") + quantile + "\"",
+                            "gauge", "latency of the requests served so far", value, true};
+    };
+    std::vector<MetricSample> samples = {
+            {"requests", "metacpu_server_requests_total", "", "counter", "requests read", requests_, false},
+            {"image_hits", "metacpu_server_image_hits_total", "", "counter", "requests for an image the server had",
+                    image_hits_, false},
+            {"image_misses", "metacpu_server_image_misses_total", "", "counter",
+                    "requests for an image the server prepared first", image_misses_, false},
+            latency("latency_p50_ns", "0.5", latency_.percentile(0.5)),
+            latency("latency_p90_ns", "0.9", latency_.percentile(0.9)),
+            latency("latency_p99_ns", "0.99", latency_.percentile(0.99)),
+            latency("latency_p999_ns", "0.999", latency_.percentile(0.999)),
+            {"latency_max_ns", "metacpu_server_latency_max_seconds", "", "gauge", "slowest request served so far",
+                    latency_.max(), true},
+    };
+    const auto counters = metricSamples();
+    samples.insert(samples.end(), counters.begin(), counters.end());
+    return formatMetrics(samples, format);
+}
+
+std::shared_ptr<VmServer::PreparedImage> VmServer::prepare(const ServerRequest &request,
+                                                            const std::vector<uint8_t> &bytes, ServerStatus &status) {
+    const auto hash = bytes.empty() ? request.image_hash : imageHash(bytes.data(), bytes.size());
+    {
+        std::lock_guard<std::mutex> guard(images_lock_);
+        const auto found = images_.find(hash);
+        if (found != images_.end()) {
+            recent_.splice(recent_.begin(), recent_, found->second);
+            image_hits_++;
+            return *found->second;
+        }
+    }
+
+    image_misses_++;
+    if (bytes.empty()) {
+        status = ServerStatus::UNKNOWN_IMAGE;
+        return nullptr;
+    }
+
+    auto prepared = std::make_shared<PreparedImage>();
+    prepared->hash = hash;
+    if (!prepared->image.load(bytes.data(), bytes.size())) {
+        status = ServerStatus::BAD_IMAGE;
+        return nullptr;
+    }
+    if (!prepared->image.wide() && !prepared->image.layout().decoded) {
+        // decoded and fused once, every run after that loads the handlers as they are
+        ImageSections sections;
+        predecodeImage(prepared->image, sections);
+        const auto predecoded = imageBytes(sections);
+        if (!prepared->image.load(predecoded.data(), predecoded.size())) {
+            status = ServerStatus::BAD_IMAGE;
+            return nullptr;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(images_lock_);
+    const auto found = images_.find(hash);
+    if (found != images_.end()) {
+        // another connection got there first
+        return *found->second;
+    }
+    if (images_.size() == image_entries_) {
+        images_.erase(recent_.back()->hash);
+        recent_.pop_back();
+    }
+    recent_.push_front(prepared);
+    images_.emplace(hash, recent_.begin());
+    return prepared;
+}
+
+ServerStatus VmServer::run(PreparedImage &prepared, const ServerRequest &request, const std::vector<uint16_t> &data,
+                           std::string &output) {
+    const auto &image = prepared.image;
+    const auto data_end = image.wide() ? wide_address_space_size : memory_bank_capacity;
+    const auto data_start = image.wide() ? image.wideLayout().data_start : image.layout().data_start;
+    if (data_start + data.size() > data_end) {
+        return ServerStatus::BAD_DATA;
+    }
+
+    const auto budget = request.max_steps ? request.max_steps : step_limit_;
+    if (image.wide()) {
+        StringSink sink(output);
+        WideInterpreter interp(image, data, &sink);
+        return serverStatusOf(interp.run(budget));
+    }
+
+    // a run that halted says nothing about where a smaller budget would have stopped it, only runs
+    // that ask for no budget go to the cache
+    const auto cached_run = cache_ && !request.max_steps;
+    const auto key = cached_run ? runKey(image, data) : 0;
+    CachedRun cached;
+    if (cached_run && cache_->find(key, cached)) {
+        output = std::move(cached.output);
+        return ServerStatus::HALTED;
+    }
+
+    auto status = RunStatus::HALTED;
+    {
+        StringSink sink(output);
+        Interpreter interp(image, data, &sink);
+        if (mode_ == DispatchMode::JIT) {
+            auto jit = prepared.jits.checkOut(image.layout().code_end);
+            status = interp.run(budget, *jit);
+            prepared.jits.checkIn(std::move(jit));
+        } else {
+            status = interp.run(budget, mode_);
+        }
+        if (cached_run && status == RunStatus::HALTED) {
+            const auto &memory = interp.peek().memory;
+            cached.memory.assign(memory, memory + memory_bank_capacity);
+        }
+    }
+    if (cached_run && status == RunStatus::HALTED) {
+        cached.output = output;
+        cache_->insert(key, cached);
+    }
+    return serverStatusOf(status);
+}
+
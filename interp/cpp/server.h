@@ -0,0 +1,202 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "vm.h"
+#include "batch.h"
+#include "cache.h"
+#include "jit.h"
+#include "../../common/metrics.h"
+
+// Frames of the server protocol, every request is answered by exactly one response carrying
+// its id. Fields are in host byte order, whatever a frame carries follows its header
+constexpr uint32_t server_request_magic = 0x7172766D;
+constexpr uint32_t server_response_magic = 0x7372766D;
+// images the server keeps loaded, the ones used least recently go first
+constexpr size_t server_image_entries = 256;
+// anything bigger than a wide image with every word filled can't be one
+constexpr uint32_t server_max_image_size = 1u << 20;
+// budget of a run that asks for none, about a second on the switch loop
+constexpr uint64_t server_step_limit = 1ull << 28;
+
+enum class ServerRequestKind : uint8_t {
+    RUN,
+    METRICS,
+};
+
+// halted, budget_exhausted, fault - how the run ended, see RunStatus
+// bad_image - the bytes that came with the request are not an image
+// unknown_image - a request referred to an image by a hash the server does not know
+// bad_data - the data overrides do not fit into memory
+// bad_request - the frame makes no sense, the server hangs up after answering it
+enum class ServerStatus : uint8_t {
+    HALTED,
+    BUDGET_EXHAUSTED,
+    FAULT,
+    BAD_IMAGE,
+    UNKNOWN_IMAGE,
+    BAD_DATA,
+    BAD_REQUEST,
+};
+
+static inline const char *serverStatusName(const ServerStatus status) {
+    switch (status) {
+        case ServerStatus::HALTED:
+            return "halted";
+        case ServerStatus::BUDGET_EXHAUSTED:
+            return "budget exhausted";
+        case ServerStatus::FAULT:
+            return "fault";
+        case ServerStatus::BAD_IMAGE:
+            return "bad image";
+        case ServerStatus::UNKNOWN_IMAGE:
+            return "unknown image";
+        case ServerStatus::BAD_DATA:
+            return "bad data";
+        case ServerStatus::BAD_REQUEST:
+            return "bad request";
+    }
+    return "unknown";
+}
+
+// run - image_size bytes of an image follow, then data_words words written over its data section.
+//       With image_size 0 the image is the one sent earlier whose hash is image_hash
+// max_steps - budget of the run, 0 for the step limit of the server
+// metrics - nothing follows, the response carries the metrics in the MetricsFormat of format, 0 for
+//           plain text
+struct ServerRequest {
+    uint32_t magic;
+    uint32_t id;
+    uint8_t kind;
+    uint8_t format;
+    uint8_t reserved[2];
+    uint32_t image_size;
+    uint64_t image_hash;
+    uint64_t max_steps;
+    uint32_t data_words;
+    uint32_t reserved2;
+};
+
+static_assert(sizeof(ServerRequest) == 40, "ServerRequest is sent as is");
+
+// output_size bytes of output follow
+// image_hash - what later requests may refer to the image by
+// latency_ns - from the moment the request was read up to its response
+struct ServerResponse {
+    uint32_t magic;
+    uint32_t id;
+    uint8_t status;
+    uint8_t reserved[3];
+    uint32_t output_size;
+    uint64_t image_hash;
+    uint64_t latency_ns;
+};
+
+static_assert(sizeof(ServerResponse) == 32, "ServerResponse is sent as is");
+
+// what images are known by, over the bytes they were sent as
+uint64_t imageHash(const void *bytes, size_t size);
+
+// Log-linear histogram of latencies in nanoseconds, 8 buckets per power of two, which keeps
+// percentiles within an eighth of their value. Every method can be called from any thread
+class LatencyHistogram final {
+public:
+    void record(uint64_t ns) noexcept;
+
+    // smallest latency at least a fraction q of the recorded ones did not exceed, rounded up to the
+    // end of its bucket
+    [[nodiscard]] uint64_t percentile(double q) const noexcept;
+
+    [[nodiscard]] inline uint64_t count() const noexcept { return count_; }
+
+    [[nodiscard]] inline uint64_t max() const noexcept { return max_; }
+
+private:
+    static constexpr uint32_t sub_buckets = 8;
+
+    std::atomic<uint64_t> buckets_[64 * sub_buckets]{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+// Long-running vm taking requests over a stream. A connection's requests are read one after the
+// other and go to a pool of workers as soon as they are read, so that a client may send many
+// before waiting for any answer. Responses go out as runs finish, not in the order of requests.
+// Images are kept by their hash: single-bank ones predecoded and fused, and on the jit with the
+// compilers of earlier runs, one per run in flight. Every run has a budget, single-bank ones run
+// on the jit if that's the dispatch mode and on the switch loop otherwise. A run cache, if given,
+// answers single-bank runs that ask for no budget and that it already knows to halt
+class VmServer final {
+public:
+    VmServer(DispatchMode mode, uint32_t threads, RunCache *cache = nullptr, size_t images = server_image_entries,
+             uint64_t step_limit = server_step_limit);
+
+    ~VmServer();
+
+    VmServer(const VmServer &) = delete;
+
+    VmServer &operator=(const VmServer &) = delete;
+
+    // serves requests read from in_fd until it ends or a frame makes no sense, answers go to out_fd.
+    // returns once every request it read has been answered
+    void serve(int in_fd, int out_fd);
+
+    // listens on a unix socket at path and serves every connection to it as above, on a reader
+    // thread of its own. Only returns if the socket fails
+    bool listen(const char *path);
+
+    // requests, image cache hits and misses and latency percentiles, followed by the counters of
+    // common/metrics.h, which cover every run of the process
+    [[nodiscard]] std::string metrics(MetricsFormat format = MetricsFormat::TEXT) const;
+
+private:
+    struct PreparedImage {
+        uint64_t hash{0};
+        MappedImage image;
+        JitCompilerPool jits;
+    };
+
+    struct Connection;
+
+    // reader thread of a client of listen, done once the client is gone and it can be joined
+    struct ClientThread {
+        std::atomic<bool> done{false};
+        std::thread thread;
+    };
+
+    std::shared_ptr<PreparedImage> prepare(const ServerRequest &request, const std::vector<uint8_t> &bytes,
+                                           ServerStatus &status);
+
+    ServerStatus run(PreparedImage &prepared, const ServerRequest &request, const std::vector<uint16_t> &data,
+                     std::string &output);
+
+private:
+    DispatchMode mode_;
+    RunCache *cache_;
+    size_t image_entries_;
+    uint64_t step_limit_;
+
+    std::mutex images_lock_;
+    // most recently used first
+    std::list<std::shared_ptr<PreparedImage>> recent_;
+    std::unordered_map<uint64_t, std::list<std::shared_ptr<PreparedImage>>::iterator> images_;
+
+    std::mutex connections_lock_;
+    std::list<ClientThread> connections_;
+
+    std::atomic<uint64_t> requests_{0};
+    std::atomic<uint64_t> image_hits_{0};
+    std::atomic<uint64_t> image_misses_{0};
+    LatencyHistogram latency_;
+
+    // last, so that it's gone before anything its tasks touch
+    WorkStealingPool pool_;
+};
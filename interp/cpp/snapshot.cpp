@@ -0,0 +1,53 @@
+#include "snapshot.h"
+
+std::vector<uint8_t> packState(const VmState &state) {
+    auto words = std::min<size_t>(state.memory.size(), memory_bank_capacity);
+    while (words && !state.memory[words - 1]) {
+        words--;
+    }
+
+    const auto &stack = state.stack;
+    const auto depth = stack.size();
+
+    const SnapshotHeader header{snapshot_version, state.acc, state.pc, state.flags, state.code_end, state.data_start,
+                                static_cast<uint16_t>(words), static_cast<uint32_t>(depth)};
+    std::vector<uint8_t> blob(sizeof(header) + words * sizeof(uint16_t) + depth);
+    memcpy(blob.data(), &header, sizeof(header));
+    memcpy(blob.data() + sizeof(header), state.memory.data(), words * sizeof(uint16_t));
+    for (uint32_t i = 0; i < depth; ++i) {
+        blob[sizeof(header) + words * sizeof(uint16_t) + i] = stack.at(i);
+    }
+
+    return blob;
+}
+
+bool unpackState(const uint8_t *blob, const size_t size, VmState &state) {
+    SnapshotHeader header{};
+    if (size < sizeof(header)) {
+        fputs(errors[FAILED_TO_READ_PREAMBLE], stderr);
+        return false;
+    }
+
+    memcpy(&header, blob, sizeof(header));
+    const auto expected = sizeof(header) + header.memory_words * sizeof(uint16_t) + header.stack_depth;
+    if (header.version != snapshot_version || header.memory_words > memory_bank_capacity ||
+        header.stack_depth > return_stack_capacity || size != expected) {
+        fputs(errors[MALFORMED_HEADER], stderr);
+        return false;
+    }
+
+    state.acc = header.acc;
+    state.pc = header.pc;
+    state.flags = header.flags;
+    state.code_end = header.code_end;
+    state.data_start = header.data_start;
+    state.memory.assign(memory_bank_capacity, 0);
+    memcpy(state.memory.data(), blob + sizeof(header), header.memory_words * sizeof(uint16_t));
+
+    state.stack.clear();
+    for (auto *entry = blob + sizeof(header) + header.memory_words * sizeof(uint16_t); entry != blob + size; ++entry) {
+        state.stack.push(*entry);
+    }
+
+    return true;
+}
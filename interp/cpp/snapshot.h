@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "vm.h"
+
+// VmState packed into a single blob, to be kept around or shipped to another process
+// 0 - SnapshotHeader
+// 12 - memory words, trailing zero words are left out
+// then the return stack, a byte per entry from the bottom up
+constexpr uint8_t snapshot_version = 1;
+
+struct SnapshotHeader {
+    uint8_t version;
+    int8_t acc;
+    uint8_t pc;
+    uint8_t flags;
+    uint8_t code_end;
+    uint8_t data_start;
+    uint16_t memory_words;
+    uint32_t stack_depth;
+};
+
+static_assert(sizeof(SnapshotHeader) == 12, "SnapshotHeader is stored as is");
+
+std::vector<uint8_t> packState(const VmState &state);
+
+// false if the blob is not a snapshot or does not add up
+bool unpackState(const uint8_t *blob, size_t size, VmState &state);
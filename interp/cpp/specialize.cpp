@@ -0,0 +1,157 @@
+#include "specialize.h"
+#include "instructions.h"
+
+namespace {
+
+    // instructions that print output, acc is what acc holds before them and after them
+    void emitOutput(std::vector<uint16_t> &code, const std::string &output, int8_t &acc) {
+        for (const auto c: output) {
+            const auto delta = static_cast<uint8_t>(c - acc);
+            if (delta) {
+                code.push_back(ADDI | delta);
+            }
+            code.push_back(OUTB);
+            acc = static_cast<int8_t>(c);
+        }
+    }
+
+    // the ret of a program that never stores into code can't find anything but what branches pushed
+    bool mayReturn(const uint16_t *memory, const uint8_t code_end) {
+        for (uint32_t slot = 0; slot < code_end; ++slot) {
+            const auto opcode = static_cast<uint8_t>(memory[slot] >> 8);
+            if (opcode == RET >> 8 || (hasKind(opcode, kind_store) && (memory[slot] & value_mask) < code_end)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // words of the data section up to the last one that isn't zero
+    void copyData(const std::vector<uint16_t> &memory, const uint8_t data_start, std::vector<uint16_t> &data) {
+        auto data_end = std::min<size_t>(memory.size(), memory_bank_capacity);
+        while (data_end > data_start && !memory[data_end - 1]) {
+            data_end--;
+        }
+        data.assign(memory.begin() + data_start, memory.begin() + data_end);
+    }
+
+    void markLeaders(ImageSections &sections) {
+        const auto code_end = static_cast<uint8_t>(sections.code.size());
+        DecodedInsn program[decoded_program_size];
+        decodeProgram(sections.code.data(), code_end, program);
+        bool leaders[decoded_program_size];
+        findBlockLeaders(program, code_end, leaders);
+        leaders[sections.entry] = true;
+        sections.leaders.clear();
+        for (uint32_t slot = 0; slot < decoded_program_size; ++slot) {
+            if (leaders[slot]) {
+                markLeader(sections.leaders, slot);
+            }
+        }
+    }
+
+}
+
+bool specializeImage(const MappedImage &image, const uint32_t inputs, ImageSections &residual, Specialization &result,
+                     const uint64_t max_steps) {
+    if (image.wide()) {
+        fputs(errors[NEEDS_WIDE_ENGINE], stderr);
+        return false;
+    }
+
+    const auto &layout = image.layout();
+    uint16_t original[memory_bank_capacity];
+    image.copyInto(original, memory_bank_capacity);
+    const auto returns = mayReturn(original, layout.code_end);
+
+    std::vector<uint8_t> input(memory_bank_capacity);
+    for (uint32_t addr = layout.data_start; addr < std::min(layout.data_start + inputs, memory_bank_capacity); ++addr) {
+        input[addr] = true;
+    }
+
+    // first pass finds how far the program gets without its inputs, and where it may be cut
+    uint64_t cut = 0;
+    auto status = RunStatus::BUDGET_EXHAUSTED;
+    {
+        std::string output;
+        StringSink sink(output);
+        Interpreter interp(image, {}, &sink);
+        for (;;) {
+            const auto &machine = interp.peek();
+            if (!returns || machine.stack.empty()) {
+                cut = interp.retired();
+            }
+
+            const auto word = machine.memory[machine.pc];
+            const auto opcode = word & instruction_mask;
+            const auto touches = opcode == ADD || opcode == SUB || opcode == CMP || hasKind(word >> 8, kind_store);
+            if (input[machine.pc] || (touches && input[word & value_mask]) || interp.retired() == max_steps) {
+                break;
+            }
+
+            status = interp.run(1);
+            if (status != RunStatus::BUDGET_EXHAUSTED) {
+                break;
+            }
+        }
+
+        if (status == RunStatus::FAULT) {
+            fputs("[[error]] the program faults before it needs any input\n", stderr);
+            return false;
+        }
+        if (status == RunStatus::HALTED) {
+            sink.flush();
+            result.complete = true;
+            result.folded_steps = interp.retired();
+            result.output = output;
+
+            residual = ImageSections{};
+            int8_t acc = 0;
+            emitOutput(residual.code, result.output, acc);
+            residual.code.push_back(LEAVE);
+            copyData(interp.state().memory, layout.data_start, residual.data);
+        }
+    }
+
+    if (!result.complete) {
+        const auto last = layout.code_end ? original[layout.code_end - 1] : static_cast<uint16_t>(LEAVE);
+        const auto falls_through = !hasKind(last >> 8, kind_exit) && (last & instruction_mask) != UCB;
+        if (cut == 0 || falls_through) {
+            fputs("[[error]] nothing of the program can be folded\n", stderr);
+            return false;
+        }
+
+        // second pass takes the state at the cut
+        std::string output;
+        VmState state;
+        {
+            StringSink sink(output);
+            state = Interpreter::capture(image, {}, cut, &sink);
+        }
+        result.folded_steps = cut;
+        result.output = output;
+
+        residual = ImageSections{};
+        residual.code.assign(state.memory.begin(), state.memory.begin() + layout.code_end);
+        residual.entry = layout.code_end;
+        int8_t acc = 0;
+        emitOutput(residual.code, result.output, acc);
+        if (acc != state.acc) {
+            residual.code.push_back(ADDI | static_cast<uint8_t>(state.acc - acc));
+        }
+        // the flag result comes out of the difference
+        residual.code.push_back(CMPI | static_cast<uint8_t>(state.acc - flag_result_of(state.flags)));
+        residual.code.push_back(UCB | state.pc);
+        residual.code.push_back(LEAVE);
+        copyData(state.memory, layout.data_start, residual.data);
+    }
+
+    if (residual.code.size() > layout.data_start) {
+        fprintf(stderr, "[[error]] %zu words of residual code do not fit below the data section\n",
+                residual.code.size());
+        return false;
+    }
+    residual.data_start = layout.data_start;
+    markLeaders(residual);
+    return true;
+}
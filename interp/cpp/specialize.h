@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "vm.h"
+
+// instructions a program may run at specialization time before the rest is left to the residual
+constexpr uint64_t specialize_step_budget = 1ull << 24;
+
+// what specializeImage folded into the residual
+// complete - the program halted, the residual only prints what it printed
+// folded_steps - instructions that ran at specialization time
+// output - what they printed
+struct Specialization {
+    bool complete{false};
+    uint64_t folded_steps{0};
+    std::string output;
+};
+
+// Partial evaluation of a single-bank image over its own data section. The first inputs words of
+// the data section are what changes from run to run (the words a --data line writes), the rest is
+// known. The program runs on the switch loop until it halts, or until its next instruction reads,
+// writes or executes an input word, and what it did until then ends up in residual:
+// - a program that halted turns into the outb stream that prints its output, followed by leave
+// - otherwise the residual keeps the code as the run left it, with a prelude behind it as the
+//   entry point. The prelude prints the output so far, puts acc and the flags back and jumps
+//   to where the run stopped. The jump pushes the address of a leave, so the run is only cut
+//   where the return stack is empty, or anywhere if the program never returns nor writes its
+//   own code. A ret that would have faulted on an empty stack halts instead
+// Data of the residual is memory as the run left it. Nothing is written and false is returned if
+// the image is wide, the program faults, it reads an input before anything could be folded, or
+// the residual doesn't fit below the data section. A program that falls through the end of its
+// code is only specialised when it halts.
+bool specializeImage(const MappedImage &image, uint32_t inputs, ImageSections &residual, Specialization &result,
+                     uint64_t max_steps = specialize_step_budget);
@@ -0,0 +1,140 @@
+#pragma once
+
+// Cooperative scheduling of many vms on a few threads. A VmTask is a coroutine that runs its
+// vm slice_steps instructions at a time and suspends in between, whoever resumes it decides
+// which vm goes next. A task may be resumed from any thread, as long as it's one at a time.
+// Needs C++20 coroutines, the header is empty without them.
+#if defined(__cpp_impl_coroutine)
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "vm.h"
+
+class VmTask final {
+public:
+    struct promise_type {
+        RunStatus status{RunStatus::BUDGET_EXHAUSTED};
+
+        VmTask get_return_object() { return VmTask{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+
+        // nothing runs until the task is resumed for the first time
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        std::suspend_always final_suspend() noexcept { return {}; }
+
+        void return_value(const RunStatus result) noexcept { status = result; }
+
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    VmTask(VmTask &&other) noexcept : handle_{std::exchange(other.handle_, nullptr)} {}
+
+    VmTask &operator=(VmTask &&other) noexcept {
+        if (this != &other) {
+            destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    VmTask(const VmTask &) = delete;
+
+    VmTask &operator=(const VmTask &) = delete;
+
+    ~VmTask() { destroy(); }
+
+    // runs the next slice, false once the program has halted or faulted
+    bool resume() {
+        if (!handle_.done()) {
+            handle_.resume();
+        }
+        return !handle_.done();
+    }
+
+    [[nodiscard]] inline bool done() const noexcept { return handle_.done(); }
+
+    // halted or fault once done
+    [[nodiscard]] inline RunStatus status() const noexcept { return handle_.promise().status; }
+
+private:
+    explicit VmTask(const std::coroutine_handle<promise_type> handle) : handle_{handle} {}
+
+    inline void destroy() noexcept {
+        if (handle_) {
+            handle_.destroy();
+            handle_ = nullptr;
+        }
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// interp has to outlive the task
+static inline VmTask runTask(Interpreter &interp, const uint64_t slice_steps) {
+    for (;;) {
+        const auto status = interp.run(slice_steps);
+        if (status != RunStatus::BUDGET_EXHAUSTED) {
+            co_return status;
+        }
+        co_await std::suspend_always{};
+    }
+}
+
+// resumes every task in turn, a slice each, until all of them are done
+static inline void runRoundRobin(std::vector<VmTask> &tasks) {
+    for (bool pending = true; pending;) {
+        pending = false;
+        for (auto &task: tasks) {
+            if (!task.done()) {
+                pending |= task.resume();
+            }
+        }
+    }
+}
+
+// same, over threads workers. a worker claims the next task off a shared cursor, runs a slice
+// of it and hands it back, so every task is owned by one worker at a time
+static inline void runCooperatively(std::vector<VmTask> &tasks, uint32_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    size_t pending = 0;
+    for (const auto &task: tasks) {
+        pending += !task.done();
+    }
+
+    std::vector<std::atomic<bool>> claimed(tasks.size());
+    std::atomic<size_t> remaining{pending};
+    std::atomic<size_t> cursor{0};
+    const auto work = [&] {
+        while (remaining > 0) {
+            const auto i = cursor++ % tasks.size();
+            if (claimed[i].exchange(true)) {
+                std::this_thread::yield();
+                continue;
+            }
+            if (!tasks[i].done() && !tasks[i].resume()) {
+                remaining--;
+            }
+            claimed[i] = false;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < threads; ++i) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto &worker: workers) {
+        worker.join();
+    }
+}
+
+#endif
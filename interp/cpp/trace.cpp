@@ -0,0 +1,283 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "../../common/errors.h"
+#include "../../common/isa.h"
+
+namespace {
+
+    constexpr char trace_magic[8] = {'m', 'e', 't', 'a', 't', 'r', 'c', 'e'};
+
+}
+
+TraceRecorder::TraceRecorder(const uint32_t chunks)
+        : chunks_{std::max(chunks, 2u)}, data_{new uint8_t[static_cast<size_t>(chunks_) * trace_chunk_size]},
+          headers_(chunks_), queued_{new std::atomic<uint8_t>[chunks_]} {
+    for (uint32_t chunk = 0; chunk < chunks_; ++chunk) {
+        queued_[chunk] = 0;
+    }
+    start(0);
+}
+
+TraceRecorder::~TraceRecorder() {
+    finish();
+}
+
+bool TraceRecorder::stream(const char *path) {
+    finish();
+    stream_ = fopen(path, "wb");
+    if (!stream_) {
+        fputs(errors[FAILED_TO_INIT_STREAM], stderr);
+        return false;
+    }
+
+    TraceFileHeader header{};
+    memcpy(header.magic, trace_magic, sizeof(header.magic));
+    header.version = trace_version;
+    header.chunk_size = trace_chunk_size;
+    if (fwrite(&header, sizeof(header), 1, stream_) != 1) {
+        fputs("[[error]] failed to put contents into a file\n", stderr);
+        fclose(stream_);
+        stream_ = nullptr;
+        return false;
+    }
+
+    stopping_ = false;
+    writer_ = std::thread([this] { writeChunks(); });
+    return true;
+}
+
+void TraceRecorder::begin(const uint8_t pc, const int8_t acc, const uint8_t flags) {
+    current_ = 0;
+    filled_ = 0;
+    first_step_ = 0;
+    dropped_ = 0;
+    next_pc_ = pc;
+    acc_ = acc;
+    flags_ = flags;
+    start(0);
+}
+
+void TraceRecorder::finish() {
+    if (!stream_) {
+        return;
+    }
+
+    seal();
+    if (chunk_records_) {
+        queued_[current_] = 1;
+        std::lock_guard<std::mutex> guard(writer_lock_);
+        writes_.push_back(current_);
+    }
+    {
+        std::lock_guard<std::mutex> guard(writer_lock_);
+        stopping_ = true;
+    }
+    writer_cv_.notify_one();
+    writer_.join();
+
+    fclose(stream_);
+    stream_ = nullptr;
+}
+
+bool TraceRecorder::write(const char *path) {
+    seal();
+    FILE *stream = fopen(path, "wb");
+    if (!stream) {
+        fputs(errors[FAILED_TO_INIT_STREAM], stderr);
+        return false;
+    }
+
+    TraceFileHeader header{};
+    memcpy(header.magic, trace_magic, sizeof(header.magic));
+    header.version = trace_version;
+    header.chunk_size = trace_chunk_size;
+    bool written = fwrite(&header, sizeof(header), 1, stream) == 1;
+
+    // every chunk filled before the current one, as far as the ring still has them
+    const auto older = std::min(filled_, chunks_ - 1);
+    for (uint32_t i = 0; i <= older && written; ++i) {
+        const auto chunk = (current_ + chunks_ - older + i) % chunks_;
+        const auto &chunk_header = headers_[chunk];
+        written = fwrite(&chunk_header, sizeof(chunk_header), 1, stream) == 1 &&
+                  fwrite(chunkData(chunk), 1, chunk_header.bytes, stream) == chunk_header.bytes;
+    }
+
+    fclose(stream);
+    if (!written) {
+        fputs("[[error]] failed to put contents into a file\n", stderr);
+    }
+    return written;
+}
+
+uint64_t TraceRecorder::steps() const noexcept {
+    return first_step_ + chunk_records_;
+}
+
+void TraceRecorder::nextChunk() {
+    seal();
+    const auto records = headers_[current_].records;
+    first_step_ += records;
+
+    const auto next = (current_ + 1) % chunks_;
+    if (stream_ && queued_[next].load(std::memory_order_acquire)) {
+        // the writer is behind, rather than waiting for it the chunk is thrown away
+        dropped_ += records;
+        start(current_);
+        return;
+    }
+
+    if (stream_) {
+        queued_[current_].store(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> guard(writer_lock_);
+            writes_.push_back(current_);
+        }
+        writer_cv_.notify_one();
+    }
+    filled_ = std::min(filled_ + 1, chunks_);
+    current_ = next;
+    start(current_);
+}
+
+void TraceRecorder::seal() {
+    auto &header = headers_[current_];
+    header.records = chunk_records_;
+    header.bytes = static_cast<uint32_t>(cursor_ - chunkData(current_));
+}
+
+void TraceRecorder::start(const uint32_t chunk) {
+    auto &header = headers_[chunk];
+    header = TraceChunkHeader{};
+    header.first_step = first_step_;
+    header.pc = next_pc_;
+    header.acc = acc_;
+    header.flags = flags_;
+
+    cursor_ = chunkData(chunk);
+    end_ = cursor_ + trace_chunk_size;
+    chunk_records_ = 0;
+}
+
+void TraceRecorder::writeChunks() {
+    for (;;) {
+        uint32_t chunk;
+        {
+            std::unique_lock<std::mutex> lock(writer_lock_);
+            writer_cv_.wait(lock, [this] { return stopping_ || !writes_.empty(); });
+            if (writes_.empty()) {
+                return;
+            }
+            chunk = writes_.front();
+            writes_.pop_front();
+        }
+
+        const auto &header = headers_[chunk];
+        if (fwrite(&header, sizeof(header), 1, stream_) != 1 ||
+            fwrite(chunkData(chunk), 1, header.bytes, stream_) != header.bytes) {
+            fputs("[[error]] failed to put contents into a file\n", stderr);
+        }
+        queued_[chunk].store(0, std::memory_order_release);
+    }
+}
+
+bool readTrace(const char *path, const std::function<bool(const TraceStep &)> &visit, const uint64_t from) {
+    FILE *stream = fopen(path, "rb");
+    if (!stream) {
+        fputs(errors[FAILED_TO_INIT_STREAM], stderr);
+        return false;
+    }
+
+    TraceFileHeader header{};
+    if (fread(&header, sizeof(header), 1, stream) != 1 || memcmp(header.magic, trace_magic, sizeof(header.magic)) ||
+        header.version != trace_version) {
+        fprintf(stderr, "[[error]] %s is not a trace\n", path);
+        fclose(stream);
+        return false;
+    }
+
+    std::vector<uint8_t> bytes(header.chunk_size);
+    TraceChunkHeader chunk{};
+    bool valid = true;
+    bool visiting = true;
+    while (valid && visiting && fread(&chunk, sizeof(chunk), 1, stream) == 1) {
+        if (chunk.bytes > header.chunk_size) {
+            valid = false;
+            break;
+        }
+        if (chunk.first_step + chunk.records <= from) {
+            valid = !fseek(stream, chunk.bytes, SEEK_CUR);
+            continue;
+        }
+        if (fread(bytes.data(), 1, chunk.bytes, stream) != chunk.bytes) {
+            valid = false;
+            break;
+        }
+
+        size_t cursor = 0;
+        const auto take = [&](uint8_t &value) {
+            if (cursor == chunk.bytes) {
+                return false;
+            }
+            value = bytes[cursor++];
+            return true;
+        };
+
+        auto pc = chunk.pc;
+        auto acc = chunk.acc;
+        auto flags = chunk.flags;
+        for (uint32_t record = 0; record < chunk.records && visiting; ++record) {
+            uint8_t head;
+            uint8_t value;
+            if (!take(head)) {
+                valid = false;
+                break;
+            }
+
+            TraceStep step{chunk.first_step + record, pc, static_cast<uint8_t>(head & trace_opcode_escape), 0, 0};
+            if (step.opcode == trace_opcode_escape && !take(step.opcode)) {
+                valid = false;
+                break;
+            }
+            if ((head & trace_pc_jump) && !take(step.pc)) {
+                valid = false;
+                break;
+            }
+            if (head & trace_acc_delta) {
+                if (!take(value)) {
+                    valid = false;
+                    break;
+                }
+                acc = static_cast<int8_t>(acc + value);
+            }
+            if ((head & trace_flags_changed) && !take(flags)) {
+                valid = false;
+                break;
+            }
+            step.acc = acc;
+            step.flags = flags;
+            pc = static_cast<uint8_t>(step.pc + 1);
+
+            if (step.step >= from) {
+                visiting = visit(step);
+            }
+        }
+    }
+
+    fclose(stream);
+    if (!valid) {
+        fprintf(stderr, "[[error]] %s is cut short or malformed\n", path);
+    }
+    return valid;
+}
+
+void writeTraceStep(FILE *stream, const TraceStep &step) {
+    const auto *entry = isaEntry(step.opcode);
+    const auto mnemonic = entry ? entry->mnemonic : std::string_view("???");
+    // zero_flag_mask and sign_flag_mask of the vm
+    fprintf(stream, "%-10llu 0x%02x %-6.*s acc %4d flags %c%c\n", static_cast<unsigned long long>(step.step), step.pc,
+            static_cast<int>(mnemonic.size()), mnemonic.data(), step.acc, step.flags & 0x01 ? 'z' : '-',
+            step.flags & 0x02 ? 's' : '-');
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Execution traces, a record per retired instruction: its pc and opcode, and acc and flags as the
+// instruction left them. Records are delta-encoded into chunks, and every chunk starts from a
+// key frame, so that a chunk can be decoded without any that came before it.
+// a record is a head byte followed by whatever it says is there, in this order
+// bits 0-4 - opcode, trace_opcode_escape if the opcode byte follows on its own
+// bit 5 - pc is not the one after the previous record's, the pc byte follows
+// bit 6 - acc changed, the difference follows as a byte
+// bit 7 - flags changed, the flags byte follows
+constexpr uint8_t trace_opcode_escape = 0x1F;
+constexpr uint8_t trace_pc_jump = 0x20;
+constexpr uint8_t trace_acc_delta = 0x40;
+constexpr uint8_t trace_flags_changed = 0x80;
+constexpr uint32_t trace_max_record_size = 5;
+
+// bytes of records per chunk, and chunks the recorder keeps in memory by default
+constexpr uint32_t trace_chunk_size = 4096;
+constexpr uint32_t trace_ring_chunks = 256;
+
+// trace file
+// 0 - TraceFileHeader
+// then chunks, a TraceChunkHeader followed by its records each. A chunk that was dropped leaves a gap
+// in the step numbers
+constexpr uint32_t trace_version = 1;
+
+struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+};
+
+static_assert(sizeof(TraceFileHeader) == 16, "TraceFileHeader is stored as is");
+
+// first_step - number of the chunk's first record, counted from the start of the run
+// pc - where the first record's pc counts from, the pc after that of the record before it
+// acc, flags - as the record before the first one left them
+struct TraceChunkHeader {
+    uint64_t first_step;
+    uint32_t records;
+    uint32_t bytes;
+    uint8_t pc;
+    int8_t acc;
+    uint8_t flags;
+    uint8_t reserved[5];
+};
+
+static_assert(sizeof(TraceChunkHeader) == 24, "TraceChunkHeader is stored as is");
+
+// a decoded record, acc and flags are what the instruction left behind
+struct TraceStep {
+    uint64_t step;
+    uint8_t pc;
+    uint8_t opcode;
+    int8_t acc;
+    uint8_t flags;
+};
+
+// Records a single run into a ring of chunks. Once every chunk is filled the oldest one is
+// overwritten, so the ring always holds the last stretch of the run. A recorder that streams writes
+// every chunk it fills to a file on a writer thread of its own instead, and the vm never waits for
+// it: if the writer falls so far behind that the ring runs out, the chunk being filled is dropped
+class TraceRecorder final {
+public:
+    explicit TraceRecorder(uint32_t chunks = trace_ring_chunks);
+
+    ~TraceRecorder();
+
+    TraceRecorder(const TraceRecorder &) = delete;
+
+    TraceRecorder &operator=(const TraceRecorder &) = delete;
+
+    // streams into path from here on. Reports the reason on stderr and returns false if it can't
+    bool stream(const char *path);
+
+    // state of the vm before the first instruction recorded, starts over
+    void begin(uint8_t pc, int8_t acc, uint8_t flags);
+
+    inline void record(const uint8_t pc, const uint16_t word, const int8_t acc, const uint8_t flags) {
+        if (end_ - cursor_ < trace_max_record_size) {
+            nextChunk();
+        }
+
+        const auto opcode = static_cast<uint8_t>(word >> 8);
+        auto head = opcode < trace_opcode_escape ? opcode : trace_opcode_escape;
+        auto out = cursor_ + 1;
+        if (opcode >= trace_opcode_escape) {
+            *out++ = opcode;
+        }
+        if (pc != next_pc_) {
+            head |= trace_pc_jump;
+            *out++ = pc;
+        }
+        if (acc != acc_) {
+            head |= trace_acc_delta;
+            *out++ = static_cast<uint8_t>(acc - acc_);
+        }
+        if (flags != flags_) {
+            head |= trace_flags_changed;
+            *out++ = flags;
+        }
+        *cursor_ = head;
+        cursor_ = out;
+
+        next_pc_ = static_cast<uint8_t>(pc + 1);
+        acc_ = acc;
+        flags_ = flags;
+        chunk_records_++;
+    }
+
+    // hands whatever is left to the writer and waits for it to write everything
+    void finish();
+
+    // writes what the ring holds into a trace file, oldest chunk first
+    bool write(const char *path);
+
+    // instructions recorded, including the dropped ones
+    [[nodiscard]] uint64_t steps() const noexcept;
+
+    [[nodiscard]] inline uint64_t dropped() const noexcept { return dropped_; }
+
+private:
+    // what is being filled becomes a chunk, the next one is started
+    void nextChunk();
+
+    void seal();
+
+    void start(uint32_t chunk);
+
+    void writeChunks();
+
+    [[nodiscard]] inline uint8_t *chunkData(const uint32_t chunk) const noexcept {
+        return data_.get() + static_cast<size_t>(chunk) * trace_chunk_size;
+    }
+
+private:
+    uint32_t chunks_;
+    std::unique_ptr<uint8_t[]> data_;
+    std::vector<TraceChunkHeader> headers_;
+    // set while a chunk waits for the writer, or is being written
+    std::unique_ptr<std::atomic<uint8_t>[]> queued_;
+    uint32_t current_{0};
+    // chunks that hold records, up to chunks_
+    uint32_t filled_{0};
+
+    uint8_t *cursor_{nullptr};
+    uint8_t *end_{nullptr};
+    uint32_t chunk_records_{0};
+    uint64_t first_step_{0};
+    uint8_t next_pc_{0};
+    int8_t acc_{0};
+    uint8_t flags_{0};
+    uint64_t dropped_{0};
+
+    FILE *stream_{nullptr};
+    std::thread writer_;
+    std::mutex writer_lock_;
+    std::condition_variable writer_cv_;
+    std::deque<uint32_t> writes_;
+    bool stopping_{false};
+};
+
+// feeds every step of a trace file from step from on to visit, until it returns false. Chunks that
+// end before from are skipped without being decoded. False if the file is not a trace
+bool readTrace(const char *path, const std::function<bool(const TraceStep &)> &visit, uint64_t from = 0);
+
+// "step pc mnemonic acc flags", a line per step
+void writeTraceStep(FILE *stream, const TraceStep &step);
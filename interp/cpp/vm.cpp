@@ -1,123 +1,491 @@
 #include "vm.h"
 #include "instructions.h"
+#include "jit.h"
+#include "../../common/metrics.h"
 
-// updates state of the flags by first clearing off an old state, and then 
-// setting a new one.
-#define SET_FLAGS vm_->flags = (vm_->flags >> 2) | ((vm_->acc == 0 ? 1 : 0) | ((vm_->acc < 0 ? 1 : 0) << 1));
+// flags are not computed here, the result they come from is kept instead, see flags_of
+#define SET_FLAGS(result) vm_->flag_result = (result);
 
 
-bool Interpreter::initializeVm(const std::string &path) {
-    vm_ = static_cast<vm *>(calloc(1, sizeof(vm)));
+bool Interpreter::initializeVm(const MappedImage &image, const std::vector<uint16_t> &data) {
+    vm_ = new(std::nothrow) vm();
     if (!vm_) {
         fputs(errors[FAILED_TO_ALLOCATE_MEMORY], stderr);
         return false;
     }
 
-    vm_->memory = static_cast<uint16_t *>(calloc(memory_bank_size, sizeof(uint16_t)));
-    if (!vm_->memory) {
+    if (image.wide()) {
+        // nothing of it fits, the program halts right away
+        fputs(errors[NEEDS_WIDE_ENGINE], stderr);
+        vm_->memory[0] = LEAVE;
+        return false;
+    }
+
+    image.copyInto(vm_->memory, memory_bank_capacity);
+    const auto &layout = image.layout();
+    const auto data_words = std::min<size_t>(data.size(), memory_bank_capacity - layout.data_start);
+    std::copy(data.begin(), data.begin() + data_words, vm_->memory + layout.data_start);
+
+    vm_->pc = layout.entry;
+    code_end_ = layout.code_end;
+    data_start_ = layout.data_start;
+    leaders_ = layout.leaders;
+    // anything else is decoded once it's prepared for an engine that wants it
+    predecoded_ = layout.decoded && loadDecodedProgram(layout.decoded, vm_->memory, code_end_, decoded_);
+
+    return image.ready();
+}
+
+bool Interpreter::initializeVm(const VmState &state, const std::vector<uint16_t> &data) {
+    vm_ = new(std::nothrow) vm();
+    if (!vm_) {
         fputs(errors[FAILED_TO_ALLOCATE_MEMORY], stderr);
         return false;
     }
 
+    const auto words = std::min<size_t>(state.memory.size(), memory_bank_capacity);
+    memcpy(vm_->memory, state.memory.data(), words * sizeof(uint16_t));
+    const auto data_words = std::min<size_t>(data.size(), memory_bank_capacity - state.data_start);
+    std::copy(data.begin(), data.begin() + data_words, vm_->memory + state.data_start);
+
+    vm_->acc = state.acc;
+    vm_->pc = state.pc;
+    vm_->flag_result = flag_result_of(state.flags);
+    vm_->stack = state.stack;
+    code_end_ = state.code_end;
+    data_start_ = state.data_start;
+
+    return true;
+}
+
+VmState Interpreter::capture(const MappedImage &image, const std::vector<uint16_t> &data, const uint64_t steps,
+                             OutputSink *sink) {
+    Interpreter interp(image, data, sink);
+    interp.run(steps);
+    return interp.state();
+}
+
+VmState Interpreter::state() const {
+    VmState state;
+    state.acc = vm_->acc;
+    state.pc = vm_->pc;
+    state.flags = flags_of(vm_->flag_result);
+    state.memory.assign(vm_->memory, vm_->memory + memory_bank_capacity);
+    state.stack = vm_->stack;
+    state.code_end = code_end_;
+    state.data_start = data_start_;
+    return state;
+}
+
+bool Interpreter::initializeVm(const uint16_t *image, size_t words) {
+    vm_ = new(std::nothrow) vm();
+    if (!vm_) {
+        fputs(errors[FAILED_TO_ALLOCATE_MEMORY], stderr);
+        return false;
+    }
 
-    int32_t size;
-    const auto success = loadMachineCodeIntoMemory(path.c_str(), &vm_->memory, &size);
-    assert(success);
+    // nothing past the bank is addressable anyway
+    words = words < memory_bank_capacity ? words : memory_bank_capacity;
+    memcpy(vm_->memory, image, words * sizeof(uint16_t));
 
     return true;
 }
 
-void Interpreter::simulate() {
+RunStatus Interpreter::run(const uint64_t max_steps) {
     assert(vm_ && "vm must be initialized!");
 
+    auto status = RunStatus::BUDGET_EXHAUSTED;
+    const auto retired = retired_;
+    const auto pushes = vm_->stack.pushes();
+    for (uint64_t steps = 0;; ++steps) {
+        const auto opcode = static_cast<uint8_t>(vm_->memory[vm_->pc] >> 8);
+        if (opcode == LEAVE >> 8) {
+            status = RunStatus::HALTED;
+            break;
+        }
+        if (!isaEntry(opcode) || (opcode == RET >> 8 && vm_->stack.empty())) {
+            status = RunStatus::FAULT;
+            break;
+        }
+        if (steps == max_steps) {
+            break;
+        }
+
+        if (profile_ || cycles_ || trace_) {
+            step<true>();
+        } else {
+            step();
+        }
+        retired_++;
+    }
+
+    if (retired_ != retired) {
+        dropDecoded();
+    }
+    sink_->flush();
+    countMetric(Metric::RUNS);
+    countMetric(Metric::INSTRUCTIONS, retired_ - retired);
+    countMetric(Metric::BRANCHES_TAKEN, vm_->stack.pushes() - pushes);
+    return status;
+}
+
+RunStatus Interpreter::run(const uint64_t max_steps, const DispatchMode mode) {
+    assert(vm_ && "vm must be initialized!");
+
+    if (mode == DispatchMode::JIT) {
+        if (jit_) {
+            return run(max_steps, *jit_);
+        }
+        JitCompiler jit(vm_->memory, code_end_);
+        return run(max_steps, jit);
+    }
+    if (mode == DispatchMode::SWITCH || profile_ || cycles_ || trace_) {
+        return run(max_steps);
+    }
+    if (!decoded_ready_ || mode_ != mode) {
+        prepare(mode, jit_);
+    }
+
+    const auto retired = retired_;
+    const auto pushes = vm_->stack.pushes();
+    simulateThreaded(max_steps);
+    countMetric(Metric::INSTRUCTIONS, retired_ - retired);
+    countMetric(Metric::BRANCHES_TAKEN, vm_->stack.pushes() - pushes);
+    // a group that did not fit is stepped through, run() also tells apart whatever stopped the
+    // loop, counts the run and flushes the output
+    return run(max_steps - (retired_ - retired));
+}
+
+void Interpreter::prepare(const DispatchMode mode, JitCompiler *jit) {
+    mode_ = mode;
+    jit_ = jit;
+    if (mode != DispatchMode::THREADED && mode != DispatchMode::FUSED) {
+        // the switch loop and the jit read memory as it is
+        return;
+    }
+
+    if (!predecoded_) {
+        decodeProgram(vm_->memory, code_end_, decoded_);
+        if (mode == DispatchMode::FUSED) {
+            fuseSuperinstructions(decoded_, code_end_, leaders_);
+        }
+    } else if (mode != DispatchMode::FUSED) {
+        defuseSuperinstructions(decoded_, vm_->memory, code_end_);
+    }
+    // after fusion, a group starting at a dead write would not be recognised anymore
+    dropDeadFlagWrites(decoded_, vm_->memory, code_end_);
+    predecoded_ = false;
+    decoded_ready_ = true;
+}
+
+RunStatus Interpreter::finish() {
+    if (profile_) {
+        profile_->begin(vm_->pc);
+    }
+    if (trace_) {
+        trace_->begin(vm_->pc, vm_->acc, flags_of(vm_->flag_result));
+    }
+    return run(std::numeric_limits<uint64_t>::max(), mode_);
+}
+
+template<bool Instrumented>
+void Interpreter::step() {
     auto &pc = vm_->pc;
-    while ((vm_->memory[pc] & instruction_mask) != LEAVE) {
-        const auto instr = vm_->memory[pc];
-        const auto opcode = vm_->memory[pc] & instruction_mask;
-        switch (opcode) {
-            case ADDI:
-                addi(instr & value_mask);
-                break;
-            case ADD:
-                add(instr & value_mask);
-                break;
-            case SUBI:
-                subi(instr & value_mask);
-                break;
-            case SUB:
-                sub(instr & value_mask);
-                break;
-			case ADDMEM:
-				addmem(instr & value_mask);
-				break;
-			case SUBMEM:
-				submem(instr & value_mask);
-				break;
-            case CLAC:
-                clac();
-                break;
-            case BNZ:
-                bnz(instr & value_mask);
-                break;
-            case BZ:
-                bz(instr & value_mask);
-                break;
-            case UCB:
-                ucb(instr & value_mask);
-                break;
-            case STR:
-                str(instr & value_mask);
-                break;
-            case CMP:
-                cmp(instr & value_mask);
-                break;
-            case CMPI:
-                cmpi(instr & value_mask);
-                break;
-            case OUTD:
-                outd();
-                break;
-            case OUTB:
-                outb();
-                break;
-            case BIG:
-                big(instr & value_mask);
-                break;
-            case BIL:
-                bil(instr & value_mask);
-                break;
-            case RET:
-                ret();
-                break;
-            default:
-                printf("unknown instruction %d", opcode);
-                break;
+    const auto instr = vm_->memory[pc];
+    [[maybe_unused]] const auto addr = pc;
+    // a push onto a full stack drops an entry, counting the dropped ones keeps every push visible
+    [[maybe_unused]] const auto depth = Instrumented ? vm_->stack.size() + vm_->stack.dropped() : 0;
+    const auto opcode = vm_->memory[pc] & instruction_mask;
+    switch (opcode) {
+        case ADDI:
+            addi(instr & value_mask);
+            break;
+        case ADD:
+            add(instr & value_mask);
+            break;
+        case SUBI:
+            subi(instr & value_mask);
+            break;
+        case SUB:
+            sub(instr & value_mask);
+            break;
+        case ADDMEM:
+            addmem(instr & value_mask);
+            break;
+        case SUBMEM:
+            submem(instr & value_mask);
+            break;
+        case CLAC:
+            clac();
+            break;
+        case BNZ:
+            bnz(instr & value_mask);
+            break;
+        case BZ:
+            bz(instr & value_mask);
+            break;
+        case UCB:
+            ucb(instr & value_mask);
+            break;
+        case STR:
+            str(instr & value_mask);
+            break;
+        case CMP:
+            cmp(instr & value_mask);
+            break;
+        case CMPI:
+            cmpi(instr & value_mask);
+            break;
+        case OUTD:
+            outd();
+            break;
+        case OUTB:
+            outb();
+            break;
+        case BIG:
+            big(instr & value_mask);
+            break;
+        case BIL:
+            bil(instr & value_mask);
+            break;
+        case RET:
+            ret();
+            break;
+        default:
+            fprintf(stderr, "[[error]] unknown instruction %d\n", opcode);
+            break;
+    }
+    if constexpr (Instrumented) {
+        const auto depth_after = vm_->stack.size() + vm_->stack.dropped();
+        if (profile_) {
+            profile_->retire(addr, instr, depth, depth_after);
         }
+        if (cycles_) {
+            // a taken branch is the one that pushed, ret always goes elsewhere
+            cycles_->retire(instr, depth_after > depth || opcode == RET);
+        }
+        if (trace_) {
+            trace_->record(addr, instr, vm_->acc, flags_of(vm_->flag_result));
+        }
+    }
+    pc++;
+}
+
+#if defined(__GNUC__)
+void Interpreter::simulateThreaded(const uint64_t max_steps) {
+    assert(vm_ && "vm must be initialized!");
+
+    // must follow the order of Handler
+    static const void *handlers[HANDLER_COUNT] = {
+            &&op_addi,
+            &&op_add,
+            &&op_subi,
+            &&op_sub,
+            &&op_clac,
+            &&op_bnz,
+            &&op_bz,
+            &&op_ucb,
+            &&op_str,
+            &&op_leave,
+            &&op_cmp,
+            &&op_cmpi,
+            &&op_outd,
+            &&op_big,
+            &&op_bil,
+            &&op_outb,
+            &&op_ret,
+            &&op_submem,
+            &&op_addmem,
+            &&op_unknown,
+            &&op_decode,
+            &&op_clac_addi_outb,
+            &&op_submem_add_bnz,
+            &&op_cmpi_bz,
+            &&op_cmpi_bnz,
+            &&op_addi_noflags,
+            &&op_add_noflags,
+            &&op_subi_noflags,
+            &&op_sub_noflags,
+            &&op_clac_noflags,
+            &&op_skip,
+    };
+
+    auto &pc = vm_->pc;
+    DecodedInsn insn;
+    // steps still to go, a superinstruction takes one for every slot it covers
+    uint64_t left = max_steps;
+
+// stops short of a slot that no longer fits
+#define DISPATCH() do { \
+        insn = decoded_[pc]; \
+        const auto width = static_cast<uint8_t>(insn.next_pc - pc); \
+        if (left < width) { \
+            goto stop; \
+        } \
+        left -= width; \
+        goto *handlers[insn.handler]; \
+    } while (0)
+// straight-line successor
+#define NEXT() do { pc = insn.next_pc; DISPATCH(); } while (0)
+// branch handlers leave pc one slot short of the target, as the switch loop expects
+#define STEP() do { pc++; DISPATCH(); } while (0)
+
+    DISPATCH();
+
+op_decode:
+    // invalidated or data slot, fetch it from memory and cache it if it is part of the code region
+    insn = decodeInstruction(vm_->memory[pc], pc);
+    if (pc < code_end_) {
+        decoded_[pc] = insn;
+    }
+    goto *handlers[insn.handler];
+op_addi:
+    addi(insn.operand);
+    NEXT();
+op_add:
+    add(insn.operand);
+    NEXT();
+op_subi:
+    subi(insn.operand);
+    NEXT();
+op_sub:
+    sub(insn.operand);
+    NEXT();
+op_addmem:
+    addmem(insn.operand);
+    invalidateSlot(insn.operand);
+    NEXT();
+op_submem:
+    submem(insn.operand);
+    invalidateSlot(insn.operand);
+    NEXT();
+op_clac:
+    clac();
+    NEXT();
+op_bnz:
+    bnz(insn.operand);
+    STEP();
+op_bz:
+    bz(insn.operand);
+    STEP();
+op_ucb:
+    ucb(insn.operand);
+    STEP();
+op_str:
+    str(insn.operand);
+    invalidateSlot(insn.operand);
+    NEXT();
+op_cmp:
+    cmp(insn.operand);
+    NEXT();
+op_cmpi:
+    cmpi(insn.operand);
+    NEXT();
+op_outd:
+    outd();
+    NEXT();
+op_outb:
+    outb();
+    NEXT();
+op_big:
+    big(insn.operand);
+    STEP();
+op_bil:
+    bil(insn.operand);
+    STEP();
+op_ret:
+    if (vm_->stack.empty()) {
+        // nowhere to return to, the program stops at the ret as it does under run()
+        left++;
+        goto stop;
+    }
+    ret();
+    STEP();
+op_unknown:
+    left++;
+    goto stop;
+op_clac_addi_outb:
+    // addi overwrites the flags of clac right away
+    vm_->acc = 0;
+    addi(decoded_[pc + 1].operand);
+    outb();
+    NEXT();
+op_submem_add_bnz:
+    submem(insn.operand);
+    invalidateSlot(insn.operand);
+    if (decoded_[pc].handler == H_DECODE) {
+        // the store rewrote the group itself, carry on with the plain instructions
+        left += static_cast<uint8_t>(insn.next_pc - pc) - 1;
         pc++;
+        DISPATCH();
     }
+    pc++;
+    add(decoded_[pc].operand);
+    pc++;
+    bnz(decoded_[pc].operand);
+    STEP();
+op_cmpi_bz:
+    cmpi(insn.operand);
+    // branch pushes its own slot as a return address, hence pc has to point at it
+    pc++;
+    bz(decoded_[pc].operand);
+    STEP();
+op_cmpi_bnz:
+    cmpi(insn.operand);
+    pc++;
+    bnz(decoded_[pc].operand);
+    STEP();
+op_addi_noflags:
+    vm_->acc += insn.operand;
+    NEXT();
+op_add_noflags:
+    vm_->acc += vm_->memory[insn.operand];
+    NEXT();
+op_subi_noflags:
+    vm_->acc -= insn.operand;
+    NEXT();
+op_sub_noflags:
+    vm_->acc -= vm_->memory[insn.operand];
+    NEXT();
+op_clac_noflags:
+    vm_->acc = 0;
+    NEXT();
+op_skip:
+    NEXT();
+op_leave:
+    left++;
+stop:
+    retired_ += max_steps - left;
 
+#undef STEP
+#undef NEXT
+#undef DISPATCH
 }
+#else
+// computed goto is not available, run() steps through all of it on the switch loop
+void Interpreter::simulateThreaded(uint64_t) {}
+#endif
 
 void Interpreter::addi(uint8_t value) {
     vm_->acc += value;
-    SET_FLAGS
+    SET_FLAGS(vm_->acc)
 }
 
 void Interpreter::add(uint8_t addr) {
     const auto value = vm_->memory[addr];
     vm_->acc += value;
-    SET_FLAGS
+    SET_FLAGS(vm_->acc)
 }
 
 void Interpreter::subi(uint8_t value) {
     vm_->acc -= value;
-    SET_FLAGS
+    SET_FLAGS(vm_->acc)
 }
 
 void Interpreter::sub(uint8_t addr) {
     const auto value = vm_->memory[addr];
     vm_->acc -= value;
-    SET_FLAGS
+    SET_FLAGS(vm_->acc)
 }
 
 void Interpreter::addmem(uint8_t addr) {
@@ -132,29 +500,29 @@ void Interpreter::clac() {
     // Zero out accumulator
     vm_->acc ^= vm_->acc;
     // set zero flag
-    vm_->flags |= 0x1;
+    SET_FLAGS(0)
 }
 
 
 // TODO(threadedstream): push pc onto the stack as a return address
 // The same goes for every jump instruction
 void Interpreter::bnz(uint8_t addr) {
-    if (!is_zf_set(vm_->flags)) {
-        stack_.push(vm_->pc);
+    if (vm_->flag_result != 0) {
+        vm_->stack.push(vm_->pc);
         // assign addr - 1, since pc is incremented each loop
         vm_->pc = addr - 1;
     }
 }
 
 void Interpreter::bz(uint8_t addr) {
-    if (is_zf_set(vm_->flags)) {
-        stack_.push(vm_->pc);
+    if (vm_->flag_result == 0) {
+        vm_->stack.push(vm_->pc);
         vm_->pc = addr - 1;
     }
 }
 
 void Interpreter::ucb(uint8_t addr) {
-    stack_.push(vm_->pc);
+    vm_->stack.push(vm_->pc);
     vm_->pc = addr - 1;
 }
 
@@ -163,42 +531,39 @@ void Interpreter::str(uint8_t addr) {
 }
 
 void Interpreter::cmp(uint8_t addr) {
-    const auto temp = vm_->acc;
-    vm_->acc -= vm_->memory[addr];
-    SET_FLAGS
-    vm_->acc = temp;
+    // acc is left as it is, only the difference is kept
+    SET_FLAGS(static_cast<int8_t>(vm_->acc - vm_->memory[addr]))
 }
 
 void Interpreter::cmpi(uint8_t value) {
-    const auto temp = vm_->acc;
-    vm_->acc -= value;
-    SET_FLAGS
-    vm_->acc = temp;
+    SET_FLAGS(static_cast<int8_t>(vm_->acc - value))
 }
 
 void Interpreter::outd() {
-    fprintf(stdout, "%d", vm_->acc);
+    sink_->putDecimal(vm_->acc);
 }
 
 void Interpreter::outb() {
-    fprintf(stdout, "%c", vm_->acc);
+    sink_->put(static_cast<char>(vm_->acc));
 }
 
 void Interpreter::big(uint8_t addr) {
-    if (!is_sf_set(vm_->flags) && !is_zf_set(vm_->flags)) {
-        stack_.push(vm_->pc);
+    if (vm_->flag_result > 0) {
+        vm_->stack.push(vm_->pc);
         vm_->pc = addr - 1;
     }
 }
 
 void Interpreter::bil(uint8_t addr) {
-    if (is_sf_set(vm_->flags) && !is_zf_set(vm_->flags)) {
-        stack_.push(vm_->pc);
+    if (vm_->flag_result < 0) {
+        vm_->stack.push(vm_->pc);
         vm_->pc = addr - 1;
     }
 }
 
 void Interpreter::ret() {
-    vm_->pc = stack_.top();
-    stack_.pop();
-}
\ No newline at end of file
+    vm_->pc = vm_->stack.pop();
+}
+
+// the jit falls back to single steps of the plain loop
+template void Interpreter::step<false>();
@@ -9,22 +9,32 @@
 
 
 // Cpp-includes
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <new>
 #include <string>
-#include <stack>
+#include <vector>
 
 // Local includes
 #include "../../common/errors.h"
+#include "decoder.h"
+#include "loader.h"
+#include "output.h"
+#include "profile.h"
+#include "cycles.h"
+#include "trace.h"
 
+class JitCompiler;
 
 // some constant values
-constexpr uint16_t preamble_size = 12;
 constexpr uint8_t memory_bank_size = 0xFF;
+// what a vm actually reserves, every address an 8-bit pc or operand can reach
+constexpr uint32_t memory_bank_capacity = 0x100;
 
 constexpr uint8_t zero_flag_mask = 0x01;
 constexpr uint8_t sign_flag_mask = 0x02;
 
-constexpr const char expected_preamble[preamble_size + 1] = "metasm v_1_0";
-
 // lambdas
 constexpr auto is_zf_set = [](const uint8_t flags) -> bool{
 	return flags & zero_flag_mask;
@@ -34,88 +44,342 @@ constexpr auto is_sf_set = [](const uint8_t flags) -> bool {
 	return flags & sign_flag_mask;
 };
 
+// flags are evaluated lazily: a vm keeps the 8-bit result of the last instruction that wrote
+// them and branches read zf and sf straight off it, nothing is computed until one does.
+// clac leaves a zero behind, which drops sf, but no branch reads sf while zf is up
+constexpr auto flags_of = [](const int8_t result) -> uint8_t {
+	return (result == 0 ? zero_flag_mask : 0) | (result < 0 ? sign_flag_mask : 0);
+};
 
-static bool loadMachineCodeIntoMemory(const char *path, uint16_t **buffer_ptr, int32_t *size) {
-    FILE *stream = fopen(path, "rb");
-    if (!stream) {
-        fputs(errors[FAILED_TO_INIT_STREAM], stderr);
-        return false;
-    }
+// some result with the same zf and sf, the other way around
+constexpr auto flag_result_of = [](const uint8_t flags) -> int8_t {
+	return is_zf_set(flags) ? 0 : is_sf_set(flags) ? -1 : 1;
+};
 
-    fseek(stream, 0, SEEK_END);
-    const auto file_size = ftell(stream);
-    fseek(stream, 0, SEEK_SET);
 
-    char preamble[preamble_size + 1];
-    if (!fread(preamble, 1, preamble_size + 1, stream)) {
-        fputs(errors[FAILED_TO_READ_PREAMBLE], stderr);
-        return false;
+// acc - 16-bit accumulator register
+// memory - 16-bit data memory with 256 available entries
+// pc - program counter
+// flags - status flags, list of used flags
+// note: starting from lsb (least significant bit)
+//  ======================
+// |zf(zero flag) - 1 bit |
+// |sf(sign flag) - 2 bit |
+//  ======================
+// flag_result - what the flags are read off, see flags_of
+
+// return addresses of the branches taken so far. Every taken branch pushes, only ret pops, so a
+// loop keeps pushing for as long as it runs. The stack is a ring of return_stack_capacity
+// entries that are never allocated: once it's full a push overwrites the oldest entry and counts
+// it as dropped, the newest return_stack_capacity ones are always there to return to.
+// there is nothing to pop off an empty stack, every engine faults on such a ret before it pops
+constexpr uint32_t return_stack_capacity = 0x100;
+
+// Address is the type of pc, a byte for single-bank programs and a word for wide ones
+template<typename Address>
+class BasicReturnStack {
+public:
+    inline void push(const Address pc) noexcept {
+        pushes_++;
+        slots_[top_++] = pc;
+        if (depth_ < return_stack_capacity) {
+            depth_++;
+        } else {
+            dropped_++;
+        }
     }
 
-    if (strcmp(preamble, expected_preamble)) {
-        fputs(errors[MALFORMED_PREAMBLE], stderr);
-        return false;
+    inline Address pop() noexcept {
+        assert(depth_ != 0 && "nothing to return to");
+        depth_--;
+        return slots_[--top_];
     }
 
-    const auto bin_data_size = file_size - preamble_size;
-    *buffer_ptr = static_cast<uint16_t *>(calloc(bin_data_size, sizeof(uint16_t)));
-    if (!(*buffer_ptr)) {
-        fputs(errors[FAILED_TO_ALLOCATE_MEMORY], stderr);
-        return false;
+    [[nodiscard]] inline Address top() const noexcept { return slots_[static_cast<uint8_t>(top_ - 1)]; }
+
+    [[nodiscard]] inline uint32_t size() const noexcept { return depth_; }
+
+    [[nodiscard]] inline bool empty() const noexcept { return depth_ == 0; }
+
+    // entries overwritten since the stack was last cleared, a ret that would have needed one of
+    // them faults instead
+    [[nodiscard]] inline uint64_t dropped() const noexcept { return dropped_; }
+
+    [[nodiscard]] inline bool overflowed() const noexcept { return dropped_ != 0; }
+
+    // pushes since the stack was last cleared, which is every branch taken in that time
+    [[nodiscard]] inline uint64_t pushes() const noexcept { return pushes_; }
+
+    // i-th entry from the bottom, i < size()
+    [[nodiscard]] inline Address at(const uint32_t i) const noexcept {
+        return slots_[static_cast<uint8_t>(top_ - depth_ + i)];
     }
 
-    if (!fread(*buffer_ptr, sizeof(uint16_t), bin_data_size, stream)) {
-        fputs(errors[FAILED_TO_READ_CONTENTS], stderr);
-        return false;
+    inline void clear() noexcept {
+        top_ = 0;
+        depth_ = 0;
+        dropped_ = 0;
+        pushes_ = 0;
     }
 
-    *size = bin_data_size;
+    // same entries, however they were laid out in the ring and whatever got dropped on the way
+    friend bool operator==(const BasicReturnStack &lhs, const BasicReturnStack &rhs) noexcept {
+        if (lhs.depth_ != rhs.depth_) {
+            return false;
+        }
+        for (uint32_t i = 0; i < lhs.depth_; ++i) {
+            if (lhs.at(i) != rhs.at(i)) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-    fclose(stream);
+    friend bool operator!=(const BasicReturnStack &lhs, const BasicReturnStack &rhs) noexcept {
+        return !(lhs == rhs);
+    }
 
-    return true;
-}
+private:
+    Address slots_[return_stack_capacity]{};
+    // wraps around on its own
+    uint8_t top_{0};
+    uint16_t depth_{0};
+    uint64_t dropped_{0};
+    uint64_t pushes_{0};
+};
 
-// acc - 16-bit accumulator register
-// memory - 16-bit data memory with 256 available entries
-// pc - program counter
-// flags - status flags, list of used flags
-// note: starting from lsb (least significant bit)
-//  ======================
-// |zf(zero flag) - 1 bit |
-// |sf(sign flag) - 2 bit |
-//  ======================
+using ReturnStack = BasicReturnStack<uint8_t>;
 
+// registers come first so the jit can reach all of them with 8-bit displacements, the
+// memory bank is kept inline and starts on its own cache line, the return stack follows it
 struct vm {
-    vm() : acc{0}, pc{0} {}
+    vm() : acc{0}, pc{0}, flag_result{flag_result_of(0)}, memory{} {}
 
     int8_t acc;
-    uint16_t *memory;
     uint8_t pc;
-	uint8_t flags; 
+    int8_t flag_result;
+    alignas(64) uint16_t memory[memory_bank_capacity];
+    ReturnStack stack;
 };
 
+// complete architectural state of a vm, enough to resume a program somewhere else
+// code_end, data_start - layout of the image the program was loaded from
+struct VmState {
+    int8_t acc{0};
+    uint8_t pc{0};
+    uint8_t flags{0};
+    std::vector<uint16_t> memory;
+    ReturnStack stack;
+    uint8_t code_end{data_section_start};
+    uint8_t data_start{data_section_start};
+};
+
+// available dispatch engines
+// switch - decode each word on fetch and dispatch through a switch
+// threaded - pre-decode the whole image once, then dispatch through computed goto (falls back to
+// switch on compilers without the labels-as-values extension)
+// fused - threaded, with common instruction sequences fused into superinstructions
+// jit - translate blocks into native code (x86-64 only, falls back to threaded elsewhere)
+enum class DispatchMode : uint8_t {
+    SWITCH,
+    THREADED,
+    FUSED,
+    JIT,
+};
+
+// where a bounded run stopped
+// halted - the program reached leave
+// budget_exhausted - every step it was given ran, run() or resume() pick up from there
+// fault - pc points at a word that is not an instruction, or at a ret with nowhere to return to
+enum class RunStatus : uint8_t {
+    HALTED,
+    BUDGET_EXHAUSTED,
+    FAULT,
+};
 
 class Interpreter final {
+    friend class JitCompiler;
+
 public:
 
-	explicit Interpreter(const std::string& path) {
-		initializeVm(path);
-		simulate();
+	// everything the program prints goes into sink, or into a buffered stdout if none is given
+	// with a profile or a cycle model attached the program runs on the instrumented switch loop,
+	// whatever the mode
+	explicit Interpreter(const std::string& path, DispatchMode mode = DispatchMode::SWITCH, OutputSink *sink = nullptr,
+						 Profile *profile = nullptr, CycleModel *cycles = nullptr) : profile_{profile}, cycles_{cycles} {
+		attachSink(sink);
+		MappedImage image;
+		if (image.open(path.c_str())) {
+			initializeVm(image, {});
+		} else {
+			// open reported why, the program halts right away
+			const uint16_t leave = LEAVE;
+			initializeVm(&leave, 1);
+		}
+		execute(mode);
+	}
+
+	// runs a mapped image, data is written over its data section first. A trace recorder, like a
+	// profile, puts the program on the instrumented switch loop
+	Interpreter(const MappedImage &image, const std::vector<uint16_t> &data, DispatchMode mode,
+				OutputSink *sink = nullptr, Profile *profile = nullptr, CycleModel *cycles = nullptr,
+				TraceRecorder *trace = nullptr)
+			: profile_{profile}, cycles_{cycles}, trace_{trace} {
+		attachSink(sink);
+		initializeVm(image, data);
+		execute(mode);
+	}
+
+	// runs an image that is already in memory
+	Interpreter(const uint16_t *image, size_t words, DispatchMode mode, OutputSink *sink = nullptr) {
+		attachSink(sink);
+		initializeVm(image, words);
+		execute(mode);
 	}
 	
+	// resumes a program from the given state
+	Interpreter(const VmState &state, DispatchMode mode, OutputSink *sink = nullptr)
+			: Interpreter(state, {}, mode, sink) {}
+
+	// forks a program off the given state, data is written over its data section first.
+	// the state is only read, any number of forks can share one
+	Interpreter(const VmState &state, const std::vector<uint16_t> &data, DispatchMode mode,
+				OutputSink *sink = nullptr) {
+		attachSink(sink);
+		initializeVm(state, data);
+		execute(mode);
+	}
+
+	// runs a mapped image on the jit with a compiler made for it, which keeps whatever it translates
+	// for the next run of the same image. A compiler serves a single run at a time
+	Interpreter(const MappedImage &image, const std::vector<uint16_t> &data, JitCompiler &jit,
+				OutputSink *sink = nullptr) : jit_{&jit} {
+		attachSink(sink);
+		initializeVm(image, data);
+		execute(DispatchMode::JIT);
+	}
+
+	// same, forking a program off a state. It has to be the state of every run the compiler served
+	Interpreter(const VmState &state, const std::vector<uint16_t> &data, JitCompiler &jit,
+				OutputSink *sink = nullptr) : jit_{&jit} {
+		attachSink(sink);
+		initializeVm(state, data);
+		execute(DispatchMode::JIT);
+	}
+
+	// loads a program without running it, it's driven by run() and resume() from there
+	Interpreter(const MappedImage &image, const std::vector<uint16_t> &data, OutputSink *sink = nullptr) {
+		attachSink(sink);
+		initializeVm(image, data);
+	}
+
+	// same, starting from a state
+	explicit Interpreter(const VmState &state, OutputSink *sink = nullptr)
+			: Interpreter(state, std::vector<uint16_t>{}, sink) {}
+
+	// same, forking a program off a state with data written over its data section
+	Interpreter(const VmState &state, const std::vector<uint16_t> &data, OutputSink *sink) {
+		attachSink(sink);
+		initializeVm(state, data);
+	}
+
 	~Interpreter() { destroyVm(); }
 
+	// executes at most max_steps instructions on the switch loop and stops, whatever was printed
+	// until then is flushed. a halted or faulted program stays where it is
+	RunStatus run(uint64_t max_steps);
+
+	// same on the jit, whose blocks run whole as long as they fit into what is left of max_steps, the
+	// rest is stepped through. jit has to be the compiler of every run it served so far
+	RunStatus run(uint64_t max_steps, JitCompiler &jit);
+
+	// same on the engine of mode. threaded and fused run off the decoded program, decoding it for
+	// mode first unless it already is, a superinstruction only runs whole while it fits. The jit
+	// translates on the compiler given to a constructor or prepare(), on a fresh one without it
+	RunStatus run(uint64_t max_steps, DispatchMode mode);
+
+	// runs on until the program halts or faults
+	inline RunStatus resume() { return run(std::numeric_limits<uint64_t>::max()); }
+
+	// instructions executed by run() so far
+	[[nodiscard]] inline uint64_t retired() const noexcept { return retired_; }
+
+	// charges every instruction run() executes from here on to cycles, nullptr stops that
+	inline void attachCycleModel(CycleModel *cycles) noexcept { cycles_ = cycles; }
+
+	// records every instruction run() executes from here on into trace, which starts over, nullptr
+	// stops that
+	inline void attachTrace(TraceRecorder *trace) {
+		trace_ = trace;
+		if (trace_) {
+			trace_->begin(vm_->pc, vm_->acc, flags_of(vm_->flag_result));
+		}
+	}
+
+	// readies a program loaded without running it for mode, decoding it the way that mode wants.
+	// On the jit, jit is the compiler to translate on, as for the constructors taking one
+	void prepare(DispatchMode mode, JitCompiler *jit = nullptr);
+
+	// runs a prepared program until it halts or faults, the same way the constructors taking a mode do
+	RunStatus finish();
+
+	// runs the first steps instructions of an image on the switch loop, or up to leave if it comes
+	// first, and returns the state it got to. whatever those instructions print goes into sink
+	static VmState capture(const MappedImage &image, const std::vector<uint16_t> &data, uint64_t steps,
+						   OutputSink *sink = nullptr);
+
+	// state of the vm as the program left it
+	[[nodiscard]] VmState state() const;
+
+	// the vm itself, as run() left it. nothing is copied, unlike state()
+	[[nodiscard]] inline const struct vm &peek() const noexcept { return *vm_; }
+
 private:
 
-    bool initializeVm(const std::string &path);
+    bool initializeVm(const MappedImage &image, const std::vector<uint16_t> &data);
+
+    bool initializeVm(const VmState &state, const std::vector<uint16_t> &data);
+
+    bool initializeVm(const uint16_t *image, size_t words);
 
-    void simulate();
+    inline void execute(const DispatchMode mode) {
+        prepare(mode, jit_);
+        finish();
+    }
+
+    inline void attachSink(OutputSink *sink) {
+        if (!sink) {
+            owned_sink_ = std::make_unique<FdSink>(fileno(stdout));
+            sink = owned_sink_.get();
+        }
+        sink_ = sink;
+    }
+
+    // runs decoded_ through computed goto up to leave, a fault, or a slot that takes more steps than
+    // are left of max_steps, and retires whatever it executed
+    void simulateThreaded(uint64_t max_steps);
+
+    // executes a single instruction of the switch loop. the instrumented one accounts it in profile_,
+    // cycles_ and trace_, whichever of them is attached, the plain one carries none of it
+    template<bool Instrumented = false>
+    void step();
+
+    // the switch loop and the jit don't keep decoded_ up to date with the stores they execute, once
+    // either of them ran the next threaded run decodes memory again
+    inline void dropDecoded() noexcept {
+        decoded_ready_ = false;
+        predecoded_ = false;
+    }
+
+    // drops a cached slot once a store lands in the code region
+    inline void invalidateSlot(const uint8_t addr) {
+        if (addr < code_end_) {
+            invalidateDecodedSlot(decoded_, addr);
+        }
+    }
 
     inline void destroyVm() {
-        free(vm_->memory);
-        vm_->memory = nullptr;
-        free(vm_);
+        delete vm_;
         vm_ = nullptr;
     }
 
@@ -158,5 +422,25 @@ private:
 
 private:
     vm *vm_;
-    std::stack<uint8_t> stack_;
+    OutputSink *sink_{nullptr};
+    std::unique_ptr<OutputSink> owned_sink_;
+    Profile *profile_{nullptr};
+    CycleModel *cycles_{nullptr};
+    TraceRecorder *trace_{nullptr};
+    // compiler a caller keeps between runs, the jit makes a fresh one without it
+    JitCompiler *jit_{nullptr};
+    // what finish() runs the program on
+    DispatchMode mode_{DispatchMode::SWITCH};
+    // decoded_ agrees with memory and is prepared for mode_
+    bool decoded_ready_{false};
+    // pre-decoded copy of the code region, filled by prepare() for the threaded and fused loops
+    DecodedInsn decoded_[decoded_program_size];
+    uint8_t code_end_{data_section_start};
+    // where data overrides go
+    uint8_t data_start_{data_section_start};
+    uint64_t retired_{0};
+    // jump target table of the image, if it came with one
+    const uint8_t *leaders_{nullptr};
+    // decoded_ was taken over from the image, superinstructions included
+    bool predecoded_{false};
 };
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include "wide.h"
+#include "instructions.h"
+#include "../../common/metrics.h"
+
+// same lazy flags as the single-bank engines
+#define SET_FLAGS(result) vm_.flag_result = (result);
+
+WideInterpreter::WideInterpreter(const MappedImage &image, const std::vector<uint16_t> &data, OutputSink *sink) {
+    if (!sink) {
+        owned_sink_ = std::make_unique<FdSink>(fileno(stdout));
+        sink = owned_sink_.get();
+    }
+    sink_ = sink;
+
+    if (!image.wide()) {
+        fputs("[[error]] the wide engine only runs wide images\n", stderr);
+        return;
+    }
+
+    vm_.memory.reset(new(std::nothrow) uint16_t[wide_address_space_size]);
+    if (!vm_.memory) {
+        fputs(errors[FAILED_TO_ALLOCATE_MEMORY], stderr);
+        return;
+    }
+
+    image.copyInto(vm_.memory.get(), wide_address_space_size);
+    const auto &layout = image.wideLayout();
+    const auto data_words = std::min<size_t>(data.size(), wide_address_space_size - layout.data_start);
+    std::copy(data.begin(), data.begin() + data_words, vm_.memory.get() + layout.data_start);
+    vm_.pc = static_cast<uint16_t>(layout.entry);
+    ready_ = true;
+}
+
+RunStatus WideInterpreter::run(const uint64_t max_steps) {
+    if (!ready_) {
+        return RunStatus::FAULT;
+    }
+
+    auto status = RunStatus::BUDGET_EXHAUSTED;
+    const auto retired = retired_;
+    const auto pushes = vm_.stack.pushes();
+    for (uint64_t steps = 0;; ++steps) {
+        const auto word = vm_.memory[vm_.pc];
+        const auto opcode = static_cast<uint8_t>((word >> 8) & ~wide_opcode_bit);
+        if (word == LEAVE) {
+            status = RunStatus::HALTED;
+            break;
+        }
+        const auto *entry = isaEntry(opcode);
+        if (!entry || (isWideWord(word) && entry->mode != InstructionMode::MEMORY) ||
+            (opcode == RET >> 8 && vm_.stack.empty())) {
+            status = RunStatus::FAULT;
+            break;
+        }
+        if (steps == max_steps) {
+            break;
+        }
+
+        step();
+        retired_++;
+    }
+
+    sink_->flush();
+    countMetric(Metric::RUNS);
+    countMetric(Metric::INSTRUCTIONS, retired_ - retired);
+    countMetric(Metric::BRANCHES_TAKEN, vm_.stack.pushes() - pushes);
+    return status;
+}
+
+void WideInterpreter::step() {
+    const auto word = vm_.memory[vm_.pc];
+    uint16_t next;
+    const auto value = operand(word, next);
+    auto &memory = vm_.memory;
+
+    // taken branches leave the address of the next instruction behind
+    const auto branch = [&](const bool taken) {
+        if (taken) {
+            vm_.stack.push(next);
+            next = value;
+        }
+    };
+
+    switch (static_cast<uint16_t>(word & ~(wide_opcode_bit << 8)) & instruction_mask) {
+        case ADDI:
+            vm_.acc += static_cast<uint8_t>(value);
+            SET_FLAGS(vm_.acc)
+            break;
+        case ADD:
+            vm_.acc += memory[value];
+            SET_FLAGS(vm_.acc)
+            break;
+        case SUBI:
+            vm_.acc -= static_cast<uint8_t>(value);
+            SET_FLAGS(vm_.acc)
+            break;
+        case SUB:
+            vm_.acc -= memory[value];
+            SET_FLAGS(vm_.acc)
+            break;
+        case ADDMEM:
+            memory[value] += 1;
+            break;
+        case SUBMEM:
+            memory[value] -= 1;
+            break;
+        case CLAC:
+            vm_.acc = 0;
+            SET_FLAGS(0)
+            break;
+        case BNZ:
+            branch(vm_.flag_result != 0);
+            break;
+        case BZ:
+            branch(vm_.flag_result == 0);
+            break;
+        case UCB:
+            branch(true);
+            break;
+        case BIG:
+            branch(vm_.flag_result > 0);
+            break;
+        case BIL:
+            branch(vm_.flag_result < 0);
+            break;
+        case RET:
+            next = vm_.stack.pop();
+            break;
+        case STR:
+            memory[value] = vm_.acc;
+            break;
+        case CMP:
+            SET_FLAGS(static_cast<int8_t>(vm_.acc - memory[value]))
+            break;
+        case CMPI:
+            SET_FLAGS(static_cast<int8_t>(vm_.acc - static_cast<uint8_t>(value)))
+            break;
+        case OUTD:
+            sink_->putDecimal(vm_.acc);
+            break;
+        case OUTB:
+            sink_->put(static_cast<char>(vm_.acc));
+            break;
+        default:
+            fprintf(stderr, "[[error]] unknown instruction %d\n", word & instruction_mask);
+            break;
+    }
+
+    vm_.pc = next;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "vm.h"
+
+// Engine of wide programs, the ones of v3 images. pc and memory operands are 16 bits, memory is
+// a single flat bank of wide_address_space_size words and a memory instruction takes two words,
+// see isa.h. Only the switch loop exists for them: the engines of Interpreter are specialised
+// for a single bank of 8-bit addresses and never see a wide program, so none of them pays for
+// one. A program gets one engine or the other once, when its image is loaded.
+// Branches push the address of the instruction after them, ret goes straight there.
+struct WideVm {
+    int8_t acc{0};
+    uint16_t pc{0};
+    int8_t flag_result{flag_result_of(0)};
+    BasicReturnStack<uint16_t> stack;
+    std::unique_ptr<uint16_t[]> memory;
+};
+
+class WideInterpreter final {
+public:
+    // loads a wide image without running it, data is written over its data section first.
+    // everything the program prints goes into sink, or into a buffered stdout if none is given
+    WideInterpreter(const MappedImage &image, const std::vector<uint16_t> &data, OutputSink *sink = nullptr);
+
+    // false if the image is not a wide one or memory ran out, nothing runs then
+    [[nodiscard]] inline bool ready() const noexcept { return ready_; }
+
+    // same contract as Interpreter::run
+    RunStatus run(uint64_t max_steps);
+
+    inline RunStatus resume() { return run(std::numeric_limits<uint64_t>::max()); }
+
+    [[nodiscard]] inline uint64_t retired() const noexcept { return retired_; }
+
+    [[nodiscard]] inline const WideVm &vm() const noexcept { return vm_; }
+
+private:
+    // executes the instruction at pc and moves pc past it, or wherever it branches to
+    void step();
+
+    // operand and length of the instruction at pc, memory operands of wide instructions live in
+    // the word after them
+    inline uint16_t operand(const uint16_t word, uint16_t &next) const {
+        if (isWideWord(word)) {
+            next = static_cast<uint16_t>(vm_.pc + 2);
+            return vm_.memory[static_cast<uint16_t>(vm_.pc + 1)];
+        }
+        next = static_cast<uint16_t>(vm_.pc + 1);
+        return word & value_mask;
+    }
+
+private:
+    WideVm vm_;
+    OutputSink *sink_{nullptr};
+    std::unique_ptr<OutputSink> owned_sink_;
+    uint64_t retired_{0};
+    bool ready_{false};
+};
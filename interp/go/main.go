@@ -1,17 +1,85 @@
 package main
 
 import (
+	"flag"
 	"fmt"
+	"os"
+	"strconv"
+	"strings"
+
 	"github.com/ThreadedStream/metacpu/vm"
 )
 
+// runs metasm images on the Go vm, the way metacpu_vm runs them
+//
+//	metacpu-go [--steps=N] [--data="w w ..."] [--state] image...
+//
+// --steps bounds every run, --state prints acc, flags, pc and the memory bank to stderr after each
+// single-bank run
 func main() {
 	var (
-		path   = "D:\\toys\\metacpu\\assembler\\samples\\sample.bin"
-		memory [256]uint16
+		steps = flag.Uint64("steps", 0, "most instructions a run may take, 0 for no limit")
+		data  = flag.String("data", "", "words written over the data section, separated by spaces")
+		state = flag.Bool("state", false, "print the state a run ends in to stderr")
 	)
-	err := vm.LoadSrcIntoMemory(path, &memory)
-	if err != nil {
-		fmt.Printf("%s", err.Error())
+	flag.Parse()
+	if flag.NArg() == 0 {
+		fmt.Fprintln(os.Stderr, "usage: metacpu-go [--steps=N] [--data=\"w w ...\"] [--state] image...")
+		os.Exit(2)
+	}
+
+	var words []uint16
+	for _, field := range strings.Fields(*data) {
+		value, err := strconv.ParseInt(field, 10, 32)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "%s is not a word\n", field)
+			os.Exit(2)
+		}
+		words = append(words, uint16(value))
+	}
+
+	budget := *steps
+	if budget == 0 {
+		budget = vm.Unbounded
+	}
+
+	failed := false
+	for _, path := range flag.Args() {
+		image, err := vm.OpenImage(path)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "%s: %s\n", path, err.Error())
+			failed = true
+			continue
+		}
+
+		machine := vm.New(image, words, os.Stdout)
+		status := machine.Run(budget)
+		if *state {
+			printState(machine, status)
+		}
+		if status != vm.Halted {
+			failed = true
+		}
+	}
+	if failed {
+		os.Exit(1)
+	}
+}
+
+func printState(machine vm.Machine, status vm.RunStatus) {
+	single, ok := machine.(*vm.VM)
+	if !ok {
+		fmt.Fprintf(os.Stderr, "%s acc %d flags %d\n", status, machine.Acc(), machine.Flags())
+		return
+	}
+
+	var memory strings.Builder
+	for i, w := range single.Memory() {
+		if i != 0 {
+			memory.WriteByte(' ')
+		}
+		fmt.Fprintf(&memory, "%04x", w)
 	}
+	fmt.Fprintf(os.Stderr, "%s acc %d flags %d pc %d\n%s\n", status, machine.Acc(), machine.Flags(), single.PC(),
+		memory.String())
 }
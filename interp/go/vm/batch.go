@@ -0,0 +1,83 @@
+package vm
+
+import (
+	"runtime"
+	"sync"
+	"sync/atomic"
+)
+
+// Job is a single run of a batch. Data is written over the data section of the image first,
+// MaxSteps bounds the run, 0 lets it run for as long as it takes
+type Job struct {
+	Image    *Image
+	Data     []uint16
+	MaxSteps uint64
+}
+
+// Result is how a job ended, with acc and flags as the program left them
+type Result struct {
+	Status  RunStatus
+	Output  []byte
+	Acc     int8
+	Flags   uint8
+	Retired uint64
+}
+
+// RunBatch runs every job on a vm of its own, spread over workers goroutines, and returns the
+// results in the order of jobs. Workers take the next job as soon as they are done with one, so
+// long and short runs mix without anybody waiting. workers <= 0 takes one per available cpu
+func RunBatch(jobs []Job, workers int) []Result {
+	if workers <= 0 {
+		workers = runtime.GOMAXPROCS(0)
+	}
+	if workers > len(jobs) {
+		workers = len(jobs)
+	}
+
+	results := make([]Result, len(jobs))
+	var (
+		next  int64 = -1
+		group sync.WaitGroup
+	)
+	group.Add(workers)
+	for worker := 0; worker < workers; worker++ {
+		go func() {
+			defer group.Done()
+			for {
+				i := int(atomic.AddInt64(&next, 1))
+				if i >= len(jobs) {
+					return
+				}
+				results[i] = runJob(&jobs[i])
+			}
+		}()
+	}
+	group.Wait()
+	return results
+}
+
+// RunData runs a single image once per data set, see RunBatch
+func RunData(image *Image, dataSets [][]uint16, maxSteps uint64, workers int) []Result {
+	jobs := make([]Job, len(dataSets))
+	for i, data := range dataSets {
+		jobs[i] = Job{Image: image, Data: data, MaxSteps: maxSteps}
+	}
+	return RunBatch(jobs, workers)
+}
+
+func runJob(job *Job) Result {
+	budget := job.MaxSteps
+	if budget == 0 {
+		budget = Unbounded
+	}
+
+	machine := New(job.Image, job.Data, nil)
+	status := machine.Run(budget)
+	return Result{
+		Status:  status,
+		Output:  machine.Output(),
+		Acc:     machine.Acc(),
+		Flags:   machine.Flags(),
+		Retired: machine.Retired(),
+	}
+}
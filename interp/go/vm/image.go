@@ -0,0 +1,196 @@
+package vm
+
+import (
+	"encoding/binary"
+	"errors"
+	"os"
+)
+
+// metasm images, as common/image.h lays them out
+// v1 - "metasm v_1_0\0" followed by a raw dump of the whole address space
+// v2 - "metasm v_2_0\0", padded up to imageHeaderOffset, followed by a header pointing at the sections
+// v3 - "metasm v_3_0\0", the same with a header of 32-bit fields, for programs of the 16-bit address space
+const (
+	metasmMagic       = "metasm v_1_0"
+	metasmMagicV2     = "metasm v_2_0"
+	metasmMagicV3     = "metasm v_3_0"
+	preambleSize      = len(metasmMagic) + 1
+	imageHeaderOffset = 16
+	imageHeaderSize   = 24
+
+	// assembler places variables of BEGINDATA block starting from that address
+	dataSectionStart = 0xF0
+	// words of a single bank, every address an 8-bit pc or operand can reach
+	BankCapacity = 0x100
+	// words a wide program can address
+	WideAddressSpace = 0x10000
+
+	imageLeadersSize      = BankCapacity / 8
+	imageDecodedEntrySize = 3
+)
+
+var (
+	ErrMalformedPreamble = errors.New("malformed preamble")
+	ErrMalformedHeader   = errors.New("malformed image header")
+)
+
+// Layout tells where a program starts, where its code ends and where its data section is
+type Layout struct {
+	Entry     uint32
+	CodeEnd   uint32
+	DataStart uint32
+}
+
+// Image is a loaded metasm image, its sections copied out of the file. An image is only read once
+// it is loaded, any number of vms can start off one at the same time
+type Image struct {
+	version int
+	layout  Layout
+	// code goes to address 0, data to layout.DataStart
+	code []uint16
+	data []uint16
+}
+
+// OpenImage loads the image at path
+func OpenImage(path string) (*Image, error) {
+	bytes, err := os.ReadFile(path)
+	if err != nil {
+		return nil, err
+	}
+	return LoadImage(bytes)
+}
+
+// LoadImage loads an image out of its bytes, with the same checks as the C++ loader
+func LoadImage(bytes []byte) (*Image, error) {
+	if len(bytes) < preambleSize {
+		return nil, ErrMalformedPreamble
+	}
+
+	// preamble is compared together with its terminator
+	switch string(bytes[:preambleSize]) {
+	case metasmMagic + "\x00":
+		// v1 has no sections, the dump is the code as far as the loader is concerned
+		return &Image{
+			version: 1,
+			layout:  Layout{Entry: 0, CodeEnd: dataSectionStart, DataStart: dataSectionStart},
+			code:    words(bytes, uint32(preambleSize), (len(bytes)-preambleSize)/2),
+		}, nil
+	case metasmMagicV2 + "\x00":
+		return parseHeader(bytes)
+	case metasmMagicV3 + "\x00":
+		return parseWideHeader(bytes)
+	}
+	return nil, ErrMalformedPreamble
+}
+
+func parseHeader(bytes []byte) (*Image, error) {
+	if len(bytes) < imageHeaderOffset+imageHeaderSize {
+		return nil, ErrMalformedHeader
+	}
+
+	header := bytes[imageHeaderOffset:]
+	var (
+		le            = binary.LittleEndian
+		codeOffset    = le.Uint32(header[0:])
+		dataOffset    = le.Uint32(header[4:])
+		leadersOffset = le.Uint32(header[8:])
+		decodedOffset = le.Uint32(header[12:])
+		codeWords     = uint32(le.Uint16(header[16:]))
+		dataWords     = uint32(le.Uint16(header[18:]))
+		dataStart     = uint32(header[20])
+		entry         = uint32(header[21])
+	)
+
+	if codeWords > dataStart || dataStart+dataWords > BankCapacity ||
+		!fits(bytes, codeOffset, uint64(codeWords)*2) ||
+		(dataWords != 0 && !fits(bytes, dataOffset, uint64(dataWords)*2)) ||
+		(leadersOffset != 0 && !fits(bytes, leadersOffset, imageLeadersSize)) ||
+		(decodedOffset != 0 && !fits(bytes, decodedOffset, uint64(codeWords)*imageDecodedEntrySize)) {
+		return nil, ErrMalformedHeader
+	}
+
+	// leaders and the decoded stream serve the C++ engines only, the dispatch loop here needs neither
+	return &Image{
+		version: 2,
+		layout:  Layout{Entry: entry, CodeEnd: codeWords, DataStart: dataStart},
+		code:    words(bytes, codeOffset, int(codeWords)),
+		data:    words(bytes, dataOffset, int(dataWords)),
+	}, nil
+}
+
+func parseWideHeader(bytes []byte) (*Image, error) {
+	if len(bytes) < imageHeaderOffset+imageHeaderSize {
+		return nil, ErrMalformedHeader
+	}
+
+	header := bytes[imageHeaderOffset:]
+	var (
+		le         = binary.LittleEndian
+		codeOffset = le.Uint32(header[0:])
+		dataOffset = le.Uint32(header[4:])
+		codeWords  = le.Uint32(header[8:])
+		dataWords  = le.Uint32(header[12:])
+		dataStart  = le.Uint32(header[16:])
+		entry      = le.Uint32(header[20:])
+	)
+
+	if codeWords > dataStart || dataStart > WideAddressSpace || dataWords > WideAddressSpace-dataStart ||
+		entry >= WideAddressSpace || !fits(bytes, codeOffset, uint64(codeWords)*2) ||
+		(dataWords != 0 && !fits(bytes, dataOffset, uint64(dataWords)*2)) {
+		return nil, ErrMalformedHeader
+	}
+
+	return &Image{
+		version: 3,
+		layout:  Layout{Entry: entry, CodeEnd: codeWords, DataStart: dataStart},
+		code:    words(bytes, codeOffset, int(codeWords)),
+		data:    words(bytes, dataOffset, int(dataWords)),
+	}, nil
+}
+
+// section of size bytes at offset lies within the image
+func fits(bytes []byte, offset uint32, size uint64) bool {
+	return uint64(offset) <= uint64(len(bytes)) && size <= uint64(len(bytes))-uint64(offset)
+}
+
+// count words at offset, which the header checks made sure are there
+func words(bytes []byte, offset uint32, count int) []uint16 {
+	if count == 0 {
+		return nil
+	}
+	out := make([]uint16, count)
+	for i := range out {
+		out[i] = binary.LittleEndian.Uint16(bytes[offset+uint32(2*i):])
+	}
+	return out
+}
+
+// Version is 1, 2 or 3, as the preamble says
+func (image *Image) Version() int { return image.version }
+
+// Wide images hold a program of the 16-bit address space, only the wide engine runs them
+func (image *Image) Wide() bool { return image.version == 3 }
+
+func (image *Image) Layout() Layout { return image.layout }
+
+// CopyInto fills memory with the image, words the image leaves out are zero. Whatever does not fit
+// into memory is left out
+func (image *Image) CopyInto(memory []uint16) {
+	for i := range memory {
+		memory[i] = 0
+	}
+	copy(memory, image.code)
+	if int(image.layout.DataStart) < len(memory) {
+		copy(memory[image.layout.DataStart:], image.data)
+	}
+}
+
+// LoadSrcIntoMemory fills memory with the image at path, the way a single-bank vm starts off it
+func LoadSrcIntoMemory(path string, memory *[BankCapacity]uint16) error {
+	image, err := OpenImage(path)
+	if err != nil {
+		return err
+	}
+	image.CopyInto(memory[:])
+	return nil
+}
@@ -1,6 +0,0 @@
-#include <stdint.h>
-
-
-int16_t* readBinaryData(const char* path, const int32_t offset);
-
-
@@ -1,49 +1,296 @@
 package vm
 
-// #include "utils.h"
-import "C"
-
 import (
 	"errors"
-	"os"
-	"unsafe"
+	"io"
+	"math"
+	"strconv"
+)
+
+// opcodes, in the order of the isa table of common/isa.h
+const (
+	opAddi uint8 = iota
+	opAdd
+	opSubi
+	opSub
+	opClac
+	opBnz
+	opBz
+	opUcb
+	opStr
+	opLeave
+	opCmp
+	opCmpi
+	opOutd
+	opBig
+	opBil
+	opOutb
+	opRet
+	opSubmem
+	opAddmem
+
+	isaCount
+)
+
+// wide instructions have this bit set in their opcode, the address lives in the word after them
+const wideOpcodeBit = 0x80
+
+const (
+	zeroFlagMask = 0x01
+	signFlagMask = 0x02
 )
 
+// result of some instruction that raised neither flag, what a vm starts with
+const noFlags int8 = 1
+
+// bytes of output a vm holds before handing them to its writer
+const outputFlushSize = 4096
+
+// RunStatus tells where a bounded run stopped
+// Halted - the program reached leave
+// BudgetExhausted - every step it was given ran, Run picks up from there
+// Fault - pc points at a word that is not an instruction, or at a ret with nowhere to return to
+type RunStatus uint8
+
 const (
-	metasmMagic = "metasm v_1_0"
+	Halted RunStatus = iota
+	BudgetExhausted
+	Fault
 )
 
-type vmstate struct {
-	pc     uint32
-	acc    uint16
-	memory [256]uint16
+func (status RunStatus) String() string {
+	switch status {
+	case Halted:
+		return "halted"
+	case BudgetExhausted:
+		return "budget exhausted"
+	case Fault:
+		return "fault"
+	}
+	return "unknown"
 }
 
-func LoadSrcIntoMemory(path string, memory *[256]uint16) error {
-	var stream, err = os.Open(path)
-	if err != nil {
-		return err
+var ErrNeedsWideEngine = errors.New("image is wide, only the wide engine runs it")
+
+// Unbounded is a step budget that never runs out
+const Unbounded = math.MaxUint64
+
+// flags are evaluated lazily, just like in the C++ engines: a vm keeps the 8-bit result of the last
+// instruction that wrote them and branches read zf and sf straight off it
+func flagsOf(result int8) uint8 {
+	var flags uint8
+	if result == 0 {
+		flags |= zeroFlagMask
 	}
+	if result < 0 {
+		flags |= signFlagMask
+	}
+	return flags
+}
 
-	var magic = make([]byte, len(metasmMagic))
+// return addresses of the branches taken so far, a ring of 256 entries. Once it's full a push
+// overwrites the oldest entry, popping an empty stack leaves the depth at zero. Run faults before a
+// ret gets that far
+type returnStack struct {
+	slots [256]uint8
+	// wraps around on its own
+	top   uint8
+	depth uint16
+}
 
-	_, err = stream.Read(magic)
-	if err != nil {
-		return err
+func (stack *returnStack) push(pc uint8) {
+	stack.slots[stack.top] = pc
+	stack.top++
+	if stack.depth < 256 {
+		stack.depth++
 	}
+}
 
-	if string(magic) != metasmMagic {
-		return errors.New("incorrect magic value")
+func (stack *returnStack) pop() uint8 {
+	if stack.depth != 0 {
+		stack.depth--
 	}
+	stack.top--
+	return stack.slots[stack.top]
+}
 
+// Machine is a vm of either kind, as New picks it for an image
+type Machine interface {
+	// Run executes at most maxSteps instructions and stops, whatever was printed until then goes to
+	// the writer. A halted or faulted program stays where it is
+	Run(maxSteps uint64) RunStatus
+	Acc() int8
+	Flags() uint8
+	// Retired counts the instructions Run executed so far
+	Retired() uint64
+	// Output is what the program printed and nobody took yet, all of it if there is no writer
+	Output() []byte
+}
+
+// New starts a vm off an image, on the engine the image needs. data is written over its data
+// section first, out receives everything the program prints, nil keeps it in Output
+func New(image *Image, data []uint16, out io.Writer) Machine {
+	if image.Wide() {
+		return NewWideVM(image, data, out)
+	}
+	vm, _ := NewVM(image, data, out)
+	return vm
+}
+
+// VM runs single-bank programs, the ones of v1 and v2 images, with the semantics of the C++
+// Interpreter: 8-bit acc and pc, 256 words of memory, and branches that push their own pc
+type VM struct {
+	acc        int8
+	pc         uint8
+	flagResult int8
+	memory     [BankCapacity]uint16
+	stack      returnStack
+	retired    uint64
+	output     []byte
+	writer     io.Writer
+}
+
+// NewVM loads a single-bank image without running it, data is written over its data section
+// first. A wide image leaves a vm that halts right away
+func NewVM(image *Image, data []uint16, out io.Writer) (*VM, error) {
+	vm := &VM{writer: out, flagResult: noFlags}
+	if image.Wide() {
+		vm.memory[0] = uint16(opLeave) << 8
+		return vm, ErrNeedsWideEngine
+	}
+
+	image.CopyInto(vm.memory[:])
+	layout := image.Layout()
+	if int(layout.DataStart) < BankCapacity {
+		copy(vm.memory[layout.DataStart:], data)
+	}
+	vm.pc = uint8(layout.Entry)
+	return vm, nil
+}
+
+func (vm *VM) Acc() int8 { return vm.acc }
+
+func (vm *VM) PC() uint8 { return vm.pc }
+
+func (vm *VM) Flags() uint8 { return flagsOf(vm.flagResult) }
+
+func (vm *VM) Retired() uint64 { return vm.retired }
+
+func (vm *VM) Output() []byte { return vm.output }
+
+// Memory is the memory bank as the program left it, not a copy
+func (vm *VM) Memory() *[BankCapacity]uint16 { return &vm.memory }
+
+func (vm *VM) Run(maxSteps uint64) RunStatus {
+	// registers live in locals for the length of the loop
 	var (
-		magicLen        = (C.int)(len(metasmMagic))
-		buffer   *int16 = (*int16)(C.readBinaryData(C.CString(path), magicLen))
+		acc    = vm.acc
+		pc     = vm.pc
+		flag   = vm.flagResult
+		memory = &vm.memory
+		stack  = &vm.stack
+		output = vm.output
+		status = BudgetExhausted
+		steps  uint64
 	)
 
-	if unsafe.Pointer(buffer) == C.NULL {
-		return errors.New("buffer is NULL")
+	for ; ; steps++ {
+		word := memory[pc]
+		opcode := uint8(word >> 8)
+		if opcode == opLeave {
+			status = Halted
+			break
+		}
+		if opcode >= isaCount || (opcode == opRet && stack.depth == 0) {
+			status = Fault
+			break
+		}
+		if steps == maxSteps {
+			break
+		}
+
+		operand := uint8(word)
+		switch opcode {
+		case opAddi:
+			acc += int8(operand)
+			flag = acc
+		case opAdd:
+			acc += int8(memory[operand])
+			flag = acc
+		case opSubi:
+			acc -= int8(operand)
+			flag = acc
+		case opSub:
+			acc -= int8(memory[operand])
+			flag = acc
+		case opClac:
+			acc = 0
+			flag = 0
+		case opBnz:
+			if flag != 0 {
+				stack.push(pc)
+				pc = operand - 1
+			}
+		case opBz:
+			if flag == 0 {
+				stack.push(pc)
+				pc = operand - 1
+			}
+		case opUcb:
+			stack.push(pc)
+			pc = operand - 1
+		case opBig:
+			if flag > 0 {
+				stack.push(pc)
+				pc = operand - 1
+			}
+		case opBil:
+			if flag < 0 {
+				stack.push(pc)
+				pc = operand - 1
+			}
+		case opRet:
+			pc = stack.pop()
+		case opStr:
+			// acc is sign-extended into the word
+			memory[operand] = uint16(int16(acc))
+		case opCmp:
+			flag = acc - int8(memory[operand])
+		case opCmpi:
+			flag = acc - int8(operand)
+		case opOutd:
+			output = strconv.AppendInt(output, int64(acc), 10)
+			output = vm.spill(output)
+		case opOutb:
+			output = append(output, byte(acc))
+			output = vm.spill(output)
+		case opSubmem:
+			memory[operand]--
+		case opAddmem:
+			memory[operand]++
+		}
+		pc++
 	}
 
-	return nil
+	vm.acc, vm.pc, vm.flagResult = acc, pc, flag
+	vm.retired += steps
+	vm.output = vm.flush(output)
+	return status
+}
+
+// hands output to the writer once there is enough of it
+func (vm *VM) spill(output []byte) []byte {
+	if vm.writer != nil && len(output) >= outputFlushSize {
+		return vm.flush(output)
+	}
+	return output
+}
+
+func (vm *VM) flush(output []byte) []byte {
+	if vm.writer == nil || len(output) == 0 {
+		return output
+	}
+	// a writer that fails only loses the output, the program runs on
+	_, _ = vm.writer.Write(output)
+	return output[:0]
 }
@@ -0,0 +1,233 @@
+package vm
+
+import (
+	"bytes"
+	"encoding/binary"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strings"
+	"testing"
+	"time"
+)
+
+func word(opcode uint8, operand uint8) uint16 {
+	return uint16(opcode)<<8 | uint16(operand)
+}
+
+// v2 image of code and data, laid out the way the assembler writes one
+func makeImage(code []uint16, data []uint16, entry uint8) []byte {
+	const codeOffset = 48
+	dataOffset := codeOffset + 2*len(code)
+	out := make([]byte, dataOffset+2*len(data))
+	copy(out, metasmMagicV2)
+
+	header := out[imageHeaderOffset:]
+	binary.LittleEndian.PutUint32(header[0:], codeOffset)
+	binary.LittleEndian.PutUint32(header[4:], uint32(dataOffset))
+	binary.LittleEndian.PutUint16(header[16:], uint16(len(code)))
+	binary.LittleEndian.PutUint16(header[18:], uint16(len(data)))
+	header[20] = dataSectionStart
+	header[21] = entry
+	for i, w := range code {
+		binary.LittleEndian.PutUint16(out[codeOffset+2*i:], w)
+	}
+	for i, w := range data {
+		binary.LittleEndian.PutUint16(out[dataOffset+2*i:], w)
+	}
+	return out
+}
+
+func mustLoad(t testing.TB, bytes []byte) *Image {
+	image, err := LoadImage(bytes)
+	if err != nil {
+		t.Fatal(err)
+	}
+	return image
+}
+
+func runToEnd(t testing.TB, image *Image, data []uint16) (Machine, string) {
+	machine := New(image, data, nil)
+	if status := machine.Run(Unbounded); status != Halted {
+		t.Fatalf("run ended with %v", status)
+	}
+	return machine, string(machine.Output())
+}
+
+func TestPrograms(t *testing.T) {
+	cases := []struct {
+		name   string
+		code   []uint16
+		data   []uint16
+		output string
+	}{
+		{"hello", []uint16{word(opClac, 0), word(opAddi, 72), word(opOutb, 0), word(opClac, 0), word(opAddi, 105),
+			word(opOutb, 0), word(opLeave, 0)}, nil, "Hi"},
+		{"countdown", []uint16{word(opSubmem, 0xF0), word(opClac, 0), word(opAdd, 0xF0), word(opOutd, 0),
+			word(opBnz, 0), word(opLeave, 0)}, []uint16{3}, "210"},
+		// bz pushes its own slot as well, so the first ret lands right after it
+		{"call", []uint16{word(opUcb, 3), word(opOutb, 0), word(opLeave, 0), word(opClac, 0), word(opAddi, 33),
+			word(opCmpi, 33), word(opBz, 8), word(opOutd, 0), word(opRet, 0)}, nil, "33!"},
+		// big is not taken right after clac, whatever the sign of the result before it
+		{"lazy flags", []uint16{word(opClac, 0), word(opSubi, 1), word(opCmpi, 1), word(opBil, 6), word(opOutd, 0),
+			word(opLeave, 0), word(opClac, 0), word(opBig, 4), word(opAddi, 35), word(opAddi, 0), word(opOutb, 0),
+			word(opCmpi, 35), word(opBz, 4)}, nil, "#35"},
+		// stores into code are executed as they were stored
+		{"self-modifying", []uint16{word(opClac, 0), word(opAddi, 65), word(opStr, 4), word(opClac, 0),
+			word(opOutd, 0), word(opOutb, 0), word(opLeave, 0)}, nil, "A"},
+		// no flag is up before the first instruction that writes them
+		{"initial flags", []uint16{word(opBz, 3), word(opAddi, 49), word(opOutb, 0), word(opLeave, 0)}, nil, "1"},
+		{"negative", []uint16{word(opClac, 0), word(opSubi, 128), word(opOutd, 0), word(opAddi, 1), word(opOutd, 0),
+			word(opLeave, 0)}, nil, "-128-127"},
+	}
+
+	for _, c := range cases {
+		_, output := runToEnd(t, mustLoad(t, makeImage(c.code, c.data, 0)), nil)
+		if output != c.output {
+			t.Errorf("%s: printed %q, expected %q", c.name, output, c.output)
+		}
+	}
+}
+
+func TestBoundedRun(t *testing.T) {
+	image := mustLoad(t, makeImage([]uint16{word(opAddi, 1), word(opUcb, 0)}, nil, 0))
+	vm, _ := NewVM(image, nil, nil)
+	if status := vm.Run(1000); status != BudgetExhausted || vm.Retired() != 1000 || vm.Acc() != 500%256-256 {
+		t.Fatalf("status %v after %d steps, acc %d", status, vm.Retired(), vm.Acc())
+	}
+
+	// a ret with nowhere to return to faults before it runs
+	faulting := mustLoad(t, makeImage([]uint16{word(opClac, 0), word(opRet, 0)}, nil, 0))
+	vm, _ = NewVM(faulting, nil, nil)
+	if status := vm.Run(Unbounded); status != Fault || vm.PC() != 1 {
+		t.Fatalf("status %v at %d", status, vm.PC())
+	}
+}
+
+func TestImages(t *testing.T) {
+	// v1 is a raw dump right after the preamble
+	v1 := append([]byte(metasmMagic+"\x00"), 0, 0, 0, 0)
+	binary.LittleEndian.PutUint16(v1[preambleSize:], word(opAddi, 7))
+	binary.LittleEndian.PutUint16(v1[preambleSize+2:], word(opOutd, 0))
+	v1 = append(v1, 0, byte(opLeave))
+	if _, output := runToEnd(t, mustLoad(t, v1), nil); output != "7" {
+		t.Errorf("v1 printed %q", output)
+	}
+
+	// data overrides land in the data section, the entry comes from the header
+	v2 := makeImage([]uint16{word(opOutb, 0), word(opLeave, 0), word(opAdd, 0xF0), word(opUcb, 0)}, []uint16{1}, 2)
+	results := RunData(mustLoad(t, v2), [][]uint16{{65}, {66}, {}}, 0, 2)
+	if string(results[0].Output) != "A" || string(results[1].Output) != "B" || string(results[2].Output) != "\x01" {
+		t.Errorf("data sets printed %q %q %q", results[0].Output, results[1].Output, results[2].Output)
+	}
+
+	for _, broken := range [][]byte{v2[:imageHeaderOffset+4], v2[:len(v2)-1], []byte("metasm v_9_0\x00")} {
+		if _, err := LoadImage(broken); err == nil {
+			t.Errorf("loaded a broken image")
+		}
+	}
+}
+
+func TestWideImage(t *testing.T) {
+	// add of an address past the first bank, wide memory operands live in the word after them
+	const at = 0x1234
+	code := []uint16{uint16(opAdd|wideOpcodeBit) << 8, at, word(opOutd, 0), word(opLeave, 0)}
+	out := make([]byte, 48+2*len(code)+2)
+	copy(out, metasmMagicV3)
+	header := out[imageHeaderOffset:]
+	binary.LittleEndian.PutUint32(header[0:], 48)
+	binary.LittleEndian.PutUint32(header[4:], uint32(48+2*len(code)))
+	binary.LittleEndian.PutUint32(header[8:], uint32(len(code)))
+	binary.LittleEndian.PutUint32(header[12:], 1)
+	binary.LittleEndian.PutUint32(header[16:], at)
+	for i, w := range code {
+		binary.LittleEndian.PutUint16(out[48+2*i:], w)
+	}
+	binary.LittleEndian.PutUint16(out[48+2*len(code):], 42)
+
+	image := mustLoad(t, out)
+	if _, err := NewVM(image, nil, nil); err != ErrNeedsWideEngine {
+		t.Errorf("single-bank vm took a wide image")
+	}
+	if _, output := runToEnd(t, image, nil); output != "42" {
+		t.Errorf("wide image printed %q", output)
+	}
+}
+
+// images of the benchmark corpus, assembled by the go_bench target of bench/
+func corpus(t testing.TB) []string {
+	dir := os.Getenv("METACPU_CORPUS")
+	if dir == "" {
+		t.Skip("METACPU_CORPUS does not point at assembled corpus images")
+	}
+	images, _ := filepath.Glob(filepath.Join(dir, "*.bin"))
+	if len(images) == 0 {
+		t.Skipf("no images in %s", dir)
+	}
+	return images
+}
+
+// every image of the corpus has to print what the C++ vm prints for it
+func TestCorpusAgainstReference(t *testing.T) {
+	reference := os.Getenv("METACPU_VM")
+	if reference == "" {
+		t.Skip("METACPU_VM does not point at metacpu_vm")
+	}
+	for _, path := range corpus(t) {
+		expected, err := exec.Command(reference, path).Output()
+		if err != nil {
+			t.Fatalf("%s: %v", path, err)
+		}
+		image, err := OpenImage(path)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if _, output := runToEnd(t, image, nil); output != string(expected) {
+			t.Errorf("%s: printed %d bytes, the reference %d", filepath.Base(path), len(output), len(expected))
+		}
+	}
+}
+
+// ns per retired instruction of every corpus program, comparable to the rows of metacpu_bench
+func BenchmarkCorpus(b *testing.B) {
+	for _, path := range corpus(b) {
+		image, err := OpenImage(path)
+		if err != nil {
+			b.Fatal(err)
+		}
+		name := strings.TrimSuffix(filepath.Base(path), ".bin")
+		machine, _ := runToEnd(b, image, nil)
+		instructions := float64(machine.Retired())
+
+		b.Run(name, func(b *testing.B) {
+			var sink bytes.Buffer
+			start := time.Now()
+			for i := 0; i < b.N; i++ {
+				sink.Reset()
+				New(image, nil, &sink).Run(Unbounded)
+			}
+			ns := float64(time.Since(start).Nanoseconds()) / float64(b.N) / instructions
+			b.ReportMetric(ns, "ns/insn")
+			b.ReportMetric(1e3/ns, "MIPS")
+		})
+	}
+}
+
+// the whole corpus over a batch of data sets, on every cpu
+func BenchmarkCorpusBatch(b *testing.B) {
+	for _, path := range corpus(b) {
+		image, err := OpenImage(path)
+		if err != nil {
+			b.Fatal(err)
+		}
+		jobs := make([]Job, 64)
+		for i := range jobs {
+			jobs[i] = Job{Image: image}
+		}
+		b.Run(strings.TrimSuffix(filepath.Base(path), ".bin"), func(b *testing.B) {
+			for i := 0; i < b.N; i++ {
+				RunBatch(jobs, 0)
+			}
+		})
+	}
+}
@@ -0,0 +1,195 @@
+package vm
+
+import (
+	"io"
+	"strconv"
+)
+
+// opcodes whose operand is an address, the only ones that have a wide form
+const memoryOperandOpcodes = 1<<opAdd | 1<<opSub | 1<<opBnz | 1<<opBz | 1<<opUcb | 1<<opStr | 1<<opCmp |
+	1<<opBig | 1<<opBil | 1<<opSubmem | 1<<opAddmem
+
+// return stack of wide programs, the same ring with 16-bit addresses
+type wideReturnStack struct {
+	slots [256]uint16
+	top   uint8
+	depth uint16
+}
+
+func (stack *wideReturnStack) push(pc uint16) {
+	stack.slots[stack.top] = pc
+	stack.top++
+	if stack.depth < 256 {
+		stack.depth++
+	}
+}
+
+func (stack *wideReturnStack) pop() uint16 {
+	if stack.depth != 0 {
+		stack.depth--
+	}
+	stack.top--
+	return stack.slots[stack.top]
+}
+
+// WideVM runs wide programs, the ones of v3 images, with the semantics of the C++
+// WideInterpreter: pc and memory operands are 16 bits, memory is a single flat bank of
+// WideAddressSpace words, and a memory instruction takes two words. Branches push the address
+// of the instruction after them, ret goes straight there
+type WideVM struct {
+	acc        int8
+	pc         uint16
+	flagResult int8
+	memory     []uint16
+	stack      wideReturnStack
+	retired    uint64
+	output     []byte
+	writer     io.Writer
+	ready      bool
+}
+
+// NewWideVM loads a wide image without running it, data is written over its data section first.
+// Any other image leaves a vm that faults right away
+func NewWideVM(image *Image, data []uint16, out io.Writer) *WideVM {
+	vm := &WideVM{writer: out, flagResult: noFlags}
+	if !image.Wide() {
+		return vm
+	}
+
+	vm.memory = make([]uint16, WideAddressSpace)
+	image.CopyInto(vm.memory)
+	layout := image.Layout()
+	copy(vm.memory[layout.DataStart:], data)
+	vm.pc = uint16(layout.Entry)
+	vm.ready = true
+	return vm
+}
+
+func (vm *WideVM) Acc() int8 { return vm.acc }
+
+func (vm *WideVM) PC() uint16 { return vm.pc }
+
+func (vm *WideVM) Flags() uint8 { return flagsOf(vm.flagResult) }
+
+func (vm *WideVM) Retired() uint64 { return vm.retired }
+
+func (vm *WideVM) Output() []byte { return vm.output }
+
+// Memory is the address space as the program left it, not a copy
+func (vm *WideVM) Memory() []uint16 { return vm.memory }
+
+func (vm *WideVM) Run(maxSteps uint64) RunStatus {
+	if !vm.ready {
+		return Fault
+	}
+
+	var (
+		acc    = vm.acc
+		pc     = vm.pc
+		flag   = vm.flagResult
+		memory = vm.memory[:WideAddressSpace]
+		output = vm.output
+		status = BudgetExhausted
+		steps  uint64
+	)
+
+	for ; ; steps++ {
+		word := memory[pc]
+		wide := (word>>8)&wideOpcodeBit != 0
+		opcode := uint8(word>>8) &^ wideOpcodeBit
+		if word == uint16(opLeave)<<8 {
+			status = Halted
+			break
+		}
+		if opcode >= isaCount || (wide && memoryOperandOpcodes&(1<<opcode) == 0) ||
+			(opcode == opRet && vm.stack.depth == 0) {
+			status = Fault
+			break
+		}
+		if steps == maxSteps {
+			break
+		}
+
+		value := word & 0xFF
+		next := pc + 1
+		if wide {
+			value = memory[next]
+			next = pc + 2
+		}
+
+		// taken branches leave the address of the next instruction behind
+		taken := false
+		switch opcode {
+		case opAddi:
+			acc += int8(value)
+			flag = acc
+		case opAdd:
+			acc += int8(memory[value])
+			flag = acc
+		case opSubi:
+			acc -= int8(value)
+			flag = acc
+		case opSub:
+			acc -= int8(memory[value])
+			flag = acc
+		case opClac:
+			acc = 0
+			flag = 0
+		case opBnz:
+			taken = flag != 0
+		case opBz:
+			taken = flag == 0
+		case opUcb:
+			taken = true
+		case opBig:
+			taken = flag > 0
+		case opBil:
+			taken = flag < 0
+		case opRet:
+			next = vm.stack.pop()
+		case opStr:
+			memory[value] = uint16(int16(acc))
+		case opCmp:
+			flag = acc - int8(memory[value])
+		case opCmpi:
+			flag = acc - int8(value)
+		case opOutd:
+			output = strconv.AppendInt(output, int64(acc), 10)
+			output = vm.spill(output)
+		case opOutb:
+			output = append(output, byte(acc))
+			output = vm.spill(output)
+		case opSubmem:
+			memory[value]--
+		case opAddmem:
+			memory[value]++
+		case opLeave:
+			// leave with an operand is no leave here, the C++ engine reports it as unknown and moves on
+		}
+		if taken {
+			vm.stack.push(next)
+			next = value
+		}
+		pc = next
+	}
+
+	vm.acc, vm.pc, vm.flagResult = acc, pc, flag
+	vm.retired += steps
+	vm.output = vm.flush(output)
+	return status
+}
+
+func (vm *WideVM) spill(output []byte) []byte {
+	if vm.writer != nil && len(output) >= outputFlushSize {
+		return vm.flush(output)
+	}
+	return output
+}
+
+func (vm *WideVM) flush(output []byte) []byte {
+	if vm.writer == nil || len(output) == 0 {
+		return output
+	}
+	_, _ = vm.writer.Write(output)
+	return output[:0]
+}
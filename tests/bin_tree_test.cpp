@@ -1,88 +1,121 @@
 #include <bin_tree.h>
 #include <cassert>
 #include <cstring>
-
-#define CLEANUP_ASSERT(n, cond) \
-if (!(cond)) {                  \
-    free(n);                    \
-    n = nullptr;                \
-    assert(false);              \
+#include <string>
+#include <vector>
+#include "check.h"
+
+// height of a subtree, checking on the way that it's ordered, linked up and balanced, under NDEBUG too
+static int8_t checkSubtree(const Node *node, const Node *parent) {
+    if (!node) {
+        return 0;
+    }
+
+    CHECK(node->parent == parent && "parent link is broken");
+    CHECK((!node->left || node->left->name < node->name) && "left kid must go first");
+    CHECK((!node->right || node->name < node->right->name) && "right kid must go last");
+
+    const auto left = checkSubtree(node->left, node);
+    const auto right = checkSubtree(node->right, node);
+    CHECK(left - right <= 1 && right - left <= 1 && "subtrees drifted apart");
+    CHECK(node->height == (left > right ? left : right) + 1 && "stale height");
+    return node->height;
 }
 
-static void testNode(Node* subject, const char* expectedName, const uint8_t expectedVal,
-                     Node* expectedParent) {
-
-    assert(subject != nullptr && "node is nullptr!!!");
-    CLEANUP_ASSERT(subject, strcmp(subject->name, expectedName) == 0);
-    CLEANUP_ASSERT(subject, subject->value == expectedVal);
-    CLEANUP_ASSERT(subject, subject->parent == expectedParent);
+static void testNode(const Node *subject, const char *expectedName, const uint8_t expectedVal) {
+    CHECK(subject != nullptr && "node is nullptr!!!");
+    CHECK(subject->name == expectedName);
+    CHECK(subject->value == expectedVal);
 }
 
 static void compoundTest() {
+    BinTree tree;
 
     // inserting an element
-    Node *root = nullptr;
-    const char *name = "root";
-    const uint8_t value = 0x69;
-    root = insert(root, name, value);
-    testNode(root, name, value, nullptr);
-
-    const char* kid1_name = "kid1";
-    const uint8_t kid1_value = 0x70;
-    const auto kid1 = insert(root, kid1_name, kid1_value);
-    testNode(kid1, kid1_name, kid1_value, root);
-
-    const char* kid2_name = "kid2";
-    const uint8_t kid2_value = 0x71;
-    const auto kid2 = insert(root, kid2_name, kid2_value);
-    testNode(kid2, kid2_name, kid2_value, kid1);
-
-    Node* kid2_succ{nullptr};
-    findIos(kid2, kid2_succ);
-    assert(kid2_succ && "should have found a successor of kid2");
-    assert(kid2_succ == root && "kid2's successor must be the root");
-
-    const char* kid3_name = "zigmund";
-    const uint8_t kid3_value = 0x72;
-    const auto kid3 = insert(root, kid3_name, kid3_value);
-    testNode(kid3, kid3_name, kid3_value, root);
-
-    Node* kid3_succ{nullptr};
-    findIos(kid3, kid3_succ);
-    assert(!kid3_succ && "kid3 does not have a successor");
-
-    const char* kid4_name = "watt";
-    const uint8_t kid4_value = 0x73;
-    const auto kid4 = insert(root, kid4_name, kid4_value);
-    testNode(kid4, kid4_name, kid4_value, kid3);
+    const auto root = tree.insert("root", 0x69);
+    testNode(root, "root", 0x69);
+    assert(tree.root() == root && !root->parent);
+
+    const auto kid1 = tree.insert("kid1", 0x70);
+    testNode(kid1, "kid1", 0x70);
+    assert(kid1->parent == root);
+
+    // kid2 would go below kid1, which makes the tree rotate kid2 up
+    const auto kid2 = tree.insert("kid2", 0x71);
+    testNode(kid2, "kid2", 0x71);
+    assert(tree.root() == kid2 && kid2->left == kid1 && kid2->right == root);
+    checkSubtree(tree.root(), nullptr);
+
+    const auto kid3 = tree.insert("zigmund", 0x72);
+    const auto kid4 = tree.insert("watt", 0x73);
+    testNode(kid3, "zigmund", 0x72);
+    testNode(kid4, "watt", 0x73);
+    checkSubtree(tree.root(), nullptr);
+
+    // names are unique
+    CHECK(!tree.insert("watt", 0x74));
+    assert(tree.size() == 5);
 
     // finding an element
-    auto supposed_to_find = find(root, kid1_name);
-    assert(supposed_to_find && "find() supposed to find this node");
-    assert(strcmp(supposed_to_find->name, kid1_name) == 0 && "names should have matched");
-
-    auto not_supposed_to_find = find(root, "ahalai-mahalai");
-    assert(!not_supposed_to_find && "should not have found a node");
-
-    // in-order predecessor
-//    Node* iop;
-//    findIop(root, iop);
-//    assert(strcmp(iop->name, kid2_name) == 0 && "should be a kid2");
-
-    // in-order successor
-    Node* ios;
-    findIos(root, ios);
-    assert(strcmp(ios->name, kid4_name) == 0 && "should be a kid4");
-
-    // removing an element
-    auto success = remove(root, "kid2");
-    assert(success && "failed to remove an item");
-
-    success = remove(root, "root");
-    assert(success && "failed to remove an item");
+    assert(tree.find("kid1") == kid1);
+    assert(!tree.find("ahalai-mahalai") && "should not have found a node");
+
+    // in-order neighbours
+    assert(BinTree::successor(kid1) == kid2 && BinTree::successor(root) == kid4);
+    assert(!BinTree::successor(kid3) && "zigmund does not have a successor");
+    assert(BinTree::predecessor(kid4) == root && !BinTree::predecessor(kid1));
+
+    // removing a node with two kids keeps every other node where it was
+    CHECK(tree.remove("kid2"));
+    assert(!tree.find("kid2") && tree.find("kid1") == kid1 && tree.find("watt") == kid4);
+    checkSubtree(tree.root(), nullptr);
+
+    CHECK(tree.remove("root"));
+    CHECK(!tree.remove("root") && "can't remove a node twice");
+    assert(tree.size() == 3);
+    checkSubtree(tree.root(), nullptr);
+
+    // removed nodes are handed out again
+    const auto reused = tree.insert("kid5", 0x75);
+    CHECK((reused == kid2 || reused == root) && "free list was not used");
+}
 
+static void testBalance() {
+    // names coming in sorted used to turn the tree into a linked list
+    std::vector<std::string> names;
+    for (int i = 0; i < 1000; ++i) {
+        char name[8];
+        snprintf(name, sizeof(name), "n%04d", i);
+        names.emplace_back(name);
+    }
+
+    BinTree tree;
+    for (size_t i = 0; i < names.size(); ++i) {
+        CHECK(tree.insert(names[i], static_cast<uint8_t>(i)));
+    }
+    CHECK(checkSubtree(tree.root(), nullptr) <= 14 && "1000 nodes fit into 1.44 log2 n levels");
+
+    // in-order walk visits every name in order
+    size_t visited = 0;
+    for (auto node = tree.first(); node; node = BinTree::successor(node), ++visited) {
+        assert(node->name == names[visited]);
+    }
+    assert(visited == names.size());
+
+    for (size_t i = 0; i < names.size(); i += 2) {
+        CHECK(tree.remove(names[i]));
+    }
+    checkSubtree(tree.root(), nullptr);
+    assert(tree.size() == names.size() / 2);
+    for (size_t i = 0; i < names.size(); ++i) {
+        assert((tree.find(names[i]) != nullptr) == (i % 2 == 1));
+    }
+
+    tree.clear();
+    assert(!tree.root() && !tree.size());
 }
 
-int main(int argc, const char* argv[]) {
+int main() {
     compoundTest();
+    testBalance();
 }
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+// assert that still evaluates its condition under NDEBUG, for conditions that do work the rest of
+// a test relies on: writing a file, opening an image, running a program. Pure checks stay asserts
+#define CHECK(cond)                                                                     \
+    do {                                                                                \
+        if (!(cond)) {                                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);    \
+            abort();                                                                    \
+        }                                                                               \
+    } while (0)
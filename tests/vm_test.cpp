@@ -0,0 +1,888 @@
+#include <vm.h>
+#include <jit.h>
+#include <batch.h>
+#include <lockstep.h>
+#include <snapshot.h>
+#include <specialize.h>
+#include <cache.h>
+#include <server.h>
+#include <trace.h>
+#include <task.h>
+#include <wide.h>
+#include <tools.h>
+#include <linker.h>
+#include <optimizer.h>
+#include <metrics.h>
+#include "check.h"
+#include <cassert>
+#include <cstdio>
+#include <map>
+#include <thread>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+static constexpr DispatchMode all_modes[] = {
+        DispatchMode::SWITCH,
+        DispatchMode::THREADED,
+        DispatchMode::FUSED,
+        DispatchMode::JIT,
+};
+
+static std::vector<uint16_t> makeImage(std::initializer_list<uint16_t> code,
+                                       std::initializer_list<uint16_t> data = {}) {
+    std::vector<uint16_t> image(memory_bank_size, 0);
+    std::copy(code.begin(), code.end(), image.begin());
+    std::copy(data.begin(), data.end(), image.begin() + data_section_start);
+    return image;
+}
+
+static std::string runImage(const std::vector<uint16_t> &image, const DispatchMode mode) {
+    std::string output;
+    {
+        StringSink sink(output, 2);
+        Interpreter interp(image.data(), image.size(), mode, &sink);
+    }
+    return output;
+}
+
+static void expectSameOutputEverywhere(const std::vector<uint16_t> &image, const char *expected) {
+    for (const auto mode: all_modes) {
+        const auto output = runImage(image, mode);
+        if (output != expected) {
+            fprintf(stderr, "mode %d printed '%s', expected '%s'\n", static_cast<int>(mode), output.c_str(), expected);
+            assert(false && "engines disagree");
+        }
+    }
+}
+
+static void testStraightLine() {
+    // clac; addi 72; outb; clac; addi 105; outb; leave
+    const auto image = makeImage({CLAC, ADDI | 72, OUTB, CLAC, ADDI | 105, OUTB, LEAVE});
+    expectSameOutputEverywhere(image, "Hi");
+}
+
+static void testCounterLoop() {
+    // 0: submem counter; 1: clac; 2: add counter; 3: outd; 4: bnz 0; 5: leave
+    const auto image = makeImage({SUBMEM | 0xF0, CLAC, ADD | 0xF0, OUTD, BNZ | 0x00, LEAVE}, {3});
+    expectSameOutputEverywhere(image, "210");
+}
+
+static void testSubroutine() {
+    // 0: ucb 3; 1: outb; 2: leave; 3: clac; 4: addi 33; 5: cmpi 33; 6: bz 8; 7: outd; 8: ret
+    const auto image = makeImage({UCB | 3, OUTB, LEAVE, CLAC, ADDI | 33, CMPI | 33, BZ | 8, OUTD, RET});
+    // bz pushes its own slot as well, so the first ret lands right after it
+    expectSameOutputEverywhere(image, "33!");
+}
+
+static void testLazyFlags() {
+    // 0: clac; 1: subi 1; 2: cmpi 1; 3: bil 6; 4: outd; 5: leave; 6: clac; 7: big 4; 8: addi 35;
+    // 9: addi 0; 10: outb; 11: cmpi 35; 12: bz 4
+    const auto image = makeImage({CLAC, SUBI | 1, CMPI | 1, BIL | 6, OUTD, LEAVE, CLAC, BIG | 4, ADDI | 35,
+                                  ADDI | 0, OUTB, CMPI | 35, BZ | 4});
+    // big is not taken right after clac, whatever the sign of the result before it
+    expectSameOutputEverywhere(image, "#35");
+
+    VmState state;
+    state.memory = image;
+    Interpreter interp(state);
+    CHECK(interp.run(3) == RunStatus::BUDGET_EXHAUSTED && interp.state().flags == sign_flag_mask);
+
+    // writes overwritten by the next instruction are dropped, the ones a branch reads are kept
+    DecodedInsn program[decoded_program_size];
+    decodeProgram(image.data(), data_section_start, program);
+    dropDeadFlagWrites(program, image.data(), data_section_start);
+    assert(program[0].handler == H_CLAC_NOFLAGS && program[1].handler == H_SUBI_NOFLAGS);
+    assert(program[2].handler == H_CMPI && program[6].handler == H_CLAC && program[8].handler == H_ADDI_NOFLAGS);
+    assert(program[9].handler == H_ADDI && program[11].handler == H_CMPI);
+
+    // rewriting the instruction that made a write dead brings the write back
+    invalidateDecodedSlot(program, 9);
+    assert(program[8].handler == H_DECODE);
+}
+
+static void testSelfModifyingStore() {
+    // stores 'A' (0x0041, i.e. addi 65) over the outd at slot 4
+    const auto image = makeImage({CLAC, ADDI | 65, STR | 4, CLAC, OUTD, OUTB, LEAVE});
+    expectSameOutputEverywhere(image, "A");
+}
+
+static void testSelfModifyingLoop() {
+    // the loop keeps bumping the immediate of its own addi at slot 1
+    // 0: clac; 1: addi 60; 2: outb; 3: addmem 1; 4: submem counter; 5: clac; 6: add counter; 7: bnz 0; 8: leave
+    const auto image = makeImage(
+            {CLAC, ADDI | 60, OUTB, ADDMEM | 1, SUBMEM | 0xF0, CLAC, ADD | 0xF0, BNZ | 0x00, LEAVE}, {4});
+    expectSameOutputEverywhere(image, "<=>?");
+}
+
+static void testProfile() {
+    const char *path = "vm_test_profile.bin";
+    // same program as in testSubroutine
+    const auto image = makeImage({UCB | 3, OUTB, LEAVE, CLAC, ADDI | 33, CMPI | 33, BZ | 8, OUTD, RET});
+    CHECK(tools::cStyleWriteToFile(path, image));
+
+    MappedImage mapped;
+    CHECK(mapped.open(path));
+    std::string output;
+    Profile profile;
+    {
+        StringSink sink(output);
+        Interpreter interp(mapped, {}, DispatchMode::JIT, &sink, &profile);
+    }
+    assert(output == "33!");
+    assert(profile.total() == 9 && profile.opcodeCount(RET) == 2 && profile.hits(3) == 1);
+    assert(profile.taken(6) == 1 && profile.notTaken(6) == 0);
+
+    FILE *stream = tmpfile();
+    profile.writeFolded(stream);
+    rewind(stream);
+    char folded[128] = {};
+    CHECK(fread(folded, 1, sizeof(folded) - 1, stream) > 0);
+    fclose(stream);
+    assert(std::string(folded) == "0x00 2\n0x00;0x03 6\n0x00;0x03;0x08 1\n");
+
+    remove(path);
+}
+
+static void testCycles() {
+    // same program again: nine instructions at three cycles each, four of them redirect
+    VmState state;
+    state.memory = makeImage({UCB | 3, OUTB, LEAVE, CLAC, ADDI | 33, CMPI | 33, BZ | 8, OUTD, RET});
+
+    std::string output;
+    StringSink sink(output);
+    CycleModel cycles;
+    Interpreter interp(state, &sink);
+    interp.attachCycleModel(&cycles);
+    CHECK(interp.resume() == RunStatus::HALTED);
+    assert(cycles.instructions() == 9 && cycles.redirects() == 4 && cycles.cycles() == 31);
+    assert(cycles.opcodeCycles(RET) == 8 && cycles.cost(ADD) == cycles.cost(ADDI) + 1);
+
+    // the dispatch mode makes no difference, an attached model runs on the instrumented loop
+    const char *path = "vm_test_cycles.bin";
+    CHECK(tools::cStyleWriteToFile(path, state.memory));
+    MappedImage mapped;
+    CHECK(mapped.open(path));
+    cycles.reset();
+    {
+        Interpreter jit(mapped, {}, DispatchMode::JIT, &sink, nullptr, &cycles);
+    }
+    assert(cycles.cycles() == 31);
+    remove(path);
+}
+
+static void testBatch() {
+    const char *path = "vm_test_batch.bin";
+    // prints counter characters, counter comes from the data section
+    const auto image = makeImage({CLAC, ADDI | 48, OUTB, SUBMEM | 0xF0, CLAC, ADD | 0xF0, BNZ | 0x00, LEAVE}, {1});
+    CHECK(tools::cStyleWriteToFile(path, image));
+
+    std::vector<BatchJob> jobs;
+    for (uint16_t count = 1; count <= 64; ++count) {
+        jobs.push_back(BatchJob{path, {count}});
+    }
+    jobs.push_back(BatchJob{"does_not_exist.bin", {}});
+    // a loop that never ends runs out of budget, a stray ret faults
+    const char *looping_path = "vm_test_batch_loop.bin";
+    const char *faulting_path = "vm_test_batch_fault.bin";
+    CHECK(tools::cStyleWriteToFile(looping_path, makeImage({UCB | 0x00})));
+    CHECK(tools::cStyleWriteToFile(faulting_path, makeImage({CLAC, ADDI | 1, OUTD, RET})));
+    jobs.push_back(BatchJob{looping_path, {}});
+    jobs.push_back(BatchJob{faulting_path, {}});
+
+    for (const auto mode: all_modes) {
+        RunCache cache;
+        for (auto *run_cache: {static_cast<RunCache *>(nullptr), &cache}) {
+            const auto results = runBatch(jobs, mode, 4, run_cache, 1000);
+            assert(results.size() == jobs.size());
+            for (uint16_t count = 1; count <= 64; ++count) {
+                assert(results[count - 1].status == BatchStatus::HALTED);
+                assert(results[count - 1].output == std::string(count, '0'));
+            }
+            assert(results[64].status == BatchStatus::LOAD_FAILED);
+            assert(results[65].status == BatchStatus::BUDGET_EXHAUSTED);
+            assert(results[66].status == BatchStatus::FAULT && results[66].output == "1");
+        }
+        // neither of them was kept
+        assert(cache.misses() == 66);
+    }
+
+    remove(path);
+    remove(looping_path);
+    remove(faulting_path);
+}
+
+static std::string runFile(const char *path, const DispatchMode mode) {
+    std::string output;
+    {
+        StringSink sink(output, 2);
+        Interpreter interp(path, mode, &sink);
+    }
+    return output;
+}
+
+static void testImageV2() {
+    const char *path = "vm_test_v2.bin";
+    // starts at 2: clac; addi 65; outb; clac; add value; ucb 0, which lands on 0: outd; 1: leave
+    ImageSections sections;
+    sections.code = {OUTD, LEAVE, CLAC, ADDI | 65, OUTB, CLAC, ADD | 0xF0, UCB | 0x00};
+    sections.data = {7};
+    sections.entry = 2;
+    for (const auto slot: {0, 2, 8}) {
+        markLeader(sections.leaders, slot);
+    }
+    CHECK(tools::cStyleWriteToFile(path, sections));
+    for (const auto mode: all_modes) {
+        CHECK(runFile(path, mode) == "A7");
+    }
+
+    // same program with a decoded stream, and with a stale one the vm has to throw away
+    DecodedInsn program[decoded_program_size];
+    const auto code_end = static_cast<uint8_t>(sections.code.size());
+    decodeProgram(sections.code.data(), code_end, program);
+    fuseSuperinstructions(program, code_end, sections.leaders.data());
+    assert(program[2].handler == H_CLAC_ADDI_OUTB);
+    for (uint32_t slot = 0; slot < code_end; ++slot) {
+        sections.decoded.insert(sections.decoded.end(), {program[slot].handler, program[slot].operand, program[slot].next_pc});
+    }
+    sections.decoded_version = decoder_version;
+    for (const auto stale: {false, true}) {
+        if (stale) {
+            sections.decoded[3 * image_decoded_entry_size + 1] = 66;
+        }
+        CHECK(tools::cStyleWriteToFile(path, sections));
+        for (const auto mode: all_modes) {
+            CHECK(runFile(path, mode) == "A7");
+        }
+    }
+
+    // data overrides land in the data section the header describes
+    const auto results = runBatch({BatchJob{path, {9}}}, DispatchMode::FUSED, 1);
+    assert(results[0].status == BatchStatus::HALTED && results[0].output == "A9");
+
+    MappedImage image;
+    CHECK(image.open(path) && image.version() == 2 && image.layout().entry == 2);
+    std::vector<uint16_t> memory(memory_bank_capacity);
+    image.copyInto(memory.data(), memory.size());
+    const auto lanes = runLockstep(memory, {{1}, {2}}, DispatchMode::SWITCH, 1, image.layout());
+    assert(lanes[0].output == "A1" && lanes[1].output == "A2");
+
+    remove(path);
+}
+
+static void testSpecialize() {
+    const char *path = "vm_test_specialize.bin";
+    // clac; addi 72; outb; clac; add value; outd; leave
+    ImageSections sections;
+    sections.code = {CLAC, ADDI | 72, OUTB, CLAC, ADD | 0xF0, OUTD, LEAVE};
+    sections.data = {7};
+    CHECK(tools::cStyleWriteToFile(path, sections));
+
+    // without inputs the whole run folds into its output
+    MappedImage image;
+    CHECK(image.open(path));
+    ImageSections residual;
+    Specialization folded;
+    CHECK(specializeImage(image, 0, residual, folded));
+    assert(folded.complete && folded.folded_steps == 6 && folded.output == "H7" && residual.code.size() == 5);
+
+    // with the value as an input, the run stops at add and the residual carries on from there
+    Specialization prefix;
+    CHECK(specializeImage(image, 1, residual, prefix));
+    assert(!prefix.complete && prefix.folded_steps == 4 && residual.entry == sections.code.size());
+    CHECK(tools::cStyleWriteToFile(path, residual));
+    MappedImage specialized;
+    CHECK(specialized.open(path));
+    for (const auto mode: all_modes) {
+        std::string output;
+        {
+            StringSink sink(output);
+            Interpreter interp(specialized, {9}, mode, &sink);
+        }
+        assert(output == "H9");
+    }
+    remove(path);
+}
+
+static void testRunCache() {
+    const char *path = "vm_test_cache.bin";
+    const char *store_path = "vm_test_cache.store";
+    remove(store_path);
+    // clac; add value; outd; addmem value; leave
+    ImageSections sections;
+    sections.code = {CLAC, ADD | 0xF0, OUTD, ADDMEM | 0xF0, LEAVE};
+    sections.data = {7};
+    CHECK(tools::cStyleWriteToFile(path, sections));
+    MappedImage image;
+    CHECK(image.open(path));
+
+    CachedRun run;
+    {
+        RunCache cache(1);
+        CHECK(cache.attachStore(store_path, 64));
+        // a run that did not get to leave is not kept
+        CHECK(cache.run(image, {}, DispatchMode::JIT, 2, run) == RunStatus::BUDGET_EXHAUSTED && run.output.empty());
+        CHECK(cache.run(image, {}, DispatchMode::JIT, 100, run) == RunStatus::HALTED && run.output == "7");
+        assert(run.memory[0xF0] == 8 && cache.misses() == 2);
+        CHECK(cache.run(image, {}, DispatchMode::SWITCH, 100, run) == RunStatus::HALTED && run.output == "7");
+        assert(run.memory[0xF0] == 8 && cache.hits() == 1);
+        // other data is another run, and pushes the first one out of an LRU of one
+        CHECK(cache.run(image, {9}, DispatchMode::FUSED, 100, run) == RunStatus::HALTED && run.output == "9");
+        assert(cache.hits() == 1 && cache.misses() == 3);
+    }
+
+    // a new cache finds both in the store
+    RunCache cache;
+    CHECK(cache.attachStore(store_path));
+    CHECK(cache.run(image, {}, DispatchMode::THREADED, 100, run) == RunStatus::HALTED && run.output == "7");
+    assert(run.memory[0xF0] == 8);
+    CHECK(cache.run(image, {9}, DispatchMode::THREADED, 100, run) == RunStatus::HALTED && run.output == "9");
+    assert(run.memory[0xF0] == 10 && cache.hits() == 2 && cache.misses() == 0);
+    remove(path);
+    remove(store_path);
+}
+
+static void testServer() {
+    // clac; add value; outd; addmem value; leave
+    ImageSections sections;
+    sections.code = {CLAC, ADD | 0xF0, OUTD, ADDMEM | 0xF0, LEAVE};
+    sections.data = {7};
+    const auto bytes = imageBytes(sections);
+    // clac; addi 1; outd; ret, and a loop that never ends
+    sections.code = {CLAC, ADDI | 1, OUTD, RET};
+    const auto faulting = imageBytes(sections);
+    sections.code = {UCB | 0x00};
+    const auto looping = imageBytes(sections);
+
+    // the jit runs on compilers it keeps per image, fused off the handlers it decoded once
+    for (const auto mode: {DispatchMode::JIT, DispatchMode::FUSED}) {
+        int fds[2];
+        CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        VmServer server(mode, 2, nullptr, server_image_entries, 1000);
+        std::thread serving([&] { server.serve(fds[1], fds[1]); });
+
+        const auto send_image = [&](const uint32_t id, const std::vector<uint8_t> &image, const bool with_image,
+                                    const uint64_t max_steps, const std::vector<uint16_t> &data) {
+            ServerRequest request{};
+            request.magic = server_request_magic;
+            request.id = id;
+            request.image_size = with_image ? static_cast<uint32_t>(image.size()) : 0;
+            request.image_hash = imageHash(image.data(), image.size());
+            request.max_steps = max_steps;
+            request.data_words = static_cast<uint32_t>(data.size());
+            CHECK(write(fds[0], &request, sizeof(request)) == sizeof(request));
+            if (with_image) {
+                CHECK(write(fds[0], image.data(), image.size()) == static_cast<ssize_t>(image.size()));
+            }
+            CHECK(write(fds[0], data.data(), data.size() * 2) == static_cast<ssize_t>(data.size() * 2));
+        };
+        const auto send = [&](const uint32_t id, const bool with_image, const uint64_t max_steps,
+                              const std::vector<uint16_t> &data) { send_image(id, bytes, with_image, max_steps, data); };
+        // the rest refer to the image by its hash, the last one runs on a compiler used before
+        send(1, true, 0, {9});
+        send(2, false, 0, {});
+        send(3, false, 2, {});
+        send(4, false, 0, {9});
+        // a run that asks for no budget gets the server's
+        send_image(5, faulting, true, 0, {});
+        send_image(6, looping, true, 0, {});
+        shutdown(fds[0], SHUT_WR);
+        serving.join();
+        close(fds[1]);
+
+        std::map<uint32_t, std::pair<ServerStatus, std::string>> answers;
+        ServerResponse response{};
+        while (read(fds[0], &response, sizeof(response)) == sizeof(response)) {
+            assert(response.magic == server_response_magic);
+            std::string output(response.output_size, 0);
+            CHECK(read(fds[0], output.data(), output.size()) == static_cast<ssize_t>(output.size()));
+            answers[response.id] = {static_cast<ServerStatus>(response.status), output};
+        }
+        close(fds[0]);
+
+        assert(answers.size() == 6);
+        assert(answers[1] == std::make_pair(ServerStatus::HALTED, std::string("9")));
+        assert(answers[2] == std::make_pair(ServerStatus::HALTED, std::string("7")));
+        assert(answers[3] == std::make_pair(ServerStatus::BUDGET_EXHAUSTED, std::string()));
+        assert(answers[4] == std::make_pair(ServerStatus::HALTED, std::string("9")));
+        assert(answers[5] == std::make_pair(ServerStatus::FAULT, std::string("1")));
+        assert(answers[6] == std::make_pair(ServerStatus::BUDGET_EXHAUSTED, std::string()));
+        assert(server.metrics().find("image_hits 3\n") != std::string::npos);
+        assert(server.metrics(MetricsFormat::PROMETHEUS).find("metacpu_server_image_hits_total 3\n") != std::string::npos);
+    }
+}
+
+static void testTrace() {
+    const char *path = "vm_test_trace.bin";
+    const char *trace_path = "vm_test_trace.trace";
+    // counts inner down from 200, outer times: clac; add inner; subi 1; bnz 2; submem outer; clac; add outer; bnz 0; leave
+    ImageSections sections;
+    sections.code = {CLAC, ADD | 0xF0, SUBI | 1, BNZ | 2, SUBMEM | 0xF1, CLAC, ADD | 0xF1, BNZ, LEAVE};
+    sections.data = {200, 30};
+    CHECK(tools::cStyleWriteToFile(path, sections));
+    MappedImage image;
+    CHECK(image.open(path));
+
+    // what every step is supposed to look like, off the switch loop one instruction at a time
+    std::vector<TraceStep> expected;
+    {
+        Interpreter interp(image, {}, nullptr);
+        for (;;) {
+            const auto pc = interp.peek().pc;
+            const auto opcode = static_cast<uint8_t>(interp.peek().memory[pc] >> 8);
+            if (opcode == LEAVE >> 8) {
+                break;
+            }
+            interp.run(1);
+            expected.push_back(TraceStep{expected.size(), pc, opcode, interp.peek().acc, flags_of(interp.peek().flag_result)});
+        }
+    }
+    const auto same = [](const TraceStep &a, const TraceStep &b) {
+        return a.step == b.step && a.pc == b.pc && a.opcode == b.opcode && a.acc == b.acc && a.flags == b.flags;
+    };
+
+    // streamed, every step makes it into the file
+    {
+        TraceRecorder trace;
+        CHECK(trace.stream(trace_path));
+        std::string output;
+        StringSink sink(output);
+        Interpreter interp(image, {}, DispatchMode::FUSED, &sink, nullptr, nullptr, &trace);
+        trace.finish();
+        assert(trace.steps() == expected.size() && !trace.dropped());
+    }
+    size_t index = 0;
+    CHECK(readTrace(trace_path, [&](const TraceStep &step) {
+        CHECK(same(step, expected[index]));
+        index++;
+        return true;
+    }));
+    assert(index == expected.size());
+
+    // a ring of two chunks only keeps the end of the run, where replay may start at any step
+    {
+        TraceRecorder trace(2);
+        Interpreter interp(image, {}, nullptr);
+        interp.attachTrace(&trace);
+        CHECK(interp.resume() == RunStatus::HALTED);
+        CHECK(trace.write(trace_path));
+    }
+    uint64_t first = UINT64_MAX;
+    index = 0;
+    CHECK(readTrace(trace_path, [&](const TraceStep &step) {
+        first = std::min(first, step.step);
+        assert(same(step, expected[step.step]));
+        index++;
+        return true;
+    }));
+    assert(first > 0 && first + index == expected.size());
+    const auto middle = first + index / 2;
+    CHECK(readTrace(trace_path, [&](const TraceStep &step) {
+        CHECK(same(step, expected[middle]));
+        return false;
+    }, middle));
+
+    remove(path);
+    remove(trace_path);
+}
+
+static void testLink() {
+    const char *path = "vm_test_link.bin";
+    // 0: clac; 1: add value; 2: ucb print; 3: leave
+    ObjectFile main_object;
+    main_object.code = {CLAC, ADD, UCB, LEAVE};
+    main_object.fixups = {{1, main_object.addSymbol("value", SymbolSection::NONE, SymbolBinding::IMPORTED, 0)},
+                          {2, main_object.addSymbol("print", SymbolSection::NONE, SymbolBinding::IMPORTED, 0)}};
+    // print: outd; ucb done; done: ret, done only resolves within its own object
+    ObjectFile lib_object;
+    lib_object.code = {OUTD, UCB, RET};
+    lib_object.data = {5};
+    lib_object.addSymbol("print", SymbolSection::CODE, SymbolBinding::EXPORTED, 0);
+    lib_object.addSymbol("value", SymbolSection::DATA, SymbolBinding::EXPORTED, 0);
+    lib_object.fixups = {{1, lib_object.addSymbol("done", SymbolSection::CODE, SymbolBinding::LOCAL, 2)}};
+
+    // objects survive a round trip through a file unchanged
+    CHECK(tools::cStyleWriteToFile(path, lib_object));
+    ObjectFile loaded;
+    CHECK(tools::cStyleLoadObject(path, loaded));
+    assert(loaded.code == lib_object.code && loaded.data == lib_object.data && loaded.strings == lib_object.strings);
+
+    Linker linker;
+    linker.add(main_object, "main");
+    linker.add(loaded, "lib");
+    ImageSections image;
+    CHECK(linker.link(image));
+    assert(image.code[1] == (ADD | 0xF0) && image.code[2] == (UCB | 4) && image.code[5] == (UCB | 6));
+    CHECK(tools::cStyleWriteToFile(path, image));
+    for (const auto mode: all_modes) {
+        CHECK(runFile(path, mode) == "5");
+    }
+
+    // an import nobody exports fails the link
+    Linker unresolved;
+    unresolved.add(main_object, "main");
+    CHECK(!unresolved.link(image));
+
+    remove(path);
+}
+
+static void testOptimize() {
+    // 0: clac; 1: clac; 2: addi 72; 3: addi 0; 4: outb; 5: ucb next; next: leave; dead: outd; 8: ucb dead
+    ObjectFile object;
+    object.code = {CLAC, CLAC, ADDI | 72, ADDI, OUTB, UCB, LEAVE, OUTD, UCB};
+    object.fixups = {{5, object.addSymbol("next", SymbolSection::CODE, SymbolBinding::LOCAL, 6)},
+                     {8, object.addSymbol("dead", SymbolSection::CODE, SymbolBinding::LOCAL, 7)}};
+    [[maybe_unused]] const auto stats = optimizeObject(object);
+    assert(stats.unreachable == 2 && stats.peephole == 3);
+    assert((object.code == std::vector<uint16_t>{CLAC, ADDI | 72, OUTB, LEAVE}));
+    assert(object.fixups.empty() && object.symbols[0].value == 3);
+    expectSameOutputEverywhere(makeImage({CLAC, ADDI | 72, OUTB, LEAVE}), "H");
+
+    // a ret may come back to whatever follows a ucb, so neither the ucb nor its successor go
+    ObjectFile returning;
+    returning.code = {UCB, LEAVE, RET};
+    returning.fixups = {{0, returning.addSymbol("sub", SymbolSection::CODE, SymbolBinding::LOCAL, 2)}};
+    CHECK(optimizeObject(returning).unreachable == 0 && returning.code.size() == 3);
+
+    // code that writes its own code keeps its layout
+    ObjectFile modifying;
+    modifying.code = {CLAC, CLAC, STR, LEAVE};
+    modifying.fixups = {{2, modifying.addSymbol("self", SymbolSection::CODE, SymbolBinding::LOCAL, 0)}};
+    [[maybe_unused]] const auto untouched = optimizeObject(modifying);
+    assert(!untouched.unreachable && !untouched.peephole && modifying.code.size() == 4);
+}
+
+static void testWide() {
+    const char *path = "vm_test_wide.bin";
+    // 0: clac; 1: add value; 3: ucb print; 5: leave, print sits past the first bank
+    // print: outd; addmem value; ret
+    ObjectFile object;
+    object.wide = true;
+    object.code = {CLAC, wideWord(ADD >> 8), 0, wideWord(UCB >> 8), 0, LEAVE};
+    object.code.resize(0x120);
+    object.code.insert(object.code.end(), {OUTD, wideWord(ADDMEM >> 8), 0, RET});
+    object.data = {7};
+    const auto value = object.addSymbol("value", SymbolSection::DATA, SymbolBinding::LOCAL, 0);
+    object.fixups = {{2, value},
+                     {4, object.addSymbol("print", SymbolSection::CODE, SymbolBinding::LOCAL, 0x120)},
+                     {0x122, value}};
+
+    CHECK(tools::cStyleWriteToFile(path, object));
+    ObjectFile loaded;
+    CHECK(tools::cStyleLoadObject(path, loaded) && loaded.wide);
+
+    Linker linker;
+    linker.add(loaded, "wide");
+    ImageSections image;
+    CHECK(linker.link(image) && image.wide && image.data_start == 0x124 && image.code[4] == 0x120);
+    CHECK(tools::cStyleWriteToFile(path, image));
+
+    MappedImage mapped;
+    CHECK(mapped.open(path) && mapped.wide() && mapped.wideLayout().data_start == 0x124);
+    std::string output;
+    StringSink sink(output);
+    WideInterpreter interp(mapped, {}, &sink);
+    CHECK(interp.resume() == RunStatus::HALTED && output == "7" && interp.vm().memory[0x124] == 8);
+
+    // single-bank and wide objects don't link together
+    ObjectFile narrow;
+    narrow.code = {LEAVE};
+    Linker mixed;
+    mixed.add(narrow, "narrow");
+    mixed.add(loaded, "wide");
+    CHECK(!mixed.link(image));
+
+    remove(path);
+}
+
+static void testSnapshot() {
+    const char *path = "vm_test_snapshot.bin";
+    // the prefix fills a table and leaves a return address behind, the rest prints the input and the table
+    // 0: ucb 1; 1: clac; 2: addi 65; 3: str table; 4: clac; 5: add input; 6: outd; 7: clac; 8: add table
+    // 9: outb; 10: leave
+    ImageSections sections;
+    sections.code = {UCB | 1, CLAC, ADDI | 65, STR | 0xF1, CLAC, ADD | 0xF0, OUTD, CLAC, ADD | 0xF1, OUTB, LEAVE};
+    sections.data = {0, 0};
+    CHECK(tools::cStyleWriteToFile(path, sections));
+    MappedImage image;
+    CHECK(image.open(path));
+
+    const auto state = Interpreter::capture(image, {}, 4, nullptr);
+    assert(state.pc == 4 && state.memory[0xF1] == 65 && state.stack.size() == 1 && state.code_end == 11);
+
+    // blob drops the empty tail of memory and comes back as it went in
+    const auto blob = packState(state);
+    assert(blob.size() == sizeof(SnapshotHeader) + 0xF2 * sizeof(uint16_t) + 1);
+    VmState unpacked;
+    CHECK(unpackState(blob.data(), blob.size(), unpacked));
+    assert(unpacked.pc == state.pc && unpacked.memory == state.memory && unpacked.stack == state.stack);
+    CHECK(!unpackState(blob.data(), blob.size() - 1, unpacked));
+
+    for (const auto mode: all_modes) {
+        std::string output;
+        {
+            StringSink sink(output);
+            Interpreter interp(state, {7}, mode, &sink);
+        }
+        assert(output == "7A");
+    }
+
+    for (const auto mode: all_modes) {
+        const auto results = runBatch(state, {{7}, {8}, {std::vector<uint16_t>(0x11, 1)}}, mode, 2);
+        assert(results[0].status == BatchStatus::HALTED && results[1].status == BatchStatus::HALTED);
+        assert(results[0].output == "7A" && results[1].output == "8A" && results[2].status == BatchStatus::BAD_DATA);
+        // a fork that needs more steps than it has is stopped
+        const auto bounded = runBatch(state, {{7}}, mode, 1, 1);
+        assert(bounded[0].status == BatchStatus::BUDGET_EXHAUSTED);
+    }
+
+    remove(path);
+}
+
+static void testBudget() {
+    // 0: submem counter; 1: clac; 2: add counter; 3: outd; 4: bnz 0; 5: leave
+    VmState state;
+    state.memory = makeImage({SUBMEM | 0xF0, CLAC, ADD | 0xF0, OUTD, BNZ | 0x00, LEAVE}, {3});
+
+    std::string output;
+    StringSink sink(output);
+    Interpreter interp(state, &sink);
+    CHECK(interp.run(0) == RunStatus::BUDGET_EXHAUSTED && interp.retired() == 0);
+    // one pass through the loop, printed and flushed before run() comes back
+    CHECK(interp.run(5) == RunStatus::BUDGET_EXHAUSTED && output == "2");
+    CHECK(interp.resume() == RunStatus::HALTED && output == "210" && interp.retired() == 15);
+    CHECK(interp.run(10) == RunStatus::HALTED && interp.retired() == 15);
+
+    // a runaway loop is stopped by the budget, a stray ret faults without touching the stack
+    VmState looping;
+    looping.memory = makeImage({UCB | 0x00});
+    Interpreter runaway(looping, &sink);
+    CHECK(runaway.run(1000) == RunStatus::BUDGET_EXHAUSTED && runaway.retired() == 1000);
+
+    VmState faulting;
+    faulting.memory = makeImage({CLAC, RET});
+    Interpreter faulty(faulting, &sink);
+    CHECK(faulty.resume() == RunStatus::FAULT && faulty.state().pc == 1);
+
+    // the jit keeps to the same budgets, running whole blocks where they fit and single steps where not
+    JitCompiler jit(nullptr, state.code_end);
+    for (const uint64_t budget: {0, 1, 4, 5, 6, 14, 15, 100}) {
+        std::string stepped, translated;
+        StringSink stepped_sink(stepped), translated_sink(translated);
+        Interpreter switched(state, &stepped_sink), jitted(state, &translated_sink);
+        const auto status = switched.run(budget);
+        CHECK(jitted.run(budget, jit) == status);
+        assert(jitted.retired() == switched.retired() && translated == stepped && jitted.state().pc == switched.state().pc);
+        CHECK(jitted.run(std::numeric_limits<uint64_t>::max(), jit) == RunStatus::HALTED && translated == "210");
+    }
+    JitCompiler looping_jit(nullptr, looping.code_end);
+    Interpreter jit_runaway(looping, &sink);
+    CHECK(jit_runaway.run(1000, looping_jit) == RunStatus::BUDGET_EXHAUSTED && jit_runaway.retired() == 1000);
+    JitCompiler faulting_jit(nullptr, faulting.code_end);
+    Interpreter jit_faulty(faulting, &sink);
+    CHECK(jit_faulty.run(1000, faulting_jit) == RunStatus::FAULT && jit_faulty.state().pc == 1);
+
+    // so do threaded and fused, a superinstruction that does not fit is stepped through
+    VmState fusable;
+    fusable.memory = makeImage({CLAC, ADDI | 0x41, OUTB, CLAC, SUBMEM | 0xF0, ADD | 0xF0, BNZ | 0x03, CMPI, BZ | 0x0A,
+                                OUTB, OUTD, LEAVE}, {3});
+    for (const auto mode: {DispatchMode::THREADED, DispatchMode::FUSED}) {
+        for (uint64_t budget = 0; budget <= 19; ++budget) {
+            std::string stepped, dispatched;
+            StringSink stepped_sink(stepped), dispatched_sink(dispatched);
+            Interpreter switched(fusable, &stepped_sink), threaded(fusable, &dispatched_sink);
+            const auto status = switched.run(budget);
+            CHECK(threaded.run(budget, mode) == status);
+            assert(threaded.retired() == switched.retired() && dispatched == stepped);
+            assert(threaded.state().pc == switched.state().pc && threaded.state().acc == switched.state().acc);
+            CHECK(threaded.run(std::numeric_limits<uint64_t>::max(), mode) == RunStatus::HALTED);
+            assert(dispatched == "A0" && threaded.retired() == 18);
+        }
+        Interpreter threaded_runaway(looping, &sink);
+        CHECK(threaded_runaway.run(1000, mode) == RunStatus::BUDGET_EXHAUSTED && threaded_runaway.retired() == 1000);
+        Interpreter threaded_faulty(faulting, &sink);
+        CHECK(threaded_faulty.run(1000, mode) == RunStatus::FAULT && threaded_faulty.state().pc == 1);
+
+        // engines can take turns on a vm, stores into the code made by one of them are seen by the next
+        VmState patching;
+        patching.memory = makeImage({CLAC, ADDMEM | 3, CLAC, ADDI | 1, OUTD, LEAVE});
+        std::string patched;
+        StringSink patched_sink(patched);
+        Interpreter mixed(patching, &patched_sink);
+        CHECK(mixed.run(1, mode) == RunStatus::BUDGET_EXHAUSTED && mixed.run(1) == RunStatus::BUDGET_EXHAUSTED);
+        CHECK(mixed.run(std::numeric_limits<uint64_t>::max(), mode) == RunStatus::HALTED && patched == "2");
+    }
+
+#if defined(__cpp_impl_coroutine)
+    // many vms interleaved a slice at a time, each one ends up printing what it would on its own
+    std::vector<std::string> outputs(8);
+    std::vector<std::unique_ptr<StringSink>> sinks;
+    std::vector<std::unique_ptr<Interpreter>> vms;
+    std::vector<VmTask> tasks;
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        state.memory[0xF0] = static_cast<uint16_t>(i + 1);
+        sinks.push_back(std::make_unique<StringSink>(outputs[i]));
+        vms.push_back(std::make_unique<Interpreter>(state, sinks.back().get()));
+        tasks.push_back(runTask(*vms.back(), 3));
+    }
+    runCooperatively(tasks, 3);
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        assert(tasks[i].status() == RunStatus::HALTED);
+        std::string expected;
+        for (auto value = static_cast<int>(i); value >= 0; --value) {
+            expected += std::to_string(value);
+        }
+        assert(outputs[i] == expected);
+    }
+#endif
+}
+
+static void testReturnStack() {
+    // a ucb loop pushes on every pass, the stack stops growing once it's full
+    VmState looping;
+    looping.memory = makeImage({UCB | 0x00});
+    Interpreter runaway(looping);
+    CHECK(runaway.run(1000) == RunStatus::BUDGET_EXHAUSTED);
+    const auto state = runaway.state();
+    assert(state.stack.size() == return_stack_capacity && state.stack.dropped() == 1000 - return_stack_capacity);
+
+    // the newest entries are kept, bottom up
+    ReturnStack stack;
+    for (uint32_t i = 0; i < return_stack_capacity + 3; ++i) {
+        stack.push(static_cast<uint8_t>(i));
+    }
+    assert(stack.overflowed() && stack.at(0) == 3 && stack.top() == 2);
+    for (uint32_t i = 0; i < return_stack_capacity; ++i) {
+        stack.pop();
+    }
+    assert(stack.empty());
+
+    // a ret with nowhere to return to stops every engine on it, none of them jumps anywhere
+    const auto unbalanced = makeImage({ADDI | 0x01, OUTD, RET, OUTD, LEAVE});
+    for (const auto mode: {DispatchMode::SWITCH, DispatchMode::THREADED, DispatchMode::FUSED, DispatchMode::JIT}) {
+        std::string output;
+        StringSink sink(output);
+        Interpreter interp(unbalanced.data(), unbalanced.size(), mode, &sink);
+        assert(output == "1" && interp.peek().pc == 2 && interp.peek().stack.empty());
+    }
+}
+
+static void testLockstep() {
+    // counts down, calling a subroutine once the counter hits 2
+    // 0: submem counter; 1: clac; 2: add counter; 3: outd; 4: cmpi 2; 5: bz 10; 6: clac; 7: add counter
+    // 8: bnz 0; 9: leave; 10: addmem other; 11: clac; 12: add other; 13: outd; 14: ret
+    const auto image = makeImage({SUBMEM | 0xF0, CLAC, ADD | 0xF0, OUTD, CMPI | 2, BZ | 10, CLAC, ADD | 0xF0,
+                                  BNZ | 0x00, LEAVE, ADDMEM | 0xF1, CLAC, ADD | 0xF1, OUTD, RET});
+
+    // enough data sets for a few groups, diverging at different points
+    std::vector<std::vector<uint16_t>> data_sets;
+    for (uint16_t i = 0; i < 3 * lockstep_lanes + 5; ++i) {
+        data_sets.push_back({static_cast<uint16_t>(1 + i % 7), static_cast<uint16_t>(i % 5)});
+    }
+
+    // a pool serves any number of runs, the last group of each is narrower than the others
+    WorkStealingPool pool(3);
+    for (uint32_t pass = 0; pass < 2; ++pass) {
+        std::vector<VmState> states;
+        const auto results = runLockstep(image, data_sets, DispatchMode::THREADED, pool, ImageLayout{},
+                                         batch_step_limit, &states);
+        assert(results.size() == data_sets.size() && states.size() == data_sets.size());
+        for (size_t i = 0; i < data_sets.size(); ++i) {
+            VmState start;
+            start.memory = image;
+            std::copy(data_sets[i].begin(), data_sets[i].end(), start.memory.begin() + data_section_start);
+            assert(results[i].status == BatchStatus::HALTED);
+            assert(results[i].output == runImage(start.memory, DispatchMode::SWITCH));
+            // every lane ends up where the program would on its own
+            Interpreter alone(start);
+            CHECK(alone.resume() == RunStatus::HALTED);
+            const auto expected = alone.state();
+            assert(states[i].acc == expected.acc && states[i].flags == expected.flags && states[i].pc == expected.pc);
+            assert(states[i].memory == expected.memory && states[i].stack == expected.stack);
+        }
+    }
+
+    // lanes that never halt run out of budget, a stray ret faults, in groups as well as on their own
+    const std::vector<std::vector<uint16_t>> few(2), many(lockstep_lanes);
+    for (const auto *sets: {&few, &many}) {
+        const auto looping = runLockstep(makeImage({UCB | 0x00}), *sets, DispatchMode::JIT, 1, ImageLayout{}, 100);
+        const auto faulting = runLockstep(makeImage({CLAC, ADDI | 1, OUTD, RET}), *sets, DispatchMode::FUSED, 1);
+        for (size_t i = 0; i < sets->size(); ++i) {
+            assert(looping[i].status == BatchStatus::BUDGET_EXHAUSTED);
+            assert(faulting[i].status == BatchStatus::FAULT && faulting[i].output == "1");
+        }
+    }
+
+    // code stores make the whole group go scalar
+    const auto patching = makeImage({CLAC, ADD | 0xF0, STR | 4, CLAC, OUTD, OUTB, LEAVE});
+    const auto patched = runLockstep(patching, {{65}, {66}, {67}}, DispatchMode::SWITCH, 1);
+    assert(patched[0].output == "A" && patched[1].output == "B" && patched[2].output == "C");
+}
+
+static void testMetrics() {
+    [[maybe_unused]] const auto count = [](const std::vector<uint64_t> &totals, const Metric metric) {
+        return totals[static_cast<uint32_t>(metric)];
+    };
+    // 0: submem counter; 1: clac; 2: add counter; 3: outd; 4: bnz 0; 5: leave
+    const auto image = makeImage({SUBMEM | 0xF0, CLAC, ADD | 0xF0, OUTD, BNZ | 0x00, LEAVE}, {3});
+    const auto before = collectMetrics();
+
+    // the counts of a thread that is gone stay in
+    std::thread([&] { CHECK(runImage(image, DispatchMode::SWITCH) == "210"); }).join();
+    auto after = collectMetrics();
+    assert(count(after, Metric::INSTRUCTIONS) - count(before, Metric::INSTRUCTIONS) == 15);
+    assert(count(after, Metric::BRANCHES_TAKEN) - count(before, Metric::BRANCHES_TAKEN) == 2);
+    assert(count(after, Metric::OUTPUT_BYTES) - count(before, Metric::OUTPUT_BYTES) == 3);
+    assert(count(after, Metric::RUNS) - count(before, Metric::RUNS) == 1);
+
+    // every other engine counts the same, block by block on the jit
+    for (const auto mode: {DispatchMode::THREADED, DispatchMode::FUSED, DispatchMode::JIT}) {
+        const auto previous = collectMetrics();
+        CHECK(runImage(image, mode) == "210");
+        const auto counted = collectMetrics();
+        assert(count(counted, Metric::INSTRUCTIONS) - count(previous, Metric::INSTRUCTIONS) == 15);
+        assert(count(counted, Metric::BRANCHES_TAKEN) - count(previous, Metric::BRANCHES_TAKEN) == 2);
+        assert(count(counted, Metric::RUNS) - count(previous, Metric::RUNS) == 1);
+    }
+
+    const std::vector<MetricSample> samples = {
+            {"parse_ns", "metacpu_assemble_seconds_total", "phase=\"parse\"", "counter", "time per phase", 1500000000, true},
+            {"link_ns", "metacpu_assemble_seconds_total", "phase=\"link\"", "counter", "time per phase", 2, true},
+            {"runs", "metacpu_runs_total", "", "counter", "runs", 7, false},
+    };
+    assert(formatMetrics(samples, MetricsFormat::TEXT) == "parse_ns 1500000000\nlink_ns 2\nruns 7\n");
+    assert(formatMetrics(samples, MetricsFormat::JSON) == "{\"parse_ns\": 1500000000, \"link_ns\": 2, \"runs\": 7}\n");
+    assert(formatMetrics(samples, MetricsFormat::PROMETHEUS) ==
+           "# HELP metacpu_assemble_seconds_total time per phase\n"
+           "# TYPE metacpu_assemble_seconds_total counter\n"
+           "metacpu_assemble_seconds_total{phase=\"parse\"} 1.500000000\n"
+           "metacpu_assemble_seconds_total{phase=\"link\"} 0.000000002\n"
+           "# HELP metacpu_runs_total runs\n"
+           "# TYPE metacpu_runs_total counter\n"
+           "metacpu_runs_total 7\n");
+}
+
+int main() {
+    testStraightLine();
+    testCounterLoop();
+    testSubroutine();
+    testLazyFlags();
+    testSelfModifyingStore();
+    testSelfModifyingLoop();
+    testProfile();
+    testCycles();
+    testBatch();
+    testLockstep();
+    testImageV2();
+    testSpecialize();
+    testRunCache();
+    testServer();
+    testTrace();
+    testLink();
+    testOptimize();
+    testWide();
+    testSnapshot();
+    testBudget();
+    testReturnStack();
+    testMetrics();
+}